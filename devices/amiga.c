@@ -158,9 +158,9 @@ void mount_posixfs();
 
 void mount_amiga_fbfs() {
   fs_mount_builtin("/framebuffer", amiga_fbfs_open, amiga_fbfs_read, amiga_fbfs_write, 0, amiga_fbfs_mmap);
-  insert_global_symbol(alloc_sym("screen-width"),alloc_int(512));
-  insert_global_symbol(alloc_sym("screen-height"),alloc_int(250));
-  insert_global_symbol(alloc_sym("screen-bpp"),alloc_int(1));
+  insert_global_const(alloc_sym("screen-width"),alloc_int(512));
+  insert_global_const(alloc_sym("screen-height"),alloc_int(250));
+  insert_global_const(alloc_sym("screen-bpp"),alloc_int(1));
 
   mount_amiga_keyfs();
   mount_posixfs();
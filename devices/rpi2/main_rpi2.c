@@ -106,7 +106,6 @@ Cell* platform_eval(Cell* expr); // FIXME
 
 #include "compiler_new.c"
 
-#define CODESZ 8192
 #define REPLBUFSZ 1024*6
 
 void fatfs_debug(); // FIXME
@@ -228,6 +227,7 @@ Cell* platform_eval(Cell* expr) {
   int i = 0;
   Cell* res = alloc_nil();
   Cell* c;
+  uint32_t* binary;
   while ((c = car(expr))) {
     i++;
     arm_dmb();
@@ -237,9 +237,7 @@ Cell* platform_eval(Cell* expr) {
     lisp_write(c, eval_buf, 512);
     printf("<- compiling %d: %s\r\n",i,eval_buf);
     
-    code = malloc(CODESZ);
-    memset(code, 0, CODESZ);
-    jit_init(0x400);
+    jit_init();
     register void* sp asm ("sp");
     Frame empty_frame = {NULL, 0, 0, sp};
     Cell* res = compile_expr(c, &empty_frame, prototype_any);
@@ -251,15 +249,20 @@ Cell* platform_eval(Cell* expr) {
   
     if (res) {
       jit_ret();
-      funcptr fn = (funcptr)code;
+      binary = jit_finish();
+      if (!binary) break;
+      code_seal(binary);
+      funcptr fn = (funcptr)binary;
       //printf("~~ fn at %p\r\n",fn);
       
+      code_enter(binary, sp);
       __asm("stmfd sp!, {r3-r12, lr}");
       (Cell*)fn();
       __asm("ldmfd sp!, {r3-r12, lr}");
       register Cell *retval asm ("r6");
       __asm("mov r6,r0");
       res = retval;
+      code_leave(binary);
 
       arm_dmb();
       arm_isb();
@@ -272,7 +275,6 @@ Cell* platform_eval(Cell* expr) {
       printf("[platform_eval] stopped at expression %d: '%s'\r\n",i,eval_buf);
       break;
     }
-    // when to free the code? -> when no bound lambdas involved
     
     expr = cdr(expr);
   }
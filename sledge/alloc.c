@@ -2,6 +2,15 @@
 #include <string.h>
 #include "stream.h"
 
+#if !defined(WIN32) && (defined(__linux__) || defined(__APPLE__) || defined(__unix__))
+#define CODE_HEAP_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__APPLE__) && defined(__MACH__) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
 void* byte_heap;
 Cell* cell_heap;
 
@@ -47,6 +56,12 @@ Cell* get_cell_heap() {
   return cell_heap;
 }
 
+int is_heap_cell(void* addr) {
+  Cell* c = (Cell*)addr;
+  return c>=cell_heap && c<&cell_heap[cells_used]
+    && !(((uint8_t*)c-(uint8_t*)cell_heap)%sizeof(Cell));
+}
+
 // FIXME header?
 env_t* get_global_env();
 
@@ -97,6 +112,349 @@ void* bytes_alloc(int num_bytes) {
     }*/
 }
 
+// executable code heap
+//
+// compiled blobs are carved out of large regions. a blob stays alive
+// as long as a marked lambda, a running top-level form or a word on the
+// stack points into it. everything else is reclaimed by collect_garbage.
+
+#define CODE_REGION_SIZE (256*1024)
+#define CODE_ALIGN 16
+#define CODE_MAX_ACTIVE 64
+
+typedef struct CodeRegion {
+  uint8_t* start;
+  size_t size;
+} CodeRegion;
+
+typedef struct CodeBlob {
+  uint8_t* start;
+  size_t size;
+  int marked;
+  uint32_t* relocs; // offsets of absolute addresses in the code, if known
+  int num_relocs;
+  void* links;      // owned by the code_free hook, see code_set_free_hook
+} CodeBlob;
+
+typedef struct CodeActive {
+  uint8_t* blob;
+  void* stack_end;
+} CodeActive;
+
+static CodeRegion* code_regions;
+static int code_regions_used;
+static int code_regions_max;
+
+// sorted by start address
+static CodeBlob* code_blobs;
+static int code_blobs_used;
+static int code_blobs_max;
+
+static size_t code_bytes_used;
+static size_t code_bytes_mapped;
+
+// top-level forms currently executing (nested via eval)
+static CodeActive code_active[CODE_MAX_ACTIVE];
+static int code_active_used;
+
+static uint8_t* code_region_map(size_t size) {
+#ifdef CODE_HEAP_MMAP
+  void* hint = NULL;
+#ifdef CPU_ARM64
+  // regions go right below the host code, in the reach of the bl of
+  // jitted calls to the runtime (see jit_finish in jit_arm64.c)
+  static uintptr_t below = 0;
+  if (!below) below = (uintptr_t)code_region_map & ~(uintptr_t)0xfffff;
+  below -= size;
+  hint = (void*)below;
+#endif
+  void* mem = mmap(hint, size, PROT_READ|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) return NULL;
+  return mem;
+#else
+  return malloc(size);
+#endif
+}
+
+static void code_region_unmap(uint8_t* start, size_t size) {
+#ifdef CODE_HEAP_MMAP
+  munmap(start, size);
+#else
+  free(start);
+#endif
+}
+
+static size_t code_page_size() {
+#ifdef CODE_HEAP_MMAP
+  return sysconf(_SC_PAGESIZE);
+#else
+  return CODE_ALIGN;
+#endif
+}
+
+// blobs start on a page of their own, see code_protect
+static uint8_t* code_page_end(uint8_t* addr) {
+  uintptr_t page = code_page_size();
+  return (uint8_t*)(((uintptr_t)addr+page-1) & ~(page-1));
+}
+
+// W^X: pages are only writable while a blob is being filled. no two
+// blobs share a page, so that this never takes code of another blob
+// with it, which could be running.
+static void code_protect(uint8_t* start, size_t size, int writable) {
+#ifdef CODE_HEAP_MMAP
+  uintptr_t page = code_page_size();
+  uintptr_t from = (uintptr_t)start & ~(page-1);
+  uintptr_t to = ((uintptr_t)start+size+page-1) & ~(page-1);
+  if (mprotect((void*)from, to-from, writable ? (PROT_READ|PROT_WRITE) : (PROT_READ|PROT_EXEC))) {
+    printf("<code heap: mprotect failed at %p>\r\n",start);
+  }
+#endif
+}
+
+// index of the first blob starting at or after addr
+static int code_lower_bound(uint8_t* addr) {
+  int lo = 0, hi = code_blobs_used;
+  while (lo<hi) {
+    int mid = (lo+hi)/2;
+    if (code_blobs[mid].start<addr) lo = mid+1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// index of the blob containing addr or -1
+static int code_lookup(void* addr) {
+  int i = code_lower_bound((uint8_t*)addr+1)-1;
+  if (i>=0 && (uint8_t*)addr < code_blobs[i].start+code_blobs[i].size) return i;
+  return -1;
+}
+
+static void* code_insert(int i, uint8_t* start, size_t size) {
+  if (code_blobs_used>=code_blobs_max) {
+    code_blobs_max = code_blobs_max ? code_blobs_max*2 : 256;
+    code_blobs = realloc(code_blobs, code_blobs_max*sizeof(CodeBlob));
+  }
+  memmove(&code_blobs[i+1], &code_blobs[i], (code_blobs_used-i)*sizeof(CodeBlob));
+  code_blobs[i].start = start;
+  code_blobs[i].size = size;
+  code_blobs[i].marked = 0;
+  code_blobs[i].relocs = NULL;
+  code_blobs[i].num_relocs = 0;
+  code_blobs[i].links = NULL;
+  code_blobs_used++;
+  code_bytes_used += size;
+
+  code_protect(start, size, 1);
+  return start;
+}
+
+// returns a writable block. call code_seal before executing it.
+void* code_alloc(size_t num_bytes) {
+  int r;
+  uint8_t* start;
+  size_t size, page;
+
+  num_bytes = (num_bytes+CODE_ALIGN-1) & ~(CODE_ALIGN-1);
+  if (!num_bytes) num_bytes = CODE_ALIGN;
+
+  // first fit in the gaps between blobs
+  for (r=0; r<code_regions_used; r++) {
+    uint8_t* cursor = code_regions[r].start;
+    uint8_t* end = cursor + code_regions[r].size;
+    int i = code_lower_bound(cursor);
+    while (1) {
+      uint8_t* limit = (i<code_blobs_used && code_blobs[i].start<end) ? code_blobs[i].start : end;
+      if ((size_t)(limit-cursor) >= num_bytes) {
+        return code_insert(i, cursor, num_bytes);
+      }
+      if (limit==end) break;
+      cursor = code_page_end(code_blobs[i].start+code_blobs[i].size);
+      i++;
+    }
+  }
+
+  page = code_page_size();
+  size = CODE_REGION_SIZE;
+  if (num_bytes>size) size = (num_bytes+page-1) & ~(page-1);
+
+  start = code_region_map(size);
+  if (!start) {
+    printf("<code heap: cannot map %lu bytes>\r\n",(unsigned long)size);
+    return NULL;
+  }
+  if (code_regions_used>=code_regions_max) {
+    code_regions_max = code_regions_max ? code_regions_max*2 : 8;
+    code_regions = realloc(code_regions, code_regions_max*sizeof(CodeRegion));
+  }
+  code_regions[code_regions_used].start = start;
+  code_regions[code_regions_used].size = size;
+  code_regions_used++;
+  code_bytes_mapped += size;
+
+  return code_insert(code_lower_bound(start), start, num_bytes);
+}
+
+// give back the unused tail of a blob that was allocated with a worst-case size
+void code_shrink(void* blob, size_t num_bytes) {
+  int i = code_lookup(blob);
+  if (i<0) return;
+  num_bytes = (num_bytes+CODE_ALIGN-1) & ~(CODE_ALIGN-1);
+  if (!num_bytes) num_bytes = CODE_ALIGN;
+  if (num_bytes<code_blobs[i].size) {
+    code_bytes_used -= code_blobs[i].size-num_bytes;
+    code_blobs[i].size = num_bytes;
+  }
+}
+
+// make a filled blob executable
+void code_seal(void* blob) {
+  int i = code_lookup(blob);
+  if (i<0) return;
+  code_protect(code_blobs[i].start, code_blobs[i].size, 0);
+#ifdef CODE_HEAP_MMAP
+  __builtin___clear_cache((char*)code_blobs[i].start, (char*)code_blobs[i].start+code_blobs[i].size);
+#endif
+}
+
+// make a sealed blob writable again, to append code to it
+void code_unseal(void* blob) {
+  int i = code_lookup(blob);
+  if (i<0) return;
+  code_protect(code_blobs[i].start, code_blobs[i].size, 1);
+}
+
+// called with the links of every blob that is freed
+static void (*code_free_hook)(void* links) = NULL;
+
+void code_set_free_hook(void (*hook)(void* links)) {
+  code_free_hook = hook;
+}
+
+void code_free(void* blob) {
+  int i = code_lookup(blob);
+  if (i<0) return;
+  if (code_blobs[i].links && code_free_hook) code_free_hook(code_blobs[i].links);
+  free(code_blobs[i].relocs);
+  code_bytes_used -= code_blobs[i].size;
+  code_blobs_used--;
+  memmove(&code_blobs[i], &code_blobs[i+1], (code_blobs_used-i)*sizeof(CodeBlob));
+}
+
+// remember where the backend embedded absolute addresses in a blob,
+// so that it can be relocated later (heap images)
+void code_set_relocs(void* blob, uint32_t* offsets, int num_offsets) {
+  int i = code_lookup(blob);
+  if (i<0) return;
+  free(code_blobs[i].relocs);
+  code_blobs[i].relocs = malloc((num_offsets+1)*sizeof(uint32_t));
+  memcpy(code_blobs[i].relocs, offsets, num_offsets*sizeof(uint32_t));
+  code_blobs[i].num_relocs = num_offsets;
+}
+
+// attach data to a blob that has to be released with it
+void code_set_links(void* blob, void* links) {
+  int i = code_lookup(blob);
+  if (i<0) return;
+  code_blobs[i].links = links;
+}
+
+void* code_get_links(void* blob) {
+  int i = code_lookup(blob);
+  if (i<0) return NULL;
+  return code_blobs[i].links;
+}
+
+// find the blob containing addr. returns 0 if there is none.
+int code_blob_info(void* addr, uint8_t** start, size_t* size, uint32_t** relocs, int* num_relocs) {
+  int i = code_lookup(addr);
+  if (i<0) return 0;
+  *start = code_blobs[i].start;
+  *size = code_blobs[i].size;
+  *relocs = code_blobs[i].relocs;
+  *num_relocs = code_blobs[i].num_relocs;
+  return 1;
+}
+
+// pin a top-level blob while it runs. stack_end is the stack pointer of
+// its caller, so the collector can scan the frames of all nested evals.
+void code_enter(void* blob, void* stack_end) {
+  if (code_active_used<CODE_MAX_ACTIVE) {
+    code_active[code_active_used].blob = blob;
+    code_active[code_active_used].stack_end = stack_end;
+  }
+  code_active_used++;
+}
+
+void code_leave(void* blob) {
+  if (code_active_used>0) code_active_used--;
+}
+
+static void code_mark(void* addr) {
+  int i;
+  if (!code_blobs_used) return;
+  i = code_lookup(addr);
+  if (i>=0) code_blobs[i].marked = 1;
+}
+
+static void code_unmark() {
+  int i;
+  for (i=0; i<code_blobs_used; i++) {
+    code_blobs[i].marked = 0;
+  }
+}
+
+static int code_is_dead(void* addr) {
+  int i = code_lookup(addr);
+  return (i>=0 && !code_blobs[i].marked);
+}
+
+// conservatively treat every stack word as a potential return address
+// or lambda reference
+static void code_mark_stack(void* stack_end, void* stack_pointer) {
+  int i;
+  jit_word_t* a;
+  jit_word_t* top = stack_end;
+
+  for (i=0; i<code_active_used && i<CODE_MAX_ACTIVE; i++) {
+    code_mark(code_active[i].blob);
+    if ((jit_word_t*)code_active[i].stack_end>top) top = code_active[i].stack_end;
+  }
+
+  for (a=(jit_word_t*)stack_pointer; a<=top; a++) {
+    Cell* c = (Cell*)*a;
+    code_mark(c);
+    if (c>=cell_heap && c<&cell_heap[cells_used]
+        && !(((uint8_t*)c-(uint8_t*)cell_heap)%sizeof(Cell))
+        && (c->tag & ~TAG_MARK)==TAG_LAMBDA) {
+      code_mark(c->dr.next);
+    }
+  }
+}
+
+static int code_sweep() {
+  int i, r, freed = 0;
+  for (i=0; i<code_blobs_used; i++) {
+    if (!code_blobs[i].marked) {
+      code_free(code_blobs[i].start);
+      freed++;
+      i--;
+    }
+  }
+
+  // unmap empty regions, but keep the first one around
+  for (r=code_regions_used-1; r>0; r--) {
+    i = code_lower_bound(code_regions[r].start);
+    if (i>=code_blobs_used || code_blobs[i].start>=code_regions[r].start+code_regions[r].size) {
+      code_region_unmap(code_regions[r].start, code_regions[r].size);
+      code_bytes_mapped -= code_regions[r].size;
+      code_regions_used--;
+      code_regions[r] = code_regions[code_regions_used];
+    }
+  }
+  return freed;
+}
+
 void mark_tree(Cell* c) {
   if (!c) {
     //printf("~! warning: mark_tree encountered NULL cell.\n");
@@ -121,10 +479,7 @@ void mark_tree(Cell* c) {
       lisp_write((Cell*)c->ar.addr, buf, 511);
       printf("~~ mark lambda args: %s\n",buf);*/
       mark_tree((Cell*)c->ar.addr); // function arguments
-      //mark_tree((Cell*)c->dr.next); // function body
-
-      // TODO: mark compiled code / free unused compiled code
-      // -- keep all compiled blobs in a list
+      code_mark(c->dr.next); // compiled code
     }
     else if (c->tag == TAG_BUILTIN) {
       mark_tree((Cell*)c->dr.next); // builtin signature
@@ -160,6 +515,22 @@ void mark_tree(Cell* c) {
   }
 }
 
+// marks roots the collector can't find on its own, like the
+// locals of the tier-0 interpreter
+static void (*gc_root_marker)() = NULL;
+
+void gc_set_root_marker(void (*marker)()) {
+  gc_root_marker = marker;
+}
+
+// runs between marking and sweeping, for references that must not
+// keep cells alive
+static void (*gc_weak_hook)() = NULL;
+
+void gc_set_weak_hook(void (*hook)()) {
+  gc_weak_hook = hook;
+}
+
 static Cell* _symbols_list;
 void list_symbols_iter(const char *key, void *value, const void *obj)
 {
@@ -179,6 +550,31 @@ void collect_garbage_iter(const char *key, void *value, const void *obj)
   mark_tree(e->cell);
 }
 
+// the constants of a top-level form that is still running, like the
+// symbol of a def, are only referenced by its code. they are found
+// through the relocs of its blob.
+static void code_mark_active_cells() {
+  int i, j;
+  for (i=0; i<code_active_used && i<CODE_MAX_ACTIVE; i++) {
+    int b = code_lookup(code_active[i].blob);
+    if (b<0) continue;
+    for (j=0; j<code_blobs[b].num_relocs; j++) {
+      Cell* c;
+      memcpy(&c, code_blobs[b].start+code_blobs[b].relocs[j], sizeof(Cell*));
+      if (is_heap_cell(c)) mark_tree(c);
+    }
+  }
+}
+
+// fns push their lambda tagged with STACK_FRAME_MARKER. a raw int on
+// the stack, like -1, can have the marker bits set as well, so the rest
+// of the word has to be a lambda.
+static int is_frame_marker(jit_word_t item) {
+  Cell* lambda = (Cell*)(item & ~STACK_FRAME_MARKER);
+  if ((item&STACK_FRAME_MARKER)!=STACK_FRAME_MARKER) return 0;
+  return is_heap_cell(lambda) && (lambda->tag & ~TAG_MARK)==TAG_LAMBDA;
+}
+
 Cell* collect_garbage(env_t* global_env, void* stack_end, void* stack_pointer) {
   // mark
 
@@ -193,12 +589,18 @@ Cell* collect_garbage(env_t* global_env, void* stack_end, void* stack_pointer) {
   int highwater=0;
 #endif
 
-  int sw_state = 0;
+  // values pushed by a top-level form come before any frame
+  int sw_state = 1;
   jit_word_t* a;
+
+  code_unmark();
+  code_mark(__builtin_return_address(0)); // the blob that called us
+  code_mark_stack(stack_end, stack_pointer);
+
   for (a=(jit_word_t*)stack_end; a>=(jit_word_t*)stack_pointer; a--) {
     jit_word_t item = *a;
     jit_word_t next_item = *(a-1);
-    if (next_item==STACK_FRAME_MARKER) {
+    if (is_frame_marker(next_item)) {
       sw_state=2;
     } else {
       if (sw_state==2) {
@@ -206,7 +608,10 @@ Cell* collect_garbage(env_t* global_env, void* stack_end, void* stack_pointer) {
       } else if (sw_state==1) {
         // FIXME total hack, need type information for stack
         // maybe type/signature byte frame header?
-        if ((Cell*)item>cell_heap) {
+        // cells kept in frames (see escape.c) are no heap cells and
+        // are not marked, the cells they point to are words of the
+        // frame themselves
+        if (is_heap_cell((Cell*)item)) {
           mark_tree((Cell*)item);
         }
       }
@@ -224,8 +629,11 @@ Cell* collect_garbage(env_t* global_env, void* stack_end, void* stack_pointer) {
   }
   //printf("[gc] stack walk complete -------------------------------\r\n");
 
+  code_mark_active_cells();
   sm_enum(global_env, collect_garbage_iter, NULL);
   mark_tree(get_fs_list());
+  if (gc_root_marker) gc_root_marker();
+  if (gc_weak_hook) gc_weak_hook();
 
   /*for (env_entry* e=global_env; e != NULL; e=e->hh.next) {
     //printf("env entry: %s pointing to %p\n",e->name,e->cell);
@@ -250,6 +658,10 @@ Cell* collect_garbage(env_t* global_env, void* stack_end, void* stack_pointer) {
     // FIXME: we cannot free LAMBDAS currently
     // because nobody points to anonymous closures.
     // this has to be fixed by introducing metadata to their callers. (?)
+    if (c->tag==TAG_LAMBDA && code_is_dead(c->dr.next)) {
+      // unreachable lambda, its code is about to be reclaimed
+      c->dr.next = NULL;
+    }
     if (!(c->tag & TAG_MARK) && c->tag!=TAG_LAMBDA) {
       
 #ifdef DEBUG_GC
@@ -273,6 +685,11 @@ Cell* collect_garbage(env_t* global_env, void* stack_end, void* stack_pointer) {
     cell_heap[i].tag &= ~TAG_MARK;
   }
   
+  i = code_sweep();
+#ifdef DEBUG_GC
+  printf("~~ %d code blobs freed, %lu of %lu code bytes used.\r\n",i,(unsigned long)code_bytes_used,(unsigned long)code_bytes_mapped);
+#endif
+
   //printf("[gc] highwater %d fl_avail %d \r\n",highwater,free_list_avail);
 
   // FIXME on x64, this line causes corruption over time 
@@ -301,6 +718,8 @@ MemStats* alloc_stats(void) {
   mem_stats.byte_heap_max = MAX_BYTE_HEAP;
   mem_stats.cells_used = cells_used;
   mem_stats.cells_max = MAX_CELLS;
+  mem_stats.code_bytes_used = code_bytes_used;
+  mem_stats.code_bytes_max = code_bytes_mapped;
   return &mem_stats;
 }
 
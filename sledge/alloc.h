@@ -12,7 +12,7 @@
 #define STACK_FRAME_MARKER 0xf0000001
 #endif
 
-#ifdef CPU_X64
+#if defined(CPU_X64) || defined(CPU_ARM64)
 // functions store a pointer to their own definition ORed with this marker on the stack
 #define STACK_FRAME_MARKER 0xf000000000000001
 #endif
@@ -27,16 +27,35 @@ typedef struct MemStats {
   unsigned long byte_heap_max;
   unsigned long cells_used;
   unsigned long cells_max;
+  unsigned long code_bytes_used;
+  unsigned long code_bytes_max;
 } MemStats;
 
 void init_allocator();
 
 Cell* get_cell_heap();
+int   is_heap_cell(void* addr);
 void* cell_malloc(int num_bytes);
 void* cell_realloc(void* old_addr, unsigned int old_size, unsigned int num_bytes);
 Cell* collect_garbage(env_t* global_env, void* stack_end, void* stack_pointer);
+void  gc_set_root_marker(void (*marker)());
+void  gc_set_weak_hook(void (*hook)());
+void  mark_tree(Cell* c);
 Cell* list_symbols(env_t* global_env);
 
+void* code_alloc(size_t num_bytes);
+void  code_shrink(void* blob, size_t num_bytes);
+void  code_seal(void* blob);
+void  code_unseal(void* blob);
+void  code_free(void* blob);
+void  code_enter(void* blob, void* stack_end);
+void  code_leave(void* blob);
+void  code_set_relocs(void* blob, uint32_t* offsets, int num_offsets);
+void  code_set_links(void* blob, void* links);
+void* code_get_links(void* blob);
+void  code_set_free_hook(void (*hook)(void* links));
+int   code_blob_info(void* addr, uint8_t** start, size_t* size, uint32_t** relocs, int* num_relocs);
+
 Cell* alloc_cons(Cell* ar, Cell* dr);
 Cell* alloc_list(Cell** items, int num);
 Cell* alloc_sym(char* str);
@@ -0,0 +1,6 @@
+#!/bin/sh
+
+SRCS="sledge.c reader.c writer.c alloc.c strmap.c stream.c ../devices/sdl2.c ../devices/posixfs.c"
+DEFS="-DCPU_ARM64 -DDEV_SDL -DDEV_POSIXFS"
+
+cc -g -o sledge --std=gnu99 -Wall -O1 -I. ${CFLAGS} ${SRCS} -lm -lSDL2 ${DEFS}
@@ -4,5 +4,14 @@ if [ `uname` = "Darwin" ] ; then
     CFLAGS="${CFLAGS} -I/opt/local/include -L/opt/local/lib -framework Cocoa"
 fi
 
-cc -g -o sledge --std=gnu99 -Wall -O1 -I. ${CFLAGS} sledge.c reader.c writer.c alloc.c strmap.c stream.c ../devices/sdl2.c ../devices/posixfs.c -lm -lSDL2 -DCPU_X64 -DDEV_SDL -DDEV_POSIXFS
+SRCS="sledge.c reader.c writer.c alloc.c strmap.c stream.c ../devices/sdl2.c ../devices/posixfs.c"
+DEFS="-DCPU_X64 -DDEV_SDL -DDEV_POSIXFS"
 
+cc -g -o sledge --std=gnu99 -Wall -O1 -I. ${CFLAGS} ${SRCS} -lm -lSDL2 ${DEFS}
+
+if [ `uname` = "Linux" ] ; then
+    # compile the os layer ahead of time (shell.l imports mouse, repl and editor)
+    # and link the result into the final binary
+    SDL_VIDEODRIVER=dummy INTERIM_JIT_CACHE= ./sledge --aot os_aot.c os/lib.l os/gfx.l os/shell.l > /dev/null &&
+    cc -g -o sledge --std=gnu99 -Wall -O1 -I. ${CFLAGS} ${SRCS} os_aot.c -lm -lSDL2 ${DEFS} -DJIT_AOT
+fi
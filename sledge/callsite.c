@@ -0,0 +1,199 @@
+// direct calls to global lambdas (x64 hosted)
+//
+// a call to a global lambda used to load the callee's entrypoint from
+// its env entry on every call, three dependent loads. call sites carry
+// the entrypoint as an immediate instead:
+//
+//   movabs $env_entry, %r11
+//   movabs $entry, %rax
+//   call *%rax
+//
+// jit_call_env emits sites pointing to jit_call_global, which does the
+// old lookup through the env entry in r11. once a blob is placed,
+// link_calls points each of its sites to the current entrypoint of the
+// callee and adds it to the sites of the env entry. when the global is
+// rebound (insert_symbol) or its interpreted lambda gets compiled, the
+// sites are patched to the new entrypoint, or back to jit_call_global
+// if the new value is not a lambda. so a site always calls what the env
+// lookup would have found, and the callee's code stays alive through
+// the env.
+//
+// the compiled-code cache and heap images store sites pointing to
+// jit_call_global, they are linked again after loading.
+//
+// sites for the raw entry of a callee (see rettype.c) load its RAW_*
+// flags into r10 first:
+//
+//   mov $raw, %r10d
+//
+// they point to the raw entry if the callee has one that takes and
+// returns the same, or else to jit_call_global_raw, which boxes the
+// args that r10 says are unboxed, calls the callee's boxed entry and
+// unboxes its result if r10 asks for that.
+
+#define CALLSITE_ENV_OFFSET 10 // from the entry immediate back to the env immediate
+#define CALLSITE_RAW_OFFSET 16 // from the entry immediate back to the raw flags
+
+typedef struct CallSite {
+  uint8_t* entry;         // the entrypoint immediate in the code
+  env_entry* env;
+  struct CallSite* prev;  // sites of the same env entry
+  struct CallSite* next;
+  struct CallSite* next_in_blob;
+  int raw;                // RAW_* flags of a call to the raw entry
+} CallSite;
+
+// entered from a site with the callee's env entry in r11
+__asm__(
+  ".text\n"
+  ".globl jit_call_global\n"
+  "jit_call_global:\n"
+  "  mov (%r11), %rax\n"
+  "  mov 8(%rax), %rax\n" // cell->dr.next
+  "  jmp *%rax\n"
+  ".globl jit_call_global_raw\n"
+  "jit_call_global_raw:\n"
+  "  push %r11\n"
+  "  push %r10\n"
+  "  testb $2, (%rsp)\n" // RAW_ARG(0)
+  "  jz 1f\n"
+  "  mov %r12, %rdi\n"
+  "  call alloc_int\n"
+  "  mov %rax, %r12\n"
+  "1:testb $4, (%rsp)\n"
+  "  jz 2f\n"
+  "  mov %r13, %rdi\n"
+  "  call alloc_int\n"
+  "  mov %rax, %r13\n"
+  "2:testb $8, (%rsp)\n"
+  "  jz 3f\n"
+  "  mov %r14, %rdi\n"
+  "  call alloc_int\n"
+  "  mov %rax, %r14\n"
+  "3:pop %r10\n"
+  "  pop %r11\n"
+  "  mov (%r11), %rax\n"
+  "  mov 8(%rax), %rax\n"
+  "  test $1, %r10b\n"    // RAW_RET
+  "  jnz 4f\n"
+  "  jmp *%rax\n"
+  "4:call *%rax\n"
+  "  mov (%rax), %rax\n" // cell->ar.value
+  "  ret\n"
+);
+
+static jit_word_t callsite_target(env_entry* e, int raw) {
+  Cell* c = e->cell;
+  if (c && c->tag == TAG_LAMBDA && c->dr.next) {
+    if (!raw) return (jit_word_t)c->dr.next;
+#ifdef JIT_RET_INT
+    if (lambda_raw(c) == raw) return (jit_word_t)c->dr.next + RAW_ENTRY;
+#endif
+  }
+  return raw ? (jit_word_t)jit_call_global_raw : (jit_word_t)jit_call_global;
+}
+
+static void callsite_patch(CallSite* s) {
+  jit_word_t v = callsite_target(s->env, s->raw);
+  jit_word_t old;
+  memcpy(&old, s->entry, sizeof(old));
+  if (old == v) return;
+  code_unseal(s->entry);
+  memcpy(s->entry, &v, sizeof(v));
+  code_seal(s->entry);
+}
+
+// the blob holding the sites is gone
+static void callsite_free_blob(void* links) {
+  CallSite* s = links;
+  while (s) {
+    CallSite* next = s->next_in_blob;
+    if (s->prev) s->prev->next = s->next;
+    else s->env->sites = s->next;
+    if (s->next) s->next->prev = s->prev;
+    free(s);
+    s = next;
+  }
+}
+
+// e was rebound
+void callsite_relink(env_entry* e) {
+  CallSite* s;
+  for (s = e->sites; s; s = s->next) {
+    callsite_patch(s);
+  }
+}
+
+static void callsite_relink_iter(const char *key, void *value, const void *obj) {
+  env_entry* e = (env_entry*)value;
+  if (e->cell == (Cell*)obj) callsite_relink(e);
+}
+
+// the entrypoint of lambda changed
+void callsite_relink_lambda(Cell* lambda) {
+  sm_enum(global_env, callsite_relink_iter, lambda);
+}
+
+// register and link the sites among the relocations of a sealed blob,
+// starting at relocation first
+void link_calls(uint8_t* blob, int first) {
+  static int hooked = 0;
+  uint8_t* start;
+  size_t size;
+  uint32_t* relocs;
+  int num_relocs, i;
+  int unsealed = 0;
+  CallSite* sites;
+
+  if (!code_blob_info(blob, &start, &size, &relocs, &num_relocs)) return;
+  if (!hooked) {
+    code_set_free_hook(callsite_free_blob);
+    hooked = 1;
+  }
+
+  sites = code_get_links(start);
+  for (i=first; i<num_relocs; i++) {
+    uint32_t idx = relocs[i];
+    jit_word_t v;
+    CallSite* s;
+
+    if (idx < CALLSITE_ENV_OFFSET) continue;
+    memcpy(&v, start+idx, sizeof(v));
+    if (v != (jit_word_t)jit_call_global && v != (jit_word_t)jit_call_global_raw) continue;
+    if (v == (jit_word_t)jit_call_global_raw && idx < CALLSITE_RAW_OFFSET) continue;
+
+    s = malloc(sizeof(CallSite));
+    s->entry = start+idx;
+    memcpy(&s->env, start+idx-CALLSITE_ENV_OFFSET, sizeof(env_entry*));
+    s->prev = NULL;
+    s->next = s->env->sites;
+    if (s->next) s->next->prev = s;
+    s->env->sites = s;
+    s->next_in_blob = sites;
+    s->raw = 0;
+    if (v == (jit_word_t)jit_call_global_raw) {
+      memcpy(&s->raw, start+idx-CALLSITE_RAW_OFFSET, sizeof(uint32_t));
+    }
+    sites = s;
+
+    if (callsite_target(s->env, s->raw) != v) {
+      v = callsite_target(s->env, s->raw);
+      if (!unsealed) code_unseal(start);
+      unsealed = 1;
+      memcpy(s->entry, &v, sizeof(v));
+    }
+  }
+  code_set_links(start, sites);
+  if (unsealed) code_seal(start);
+}
+
+// the unlinked value of the site at entry, for storing it
+jit_word_t callsite_unlinked(uint8_t* entry) {
+  env_entry* e;
+  CallSite* s;
+  memcpy(&e, entry-CALLSITE_ENV_OFFSET, sizeof(env_entry*));
+  for (s = e->sites; s; s = s->next) {
+    if (s->entry == entry && s->raw) return (jit_word_t)jit_call_global_raw;
+  }
+  return (jit_word_t)jit_call_global;
+}
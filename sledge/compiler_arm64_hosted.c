@@ -0,0 +1,92 @@
+//#define DEBUG
+
+// enters a top-level blob from c: saves the registers c expects to be
+// preserved, starts the jit stack at sp and calls the blob the way
+// jit_callr does
+Cell* jit_enter(void* binary);
+__asm__(
+  ".text\n"
+  ".globl jit_enter\n"
+  ".type jit_enter, %function\n"
+  "jit_enter:\n"
+  "  stp x29, x30, [sp, #-96]!\n"
+  "  mov x29, sp\n"
+  "  stp x19, x20, [sp, #16]\n"
+  "  stp x21, x22, [sp, #32]\n"
+  "  stp x23, x24, [sp, #48]\n"
+  "  stp x25, x26, [sp, #64]\n"
+  "  stp x27, x28, [sp, #80]\n"
+  "  mov x28, sp\n"
+  "  adr x30, 1f\n"
+  "  str x30, [x28, #-8]!\n"
+  "  and sp, x28, #-16\n"
+  "  blr x0\n"
+  "1:add x28, x28, #8\n"
+  "  mov sp, x28\n"
+  "  ldp x19, x20, [sp, #16]\n"
+  "  ldp x21, x22, [sp, #32]\n"
+  "  ldp x23, x24, [sp, #48]\n"
+  "  ldp x25, x26, [sp, #64]\n"
+  "  ldp x27, x28, [sp, #80]\n"
+  "  ldp x29, x30, [sp], #96\n"
+  "  ret\n"
+);
+
+int compile_for_platform(Cell* expr, Cell** res) {
+  uint32_t* binary;
+  char* defsym = "anon";
+  Cell* success;
+  Frame empty_frame;
+
+  jit_init();
+
+  register void* sp asm ("sp");
+  frame_init_toplevel(&empty_frame, sp);
+
+  if (expr && expr->tag == TAG_CONS && car(expr)->tag == TAG_SYM) {
+    if (!strcmp(car(expr)->ar.addr,"def")) {
+      defsym = car(cdr(expr))->ar.addr;
+    }
+  }
+
+  success = compile_expr(expr, &empty_frame, prototype_any);
+  jit_ret();
+
+  if (!success) {
+    printf("<compile_expr failed: %p>\r\n",success);
+    return 0;
+  }
+
+  if (strcmp(defsym,"anon")) {
+    printf("compiled def %s\r\n",defsym);
+  }
+#ifdef PEEPHOLE_STATS
+  peephole_report(defsym);
+#endif
+#ifdef IR_DUMP
+  ir_dump(defsym);
+#endif
+
+  binary = jit_finish();
+  if (!binary) return 0;
+
+#ifdef DEBUG
+  // disassemble with: objdump -D -b binary -maarch64 /tmp/jit_<addr>_<sym>.bin
+  printf("<assembled words: %d at: %p (%s)>\n",code_idx,binary,defsym);
+  char path[256];
+  snprintf(path,255,"/tmp/jit_%p_%s.bin",binary,defsym);
+  FILE* dump_f = fopen(path,"w");
+  if (dump_f) {
+    fwrite(binary, 4, code_idx, dump_f);
+    fclose(dump_f);
+  }
+#endif
+
+  code_seal(binary);
+
+  code_enter(binary, empty_frame.stack_end);
+  *res = jit_enter(binary);
+  code_leave(binary);
+
+  return 1;
+}
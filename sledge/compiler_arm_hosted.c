@@ -1,22 +1,29 @@
-#define CODESZ 8192
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/mman.h>
 
 int compile_for_platform(Cell* expr, Cell** res) {
-  code = mmap(0, CODESZ, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
-  memset(code, 0, CODESZ);
-  jit_init(0x400);
-  //cpool_idx = CODESZ/2; // 128 ops gap
-  //code_idx = 0;
+  uint32_t* binary;
+  jit_init();
 
   register void* sp asm ("sp"); // FIXME maybe unportable
   Frame empty_frame = {NULL, 0, 0, sp};
+  // jitted fns keep args and locals in r4-r10 without preserving them
+  jit_push(LBDREG, LBDREG+FRAME_REGS-1);
   int tag = compile_expr(expr, &empty_frame, TAG_ANY);
+  jit_pop(LBDREG, LBDREG+FRAME_REGS-1);
   jit_ret();
+#ifdef PEEPHOLE_STATS
+  peephole_report("form");
+#endif
+#ifdef IR_DUMP
+  ir_dump("form");
+#endif
+
+  binary = jit_finish();
+  if (!binary) return 0;
 
   FILE* f = fopen("/tmp/test","w");
-  fwrite(code, CODESZ, 1, f);
+  fwrite(binary, code_idx*4, 1, f);
   fclose(f);
 
   // disassemble
@@ -32,10 +39,12 @@ int compile_for_platform(Cell* expr, Cell** res) {
   close(fd);
 #endif
 
-  int mp_res = mprotect(code, CODESZ, PROT_EXEC|PROT_READ);
+  code_seal(binary);
   
-  funcptr fn = (funcptr)code;
+  funcptr fn = (funcptr)binary;
+  code_enter(binary, sp);
   *res = (Cell*)fn();
+  code_leave(binary);
   //printf("pointer result: %p\n",*res);
   //printf("pointer value: %p\n",((Cell*)*res)->value);
 
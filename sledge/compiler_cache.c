@@ -0,0 +1,1058 @@
+// persistent compiled-code cache (x64 hosted)
+//
+// top-level defs are keyed by a hash of their canonical serialized form,
+// the cache version and the host binary. a cache file stores the machine
+// code together with relocations for every absolute address in it (env
+// entries, constant cells, host functions), so an unchanged def is
+// relinked instead of compiled again.
+//
+// the generated code also depends on the globals the compiler looked up
+// (signatures of called functions, struct layouts). their fingerprints
+// are stored as well and checked before a cached blob is used.
+//
+// set INTERIM_JIT_CACHE to a directory to relocate the cache, or to an
+// empty string to disable it.
+//
+// the same records can be compiled ahead of time into an image that is
+// linked into the binary (see jit_aot_write and build_x64.sh). forms
+// found in the image are linked from there instead of being compiled.
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define JIT_CACHE_MAGIC 0x314a4349 // "ICJ1"
+#define JIT_CACHE_VERSION 5
+#define JIT_AOT_MAGIC 0x31414349 // "ICA1"
+
+// bounds of the host binary, provided by the linker
+extern char __executable_start;
+extern char _end;
+
+enum jit_cache_ser {
+  SER_NULL = 0,
+  SER_INT,
+  SER_CONS,
+  SER_SYM,
+  SER_STR,
+  SER_BYTES,
+  SER_STATIC,
+  SER_GLOBAL,
+  SER_LAMBDA,
+  SER_UNDEFINED,
+  SER_FORM
+};
+
+enum jit_cache_link {
+  LINK_NONE = 0,  // plain values only
+  LINK_REFS,      // prototypes, globals and lambdas by reference
+  LINK_FORM       // and cells of the form being compiled by position
+};
+
+enum jit_cache_reloc {
+  RELOC_CONST = 0,
+  RELOC_ENV,
+  RELOC_HOST,
+  RELOC_GLOBAL_ENV,
+  RELOC_STACK_END,
+  RELOC_HOST_FN
+};
+
+typedef struct JitBuf {
+  uint8_t* data;
+  size_t len;
+  size_t size;
+} JitBuf;
+
+typedef struct JitReader {
+  uint8_t* data;
+  size_t len;
+  size_t pos;
+  int err;
+} JitReader;
+
+// cells created by init_compiler that code may point to
+static Cell** jit_cache_statics[] = {
+  &prototype_nil, &prototype_type_error, &consed_type_error, &prototype_any,
+  &prototype_void, &prototype_symbol, &prototype_int, &prototype_struct,
+  &prototype_struct_def, &prototype_stream, &prototype_string,
+  &prototype_lambda, &prototype_cons
+};
+#define JIT_CACHE_NUM_STATICS (sizeof(jit_cache_statics)/sizeof(Cell**))
+
+// host functions called from generated code, by index. unlike plain
+// offsets these stay valid across builds.
+static void* jit_cache_host_fns[] = {
+  alloc_int, alloc_nil, alloc_num_bytes, alloc_num_string,
+  alloc_string_from_bytes, alloc_struct, alloc_struct_def, alloc_concat,
+  alloc_cons, alloc_substr, fs_mmap, fs_open, fs_mount, stream_read,
+  stream_write, lisp_print, lisp_write_to_cell, read_string_cell,
+  list_symbols, insert_global_symbol, platform_eval, collect_garbage,
+  inline_mod, jit_call_global, insert_global_const, jit_call_global_raw,
+#ifdef HEAP_IMAGE
+  image_save
+#endif
+};
+#define JIT_CACHE_NUM_HOST_FNS (sizeof(jit_cache_host_fns)/sizeof(void*))
+
+static char jit_cache_dir[256];
+static int jit_cache_state = 0; // 0 = uninitialized, 1 = on, -1 = off
+static JitBuf jit_cache_stamp;
+
+// globals looked up while compiling
+static int jit_cache_recording = 0;
+static int jit_cache_storing_form = 0; // the recorded form will be stored
+static char** jit_cache_deps = NULL;
+static int jit_cache_deps_count = 0;
+static int jit_cache_deps_size = 0;
+
+// snapshot of the global env, for reverse lookups
+static env_entry** jit_cache_env = NULL;
+static int jit_cache_env_count = 0;
+static int jit_cache_env_size = 0;
+
+// constants of the blob being stored
+static Cell** jit_cache_consts = NULL;
+static int jit_cache_consts_count = 0;
+static int jit_cache_consts_size = 0;
+
+// cells of the form being compiled in preorder. code points
+// straight into the form (constants, lambda bodies), and the
+// collector only keeps those alive through the lambdas' bodies,
+// so they have to be the very same cells after loading.
+static Cell** jit_cache_form = NULL;
+static int jit_cache_form_count = 0;
+static int jit_cache_form_size = 0;
+static uint32_t* jit_cache_form_hash = NULL; // cell -> index+1
+static uint32_t jit_cache_form_hash_size = 0;
+
+// lambdas of the blob being loaded
+typedef struct JitPending {
+  Cell* lambda;
+  uint32_t idx;
+} JitPending;
+
+static JitPending* jit_cache_pending = NULL;
+static int jit_cache_pending_count = 0;
+static int jit_cache_pending_size = 0;
+
+// ahead-of-time image: records being collected by sledge --aot,
+// and the index of the image linked into this binary
+typedef struct JitAotEntry {
+  uint64_t hash;
+  uint8_t* data;
+  uint32_t len;
+} JitAotEntry;
+
+static int jit_aot_recording = 0;
+static JitBuf jit_aot_out;
+static int jit_aot_out_count = 0;
+static JitAotEntry* jit_aot_index = NULL;
+static int jit_aot_count = 0;
+
+// where the last jit_cache_load found its record: 1 = disk, 2 = image
+int jit_cache_source = 0;
+
+static void jb_put(JitBuf* b, void* src, size_t n) {
+  if (b->len+n > b->size) {
+    while (b->len+n > b->size) b->size = b->size ? b->size*2 : 1024;
+    b->data = realloc(b->data, b->size);
+  }
+  memcpy(b->data+b->len, src, n);
+  b->len += n;
+}
+
+static void jb_u8(JitBuf* b, uint8_t v) {
+  jb_put(b, &v, 1);
+}
+
+static void jb_u32(JitBuf* b, uint32_t v) {
+  jb_put(b, &v, 4);
+}
+
+static void jb_u64(JitBuf* b, uint64_t v) {
+  jb_put(b, &v, 8);
+}
+
+static void jb_str(JitBuf* b, char* str) {
+  uint32_t n = strlen(str);
+  jb_u32(b, n);
+  jb_put(b, str, n);
+}
+
+static void jr_get(JitReader* r, void* dest, size_t n) {
+  if (r->err || r->pos+n > r->len) {
+    r->err = 1;
+    memset(dest, 0, n);
+    return;
+  }
+  memcpy(dest, r->data+r->pos, n);
+  r->pos += n;
+}
+
+static uint8_t jr_u8(JitReader* r) {
+  uint8_t v;
+  jr_get(r, &v, 1);
+  return v;
+}
+
+static uint32_t jr_u32(JitReader* r) {
+  uint32_t v;
+  jr_get(r, &v, 4);
+  return v;
+}
+
+static uint64_t jr_u64(JitReader* r) {
+  uint64_t v;
+  jr_get(r, &v, 8);
+  return v;
+}
+
+// returns a pointer into the reader's data, not 0-terminated
+static uint8_t* jr_bytes(JitReader* r, uint32_t n) {
+  uint8_t* res = r->data+r->pos;
+  if (r->err || r->pos+n > r->len) {
+    r->err = 1;
+    return NULL;
+  }
+  r->pos += n;
+  return res;
+}
+
+static uint64_t jit_cache_hash(uint8_t* data, size_t len, uint64_t h) {
+  size_t i;
+  for (i=0; i<len; i++) {
+    h ^= data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+void jit_cache_note_lookup(char* name) {
+  int i;
+  if (!jit_cache_recording) return;
+  for (i=0; i<jit_cache_deps_count; i++) {
+    if (!strcmp(jit_cache_deps[i], name)) return;
+  }
+  if (jit_cache_deps_count>=jit_cache_deps_size) {
+    jit_cache_deps_size = jit_cache_deps_size ? jit_cache_deps_size*2 : 64;
+    jit_cache_deps = realloc(jit_cache_deps, jit_cache_deps_size*sizeof(char*));
+  }
+  jit_cache_deps[jit_cache_deps_count++] = strdup(name);
+}
+
+static void jit_cache_env_iter(const char *key, void *value, const void *obj) {
+  if (jit_cache_env_count>=jit_cache_env_size) {
+    jit_cache_env_size = jit_cache_env_size ? jit_cache_env_size*2 : 512;
+    jit_cache_env = realloc(jit_cache_env, jit_cache_env_size*sizeof(env_entry*));
+  }
+  jit_cache_env[jit_cache_env_count++] = value;
+}
+
+static void jit_cache_snapshot_env() {
+  jit_cache_env_count = 0;
+  sm_enum(global_env, jit_cache_env_iter, NULL);
+}
+
+static env_entry* jit_cache_find_env(jit_word_t addr) {
+  int i;
+  for (i=0; i<jit_cache_env_count; i++) {
+    if ((jit_word_t)jit_cache_env[i] == addr) return jit_cache_env[i];
+  }
+  return NULL;
+}
+
+static env_entry* jit_cache_find_env_value(Cell* c) {
+  int i;
+  for (i=0; i<jit_cache_env_count; i++) {
+    if (jit_cache_env[i]->cell == c) return jit_cache_env[i];
+  }
+  return NULL;
+}
+
+static int jit_cache_find_static(Cell* c) {
+  int i;
+  for (i=0; i<JIT_CACHE_NUM_STATICS; i++) {
+    if (*jit_cache_statics[i] == c) return i;
+  }
+  return -1;
+}
+
+static uint32_t jit_cache_ptr_hash(Cell* c) {
+  uint64_t v = (uint64_t)(jit_word_t)c;
+  v ^= v>>17;
+  v *= 0xed5ad4bbULL;
+  v ^= v>>11;
+  return (uint32_t)v;
+}
+
+static void jit_cache_index_cell(Cell* c) {
+  while (c) {
+    if (jit_cache_form_count>=jit_cache_form_size) {
+      jit_cache_form_size = jit_cache_form_size ? jit_cache_form_size*2 : 1024;
+      jit_cache_form = realloc(jit_cache_form, jit_cache_form_size*sizeof(Cell*));
+    }
+    jit_cache_form[jit_cache_form_count++] = c;
+    if (c->tag != TAG_CONS) return;
+    jit_cache_index_cell((Cell*)c->ar.addr);
+    c = (Cell*)c->dr.next;
+  }
+}
+
+static void jit_cache_index_form(Cell* expr, int with_hash) {
+  uint32_t i;
+  jit_cache_form_count = 0;
+  jit_cache_index_cell(expr);
+  if (!with_hash) return;
+
+  jit_cache_form_hash_size = 64;
+  while (jit_cache_form_hash_size < 2*jit_cache_form_count) jit_cache_form_hash_size*=2;
+  free(jit_cache_form_hash);
+  jit_cache_form_hash = calloc(jit_cache_form_hash_size, sizeof(uint32_t));
+
+  for (i=0; i<jit_cache_form_count; i++) {
+    uint32_t h = jit_cache_ptr_hash(jit_cache_form[i]) & (jit_cache_form_hash_size-1);
+    while (jit_cache_form_hash[h]) {
+      if (jit_cache_form[jit_cache_form_hash[h]-1] == jit_cache_form[i]) break;
+      h = (h+1) & (jit_cache_form_hash_size-1);
+    }
+    if (!jit_cache_form_hash[h]) jit_cache_form_hash[h] = i+1;
+  }
+}
+
+static int jit_cache_find_form(Cell* c) {
+  uint32_t h;
+  if (!jit_cache_form_hash_size) return -1;
+  h = jit_cache_ptr_hash(c) & (jit_cache_form_hash_size-1);
+  while (jit_cache_form_hash[h]) {
+    if (jit_cache_form[jit_cache_form_hash[h]-1] == c) return jit_cache_form_hash[h]-1;
+    h = (h+1) & (jit_cache_form_hash_size-1);
+  }
+  return -1;
+}
+
+// serialize a cell tree. with link set, cells that have to keep their
+// identity are written as references: compiler prototypes, values of
+// global symbols, cells of the current form and lambdas compiled into
+// the current blob.
+static int jit_cache_ser_cell(JitBuf* b, Cell* c, int link) {
+  while (1) {
+    if (!c) {
+      jb_u8(b, SER_NULL);
+      return 1;
+    }
+    if (link) {
+      int idx = jit_cache_find_static(c);
+      env_entry* e;
+      if (idx>=0) {
+        jb_u8(b, SER_STATIC);
+        jb_u32(b, idx);
+        return 1;
+      }
+      if (link == LINK_FORM && (idx = jit_cache_find_form(c))>=0) {
+        jb_u8(b, SER_FORM);
+        jb_u32(b, idx);
+        return 1;
+      }
+      if ((e = jit_cache_find_env_value(c))) {
+        jb_u8(b, SER_GLOBAL);
+        jb_str(b, e->name);
+        return 1;
+      }
+    }
+
+    switch (c->tag) {
+    case TAG_INT:
+      jb_u8(b, SER_INT);
+      jb_u64(b, c->ar.value);
+      return 1;
+    case TAG_SYM:
+    case TAG_STR:
+    case TAG_BYTES: {
+      uint32_t sz = c->dr.size;
+      if (c->tag == TAG_SYM) {
+        jb_u8(b, SER_SYM);
+        sz = c->ar.addr ? strlen(c->ar.addr) : 0;
+      } else {
+        jb_u8(b, c->tag == TAG_STR ? SER_STR : SER_BYTES);
+      }
+      jb_u32(b, sz);
+      jb_put(b, c->ar.addr, sz);
+      return 1;
+    }
+    case TAG_LAMBDA: {
+      char label[64];
+      Label* lbl;
+      if (!link) return 0;
+      sprintf(label,"L0_%p",c);
+      lbl = find_label(label);
+      if (!lbl) return 0; // compiled elsewhere
+      jb_u8(b, SER_LAMBDA);
+      jb_u32(b, lbl->idx);
+      c = (Cell*)c->ar.addr; // signature and body
+      break;
+    }
+    case TAG_CONS:
+      jb_u8(b, SER_CONS);
+      if (!jit_cache_ser_cell(b, (Cell*)c->ar.addr, link)) return 0;
+      c = (Cell*)c->dr.next; // iterate on the tail to save stack
+      break;
+    default:
+      return 0;
+    }
+  }
+}
+
+static Cell* jit_cache_deser_cell(JitReader* r) {
+  uint8_t t = jr_u8(r);
+  if (r->err) return NULL;
+
+  switch (t) {
+  case SER_NULL:
+    return NULL;
+  case SER_INT:
+    return alloc_int((int)jr_u64(r));
+  case SER_SYM:
+  case SER_STR:
+  case SER_BYTES: {
+    uint32_t sz = jr_u32(r);
+    uint8_t* src = jr_bytes(r, sz);
+    Cell* c;
+    if (!src) return NULL;
+    if (t == SER_SYM) {
+      char* name = malloc(sz+1);
+      memcpy(name, src, sz);
+      name[sz] = 0;
+      c = alloc_sym(name);
+      free(name);
+      return c;
+    }
+    c = (t == SER_BYTES) ? alloc_num_bytes(sz) : alloc_num_string(sz);
+    memcpy(c->ar.addr, src, sz);
+    return c;
+  }
+  case SER_FORM: {
+    uint32_t idx = jr_u32(r);
+    if (idx>=jit_cache_form_count) {
+      r->err = 1;
+      return NULL;
+    }
+    return jit_cache_form[idx];
+  }
+  case SER_STATIC: {
+    uint32_t idx = jr_u32(r);
+    if (idx>=JIT_CACHE_NUM_STATICS) {
+      r->err = 1;
+      return NULL;
+    }
+    return *jit_cache_statics[idx];
+  }
+  case SER_GLOBAL: {
+    char name[MAX_SYMBOL_SIZE];
+    uint32_t sz = jr_u32(r);
+    uint8_t* src = jr_bytes(r, sz);
+    env_entry* e;
+    if (!src || sz>=MAX_SYMBOL_SIZE) {
+      r->err = 1;
+      return NULL;
+    }
+    memcpy(name, src, sz);
+    name[sz] = 0;
+    e = lookup_global_symbol(name);
+    if (!e) {
+      r->err = 1;
+      return NULL;
+    }
+    return e->cell;
+  }
+  case SER_LAMBDA: {
+    uint32_t idx = jr_u32(r);
+    Cell* lambda = alloc_lambda(jit_cache_deser_cell(r));
+    lambda->dr.next = 0;
+    if (jit_cache_pending_count>=jit_cache_pending_size) {
+      jit_cache_pending_size = jit_cache_pending_size ? jit_cache_pending_size*2 : 32;
+      jit_cache_pending = realloc(jit_cache_pending, jit_cache_pending_size*sizeof(JitPending));
+    }
+    jit_cache_pending[jit_cache_pending_count].lambda = lambda;
+    jit_cache_pending[jit_cache_pending_count].idx = idx;
+    jit_cache_pending_count++;
+    return lambda;
+  }
+  case SER_CONS: {
+    Cell* head = jit_cache_deser_cell(r);
+    return alloc_cons(head, jit_cache_deser_cell(r));
+  }
+  }
+  r->err = 1;
+  return NULL;
+}
+
+// what the compiler may have taken from a global when generating code
+static void jit_cache_fingerprint(JitBuf* b, char* name) {
+  env_entry* e = lookup_global_symbol(name);
+  Cell* c;
+
+  if (!e || !e->cell) {
+    jb_u8(b, SER_UNDEFINED);
+    return;
+  }
+  c = e->cell;
+  jb_u32(b, c->tag);
+
+  if (c->tag == TAG_STRUCT && c->ar.addr) {
+    // instances are accessed by the layout of their definition
+    c = ((Cell**)c->ar.addr)[0];
+    if (!c) return;
+  }
+
+  if (c->tag == TAG_BUILTIN) {
+    jb_u64(b, c->ar.value);
+  }
+  else if (c->tag == TAG_LAMBDA) {
+    // the signature
+    if (!jit_cache_ser_cell(b, car((Cell*)c->ar.addr), LINK_REFS)) jb_u8(b, SER_UNDEFINED);
+  }
+  else if (c->tag == TAG_STRUCT_DEF) {
+    // name, field names and field types
+    Cell** fields = c->ar.addr;
+    int i;
+    jb_u32(b, c->dr.size);
+    for (i=0; i<c->dr.size; i++) {
+      Cell* f = fields[i];
+      if (!f) {
+        jb_u8(b, SER_NULL);
+        continue;
+      }
+      jb_u32(b, f->tag);
+      if (f->tag == TAG_SYM) {
+        jit_cache_ser_cell(b, f, LINK_NONE);
+      } else if (f->tag == TAG_STRUCT && f->ar.addr) {
+        Cell* def = ((Cell**)f->ar.addr)[0];
+        if (def && def->tag == TAG_STRUCT_DEF) jit_cache_ser_cell(b, ((Cell**)def->ar.addr)[0], LINK_NONE);
+      }
+    }
+  }
+}
+
+// identifies the host binary
+static void jit_cache_host_stamp(JitBuf* b) {
+  uint64_t v;
+  jb_str(b, __DATE__ " " __TIME__);
+  v = (jit_word_t)alloc_int - (jit_word_t)compile_expr;
+  jb_u64(b, v);
+  v = (jit_word_t)lisp_write - (jit_word_t)compile_expr;
+  jb_u64(b, v);
+}
+
+static int jit_cache_init() {
+  char* dir;
+  char* home;
+
+  if (jit_cache_state) return jit_cache_state>0;
+  jit_cache_state = -1;
+
+  dir = getenv("INTERIM_JIT_CACHE");
+  if (dir) {
+    if (!dir[0]) return 0;
+    snprintf(jit_cache_dir, sizeof(jit_cache_dir), "%s", dir);
+  } else {
+    home = getenv("HOME");
+    if (!home) return 0;
+    snprintf(jit_cache_dir, sizeof(jit_cache_dir), "%s/.cache", home);
+    mkdir(jit_cache_dir, 0755);
+    snprintf(jit_cache_dir, sizeof(jit_cache_dir), "%s/.cache/interim-jit", home);
+  }
+  mkdir(jit_cache_dir, 0755);
+  if (access(jit_cache_dir, W_OK)) {
+    printf("<jit cache: cannot write to %s, disabled>\r\n",jit_cache_dir);
+    return 0;
+  }
+
+  // everything that invalidates all cached code at once
+  jb_str(&jit_cache_stamp, "x64");
+  jb_u32(&jit_cache_stamp, JIT_CACHE_VERSION);
+  jit_cache_host_stamp(&jit_cache_stamp);
+
+  jit_cache_state = 1;
+  return 1;
+}
+
+static void jit_cache_path(JitBuf* form, char* path, int len) {
+  uint64_t h1 = jit_cache_hash(jit_cache_stamp.data, jit_cache_stamp.len, 0xcbf29ce484222325ULL);
+  uint64_t h2 = jit_cache_hash(jit_cache_stamp.data, jit_cache_stamp.len, 0x84222325cbf29ce4ULL);
+  h1 = jit_cache_hash(form->data, form->len, h1);
+  h2 = jit_cache_hash(form->data, form->len, h2);
+  snprintf(path, len, "%s/%016" PRIx64 "%016" PRIx64 ".jit", jit_cache_dir, h1, h2);
+}
+
+static int jit_cache_is_def(Cell* expr) {
+  if (!expr || expr->tag != TAG_CONS || !car(expr) || car(expr)->tag != TAG_SYM) return 0;
+  return !strcmp(car(expr)->ar.addr, "def");
+}
+
+// should this form go through the cache?
+int jit_cache_wanted(Cell* expr) {
+  if (debug_mode) return 0;
+#ifdef JIT_PROFILE
+  // cached code is not counted
+  if (profile_mode()) return 0;
+#endif
+  if (!expr || expr->tag != TAG_CONS) return 0;
+  // any top-level form can be compiled ahead of time
+  if (jit_aot_recording || jit_aot_count) return 1;
+  if (!jit_cache_is_def(expr)) return 0;
+  return jit_cache_init();
+}
+
+// start recording the globals the compiler looks up
+void jit_cache_begin(Cell* expr) {
+  int i;
+  for (i=0; i<jit_cache_deps_count; i++) {
+    free(jit_cache_deps[i]);
+  }
+  jit_cache_deps_count = 0;
+  jit_cache_recording = 1;
+  jit_cache_storing_form = jit_aot_recording || jit_cache_is_def(expr);
+}
+
+// is the code being compiled going to be stored? such code must not
+// depend on more than the fingerprints of its globals cover.
+int jit_cache_storing() {
+  return jit_cache_recording && jit_cache_storing_form;
+}
+
+// serialize the current jit state (code, relocations, labels) into
+// a record. with portable set, the record must not depend on the
+// layout of this binary.
+static int jit_cache_record(JitBuf* out, JitBuf* form, Cell* expr, void* stack_end, int portable) {
+  JitBuf relocs = {NULL, 0, 0};
+  JitBuf consts = {NULL, 0, 0};
+  jit_word_t cells_start = (jit_word_t)get_cell_heap();
+  jit_word_t cells_end = cells_start + alloc_stats()->cells_max*sizeof(Cell);
+  int i, j;
+  int ok = 0;
+
+  jit_cache_snapshot_env();
+  jit_cache_index_form(expr, 1);
+  jit_cache_consts_count = 0;
+
+  for (i=0; i<reloc_idx; i++) {
+    jit_word_t v = jit_relocs[i].value;
+    jit_word_t base = v & ~STACK_FRAME_MARKER;
+    env_entry* e;
+
+    jb_u32(&relocs, jit_relocs[i].idx);
+
+    if (v == (jit_word_t)global_env) {
+      jb_u8(&relocs, RELOC_GLOBAL_ENV);
+    }
+    else if (v == (jit_word_t)stack_end) {
+      jb_u8(&relocs, RELOC_STACK_END);
+    }
+    else if ((e = jit_cache_find_env(v))) {
+      jb_u8(&relocs, RELOC_ENV);
+      jb_str(&relocs, e->name);
+    }
+    else if (base>=cells_start && base<cells_end) {
+      for (j=0; j<jit_cache_consts_count; j++) {
+        if ((jit_word_t)jit_cache_consts[j] == base) break;
+      }
+      if (j==jit_cache_consts_count) {
+        if (jit_cache_consts_count>=jit_cache_consts_size) {
+          jit_cache_consts_size = jit_cache_consts_size ? jit_cache_consts_size*2 : 64;
+          jit_cache_consts = realloc(jit_cache_consts, jit_cache_consts_size*sizeof(Cell*));
+        }
+        jit_cache_consts[jit_cache_consts_count++] = (Cell*)base;
+        if (!jit_cache_ser_cell(&consts, (Cell*)base, LINK_FORM)) goto done;
+      }
+      jb_u8(&relocs, RELOC_CONST);
+      jb_u32(&relocs, j);
+      jb_u64(&relocs, v - base);
+    }
+    else {
+      for (j=0; j<JIT_CACHE_NUM_HOST_FNS; j++) {
+        if ((jit_word_t)jit_cache_host_fns[j] == v) break;
+      }
+      if (j<JIT_CACHE_NUM_HOST_FNS) {
+        jb_u8(&relocs, RELOC_HOST_FN);
+        jb_u32(&relocs, j);
+      }
+      else if (!portable && v>=(jit_word_t)&__executable_start && v<(jit_word_t)&_end) {
+        jb_u8(&relocs, RELOC_HOST);
+        jb_u64(&relocs, v - (jit_word_t)compile_expr);
+      }
+      else {
+        // points somewhere we can't reproduce
+        goto done;
+      }
+    }
+  }
+
+  jb_u32(out, JIT_CACHE_MAGIC);
+  jb_u32(out, JIT_CACHE_VERSION);
+  jb_u32(out, form->len);
+  jb_put(out, form->data, form->len);
+
+  jb_u32(out, jit_cache_deps_count);
+  for (i=0; i<jit_cache_deps_count; i++) {
+    JitBuf fp = {NULL, 0, 0};
+    jit_cache_fingerprint(&fp, jit_cache_deps[i]);
+    jb_str(out, jit_cache_deps[i]);
+    jb_u32(out, fp.len);
+    jb_put(out, fp.data, fp.len);
+    free(fp.data);
+  }
+
+  jb_u32(out, jit_cache_consts_count);
+  jb_put(out, consts.data, consts.len);
+  jb_u32(out, reloc_idx);
+  jb_put(out, relocs.data, relocs.len);
+  jb_u32(out, code_idx);
+  jb_put(out, code, code_idx);
+  ok = 1;
+
+done:
+  free(relocs.data);
+  free(consts.data);
+  return ok;
+}
+
+// store the current jit state for expr in the cache, or in the
+// image being built. has to be called before the code runs.
+void jit_cache_store(Cell* expr, void* stack_end) {
+  JitBuf out = {NULL, 0, 0};
+  JitBuf form = {NULL, 0, 0};
+  char path[512];
+  char tmp_path[600];
+  FILE* f;
+
+  jit_cache_recording = 0;
+#ifdef JIT_CONST_GLOBALS
+  // code with defconst values folded in has to be recompiled when
+  // they change, which only works for code compiled in this process
+  if (const_globals_folded) goto done;
+#endif
+  if (!jit_cache_ser_cell(&form, expr, LINK_NONE)) goto done;
+
+  if (jit_aot_recording) {
+    if (jit_cache_record(&out, &form, expr, stack_end, 1)) {
+      jb_u32(&jit_aot_out, out.len);
+      jb_put(&jit_aot_out, out.data, out.len);
+      jit_aot_out_count++;
+    }
+    goto done;
+  }
+
+  if (!jit_cache_is_def(expr) || !jit_cache_init()) goto done;
+  if (!jit_cache_record(&out, &form, expr, stack_end, 0)) goto done;
+
+  jit_cache_path(&form, path, sizeof(path));
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+  f = fopen(tmp_path, "wb");
+  if (f) {
+    int ok = (fwrite(out.data, 1, out.len, f) == out.len);
+    fclose(f);
+    if (!ok || rename(tmp_path, path)) unlink(tmp_path);
+  }
+
+done:
+  free(out.data);
+  free(form.data);
+}
+
+// link a record for expr (serialized as form) into a sealed blob
+// with all of its lambdas pointing into it. NULL if the record
+// doesn't fit the current globals.
+static uint8_t* jit_cache_link(JitReader* r, JitBuf* form, Cell* expr, void* stack_end) {
+  uint8_t* blob = NULL;
+  uint8_t* code_src;
+  Cell** consts = NULL;
+  uint32_t* offsets = NULL;
+  uint32_t i, n, num_consts, num_relocs, code_len;
+
+  jit_cache_pending_count = 0;
+  if (jr_u32(r) != JIT_CACHE_MAGIC || jr_u32(r) != JIT_CACHE_VERSION) goto fail;
+
+  // guard against hash collisions
+  n = jr_u32(r);
+  if (n != form->len) goto fail;
+  code_src = jr_bytes(r, n);
+  if (!code_src || memcmp(code_src, form->data, n)) goto fail;
+
+  // the globals the code was specialized for must be unchanged
+  jit_cache_snapshot_env();
+  n = jr_u32(r);
+  for (i=0; i<n && !r->err; i++) {
+    JitBuf fp = {NULL, 0, 0};
+    char name[MAX_SYMBOL_SIZE];
+    uint32_t len = jr_u32(r);
+    uint8_t* src = jr_bytes(r, len);
+    int same;
+    if (!src || len>=MAX_SYMBOL_SIZE) goto fail;
+    memcpy(name, src, len);
+    name[len] = 0;
+
+    jit_cache_fingerprint(&fp, name);
+    len = jr_u32(r);
+    src = jr_bytes(r, len);
+    same = (src && len==fp.len && !memcmp(src, fp.data, len));
+    free(fp.data);
+    if (!same) goto fail;
+  }
+
+  jit_cache_index_form(expr, 0);
+  num_consts = jr_u32(r);
+  if (r->err) goto fail;
+  consts = malloc((num_consts+1)*sizeof(Cell*));
+  for (i=0; i<num_consts && !r->err; i++) {
+    consts[i] = jit_cache_deser_cell(r);
+  }
+
+  // relocations are applied once the code is in place
+  num_relocs = jr_u32(r);
+  {
+    size_t reloc_pos = r->pos;
+    for (i=0; i<num_relocs && !r->err; i++) {
+      uint8_t kind;
+      jr_u32(r);
+      kind = jr_u8(r);
+      if (kind == RELOC_ENV) jr_bytes(r, jr_u32(r));
+      else if (kind == RELOC_CONST) { jr_u32(r); jr_u64(r); }
+      else if (kind == RELOC_HOST) jr_u64(r);
+      else if (kind == RELOC_HOST_FN) jr_u32(r);
+    }
+
+    code_len = jr_u32(r);
+    code_src = jr_bytes(r, code_len);
+    if (r->err || !code_src) goto fail;
+
+    blob = code_alloc(code_len);
+    if (!blob) goto fail;
+    memcpy(blob, code_src, code_len);
+
+    r->pos = reloc_pos;
+    offsets = malloc((num_relocs+1)*sizeof(uint32_t));
+    for (i=0; i<num_relocs && !r->err; i++) {
+      uint32_t idx = jr_u32(r);
+      offsets[i] = idx;
+      uint8_t kind = jr_u8(r);
+      jit_word_t v = 0;
+
+      if (kind == RELOC_CONST) {
+        uint32_t ci = jr_u32(r);
+        uint64_t addend = jr_u64(r);
+        if (ci>=num_consts) goto fail;
+        v = (jit_word_t)consts[ci] + addend;
+      }
+      else if (kind == RELOC_ENV) {
+        char name[MAX_SYMBOL_SIZE];
+        uint32_t len = jr_u32(r);
+        uint8_t* src = jr_bytes(r, len);
+        env_entry* e;
+        if (!src || len>=MAX_SYMBOL_SIZE) goto fail;
+        memcpy(name, src, len);
+        name[len] = 0;
+        e = lookup_global_symbol(name);
+        if (!e) goto fail;
+        v = (jit_word_t)e;
+      }
+      else if (kind == RELOC_HOST) {
+        v = (jit_word_t)compile_expr + jr_u64(r);
+      }
+      else if (kind == RELOC_HOST_FN) {
+        uint32_t fi = jr_u32(r);
+        if (fi>=JIT_CACHE_NUM_HOST_FNS) goto fail;
+        v = (jit_word_t)jit_cache_host_fns[fi];
+      }
+      else if (kind == RELOC_GLOBAL_ENV) {
+        v = (jit_word_t)global_env;
+      }
+      else if (kind == RELOC_STACK_END) {
+        v = (jit_word_t)stack_end;
+      }
+      else {
+        goto fail;
+      }
+
+      if (idx+sizeof(jit_word_t) > code_len) goto fail;
+      memcpy(blob+idx, &v, sizeof(jit_word_t));
+    }
+    if (r->err) goto fail;
+  }
+
+  for (i=0; i<jit_cache_pending_count; i++) {
+    if (jit_cache_pending[i].idx >= code_len) goto fail;
+    jit_cache_pending[i].lambda->dr.next = blob + jit_cache_pending[i].idx;
+  }
+
+  jit_cache_pending_count = 0;
+  code_set_relocs(blob, offsets, num_relocs);
+  code_seal(blob);
+  free(offsets);
+  free(consts);
+  return blob;
+
+fail:
+  for (i=0; i<jit_cache_pending_count; i++) {
+    jit_cache_pending[i].lambda->dr.next = 0;
+  }
+  jit_cache_pending_count = 0;
+  if (blob) code_free(blob);
+  free(offsets);
+  free(consts);
+  return NULL;
+}
+
+// returns a sealed blob ready to run, with all of its lambdas
+// linked, or NULL if there is no valid record for expr
+uint8_t* jit_cache_load(Cell* expr, void* stack_end) {
+  JitBuf form = {NULL, 0, 0};
+  JitReader r = {NULL, 0, 0, 0};
+  char path[512];
+  uint8_t* blob = NULL;
+  FILE* f;
+  long sz;
+  int i;
+
+  jit_cache_source = 0;
+  if (jit_aot_recording) return NULL;
+  if (!jit_cache_ser_cell(&form, expr, LINK_NONE)) goto done;
+
+  if (jit_aot_count) {
+    uint64_t h = jit_cache_hash(form.data, form.len, 0xcbf29ce484222325ULL);
+    for (i=0; i<jit_aot_count && !blob; i++) {
+      if (jit_aot_index[i].hash != h) continue;
+      JitReader ir = {jit_aot_index[i].data, jit_aot_index[i].len, 0, 0};
+      blob = jit_cache_link(&ir, &form, expr, stack_end);
+    }
+    if (blob) {
+      jit_cache_source = 2;
+      goto done;
+    }
+  }
+
+  if (!jit_cache_is_def(expr) || !jit_cache_init()) goto done;
+  jit_cache_path(&form, path, sizeof(path));
+
+  f = fopen(path, "rb");
+  if (!f) goto done;
+  fseek(f, 0, SEEK_END);
+  sz = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (sz>0) {
+    r.data = malloc(sz);
+    r.len = fread(r.data, 1, sz, f);
+  }
+  fclose(f);
+  if (!r.data) goto done;
+
+  blob = jit_cache_link(&r, &form, expr, stack_end);
+  if (blob) jit_cache_source = 1;
+
+done:
+  free(form.data);
+  free(r.data);
+  return blob;
+}
+
+// is there a record for expr, in the linked-in image or on disk?
+// cheaper than jit_cache_load, which also links it.
+int jit_cache_has(Cell* expr) {
+  JitBuf form = {NULL, 0, 0};
+  char path[512];
+  int found = 0;
+  int i;
+
+  if (jit_aot_recording) return 0;
+  if (!jit_cache_ser_cell(&form, expr, LINK_NONE)) goto done;
+
+  if (jit_aot_count) {
+    uint64_t h = jit_cache_hash(form.data, form.len, 0xcbf29ce484222325ULL);
+    for (i=0; i<jit_aot_count && !found; i++) {
+      found = (jit_aot_index[i].hash == h);
+    }
+    if (found) goto done;
+  }
+
+  if (!jit_cache_is_def(expr) || !jit_cache_init()) goto done;
+  jit_cache_path(&form, path, sizeof(path));
+  found = !access(path, R_OK);
+
+done:
+  free(form.data);
+  return found;
+}
+
+// collect the records of all forms compiled from now on
+void jit_aot_begin() {
+  jit_aot_recording = 1;
+  jit_aot_out.len = 0;
+  jit_aot_out_count = 0;
+}
+
+// write the collected records as a C source defining jit_aot_image,
+// to be linked into a binary built with -DJIT_AOT
+int jit_aot_write(char* path) {
+  FILE* f = fopen(path, "w");
+  JitBuf img = {NULL, 0, 0};
+  size_t i;
+
+  jit_aot_recording = 0;
+  if (!f) {
+    printf("<aot: cannot write %s>\r\n",path);
+    return 0;
+  }
+  jb_u32(&img, JIT_AOT_MAGIC);
+  jb_u32(&img, JIT_CACHE_VERSION);
+  jb_u32(&img, jit_aot_out_count);
+  jb_put(&img, jit_aot_out.data, jit_aot_out.len);
+
+  fprintf(f, "// generated by sledge --aot, do not edit\n\n");
+  fprintf(f, "#include <stdint.h>\n\n");
+  fprintf(f, "const uint32_t jit_aot_image_size = %u;\n", (unsigned)img.len);
+  fprintf(f, "const uint8_t jit_aot_image[] = {");
+  for (i=0; i<img.len; i++) {
+    fprintf(f, "%s0x%02x,", (i%16) ? "" : "\n", img.data[i]);
+  }
+  fprintf(f, "\n};\n");
+  fclose(f);
+
+  printf("[aot] %d forms, %u bytes written to %s\r\n",jit_aot_out_count,(unsigned)img.len,path);
+  free(img.data);
+  return 1;
+}
+
+#ifdef JIT_AOT
+extern const uint32_t jit_aot_image_size;
+extern const uint8_t jit_aot_image[];
+
+// index the records of the image linked into this binary
+void jit_aot_init() {
+  JitReader r = {(uint8_t*)jit_aot_image, jit_aot_image_size, 0, 0};
+  uint32_t i, n;
+
+  if (jr_u32(&r) != JIT_AOT_MAGIC || jr_u32(&r) != JIT_CACHE_VERSION) {
+    printf("<aot: image doesn't match this build, ignored>\r\n");
+    return;
+  }
+  n = jr_u32(&r);
+  jit_aot_index = malloc((n+1)*sizeof(JitAotEntry));
+
+  for (i=0; i<n && !r.err; i++) {
+    JitAotEntry* e = &jit_aot_index[jit_aot_count];
+    JitReader fr;
+    uint32_t form_len;
+    e->len = jr_u32(&r);
+    e->data = jr_bytes(&r, e->len);
+    if (!e->data) break;
+
+    // records start with magic, version and the form
+    fr = (JitReader){e->data, e->len, 8, 0};
+    form_len = jr_u32(&fr);
+    if (!jr_bytes(&fr, form_len)) continue;
+    e->hash = jit_cache_hash(e->data+12, form_len, 0xcbf29ce484222325ULL);
+    jit_aot_count++;
+  }
+  printf("[aot] %d native forms linked in\r\n",jit_aot_count);
+}
+#endif
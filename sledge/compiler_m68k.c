@@ -10,7 +10,8 @@ int compile_for_platform(Cell* expr, Cell** res) {
   register void* sp __asm ("sp");
   Frame empty_frame = {NULL, 0, 0, sp};
   
-  code = malloc(codesz);
+  code = code_alloc(codesz);
+  if (!code) return 0;
   
   memset(code, 0, codesz);
 
@@ -18,6 +19,12 @@ int compile_for_platform(Cell* expr, Cell** res) {
   
   success = compile_expr(expr, &empty_frame, TAG_ANY);
   jit_ret();
+#ifdef PEEPHOLE_STATS
+  peephole_report("form");
+#endif
+#ifdef IR_DUMP
+  ir_dump("form");
+#endif
 
   if (success) {
     printf("<assembled at: %p>\r\n",code);
@@ -29,10 +36,16 @@ int compile_for_platform(Cell* expr, Cell** res) {
       return 0;
       }*/
 
+    code_shrink(code, code_idx);
+    code_seal(code);
+    code_enter(code, sp);
     *res = execute_jitted(code);
+    code_leave(code);
     //printf("res: %p\r\n",*res);
     success = 1;
     
+  } else {
+    code_free(code);
   }
   return success;
 }
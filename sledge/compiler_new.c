@@ -12,19 +12,70 @@ static env_t* global_env = NULL;
 //#define CHECK_BOUNDS    // enforce boundaries of array put/get
 #ifdef CPU_X86
 #define ARG_SPILLOVER 0
+#elif defined(CPU_ARM64)
+#define ARG_SPILLOVER 6 // max 6 args via regs, rest via stack
 #else
 #define ARG_SPILLOVER 3 // max 4 args via regs, rest via stack
 #endif
 #define LBDREG R4       // register base used for passing args to functions
+#if defined(CPU_X64) || defined(CPU_ARM) || defined(CPU_ARM64)
+#define LET_REGS        // hot locals get the registers after the args, see letregs.c
+#define LIVE_REGS       // calls save only the registers read after them, see liveregs.c
+#endif
 
-#define DEBUG_ASM_SRC
+//#define DEBUG_ASM_SRC
+#define JIT_PEEPHOLE      // peephole pass over the jit_* calls, see peephole.c
+//#define PEEPHOLE_STATS  // print the number of jit ops it removed per form
+#define JIT_IR            // jit_* calls are recorded as ir and lowered per basic block, see ir.c
+//#define IR_DUMP         // print the ir of every compiled form (needs JIT_IR)
 
 static int debug_mode = 0;
 
+#if defined(CPU_X64) && defined(__linux__)
+#define JIT_CACHE       // persistent compiled-code cache, see compiler_cache.c
+#define HEAP_IMAGE      // (save path) and sledge --image, see image.c
+#define JIT_TIER0       // interpret one-shot forms, compile hot lambdas, see tier0.c
+#define JIT_UNITS       // INTERIM_UNITS=1 compiles evaluated files as one unit, see unit.c
+int unit_direct_call(char* name, Cell* lambda, int tail, int raw);
+#define JIT_DIRECT_CALLS // calls to globals are patched when they are rebound, see callsite.c
+#define JIT_TAIL_CALLS   // calls in tail position reuse the frame, self-recursion loops
+void jit_call_global();
+void jit_call_global_raw();
+void callsite_relink(env_entry* e);
+#define JIT_CONST_GLOBALS // values of defconst globals are folded into code, see constglobal.c
+void const_global_use(env_entry* e, Frame* frame);
+void const_global_add(env_entry* e, Cell* lambda);
+int const_global_dependent(Cell* lambda);
+void const_global_rebound(env_entry* e);
+#define JIT_INLINE       // calls to small fns are compiled in place, see inline.c
+int jit_cache_storing();
+#define JIT_FUSED_BRANCHES // conditions of if and while compare and branch, see cond.c
+#define JIT_RET_INT      // fns that always give an int return it unboxed to int callers, see rettype.c
+#define JIT_INT_ARGS     // args only used as ints are passed unboxed, see intargs.c
+#define JIT_TYPE_PROP    // car, cdr, get8 and get16 of locals with a known tag skip the check, see typeprop.c
+#define JIT_HOIST        // invariant sget and size are loaded before a while, see hoist.c
+#define JIT_STACK_CELLS  // conses and boxed ints that don't leave a fn live in its frame, see escape.c
+Cell* image_save(Cell* path);
+void jit_cache_note_lookup(char* name);
+#define JIT_PERF         // INTERIM_PERF=map or jitdump names compiled code for linux perf, see perf.c
+void perf_fn(Cell* lambda, char* name);
+int jit_aot_main(char* out_path, int num_files, char** files);
+#ifdef JIT_AOT
+void jit_aot_init();
+#endif
+#endif
+
+#if (defined(CPU_X64) || defined(CPU_ARM64)) && defined(__linux__)
+#define JIT_PROFILE      // INTERIM_PROFILE=calls or cycles counts fns, read from /sys/profile, see profile.c
+#endif
+
 env_entry* lookup_global_symbol(char* name) {
   env_entry* res;
   int found = sm_get(global_env, name, (void**)&res);
   //printf("[lookup] %s res: %p\n",name,res);
+#ifdef JIT_CACHE
+  jit_cache_note_lookup(name);
+#endif
   if (!found) return NULL;
   return res;
 }
@@ -35,11 +86,20 @@ Cell* insert_symbol(Cell* symbol, Cell* cell, env_t** env) {
   
   if (found) {
     e->cell = cell;
+#ifdef JIT_DIRECT_CALLS
+    if (e->sites) callsite_relink(e);
+#endif
+#ifdef JIT_CONST_GLOBALS
+    if (e->uses) const_global_rebound(e);
+#endif
     //printf("[insert_symbol] update %s entry at %p (cell: %p value: %d)\r\n",symbol->ar.addr,e,e->cell,e->cell->ar.value);
     return e->cell;
   }
     
   e = malloc(sizeof(env_entry));
+  e->sites = NULL;
+  e->constant = 0;
+  e->uses = NULL;
   int ret = snprintf(e->name, MAX_SYMBOL_SIZE, "%s", (char*)symbol->ar.addr);
   if (ret >= MAX_SYMBOL_SIZE) {
     printf("[insert_symbol] max symbol size exceeded by %d\n", ret - MAX_SYMBOL_SIZE + 1);
@@ -58,9 +118,17 @@ Cell* insert_global_symbol(Cell* symbol, Cell* cell) {
   return insert_symbol(symbol, cell, &global_env);
 }
 
+// like insert_global_symbol, but compiled code may take the value as a
+// constant. rebinding the symbol later recompiles the code that did.
+Cell* insert_global_const(Cell* symbol, Cell* cell) {
+  env_entry* e;
+  Cell* res = insert_symbol(symbol, cell, &global_env);
+  if (sm_get(global_env, symbol->ar.addr, (void**)&e)) e->constant = 1;
+  return res;
+}
+
 #define TMP_PRINT_BUFSZ 1024
 
-static FILE* jit_out;
 static Cell* cell_heap_start;
 static int label_skip_count = 0;
 static char temp_print_buffer[TMP_PRINT_BUFSZ];
@@ -88,6 +156,11 @@ static Cell* prototype_cons;
 #define PTRSZ 8
 #endif
 
+#ifdef CPU_ARM64
+#include "jit_arm64.c"
+#define PTRSZ 8
+#endif
+
 #ifdef CPU_X86
 #include "jit_x86.c"
 #define PTRSZ 4
@@ -98,6 +171,14 @@ static Cell* prototype_cons;
 #define PTRSZ 4
 #endif
 
+#ifdef JIT_PEEPHOLE
+#include "peephole.c"
+#endif
+
+#ifdef JIT_IR
+#include "ir.c"
+#endif
+
 void debug_break(Cell* arg) {
   printf("argr0: %p\r\n",arg);
   exit(0);
@@ -139,15 +220,21 @@ void load_int(int dreg, Arg arg, Frame* f) {
     //printf("loading int from stack_int sp %d - slot %d to reg %d\n",f->sp,arg.slot,dreg);
     jit_ldr_stack(dreg, PTRSZ*(f->sp-arg.slot));
   }
+  else if (arg.type == ARGT_IMM) {
+    jit_movi(dreg, arg.value);
+  }
   else {
     jit_movi(dreg, 0xdeadbeef);
   }
+#ifdef JIT_IR
+  ir_type(dreg, IR_INT);
+#endif
 }
 
 void load_cell(int dreg, Arg arg, Frame* f) {
   if (arg.type == ARGT_CONST) {
     // argument is a constant like 123, "foo"
-    jit_movi(dreg, (jit_word_t)arg.cell);
+    jit_lea(dreg, arg.cell);
   }
   else if (arg.type == ARGT_ENV) {
     jit_lea(dreg, arg.env);
@@ -157,8 +244,13 @@ void load_cell(int dreg, Arg arg, Frame* f) {
     jit_movr(dreg, arg.slot);
   }
   else if (arg.type == ARGT_REG_INT) {
+    if (dreg!=ARGR0) jit_push(ARGR0,ARGR0);
+    if (dreg!=R0) jit_push(R0,R0);
+    jit_movr(ARGR0, arg.slot);
     jit_call(alloc_int, "alloc_int");
     jit_movr(dreg,R0);
+    if (dreg!=R0) jit_pop(R0,R0);
+    if (dreg!=ARGR0) jit_pop(ARGR0,ARGR0);
   }
   else if (arg.type == ARGT_STACK) {
     //printf("loading cell from stack slot %d + sp %d to reg %d\n",arg.slot,f->sp,dreg);
@@ -175,10 +267,22 @@ void load_cell(int dreg, Arg arg, Frame* f) {
     if (dreg!=R0) jit_pop(R0,R0);
     if (dreg!=ARGR0) jit_pop(ARGR0,ARGR0);
   }
+  else if (arg.type == ARGT_IMM) {
+    if (dreg!=ARGR0) jit_push(ARGR0,ARGR0);
+    if (dreg!=R0) jit_push(R0,R0);
+    jit_movi(ARGR0, arg.value);
+    jit_call(alloc_int, "alloc_int");
+    jit_movr(dreg,R0);
+    if (dreg!=R0) jit_pop(R0,R0);
+    if (dreg!=ARGR0) jit_pop(ARGR0,ARGR0);
+  }
   else {
     printf("<load_cell unhandled arg.type: %d>\r\n",arg.type);
     jit_movi(dreg, 0xdeadcafe);
   }
+#ifdef JIT_IR
+  ir_type(dreg, IR_CELL);
+#endif
 }
 
 int get_sym_frame_idx(char* argname, Arg* fn_frame, int ignore_regs) {
@@ -201,43 +305,65 @@ int get_sym_frame_idx(char* argname, Arg* fn_frame, int ignore_regs) {
   return -1;
 }
 
-// TODO: optimize!
-int push_frame_regs(Arg* fn_frame) {
-  int pushreg=0;
-  int i;
-  
-  if (!fn_frame) return 0;
-  
-  for (i=0; i<MAXFRAME; i++) {
-    if (fn_frame[i].type == ARGT_REG) {
-      pushreg++;
+#ifdef LET_REGS
+#include "letregs.c"
+#endif
+#ifdef LIVE_REGS
+#include "liveregs.c"
+#endif
+
+// pushes the frame registers in mask, a bit per register from LBDREG
+// on, the lowest first
+static int push_regs_mask(unsigned int mask) {
+  int i, n = 0;
+  for (i=0; mask>>i; i++) {
+    if (mask & (1u<<i)) {
+      jit_push(LBDREG+i,LBDREG+i);
+      n++;
     }
   }
-  //printf("pushing %d frame regs\n",pushreg);
-  if (pushreg) {
-    jit_push(LBDREG,LBDREG+pushreg-1);
-  }
-  return pushreg;
+  return n;
 }
 
-int pop_frame_regs(Arg* fn_frame) {
-  int pushreg=0;
-  int i;
-  
-  if (!fn_frame) return 0;
-  
-  for (i=0; i<MAXFRAME; i++) {
-    if (fn_frame[i].type == ARGT_REG) {
-      pushreg++;
+static int pop_regs_mask(unsigned int mask) {
+  int i, n = 0;
+  for (i=31; i>=0; i--) {
+    if (mask & (1u<<i)) {
+      jit_pop(LBDREG+i,LBDREG+i);
+      n++;
     }
   }
-  //printf("popping %d frame regs\n",pushreg);
-  if (pushreg) {
-    jit_pop(LBDREG,LBDREG+pushreg-1);
-  }
-  return pushreg;
+  return n;
+}
+
+// args and locals in registers that callees clobber and that are read
+// after expr, all of them for NULL
+static unsigned int frame_regs(Frame* frame, Cell* expr) {
+  if (!frame->f) return 0;
+#ifdef LIVE_REGS
+  return live_regs(frame, expr);
+#else
+  return (1<<frame->num_regs)-1;
+#endif
+}
+
+int push_frame_regs(Frame* frame, Cell* expr) {
+  return push_regs_mask(frame_regs(frame, expr));
+}
+
+int pop_frame_regs(Frame* frame, Cell* expr) {
+  return pop_regs_mask(frame_regs(frame, expr));
 }
 
+// the (fn ...) being def'd by the innermost def and its name
+static Cell* def_fn_form = NULL;
+static char* def_fn_name = NULL;
+
+#ifdef JIT_CONST_GLOBALS
+static int const_globals_folded = 0; // the form being compiled took a defconst value
+static Cell* const_fn_target = NULL; // lambda that gets the code being compiled
+#endif
+
 static char* analyze_buffer[MAXFRAME];
 int analyze_fn(Cell* expr, Cell* parent, int num_lets) {
   if (expr->tag == TAG_SYM) {
@@ -295,6 +421,145 @@ Cell* clean_return(int args_pushed, Frame* frame, Cell* compiled_type) {
   return compiled_type;
 }
 
+// the value of expr if it is an integer known at compile time: int
+// literals, defconst globals and the pure int builtins applied to
+// those. with record set, the defconst globals taken are noted.
+static int fold_int(Cell* expr, Frame* frame, jit_word_t* value, int record) {
+  env_entry* e;
+  Cell* args;
+  Cell* arg;
+  jit_word_t v[2] = {0, 0};
+  intptr_t a, b, r; // signed, like the compares and idiv of the code
+  int bits = sizeof(jit_word_t)*8;
+  int n = 0, op;
+
+  if (!expr) return 0;
+  if (expr->tag == TAG_INT) {
+    *value = expr->ar.value;
+    return 1;
+  }
+#ifdef JIT_CONST_GLOBALS
+  if (expr->tag == TAG_SYM) {
+    if (get_sym_frame_idx(expr->ar.addr, frame->f, 0)>=0) return 0;
+    e = lookup_global_symbol(expr->ar.addr);
+    if (!e || !e->constant || !e->cell || e->cell->tag != TAG_INT) return 0;
+    if (record) const_global_use(e, frame);
+    *value = e->cell->ar.value;
+    return 1;
+  }
+#endif
+  if (expr->tag != TAG_CONS || !car(expr) || car(expr)->tag != TAG_SYM) return 0;
+
+  e = lookup_global_symbol(car(expr)->ar.addr);
+  if (!e || !e->cell || e->cell->tag != TAG_BUILTIN) return 0;
+  op = e->cell->ar.value;
+  if (op<BUILTIN_ADD || op>BUILTIN_EQ) return 0;
+
+  args = cdr(expr);
+  while ((arg = car(args))) {
+    if (n==2 || !fold_int(arg, frame, &v[n], record)) return 0;
+    n++;
+    args = cdr(args);
+  }
+  if (n != (op == BUILTIN_BITNOT ? 1 : 2)) return 0;
+  a = (intptr_t)v[0];
+  b = (intptr_t)v[1];
+
+  // the same results as the code compile_expr emits
+  switch (op) {
+  case BUILTIN_ADD: r = (intptr_t)((uintptr_t)a + (uintptr_t)b); break;
+  case BUILTIN_SUB: r = (intptr_t)((uintptr_t)a - (uintptr_t)b); break;
+  case BUILTIN_MUL: r = (intptr_t)((uintptr_t)a * (uintptr_t)b); break;
+  case BUILTIN_DIV:
+    if (!b || b==-1) return 0;
+    r = a/b;
+    break;
+  case BUILTIN_MOD:
+    // inline_mod returns 32 bits
+    if (!b || b==-1) return 0;
+    r = a%b;
+    if (r != (int32_t)r) return 0;
+    break;
+  case BUILTIN_BITAND: r = a&b; break;
+  case BUILTIN_BITNOT: r = ~a; break;
+  case BUILTIN_BITOR: r = a|b; break;
+  case BUILTIN_BITXOR: r = a^b; break;
+  case BUILTIN_SHL:
+    if (b<0 || b>=bits) return 0;
+    r = (intptr_t)((uintptr_t)a << b);
+    break;
+  case BUILTIN_SHR:
+    if (b<0 || b>=bits) return 0;
+    r = (intptr_t)((uintptr_t)a >> b);
+    break;
+  case BUILTIN_LT:
+    r = (intptr_t)((uintptr_t)b - (uintptr_t)a);
+    if (r<0) r = 0;
+    break;
+  case BUILTIN_GT:
+    r = (intptr_t)((uintptr_t)a - (uintptr_t)b);
+    if (r<0) r = 0;
+    break;
+  case BUILTIN_EQ: r = (a==b); break;
+  default:
+    return 0;
+  }
+  *value = (jit_word_t)r;
+  return 1;
+}
+
+static int fold_expr(Cell* expr, Frame* frame, jit_word_t* value) {
+  if (debug_mode || !fold_int(expr, frame, value, 0)) return 0;
+  return fold_int(expr, frame, value, 1);
+}
+
+// log2 of a constant power of two argument, or -1
+static int const_shift(Arg arg) {
+  jit_word_t v;
+  int shift = 0;
+  if (arg.type == ARGT_IMM) v = arg.value;
+  else if (arg.type == ARGT_CONST && arg.cell->tag == TAG_INT) v = arg.cell->ar.value;
+  else return -1;
+  if (v<=0 || (v & (v-1))) return -1;
+  while (v>1) {
+    v >>= 1;
+    shift++;
+  }
+  return shift;
+}
+
+#ifdef JIT_PROFILE
+#include "profile.c"
+#endif
+
+#ifdef JIT_INLINE
+#include "inline.c"
+#endif
+
+#ifdef JIT_FUSED_BRANCHES
+#include "cond.c"
+#endif
+
+#ifdef JIT_RET_INT
+#include "rettype.c"
+#endif
+
+#ifdef JIT_INT_ARGS
+#include "intargs.c"
+#endif
+
+#ifdef JIT_HOIST
+#include "hoist.c"
+#endif
+
+#ifdef JIT_TYPE_PROP
+#include "typeprop.c"
+#endif
+
+#ifdef JIT_STACK_CELLS
+#include "escape.c"
+#endif
+
 // returns a prototype cell that can be used for type information
 Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
   Cell* compiled_type = prototype_any;
@@ -304,9 +569,21 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
   char* op_name;
   
   int is_let = 0;
+  int let_in_r0 = 0;
   int argi = 0;
   int args_pushed = 0;
   Arg argdefs[MAXARGS];
+  jit_word_t folded;
+#ifdef JIT_RET_INT
+  int call_raw = 0; // RAW_* flags of the lambda called, see rettype.c
+#endif
+#ifdef JIT_HOIST
+  Hoist* hoist;     // an sget or size loaded before the loop
+#endif
+#ifdef JIT_STACK_CELLS
+  int call_no_escape = 0; // ESC_ARG flags of the args that can be stack cells, see escape.c
+  int cells_op;
+#endif
 
   if (!expr) return 0;
   if (!frame) return 0;
@@ -317,14 +594,20 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       env_entry* env;
       
       if (arg_frame_idx>=0) {
-        load_cell(R0, fn_frame[arg_frame_idx], frame);
+        Arg local = fn_frame[arg_frame_idx];
+        if (return_type->tag == TAG_INT && (local.type == ARGT_STACK_INT || local.type == ARGT_REG_INT)) {
+          // no need to box it
+          load_int(R0, local, frame);
+          return prototype_int;
+        }
+        load_cell(R0, local, frame);
         return compiled_type;
       }
 
       env = lookup_global_symbol(expr->ar.addr);
       if (env) {
         Cell* value = env->cell;
-        jit_movi(R0,(jit_word_t)env);
+        jit_lea(R0,env);
         jit_ldr(R0);
         return value; // FIXME TODO forbid later type change
       } else {
@@ -334,7 +617,7 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       }
     } else {
       // return the expr
-      jit_movi(R0,(jit_word_t)expr);
+      jit_lea(R0,expr);
       return compiled_type;
     }
     return 0;
@@ -368,9 +651,44 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
     if (op->ar.value == BUILTIN_LET) {
       is_let = 1;
     }
+    if ((op->ar.value == BUILTIN_DEF || op->ar.value == BUILTIN_DEFCONST) && car(args) && car(args)->tag == TAG_SYM) {
+      def_fn_form = car(cdr(args));
+      def_fn_name = car(args)->ar.addr;
+    }
+
+    // pure integer expressions are computed right away
+    if (fold_expr(expr, frame, &folded)) {
+      if (return_type->tag == TAG_ANY) {
+        jit_movi(ARGR0, folded);
+        jit_call(alloc_int, "alloc_int");
+        return compiled_type;
+      }
+      jit_movi(R0, folded);
+      return prototype_int;
+    }
   }
   else if (op->tag == TAG_LAMBDA) {
+#ifdef JIT_INLINE
+    Inline inl;
+    if (inline_expand(expr, op, frame, &inl)) {
+      const_global_use(op_env, frame);
+      return inline_compile(&inl, expr, frame, return_type);
+    }
+#endif
     signature_args = car((Cell*)(op->ar.addr));
+#ifdef JIT_RET_INT
+    // a call to the fn being compiled enters it the way it is compiled
+    if (!debug_mode) {
+      if (frame->name && !strcmp(op_name, frame->name)) call_raw = frame->raw;
+      else call_raw = lambda_raw(op);
+      // its raw entry returns an unboxed int, a cell is wanted from the
+      // usual one, which takes boxed args
+      if (return_type->tag != TAG_INT && (call_raw & RAW_RET)) call_raw = 0;
+    }
+#endif
+#ifdef JIT_STACK_CELLS
+    call_no_escape = escape_call(expr, op, op_name, frame);
+#endif
   }
   else if (op->tag == TAG_STRUCT_DEF) {
     signature_args = NULL;
@@ -396,14 +714,14 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
 
   if (debug_mode) {
     char* debug_buf = malloc(256);
-    push_frame_regs(frame->f);
+    push_frame_regs(frame, NULL);
     lisp_write(expr, debug_buf, 256);
     jit_push(R0, ARGR1);
     jit_lea(ARGR0, debug_buf);
     jit_lea(ARGR1, frame);
     jit_call(debug_handler,"dbg");
     jit_pop(R0, ARGR1);
-    pop_frame_regs(frame->f);
+    pop_frame_regs(frame, NULL);
   }
   
   // first, we need a signature
@@ -422,6 +740,12 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       //printf("named arg: %s\r\n",arg_name);
       signature_arg = cdr(signature_arg);
     }
+#ifdef JIT_INT_ARGS
+    if ((call_raw & RAW_ARG(argi)) && arg && (arg->tag == TAG_CONS || arg->tag == TAG_SYM)) {
+      // passed unboxed, see intargs.c
+      signature_arg = prototype_int;
+    }
+#endif
 
     /*if (signature_args) {
       char dbg[256];
@@ -443,7 +767,11 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
           type_hint = fn_frame[fidx].type;
         }
       
-        if (given_tag == TAG_INT || type_hint == ARGT_STACK_INT) {
+        if (given_tag == TAG_INT || type_hint == ARGT_STACK_INT || type_hint == ARGT_REG_INT
+#ifdef JIT_STACK_CELLS
+            || escape_box_int(arg, argdefs[0].cell->ar.addr, frame)
+#endif
+          ) {
           //printf("INT mode of let\r\n");
           // let prefers raw integers!
           sig_tag = TAG_INT;
@@ -455,6 +783,13 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
           signature_arg = prototype_any;
         }
       }
+#ifdef JIT_FUSED_BRANCHES
+      if (argi==0 && op->tag == TAG_BUILTIN && op->ar.value == BUILTIN_IF) {
+        // the condition is compiled by jit_cond. constants other than
+        // ints are left to the type check below.
+        if (given_tag == TAG_INT || given_tag == TAG_SYM || given_tag == TAG_CONS) sig_tag = TAG_LAMBDA;
+      }
+#endif
 
       if (!signature_args) {
         // any number of arguments allowed
@@ -466,6 +801,32 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
         argdefs[argi].cell = arg;
         argdefs[argi].type = ARGT_LAMBDA;
       }
+      else if (arg->tag == TAG_CONS && sig_tag == TAG_INT && fold_expr(arg, frame, &argdefs[argi].value)) {
+        // constant expression
+        argdefs[argi].cell = NULL;
+        argdefs[argi].type = ARGT_IMM;
+      }
+#ifdef JIT_HOIST
+      else if (arg->tag == TAG_CONS && (hoist = hoist_lookup(arg, frame))) {
+        // loaded before the loop, read like a local
+        argdefs[argi] = hoist->temp;
+      }
+#endif
+#ifdef JIT_STACK_CELLS
+      else if ((call_no_escape & ESC_ARG(argi)) && sig_tag == TAG_ANY && (cells_op = escape_cells_form(arg))) {
+        // the callee keeps no reference to it
+        int words = escape_cells(arg, cells_op, frame);
+        if (words<0) return NULL;
+        args_pushed += words;
+        const_global_use(op_env, frame);
+
+        argdefs[argi].cell = NULL;
+        argdefs[argi].slot = ++frame->sp;
+        argdefs[argi].type = ARGT_STACK;
+        jit_push(R0,R0);
+        args_pushed++;
+      }
+#endif
       else if (arg->tag == TAG_CONS) {
         // eager evaluation
         // nested expression
@@ -474,7 +835,12 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
         given_tag = cons_type->tag;
         
         argdefs[argi].cell = NULL; // cell is in R0 at runtime
-        argdefs[argi].slot = ++frame->sp; // record sp at this point
+        if (is_let && argi==1) {
+          // the let takes it from R0 right away
+          let_in_r0 = 1;
+        } else {
+          argdefs[argi].slot = ++frame->sp; // record sp at this point
+        }
 
         if (given_tag == TAG_INT) {
           argdefs[argi].type = ARGT_STACK_INT;
@@ -490,9 +856,10 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
           //printf("!!! nested struct name extracted: %s (arg# %d argt %d) !!!\r\n",argdefs[argi].type_name,argi,argdefs[argi].type);
         }
         
-        jit_push(R0,R0);
-        args_pushed++;
-        
+        if (!let_in_r0) {
+          jit_push(R0,R0);
+          args_pushed++;
+        }
       }
       else if (given_tag == TAG_SYM && sig_tag != TAG_SYM) {
         // symbol given, lookup (indirect)
@@ -509,6 +876,9 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
         } else {
           argdefs[argi].env = lookup_global_symbol((char*)arg->ar.addr);
           argdefs[argi].type = ARGT_ENV;
+          if (sig_tag == TAG_INT && fold_expr(arg, frame, &argdefs[argi].value)) {
+            argdefs[argi].type = ARGT_IMM;
+          }
           
           //printf("argument %i:%s from environment.\n", argi, arg->ar.addr);
         }
@@ -642,9 +1012,22 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       break;
     }
     case BUILTIN_MUL: {
-      load_int(ARGR0,argdefs[0], frame);
-      load_int(R2,argdefs[1], frame);
-      jit_mulr(ARGR0,R2);
+      int shift = const_shift(argdefs[1]);
+      Arg factor = argdefs[0];
+      if (shift<0 && (shift = const_shift(argdefs[0]))>=0) factor = argdefs[1];
+
+      if (shift>=0) {
+        // multiplying by a power of two is a shift
+        load_int(ARGR0,factor, frame);
+        if (shift) {
+          jit_movi(R2,shift);
+          jit_shlr(ARGR0,R2);
+        }
+      } else {
+        load_int(ARGR0,argdefs[0], frame);
+        load_int(R2,argdefs[1], frame);
+        jit_mulr(ARGR0,R2);
+      }
       if (return_type->tag == TAG_ANY) jit_call(alloc_int, "alloc_int");
       else {
         compiled_type = prototype_int;
@@ -724,13 +1107,25 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       jit_lea(ARGR0,argdefs[0].cell); // load symbol address
       load_cell(ARGR1,argdefs[1],frame);
       
-      push_frame_regs(frame->f);
+      push_frame_regs(frame, expr);
       jit_call2(insert_global_symbol, "insert_global_symbol");
-      pop_frame_regs(frame->f);
+      pop_frame_regs(frame, expr);
+      break;
+    }
+    case BUILTIN_DEFCONST: {
+      jit_lea(ARGR0,argdefs[0].cell);
+      load_cell(ARGR1,argdefs[1],frame);
+
+      push_frame_regs(frame, expr);
+      jit_call2(insert_global_const, "insert_global_const");
+      pop_frame_regs(frame, expr);
       break;
     }
     case BUILTIN_LET: {
       int is_int, offset, fidx, is_reg;
+#ifdef JIT_STACK_CELLS
+      int box;
+#endif
       
       if (!frame->f) {
         printf("<error: let is not allowed on global level, only in fn>\r\n");
@@ -761,6 +1156,7 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       } else {
         if ((argdefs[1].type == ARGT_REG_INT ||
            argdefs[1].type == ARGT_STACK_INT ||
+           argdefs[1].type == ARGT_IMM ||
            (argdefs[1].type == ARGT_CONST && argdefs[1].cell->tag == TAG_INT)
          )) {
           is_int = 1;
@@ -778,6 +1174,13 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
           //printf("new let %s inferred ANY\n",argdefs[0].cell->ar.addr);
         }
         fn_frame[offset].slot = -frame->locals;
+#ifdef LET_REGS
+        if (let_reg(frame, fn_frame[offset].name)>=0) {
+          fn_frame[offset].type = is_int ? ARGT_REG_INT : ARGT_REG;
+          fn_frame[offset].slot = let_reg(frame, fn_frame[offset].name);
+          is_reg = 1;
+        }
+#endif
 
 #ifdef DEBUG_ASM_SRC
         debug_buf = malloc(256);
@@ -794,11 +1197,26 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       
       if (is_int) {
         jit_comment("(let) load int");
-        load_int(R0, argdefs[1], frame);
+        if (!let_in_r0) load_int(R0, argdefs[1], frame);
+        else if (argdefs[1].type == ARGT_STACK) jit_ldr(R0);
         compiled_type = prototype_int;
-      } else {
+      }
+#ifdef JIT_STACK_CELLS
+      else if ((box = escape_box(frame, fn_frame[offset].name))>=0 &&
+               (argdefs[1].type == ARGT_STACK_INT || argdefs[1].type == ARGT_REG_INT || argdefs[1].type == ARGT_IMM)) {
+        jit_comment("(let) int to box");
+        if (!let_in_r0) load_int(R0, argdefs[1], frame);
+        escape_box_let(frame, box);
+        compiled_type = prototype_any;
+      }
+#endif
+      else {
         jit_comment("(let) load cell");
-        load_cell(R0, argdefs[1], frame);
+        if (!let_in_r0) load_cell(R0, argdefs[1], frame);
+        else if (argdefs[1].type == ARGT_STACK_INT) {
+          jit_movr(ARGR0,R0);
+          jit_call(alloc_int, "alloc_int");
+        }
         compiled_type = prototype_any;
       }
 
@@ -830,13 +1248,29 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       Cell* fn_body, *fn_args, *lambda;
       Arg fn_new_frame[MAXFRAME];
       int num_lets, i, j, spo_count, fn_argc;
+#ifdef LET_REGS
+      char* let_regs[FRAME_REGS+1];
+      int num_let_regs = 0;
+#endif
       Cell* compiled_type;
       char label_fn[64];
       char label_fe[64];
+#ifdef JIT_STACK_CELLS
+      char* boxes[ESC_BOXES];
+      int no_escape = 0;
+#endif
+      char label_loop[64];
+#ifdef JIT_RET_INT
+      char label_box[64];
+      int ret_int = 0, raw = 0, raw_entry = 0;
+#endif
+#ifdef JIT_PROFILE
+      ProfileFn* profile;
+#endif
       
       Frame* nframe_ptr;
       Frame nframe = {fn_new_frame, 0, 0, frame->stack_end};
-#if CPU_ARM||__AMIGA||CPU_X86
+#if __AMIGA||CPU_X86
       Label* fn_lbl;
 #endif
       
@@ -878,6 +1312,7 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
         else {
           fn_new_frame[j].type = ARGT_REG;
           fn_new_frame[j].slot = j + LBDREG;
+          nframe.num_regs++;
         }
         
         if (argdefs[j].cell->tag == TAG_SYM) {
@@ -933,13 +1368,91 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
 
       sprintf(label_fn,"L0_%p",lambda);
       sprintf(label_fe,"L1_%p",lambda);
+      sprintf(label_loop,"L2_%p",lambda);
+
+      nframe.tail = fn_body;
+      nframe.name = (expr == def_fn_form) ? def_fn_name : NULL;
+#ifdef JIT_PERF
+      perf_fn(lambda, nframe.name);
+#endif
+#ifdef JIT_PROFILE
+      profile = profile_fn(nframe.name, frame->name);
+#endif
+      nframe.loop_label = label_loop;
+      nframe.num_lets = num_lets;
+      nframe.num_args = fn_argc;
+      nframe.lambda = frame->lambda ? frame->lambda : lambda;
+#ifdef JIT_RET_INT
+      if (!debug_mode) {
+        // args on the stack would move by the return address of the
+        // boxed entry's call
+        ret_int = !spo_count && fn_returns_int(fn_body, fn_new_frame);
+        raw = ret_int ? RAW_RET : 0;
+#ifdef JIT_INT_ARGS
+        raw |= fn_int_args(fn_body, fn_new_frame, fn_argc, nframe.name);
+        for (j=0; j<fn_argc; j++) {
+          if (raw & RAW_ARG(j)) fn_new_frame[j].type = ARGT_REG_INT;
+        }
+#endif
+        nframe.raw = raw;
+      }
+#endif
+#ifdef JIT_STACK_CELLS
+      if (!debug_mode) {
+        no_escape = escape_scan(fn_body, fn_new_frame, fn_argc, nframe.name, boxes, &nframe.num_boxes, &nframe);
+        nframe.boxes = boxes;
+        nframe.box_slot = num_lets;
+        // the boxes go below the locals, the stack args move up
+        num_lets += nframe.num_boxes*ESC_CELL_WORDS;
+        nframe.num_lets = num_lets;
+        for (j=ARG_SPILLOVER; j<fn_argc; j++) {
+          fn_new_frame[j].slot -= nframe.num_boxes*ESC_CELL_WORDS;
+        }
+      }
+#endif
+#ifdef LET_REGS
+      if (!debug_mode) {
+        num_let_regs = let_regs_scan(fn_body, fn_new_frame, FRAME_REGS - nframe.num_regs, let_regs);
+        nframe.let_regs = let_regs;
+        nframe.num_regs += num_let_regs;
+      }
+#endif
+#ifdef LIVE_REGS
+      if (!debug_mode) live_regs_scan(fn_body, &nframe);
+#endif
+#ifdef JIT_TYPE_PROP
+      if (!debug_mode) type_prop_scan(fn_body, fn_new_frame, &nframe);
+#endif
       
       jit_jmp(label_fe);
       jit_label(label_fn);
-      jit_movi(R2,(jit_word_t)lambda|STACK_FRAME_MARKER);
+#ifdef JIT_RET_INT
+      if (raw) {
+        // the boxed entry comes last, raw callers enter right here
+        sprintf(label_box,"L3_%p",lambda);
+        jit_jmp(label_box);
+        raw_entry = code_idx;
+      }
+#endif
+      jit_lea(R2,(void*)((jit_word_t)lambda|STACK_FRAME_MARKER));
       jit_push(R2,R2);
       
       jit_dec_stack(num_lets*PTRSZ);
+#ifdef LET_REGS
+      // they are pushed around calls before their first let
+      for (i=0; i<num_let_regs; i++) {
+        jit_movi(LBDREG + nframe.num_regs - num_let_regs + i, 0);
+      }
+#endif
+#ifdef JIT_STACK_CELLS
+      escape_boxes_init(&nframe);
+#endif
+#ifdef JIT_PROFILE
+      if (profile) profile_emit_entry(profile);
+#endif
+#ifdef JIT_TAIL_CALLS
+      jit_label(label_loop);
+#endif
 
       if (debug_mode) {
         Arg* nargs_ptr;
@@ -958,19 +1471,56 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
 
       //nframe_ptr->parent_frame = frame;
 
-      // TODO here we can introduce function return types
+#ifdef JIT_RET_INT
+      compiled_type = compile_expr(fn_body, nframe_ptr, ret_int ? prototype_int : prototype_any); // new frame, fresh sp
+      if (ret_int && compiled_type && compiled_type->tag != TAG_INT) jit_ldr(R0);
+      // the int the boxed entry would give, see rettype.c
+      if (ret_int && compiled_type) jit_movsx32(R0,R0);
+#else
       compiled_type = compile_expr(fn_body, nframe_ptr, prototype_any); // new frame, fresh sp
+#endif
+#ifdef LIVE_REGS
+      free(nframe.live_sites);
+#endif
+#ifdef JIT_TYPE_PROP
+      free(nframe.tag_facts);
+#endif
       if (!compiled_type) return 0;
+#ifdef JIT_PROFILE
+      if (profile) profile_emit_exit(profile);
+#endif
 
       //printf(">> fn has %d args and %d locals. predicted locals: %d\r\n",fn_argc,nframe.locals,num_lets);
       
       jit_inc_stack(num_lets*PTRSZ);
       jit_inc_stack(PTRSZ);
       jit_ret();
+#ifdef JIT_RET_INT
+      if (raw) {
+        jit_label(label_box);
+#ifdef JIT_INT_ARGS
+        for (j=0; j<fn_argc; j++) {
+          if (raw & RAW_ARG(j)) jit_ldr(LBDREG+j);
+        }
+#endif
+        if (ret_int) {
+          jit_call_rel(raw_entry);
+          jit_movr(ARGR0,R0);
+          jit_call(alloc_int,"alloc_int");
+          jit_ret();
+        } else {
+          jit_jmp_rel(raw_entry);
+        }
+        lambda_set_raw(lambda, raw);
+      }
+#endif
+#ifdef JIT_STACK_CELLS
+      lambda_set_flags(lambda, lambda_flags(lambda) | no_escape);
+#endif
       jit_label(label_fe);
       jit_lea(R0,lambda);
       
-#if CPU_ARM||__AMIGA||CPU_X86
+#if __AMIGA||CPU_X86
       fn_lbl = find_label(label_fn);
       //printf("fn_lbl idx: %d code: %p\r\n",fn_lbl->idx,code);
       lambda->dr.next = code + fn_lbl->idx;
@@ -983,18 +1533,29 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       Cell* then_type=NULL;
       Cell* else_type=NULL;
       char label_skip[64];
+      int is_tail = (expr == frame->tail);
       sprintf(label_skip,"Lelse_%d",++label_skip_count);
       
+#ifdef JIT_FUSED_BRANCHES
+      if (!jit_cond(argdefs[0].cell, frame, label_skip, 0)) return 0;
+#else
       // load the condition
       load_int(R0, argdefs[0], frame);
 
       // compare to zero
       jit_cmpi(R0,0);
       jit_je(label_skip);
+#endif
 
       // then
+      if (is_tail) frame->tail = argdefs[1].cell;
       then_type = compile_expr(argdefs[1].cell, frame, return_type);
       if (!then_type) return 0;
+      if (return_type->tag == TAG_INT && then_type->tag != TAG_INT) {
+        // an int is wanted, so both branches leave a raw one
+        jit_ldr(R0);
+        then_type = prototype_int;
+      }
 
       // else
       if (argdefs[2].cell) {
@@ -1003,8 +1564,13 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
         jit_jmp(label_end);
         
         jit_label(label_skip);
+        if (is_tail) frame->tail = argdefs[2].cell;
         else_type = compile_expr(argdefs[2].cell, frame, return_type);
         if (!else_type) return 0;
+        if (return_type->tag == TAG_INT && else_type->tag != TAG_INT) {
+          jit_ldr(R0);
+          else_type = prototype_int;
+        }
         
         jit_label(label_end);
       } else {
@@ -1015,6 +1581,7 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
         printf("<incompatible then/else types of if: %s/%s, return type: %s>\r\n",tag_to_str(then_type->tag),tag_to_str(else_type->tag),tag_to_str(return_type->tag));
         return 0;
       }
+      if (return_type->tag == TAG_INT) compiled_type = prototype_int;
       
       break;
     }
@@ -1025,6 +1592,37 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       sprintf(label_loop, "Lloop_%d",++label_skip_count);
       sprintf(label_skip, "Lskip_%d",label_skip_count);
       sprintf(label_skip2,"Lskip2_%d",label_skip_count);
+
+#ifdef JIT_TYPE_PROP
+      {
+        int versioned;
+        compiled_type = type_prop_while(expr, frame, return_type, &versioned);
+        if (versioned) {
+          if (!compiled_type) return 0;
+          break;
+        }
+      }
+#endif
+
+#ifdef JIT_FUSED_BRANCHES
+      if (!cond_new_lets(argdefs[1].cell, frame)) {
+        // test at the bottom, entered from the top
+        jit_jmp(label_skip2);
+        jit_label(label_loop);
+        compiled_type = compile_expr(argdefs[1].cell, frame, return_type);
+        if (!compiled_type) return 0;
+        jit_label(label_skip2);
+        if (!jit_cond(argdefs[0].cell, frame, label_loop, 1)) return 0;
+        // a finished while is 0
+        if (return_type->tag == TAG_ANY) {
+          jit_movi(ARGR0,0);
+          jit_call(alloc_int,"alloc_int");
+        } else if (return_type->tag != TAG_VOID) {
+          jit_movi(R0,0);
+        }
+        break;
+      }
+#endif
       
       jit_label(label_loop);
       
@@ -1067,18 +1665,20 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
         return 0;
       }
       
+      // an unboxed int from the last form stays unboxed
       while ((arg = car(args))) {
-        Cell* compiled_type;
         if (car(cdr(args))) {
           // discard all returns except for the last one
           compiled_type = compile_expr(arg, frame, prototype_void);
         } else {
+          if (expr == frame->tail) frame->tail = arg;
           compiled_type = compile_expr(arg, frame, return_type);
         }
         
         if (!compiled_type) return 0;
         args = cdr(args);
       }
+      if (compiled_type->tag != TAG_INT) compiled_type = prototype_any;
       break;
     }
     case BUILTIN_LIST: {
@@ -1154,9 +1754,9 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       jit_push(R0,R0);
       jit_movr(ARGR1,R0);
       jit_lea(ARGR0,name_sym);
-      push_frame_regs(frame->f);
+      push_frame_regs(frame, expr);
       jit_call2(insert_global_symbol, "insert_global_symbol");
-      pop_frame_regs(frame->f);
+      pop_frame_regs(frame, expr);
       jit_pop(R0,R0);
       
       break;
@@ -1207,6 +1807,14 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
         printf("<untyped value passed to sget (field %s)>\r\n",lookup_name);
         return 0;
       }
+#ifdef JIT_HOIST
+      if ((hoist = hoist_lookup(expr, frame))) {
+        // loaded before the loop
+        load_cell(R0, hoist->temp, frame);
+        compiled_type = hoist->type;
+        break;
+      }
+#endif
 
       // arg points to struct definition which is TAG_VEC
       if (struct_def->tag != TAG_STRUCT_DEF) {
@@ -1280,11 +1888,13 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       for (int i=0; i<num_fields; i++) {
         if (!strcmp(lookup_name,(char*)struct_elements[1+i*2]->ar.addr)) {
           //printf("[sput] field found at index %d\r\n",i);
+          // the value first, boxing an int calls alloc_int which
+          // may clobber R2
+          load_cell(R3,argdefs[2],frame); // TODO type check!
           load_cell(R2,argdefs[0],frame);
           jit_movr(R0,R2);
           jit_ldr(R2);
           jit_addi(R2,(i+1)*PTRSZ);
-          load_cell(R3,argdefs[2],frame); // TODO type check!
           jit_stra(R2);
           found = 1;
           break;
@@ -1313,15 +1923,21 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       break;
     }
     case BUILTIN_CAR: {
+      int checked = 1;
+#ifdef JIT_TYPE_PROP
+      checked = !type_prop_proven(car(orig_args), frame, TAG_CONS);
+#endif
       load_cell(R0,argdefs[0], frame);
       
       // type check -------------------
-      jit_movr(R1,R0);
-      jit_addi(R1,2*PTRSZ);
-      jit_ldr(R1);
-      jit_lea(R2,consed_type_error);
-      jit_cmpi(R1,TAG_CONS);
-      jit_movne(R0,R2);
+      if (checked) {
+        jit_movr(R1,R0);
+        jit_addi(R1,2*PTRSZ);
+        jit_ldr(R1);
+        jit_lea(R2,consed_type_error);
+        jit_cmpi(R1,TAG_CONS);
+        jit_movne(R0,R2);
+      }
       // ------------------------------
       
       jit_ldr(R0);
@@ -1331,16 +1947,22 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       break;
     }
     case BUILTIN_CDR: {
+      int checked = 1;
+#ifdef JIT_TYPE_PROP
+      checked = !type_prop_proven(car(orig_args), frame, TAG_CONS);
+#endif
       load_cell(R0,argdefs[0], frame);
       jit_addi(R0,PTRSZ);
 
       // type check -------------------
-      jit_movr(R1,R0);
-      jit_addi(R1,PTRSZ); // because already added PTRSZ
-      jit_ldr(R1);
-      jit_lea(R2,consed_type_error);
-      jit_cmpi(R1,TAG_CONS);
-      jit_movne(R0,R2);
+      if (checked) {
+        jit_movr(R1,R0);
+        jit_addi(R1,PTRSZ); // because already added PTRSZ
+        jit_ldr(R1);
+        jit_lea(R2,consed_type_error);
+        jit_cmpi(R1,TAG_CONS);
+        jit_movne(R0,R2);
+      }
       // ------------------------------
 
       jit_ldr(R0);
@@ -1371,29 +1993,34 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
     case BUILTIN_GET8: {
       char label_skip[64];
       char label_ok[64];
+      int checked = 1;
       sprintf(label_skip,"Lskip_%d",++label_skip_count);
       sprintf(label_ok,"Lok_%d",label_skip_count);
+#ifdef JIT_TYPE_PROP
+      checked = !type_prop_proven(car(orig_args), frame, TAG_BYTES);
+#endif
       
       load_cell(R1,argdefs[0], frame);
       load_int(R2,argdefs[1], frame); // offset -> R2
       jit_movr(R0,R1); // save original cell in r0
 
-      // todo: compile-time checking would be much more awesome
-      // type check
-      jit_addi(R1,2*PTRSZ);
-      jit_ldr(R1);
-      jit_cmpi(R1,TAG_BYTES); // todo: better perf with mask?
-      jit_je(label_ok);
-      jit_cmpi(R1,TAG_STR);
-      jit_je(label_ok);
-
-      // wrong type
-      jit_movi(R3, 0);
-      jit_jmp(label_skip);
-
-      // good type
-      jit_label(label_ok);
-      jit_movr(R1,R0); // get original cell from r3
+      // type check, unless the tag is known
+      if (checked) {
+        jit_addi(R1,2*PTRSZ);
+        jit_ldr(R1);
+        jit_cmpi(R1,TAG_BYTES); // todo: better perf with mask?
+        jit_je(label_ok);
+        jit_cmpi(R1,TAG_STR);
+        jit_je(label_ok);
+
+        // wrong type
+        jit_movi(R3, 0);
+        jit_jmp(label_skip);
+
+        // good type
+        jit_label(label_ok);
+        jit_movr(R1,R0); // get original cell from r3
+      }
 
 #ifdef CHECK_BOUNDS
       // bounds check -----
@@ -1426,29 +2053,34 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
     case BUILTIN_GET16: {
       char label_skip[64];
       char label_ok[64];
+      int checked = 1;
       sprintf(label_skip,"Lskip_%d",++label_skip_count);
       sprintf(label_ok,"Lok_%d",label_skip_count);
+#ifdef JIT_TYPE_PROP
+      checked = !type_prop_proven(car(orig_args), frame, TAG_BYTES);
+#endif
       
       load_cell(R1,argdefs[0], frame);
       load_int(R2,argdefs[1], frame); // offset -> R2
       jit_movr(R0,R1); // save original cell in r0
 
-      // todo: compile-time checking would be much more awesome
-      // type check
-      jit_addi(R1,2*PTRSZ);
-      jit_ldr(R1);
-      jit_cmpi(R1,TAG_BYTES); // todo: better perf with mask?
-      jit_je(label_ok);
-      jit_cmpi(R1,TAG_STR);
-      jit_je(label_ok);
-
-      // wrong type
-      jit_movi(R3, 0);
-      jit_jmp(label_skip);
-
-      // good type
-      jit_label(label_ok);
-      jit_movr(R1,R0); // get original cell from r3
+      // type check, unless the tag is known
+      if (checked) {
+        jit_addi(R1,2*PTRSZ);
+        jit_ldr(R1);
+        jit_cmpi(R1,TAG_BYTES); // todo: better perf with mask?
+        jit_je(label_ok);
+        jit_cmpi(R1,TAG_STR);
+        jit_je(label_ok);
+
+        // wrong type
+        jit_movi(R3, 0);
+        jit_jmp(label_skip);
+
+        // good type
+        jit_label(label_ok);
+        jit_movr(R1,R0); // get original cell from r3
+      }
 
 #ifdef CHECK_BOUNDS
       // bounds check -----
@@ -1615,9 +2247,17 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       break;
     }
     case BUILTIN_SIZE: {
-      load_cell(ARGR0,argdefs[0], frame);
-      jit_addi(ARGR0,PTRSZ); // fetch size -> R0
-      jit_ldr(ARGR0);
+#ifdef JIT_HOIST
+      if ((hoist = hoist_lookup(expr, frame))) {
+        // loaded before the loop
+        load_int(ARGR0, hoist->temp, frame);
+      } else
+#endif
+      {
+        load_cell(ARGR0,argdefs[0], frame);
+        jit_addi(ARGR0,PTRSZ); // fetch size -> R0
+        jit_ldr(ARGR0);
+      }
       if (return_type->tag == TAG_ANY) {
         jit_call(alloc_int, "alloc_int");
       } else if (return_type->tag == TAG_INT) {
@@ -1628,12 +2268,12 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
       break;
     }
     case BUILTIN_GC: {
-      push_frame_regs(frame->f);
+      push_frame_regs(frame, expr);
       jit_lea(ARGR0,global_env);
-      jit_movi(ARGR1,(jit_word_t)frame->stack_end);
+      jit_lea(ARGR1,frame->stack_end);
       jit_movr(ARGR2,RSP);
       jit_call3(collect_garbage,"collect_garbage");
-      pop_frame_regs(frame->f);
+      pop_frame_regs(frame, expr);
       break;
     }
     case BUILTIN_SYMBOLS: {
@@ -1647,11 +2287,11 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
     }
     case BUILTIN_PRINT: {
       load_cell(ARGR0,argdefs[0], frame);
-      push_frame_regs(frame->f);
+      push_frame_regs(frame, expr);
       jit_host_call_enter();
       jit_call(lisp_print,"lisp_print");
       jit_host_call_exit();
-      pop_frame_regs(frame->f);
+      pop_frame_regs(frame, expr);
       break;
     }
     case BUILTIN_MOUNT: {
@@ -1664,37 +2304,50 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
     }
     case BUILTIN_MMAP: {
       load_cell(ARGR0,argdefs[0], frame);
+      push_frame_regs(frame, expr);
       jit_host_call_enter();
       jit_call(fs_mmap,"fs_mmap");
       jit_host_call_exit();
+      pop_frame_regs(frame, expr);
+      break;
+    }
+#ifdef HEAP_IMAGE
+    case BUILTIN_SAVE: {
+      load_cell(ARGR0,argdefs[0], frame);
+      push_frame_regs(frame, expr);
+      jit_host_call_enter();
+      jit_call(image_save,"image_save");
+      jit_host_call_exit();
+      pop_frame_regs(frame, expr);
       break;
     }
+#endif
     case BUILTIN_OPEN: {
       load_cell(ARGR0,argdefs[0], frame);
-      push_frame_regs(frame->f);
+      push_frame_regs(frame, expr);
       jit_host_call_enter();
       jit_call(fs_open,"fs_open");
       jit_host_call_exit();
-      pop_frame_regs(frame->f);
+      pop_frame_regs(frame, expr);
       break;
     }
     case BUILTIN_RECV: {
       load_cell(ARGR0,argdefs[0], frame);
-      push_frame_regs(frame->f);
+      push_frame_regs(frame, expr);
       jit_host_call_enter();
       jit_call(stream_read,"stream_read");
       jit_host_call_exit();
-      pop_frame_regs(frame->f);
+      pop_frame_regs(frame, expr);
       break;
     }
     case BUILTIN_SEND: {
       load_cell(ARGR0,argdefs[0], frame);
       load_cell(ARGR1,argdefs[1], frame);
-      push_frame_regs(frame->f);
+      push_frame_regs(frame, expr);
       jit_host_call_enter();
       jit_call2(stream_write,"stream_write");
       jit_host_call_exit();
-      pop_frame_regs(frame->f);
+      pop_frame_regs(frame, expr);
       break;
     }
     }
@@ -1702,10 +2355,50 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
     // λλλ lambda call λλλ
 
     int spo_adjust = 0, j;
+    int tail = 0;
+#ifdef JIT_RET_INT
+    int raw = 0;
+#endif
+
+#ifdef JIT_TAIL_CALLS
+    // a call in tail position of a fn replaces its frame. a self call
+    // restarts the body instead, args that don't fit in registers are
+    // moved to the fn's own stack args. other callees must not take
+    // stack args, our caller pops ours.
+    if (frame->f && expr == frame->tail && !debug_mode) {
+      if (frame->name && !strcmp(op_name, frame->name) && argi-1 == frame->num_args) {
+        tail = 2;
+      } else if (argi-1 <= ARG_SPILLOVER) {
+        tail = 1;
+      }
+    }
+#ifdef JIT_PROFILE
+    // the callee would return past our profile_leave
+    if (tail == 1 && profile_mode() == PROFILE_CYCLES) tail = 0;
+#endif
+#endif
+#ifdef JIT_RET_INT
+    // enter the callee at its raw entry, see rettype.c, for an unboxed
+    // int result or to pass args unboxed. a tail call would return a
+    // boxed int.
+    if (return_type->tag == TAG_INT && tail == 1) tail = 0;
+    if (!debug_mode && tail != 1) {
+      raw = call_raw;
+      if (return_type->tag != TAG_INT) raw &= ~RAW_RET;
+    }
+#endif
     
-    // save our args
+    // save the args and locals that are read after the call, and
+    // those passed on that would be overwritten before they are loaded
+    unsigned int saved = frame_regs(frame, expr);
+    for (j=0; j<argi-1 && j<ARG_SPILLOVER; j++) {
+      if (argdefs[j].type == ARGT_REG || argdefs[j].type == ARGT_REG_INT) {
+        int k = argdefs[j].slot-LBDREG;
+        if (k>j && k<argi-1 && k<ARG_SPILLOVER) saved |= 1u<<k;
+      }
+    }
 
-    int pushed = push_frame_regs(frame->f);
+    int pushed = push_regs_mask(saved);
     frame->sp+=pushed;
     
     for (j=argi-2; j>=0; j--) {
@@ -1718,51 +2411,106 @@ Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type) {
         frame->sp++;
       } else {
         // pass arg in reg (LBDREG + slot)
+        int k = argdefs[j].slot-LBDREG;
         
-        if (argdefs[j].type == ARGT_REG) {
-          // FIXME kludge?
-          if (1 || argdefs[j].slot<j+LBDREG) {
-            int offset = ((pushed+spo_adjust) - (argdefs[j].slot-LBDREG) - 1);
-            // register already clobbered, load from stack
-            //printf("-- loading clobbered reg %d from stack offset %d to reg %d\n",argdefs[j].slot,offset,LBDREG+j);
+        int unboxed = 0;
+#ifdef JIT_INT_ARGS
+        unboxed = raw & RAW_ARG(j);
+#endif
+        
+        if ((argdefs[j].type == ARGT_REG || argdefs[j].type == ARGT_REG_INT) && (saved & (1u<<k))) {
+          // load from the copy pushed above, the lowest register first
+          int offset = (pushed+spo_adjust) - __builtin_popcount(saved & ((1u<<k)-1)) - 1;
+          if (argdefs[j].type == ARGT_REG) {
             jit_ldr_stack(LBDREG+j, offset*PTRSZ);
+            if (unboxed) jit_ldr(LBDREG+j);
           } else {
-            // no need to move a reg into itself
-            if (argdefs[j].slot!=j) {
-              load_cell(LBDREG+j, argdefs[j], frame);
-            }
+            Arg copy = argdefs[j];
+            copy.type = ARGT_STACK_INT;
+            copy.slot = frame->sp - offset;
+            if (unboxed) load_int(LBDREG+j, copy, frame);
+            else load_cell(LBDREG+j, copy, frame);
           }
         }
+        else if (argdefs[j].type == (unboxed ? ARGT_REG_INT : ARGT_REG) && k == j) {
+          // no need to move a reg into itself
+        }
+        else if (unboxed) {
+          load_int(LBDREG+j, argdefs[j], frame);
+        }
         else {
           load_cell(LBDREG+j, argdefs[j], frame);
         }
       }
     }
     
-    jit_lea(R0,op_env);
-    jit_ldr(R0); // load cell
-    jit_addi(R0,PTRSZ); // &cell->dr.next
-    jit_ldr(R0); // cell->dr.next
+#ifdef JIT_TAIL_CALLS
+    if (tail == 2) {
+      for (j=ARG_SPILLOVER; j<argi-1; j++) {
+        jit_ldr_stack(R0, (j-ARG_SPILLOVER)*PTRSZ);
+        jit_str_stack(R0, PTRSZ*(frame->sp - fn_frame[j].slot));
+      }
+      jit_inc_stack(frame->sp*PTRSZ);
+      jit_jmp(frame->loop_label);
+    }
+    else if (tail == 1) {
+      // drop everything down to our return address
+      jit_inc_stack((frame->sp + frame->num_lets + 1)*PTRSZ);
+#ifdef JIT_UNITS
+      if (!unit_direct_call(op_name, op, 1, 0))
+#endif
+      jit_jmp_env(op_env);
+    }
+    else
+#endif
+#ifdef JIT_UNITS
+    if (unit_direct_call(op_name, op, 0, raw)) {
+      // callee is bound at unit link time
+    } else
+#endif
+    {
+#ifdef JIT_DIRECT_CALLS
+      // the call! linked to op's entrypoint
+      if (raw) jit_call_env_raw(op_env, raw);
+      else jit_call_env(op_env);
+#else
+      jit_lea(R0,op_env);
+      jit_ldr(R0); // load cell
+      jit_addi(R0,PTRSZ); // &cell->dr.next
+      jit_ldr(R0); // cell->dr.next
 
-    jit_callr(R0); // the call!
-    
-    if (spo_adjust) {
-      jit_inc_stack(spo_adjust*PTRSZ);
-      frame->sp-=spo_adjust;
+      jit_callr(R0); // the call!
+#endif
     }
 
-    pop_frame_regs(frame->f);
-    frame->sp-=pushed;
-  }
+    if (tail) {
+      // nothing follows at runtime
+      frame->sp-=spo_adjust+pushed;
+    } else {
+      if (spo_adjust) {
+        jit_inc_stack(spo_adjust*PTRSZ);
+        frame->sp-=spo_adjust;
+      }
 
-#ifdef CPU_X64
-  fflush(jit_out);
+      pop_regs_mask(saved);
+      frame->sp-=pushed;
+#ifdef JIT_RET_INT
+      if (raw & RAW_RET) compiled_type = prototype_int;
 #endif
+    }
+  }
 
   // at this point, registers R1-R6 are filled, execute
   return clean_return(args_pushed, frame, compiled_type);
 }
 
+// the frame of a top-level form. (gc) scans the stack down from
+// stack_end while code compiled with it runs.
+void frame_init_toplevel(Frame* frame, void* stack_end) {
+  memset(frame, 0, sizeof(Frame));
+  frame->stack_end = stack_end;
+}
+
 env_t* get_global_env() {
   return global_env;
 }
@@ -1803,6 +2551,7 @@ void init_compiler() {
 
   signature[0]=prototype_symbol; signature[1]=prototype_any;
   insert_symbol(alloc_sym("def"), alloc_builtin(BUILTIN_DEF, alloc_list(signature, 2)), &global_env);
+  insert_symbol(alloc_sym("defconst"), alloc_builtin(BUILTIN_DEFCONST, alloc_list(signature, 2)), &global_env);
   insert_symbol(alloc_sym("let"), alloc_builtin(BUILTIN_LET, alloc_list(signature, 2)), &global_env);
   
   signature[0]=prototype_struct_def; signature[1]=prototype_symbol; signature[2]=prototype_any;
@@ -1893,6 +2642,9 @@ void init_compiler() {
   insert_symbol(alloc_sym("mount"), alloc_builtin(BUILTIN_MOUNT, alloc_list(signature,2)), &global_env);
   insert_symbol(alloc_sym("open"), alloc_builtin(BUILTIN_OPEN, alloc_list(signature,1)), &global_env);
   insert_symbol(alloc_sym("mmap"), alloc_builtin(BUILTIN_MMAP, alloc_list(signature,1)), &global_env);
+#ifdef HEAP_IMAGE
+  insert_symbol(alloc_sym("save"), alloc_builtin(BUILTIN_SAVE, alloc_list(signature,1)), &global_env);
+#endif
   
   signature[0]=prototype_stream;
   signature[1]=prototype_any;
@@ -1908,4 +2660,8 @@ void init_compiler() {
   insert_symbol(alloc_sym("debug"), alloc_builtin(BUILTIN_DEBUG, NULL), &global_env);
   
   printf("[compiler] interim knows %u symbols. enter (symbols) to see them.\r\n", sm_get_count(global_env));
+
+#ifdef JIT_AOT
+  jit_aot_init();
+#endif
 }
@@ -15,7 +15,8 @@ typedef enum arg_t {
   ARGT_REG,
   ARGT_REG_INT,
   ARGT_STACK,
-  ARGT_STACK_INT
+  ARGT_STACK_INT,
+  ARGT_IMM        // integer known at compile time, in value
 } arg_t;
 
 typedef struct Arg {
@@ -25,18 +26,54 @@ typedef struct Arg {
   int slot;
   char* name;
   char* type_name;
+  jit_word_t value;
 } Arg;
 
 typedef struct Frame Frame;
 
+// a local whose cells are known to have one tag, see typeprop.c
+typedef struct TagFact {
+  char* name;
+  int tag;         // TAG_CONS, or TAG_BYTES for strings and bytes
+} TagFact;
+
+// a call and the frame registers that are read after it returns
+typedef struct LiveSite {
+  Cell* expr;
+  unsigned int regs; // a bit per register from LBDREG on
+} LiveSite;
+
 struct Frame {
   Arg* f;
   int sp;
   int locals;
   void* stack_end;
   Frame* parent_frame;
+  Cell* tail;        // the expression in tail position of the fn
+  char* name;        // the name the fn is def'd to, if known
+  char* loop_label;  // start of the fn body, after the prologue
+  int num_lets;      // stack slots reserved for locals
+  int num_args;
+  Cell* lambda;      // the outermost fn being compiled
+  int num_regs;      // registers from LBDREG on that hold args and locals
+  char** let_regs;   // locals kept in the last of them, see letregs.c
+  LiveSite* live_sites; // registers to save around each call, see liveregs.c
+  int num_live_sites;
+  int raw;           // how its raw entry takes args and returns, see rettype.c
+  TagFact* tag_facts; // locals with a known tag, see typeprop.c
+  int num_tag_facts;
+  char** boxes;      // locals with an int box in the frame, see escape.c
+  int num_boxes;
+  int box_slot;      // the slot of the first box among those of the locals
 };
 
+// a compiled fn that has the value of a global folded in: a defconst
+// value, or the body of an inlined fn
+typedef struct ConstUse {
+  Cell* lambda;
+  struct ConstUse* next;
+} ConstUse;
+
 typedef struct Label {
   char* name;
   int idx;
@@ -121,10 +158,13 @@ typedef enum builtin_t {
 
   BUILTIN_SIN,
   BUILTIN_COS,
-  BUILTIN_SQRT
+  BUILTIN_SQRT,
+
+  BUILTIN_DEFCONST
 } builtin_t;
 
 Cell* insert_global_symbol(Cell* symbol, Cell* cell);
+Cell* insert_global_const(Cell* symbol, Cell* cell);
 env_entry* lookup_global_symbol(char* name);
 
 extern Cell* platform_debug();
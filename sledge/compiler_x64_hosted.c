@@ -1,160 +1,240 @@
-#if defined(__APPLE__) && defined(__MACH__)
-#define MAP_ANONYMOUS MAP_ANON
+//#define DEBUG
+
+#ifdef JIT_DIRECT_CALLS
+#include "callsite.c"
 #endif
 
-//#define DEBUG
+#ifdef JIT_CACHE
+#include "compiler_cache.c"
+#endif
 
-#include <sys/mman.h> // mprotect
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
+#ifdef HEAP_IMAGE
+#include "image.c"
+#endif
 
+#ifdef JIT_PERF
+#include "perf.c"
+#endif
+
+__attribute__((noinline))
 Cell* execute_jitted(void* binary) {
-  return (Cell*)((funcptr)binary)(0);
+  Cell* res = (Cell*)((funcptr)binary)(0);
+  // jitted code passes arguments in r12-r15 without preserving them,
+  // so make sure they are saved/restored around the call
+  __asm__ volatile("" ::: "r12","r13","r14","r15");
+  return res;
 }
 
-int compile_for_platform(Cell* expr, Cell** res) {
-  jit_out = fopen("/tmp/jit_out.s","w");
-  
+// keep the positions of all absolute addresses in the blob
+static void set_blob_relocs(uint8_t* binary) {
+  uint32_t* offsets = malloc((reloc_idx+1)*sizeof(uint32_t));
+  int i;
+  for (i=0; i<reloc_idx; i++) {
+    offsets[i] = jit_relocs[i].idx;
+  }
+  code_set_relocs(binary, offsets, reloc_idx);
+  free(offsets);
+}
+
+// point every lambda compiled into this blob to its entrypoint.
+// entrypoints are the labels L0_<lambda>, see BUILTIN_FN.
+void link_lambdas(uint8_t* binary) {
+  for (int i=0; i<labels_size; i++) {
+    char* name = jit_labels[i].l.name;
+    if (name && jit_labels[i].l.idx >= 0 && !strncmp(name,"L0_",3)) {
+      Cell* lambda = (Cell*)strtoul(&name[3], NULL, 16);
+      if (lambda->tag == TAG_LAMBDA) {
+        lambda->dr.next = binary + jit_labels[i].l.idx;
+      } else {
+        printf("fatal error: no lambda found at %p!\n",lambda);
+      }
+    }
+  }
+}
+
+// where the stack scan of (gc) stops for code compiled from now on,
+// the current stack pointer if NULL
+static void* toplevel_stack_end = NULL;
+
+// compile a top-level form and, with run set, execute it
+static int compile_toplevel(Cell* expr, Cell** res, int run) {
+  uint8_t* jit_binary = NULL;
+  char* defsym = "anon";
+  Cell* success = NULL;
+#ifdef JIT_CACHE
+  int cached = jit_cache_wanted(expr);
+#endif
+
   jit_init();
-  
+
   register void* sp asm ("sp");
   Frame* empty_frame = malloc(sizeof(Frame)); // FIXME leak
-  empty_frame->f=NULL;
-  empty_frame->sp=0;
-  empty_frame->locals=0;
-  empty_frame->stack_end=sp;
-  empty_frame->parent_frame=NULL;
-
-  Cell* success = compile_expr(expr, empty_frame, prototype_any);
-  jit_ret();
-  char* defsym = "anon";
+  frame_init_toplevel(empty_frame, toplevel_stack_end ? toplevel_stack_end : sp);
 
-  if (!success) {
-    printf("<compile_expr failed: %p>\r\n",success);
+  if (expr && expr->tag == TAG_CONS && car(expr)->tag == TAG_SYM) {
+    if (!strcmp(car(expr)->ar.addr,"def")) {
+      defsym = car(cdr(expr))->ar.addr;
+    }
   }
 
-  if (success) {
-    int codesz = 1024;
-    fclose(jit_out);
-
-    struct stat src_stat;
-    stat("/tmp/jit_out.s", &src_stat);
-    off_t generated_sz = src_stat.st_size;
-
-    if (expr && expr->tag == TAG_CONS && car(expr)->tag == TAG_SYM) {
-      if (!strcmp(car(expr)->ar.addr,"def")) {
-        defsym = car(cdr(expr))->ar.addr;
-        char cpcmd[256];
-        printf("compiled def %s\r\n",defsym);
-        snprintf(cpcmd,255,"cp /tmp/jit_out.s /tmp/jit_out_%s.s",defsym);
-        system(cpcmd);
+#ifdef JIT_CACHE
+  if (cached) {
+    jit_binary = jit_cache_load(expr, empty_frame->stack_end);
+    if (jit_binary) {
+      if (strcmp(defsym,"anon")) {
+        printf("%s def %s\r\n",jit_cache_source==2 ? "native" : "cached",defsym);
       }
+      success = prototype_any;
+#ifdef JIT_PERF
+      perf_blob(jit_binary, defsym);
+#endif
+    } else {
+      jit_cache_begin(expr);
     }
+  }
+#endif
 
-#ifdef DEBUG
-    FILE* asm_f = fopen("/tmp/jit_out.s","r");
-    char* jit_asm = malloc(generated_sz+1);
-    memset(jit_asm,0,generated_sz+1);
-    int read = fread(jit_asm,1,generated_sz,asm_f);
-    fclose(asm_f);
-    printf("read: %d\n",read);
-    
-    printf("\nJIT ---------------------\n%s\n-------------------------\n\n",jit_asm);
-    free(jit_asm);
-#endif
-        
-    // prefix with arm-none-eabi- on ARM  -mlittle-endian
-    
-#if defined(__APPLE__) && defined(__MACH__)
-    system("clang -no-integrated-as -c /tmp/jit_out.s -o /tmp/jit_out.o -Xassembler -L");
-    system("gobjcopy /tmp/jit_out.o -O binary /tmp/jit_out.bin");
-#else
-    system("as -L /tmp/jit_out.s -o /tmp/jit_out.o");
-    system("objcopy /tmp/jit_out.o -O binary /tmp/jit_out.bin");
-#endif
-
-    stat("/tmp/jit_out.bin", &src_stat);
-    
-    generated_sz = src_stat.st_size;
-    while (generated_sz>codesz) {
-      codesz*=2;
-      printf ("<compiler: doubling code block size to %d>\r\n",codesz);
-    }
-    
-    FILE* binary_f = fopen("/tmp/jit_out.bin","r");
-    
-    uint32_t* jit_binary = mmap(0, codesz, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
-    
-    int bytes_read = fread(jit_binary,1,codesz,binary_f);
-    fclose(binary_f);
-
-#ifdef DEBUG
-    printf("<assembled bytes: %d at: %p (%s)>\n",bytes_read,jit_binary,defsym);
-    char cmd[256];
-    sprintf(cmd,"cp /tmp/jit_out.o /tmp/jit_%p_%s.o",jit_binary,defsym);
-    system(cmd);
-    sprintf(cmd,"cp /tmp/jit_out.s /tmp/jit_%p_%s.s",jit_binary,defsym);
-    system(cmd);
+  if (!jit_binary) {
+#ifdef JIT_CONST_GLOBALS
+    const_globals_folded = 0;
 #endif
+    success = compile_expr(expr, empty_frame, prototype_any);
+    jit_ret();
 
-    if (bytes_read>codesz) {
-      printf("<error: max assembly size of %d exhausted. aborting>\n",codesz);
-      munmap(jit_binary,codesz);
+    if (!success) {
+      printf("<compile_expr failed: %p>\r\n",success);
       return 0;
     }
 
-    // read symbols for linking lambdas
-#if defined(__APPLE__) && defined(__MACH__)
-    system("gnm /tmp/jit_out.o > /tmp/jit_out.syms 2> /dev/null");
-#else
-    system("nm /tmp/jit_out.o > /tmp/jit_out.syms");
-#endif
-    FILE* link_f = fopen("/tmp/jit_out.syms","r");
-    if (link_f) {
-      char* link_line=malloc(128);
-      while(fgets(link_line, 128, link_f)) {
-
-        if (strlen(link_line)>22) {
-          char ida=link_line[19];
-          char idb=link_line[20];
-          char idc=link_line[21];
-          //printf("link_line: %s %c %c %c\n",link_line,ida,idb,idc);
-
-          if (ida=='L' && idc=='_') {
-            Cell* lambda = (Cell*)strtoul(&link_line[24], NULL, 16);
-            if (idb=='0') {
-              // function entrypoint
-              uint64_t offset = strtoul(link_line, NULL, 16);
-              void* binary = ((uint8_t*)jit_binary) + offset;
-              //printf("function %p entrypoint: %p (+%ld)\n",lambda,binary,offset);
-
-              if (lambda->tag == TAG_LAMBDA) {
-                lambda->dr.next = binary;
-              } else {
-                printf("fatal error: no lambda found at %p!\n",lambda);
-              }
-            }
-            else if (idb=='1') {
-              // function exit
-              //unsigned long long offset = strtoul(link_line, NULL, 16);
-              //printf("function exit point: %p\n",offset);
-            }
-          }
-        }
-      }
-      free(link_line);
+    if (strcmp(defsym,"anon")) {
+      printf("compiled def %s\r\n",defsym);
     }
+#ifdef PEEPHOLE_STATS
+    peephole_report(defsym);
+#endif
+#ifdef IR_DUMP
+    ir_dump(defsym);
+#endif
 
-    int mp_res = mprotect(jit_binary, codesz, PROT_EXEC|PROT_READ);
-    
-    if (!mp_res) {
-      *res = execute_jitted(jit_binary);
-    } else {
-      printf("<mprotect result: %d\n>",mp_res);
-      *res = NULL;
-      success = 0;
+#ifdef JIT_CACHE
+    if (cached) jit_cache_store(expr, empty_frame->stack_end);
+#endif
+
+    jit_binary = code_alloc(code_idx);
+    if (!jit_binary) return 0;
+    memcpy(jit_binary, code, code_idx);
+
+#ifdef DEBUG
+    // disassemble with: objdump -D -b binary -mi386:x86-64 /tmp/jit_<addr>_<sym>.bin
+    printf("<assembled bytes: %d at: %p (%s)>\n",code_idx,jit_binary,defsym);
+    char path[256];
+    snprintf(path,255,"/tmp/jit_%p_%s.bin",jit_binary,defsym);
+    FILE* dump_f = fopen(path,"w");
+    if (dump_f) {
+      fwrite(code, 1, code_idx, dump_f);
+      fclose(dump_f);
     }
+#endif
+
+    link_lambdas(jit_binary);
+    set_blob_relocs(jit_binary);
+    code_seal(jit_binary);
+#ifdef JIT_PERF
+    perf_code(jit_binary, code_idx, defsym);
+#endif
+  }
+
+#ifdef JIT_DIRECT_CALLS
+  link_calls(jit_binary, 0);
+#endif
+
+  if (!run) {
+    code_free(jit_binary);
+    return !!success;
   }
+
+  code_enter(jit_binary, empty_frame->stack_end);
+  *res = execute_jitted(jit_binary);
+  code_leave(jit_binary);
+
   return !!success;
 }
+
+#ifdef JIT_TIER0
+#include "tier0.c"
+#endif
+
+#ifdef JIT_CONST_GLOBALS
+#include "constglobal.c"
+#endif
+
+#ifdef JIT_UNITS
+#include "unit.c"
+#endif
+
+int compile_for_platform(Cell* expr, Cell** res) {
+#ifdef JIT_TIER0
+  if (tier0_wanted(expr)) return tier0_eval_toplevel(expr, res);
+#endif
+  return compile_toplevel(expr, res, 1);
+}
+
+#ifdef JIT_CACHE
+// ahead-of-time compilation of lisp sources (sledge --aot out.c files...).
+// every top-level form is compiled in order. defs and structs are run so
+// that later forms see their globals, imports of /sd/ files are followed,
+// anything else (setup code, main loops) is only compiled.
+static int jit_aot_file(char* path) {
+  Cell* forms;
+  Cell* res;
+  char* buf;
+  FILE* f;
+  long sz;
+
+  if (!strncmp(path,"/sd/",4)) path+=4;
+  f = fopen(path,"rb");
+  if (!f) {
+    printf("<aot: cannot open %s>\r\n",path);
+    return 0;
+  }
+  fseek(f, 0, SEEK_END);
+  sz = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  buf = malloc(sz+1);
+  buf[fread(buf, 1, sz, f)] = 0;
+  fclose(f);
+
+  forms = read_string(buf);
+  free(buf);
+  if (!forms || forms->tag != TAG_CONS) {
+    printf("<aot: no forms in %s>\r\n",path);
+    return 0;
+  }
+
+  printf("[aot] %s\r\n",path);
+  for (; forms && forms->tag == TAG_CONS; forms = cdr(forms)) {
+    Cell* c = car(forms);
+    char* op = NULL;
+    int run;
+    if (!c || c->tag != TAG_CONS) continue;
+    if (car(c) && car(c)->tag == TAG_SYM) op = car(c)->ar.addr;
+
+    run = op && (!strcmp(op,"def") || !strcmp(op,"struct"));
+    if (!compile_toplevel(c, &res, run)) return 0;
+
+    if (op && !strcmp(op,"import") && car(cdr(c)) && car(cdr(c))->tag == TAG_STR) {
+      if (!jit_aot_file(car(cdr(c))->ar.addr)) return 0;
+    }
+  }
+  return 1;
+}
+
+int jit_aot_main(char* out_path, int num_files, char** files) {
+  int i;
+  jit_aot_begin();
+  for (i=0; i<num_files; i++) {
+    if (!jit_aot_file(files[i])) return 1;
+  }
+  return !jit_aot_write(out_path);
+}
+#endif
@@ -1,8 +1,4 @@
 
-#ifndef WIN32
-#include <sys/mman.h>
-#endif
-
 Cell* execute_jitted(void* binary) {
   return (Cell*)((funcptr)binary)(0);
 }
@@ -12,11 +8,8 @@ Cell* execute_jitted(void* binary) {
 Cell* compile_for_platform(Cell* expr, Cell** res) {
   int codesz = 8192;
 
-#ifdef WIN32
-  uint8_t* jit_binary = malloc(codesz);
-#else
-  uint8_t* jit_binary = mmap(0, codesz, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, 0, 0);
-#endif
+  uint8_t* jit_binary = code_alloc(codesz);
+  if (!jit_binary) return 0;
   
   printf("jit_binary: %p\r\n",jit_binary);
   
@@ -26,15 +19,17 @@ Cell* compile_for_platform(Cell* expr, Cell** res) {
   
   register void* sp asm ("sp");
   Frame* empty_frame = malloc(sizeof(Frame)); // FIXME leak
-  empty_frame->f=NULL;
-  empty_frame->sp=0;
-  empty_frame->locals=0;
-  empty_frame->stack_end=sp;
-  empty_frame->parent_frame=NULL;
+  frame_init_toplevel(empty_frame, sp);
 
   Cell* success = compile_expr(expr, empty_frame, prototype_any);
   
   jit_ret();
+#ifdef PEEPHOLE_STATS
+  peephole_report("form");
+#endif
+#ifdef IR_DUMP
+  ir_dump("form");
+#endif
 
   if (success) {
     printf("<assembled at: %p>\r\n",jit_binary);
@@ -45,10 +40,13 @@ Cell* compile_for_platform(Cell* expr, Cell** res) {
     //fwrite(code, 1, codesz, f);
     //fclose(f);
     
-#ifndef WIN32
-    int mp_res = mprotect(jit_binary, codesz, PROT_EXEC|PROT_READ);
-#endif
+    code_shrink(jit_binary, code_idx);
+    code_seal(jit_binary);
+    code_enter(jit_binary, sp);
     *res = execute_jitted(jit_binary);
+    code_leave(jit_binary);
+  } else {
+    code_free(jit_binary);
   }
   return success;
 }
@@ -0,0 +1,248 @@
+// conditions of if and while (x64 hosted)
+//
+// lt, gt and eq leave a 0/1 int (a difference for lt and gt) that if
+// and while used to compare to zero again. jit_cond compiles such a
+// condition into a compare of its two operands and one conditional
+// jump instead. an if inside a condition, which is what and, or and
+// not become when they are inlined (see inline.c), turns into more
+// jumps, so that they short-circuit without computing a value. constant
+// conditions leave no test at all. any other form is compiled as before
+// and its value compared to zero.
+//
+// while tests its condition at the bottom of the loop, so that every
+// round takes just the one branch back to the top.
+
+Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type);
+
+static int jit_cond(Cell* c, Frame* frame, char* label, int jump_if);
+
+// forms that give the same result every time, so that
+// (if a a b) can test a once
+static int cond_pure(Cell* c) {
+  env_entry* e;
+  if (!c || c->tag == TAG_INT || c->tag == TAG_SYM) return 1;
+  if (c->tag != TAG_CONS || !car(c) || car(c)->tag != TAG_SYM) return 0;
+  e = lookup_global_symbol(car(c)->ar.addr);
+  if (!e || !e->cell || e->cell->tag != TAG_BUILTIN) return 0;
+  if (e->cell->ar.value<BUILTIN_ADD || e->cell->ar.value>BUILTIN_EQ) return 0;
+  for (c = cdr(c); c && car(c); c = cdr(c)) {
+    if (!cond_pure(car(c))) return 0;
+  }
+  return 1;
+}
+
+// (lt a b), (gt a b) or (eq a b). returns -1 for forms that
+// compile_expr should report.
+static int cond_compare(Cell* c, int op, Frame* frame, char* label, int jump_if) {
+  Cell* operand[2];
+  Arg args[2];
+  int in_r0[2] = {0, 0};
+  int regs[2] = {R1, R2};
+  int i, idx, pushed = 0;
+  Cell* type;
+
+  operand[0] = car(cdr(c));
+  operand[1] = car(cdr(cdr(c)));
+  if (!operand[0] || !operand[1] || car(cdr(cdr(cdr(c))))) return -1;
+  for (i=0; i<2; i++) {
+    if (operand[i]->tag != TAG_INT && operand[i]->tag != TAG_SYM && operand[i]->tag != TAG_CONS) return -1;
+    if (operand[i]->tag == TAG_SYM && get_sym_frame_idx(operand[i]->ar.addr, frame->f, 0)<0
+        && !lookup_global_symbol(operand[i]->ar.addr)) return -1;
+  }
+
+  for (i=0; i<2; i++) {
+    Cell* arg = operand[i];
+    if (fold_expr(arg, frame, &args[i].value)) {
+      args[i].type = ARGT_IMM;
+    }
+    else if (arg->tag == TAG_SYM) {
+      idx = get_sym_frame_idx(arg->ar.addr, frame->f, 0);
+      if (idx>=0) {
+        args[i] = frame->f[idx];
+      } else {
+        args[i].env = lookup_global_symbol(arg->ar.addr);
+        args[i].type = ARGT_ENV;
+      }
+    }
+    else {
+      type = compile_expr(arg, frame, prototype_int);
+      if (!type) return 0;
+      if (i==0 && operand[1]->tag == TAG_CONS) {
+        // keep it while the other one is computed
+        args[i].cell = NULL;
+        args[i].type = (type->tag == TAG_INT) ? ARGT_STACK_INT : ARGT_STACK;
+        args[i].slot = ++frame->sp;
+        jit_push(R0,R0);
+        pushed++;
+      } else {
+        if (type->tag != TAG_INT) jit_ldr(R0);
+        regs[i] = R0;
+        in_r0[i] = 1;
+      }
+    }
+  }
+
+  for (i=0; i<2; i++) {
+    if (!in_r0[i]) load_int(regs[i], args[i], frame);
+  }
+  if (pushed) {
+    jit_inc_stack(pushed*PTRSZ);
+    frame->sp -= pushed;
+  }
+
+  jit_cmpr(regs[0], regs[1]);
+  switch (op) {
+  case BUILTIN_LT: if (jump_if) jit_jlt(label); else jit_jge(label); break;
+  case BUILTIN_GT: if (jump_if) jit_jgt(label); else jit_jle(label); break;
+  default:         if (jump_if) jit_je(label);  else jit_jne(label); break;
+  }
+  return 1;
+}
+
+// (if test then else) as a condition
+static int cond_if(Cell* c, Frame* frame, char* label, int jump_if) {
+  Cell* test = car(cdr(c));
+  Cell* then_c = car(cdr(cdr(c)));
+  Cell* else_c = car(cdr(cdr(cdr(c))));
+  jit_word_t then_v = 0, else_v = 0;
+  int then_const, else_const;
+  char label_else[64];
+  char label_end[64];
+
+  if (!test || !then_c || !else_c || car(cdr(cdr(cdr(cdr(c)))))) return -1;
+  // a constant test that is not an int is a type error
+  if (test->tag != TAG_INT && test->tag != TAG_SYM && test->tag != TAG_CONS) return -1;
+  then_const = fold_expr(then_c, frame, &then_v);
+  else_const = fold_expr(else_c, frame, &else_v);
+  then_v = !!then_v;
+  else_v = !!else_v;
+  sprintf(label_end,"Lcond_%d",++label_skip_count);
+
+  if (then_const && else_const) {
+    if (then_v != else_v) {
+      // the test itself, or its opposite
+      return jit_cond(test, frame, label, then_v ? jump_if : !jump_if);
+    }
+    if (!jit_cond(test, frame, label_end, 1)) return 0;
+    jit_label(label_end);
+    if (then_v == jump_if) jit_jmp(label);
+    return 1;
+  }
+  if (then_const) {
+    if (!jit_cond(test, frame, then_v == jump_if ? label : label_end, 1)) return 0;
+    if (!jit_cond(else_c, frame, label, jump_if)) return 0;
+    jit_label(label_end);
+    return 1;
+  }
+  if (else_const) {
+    if (!jit_cond(test, frame, else_v == jump_if ? label : label_end, 0)) return 0;
+    if (!jit_cond(then_c, frame, label, jump_if)) return 0;
+    jit_label(label_end);
+    return 1;
+  }
+  if (then_c == test && cond_pure(test)) {
+    // (or a b)
+    if (!jit_cond(test, frame, jump_if ? label : label_end, 1)) return 0;
+    if (!jit_cond(else_c, frame, label, jump_if)) return 0;
+    jit_label(label_end);
+    return 1;
+  }
+
+  sprintf(label_else,"Lcond_%d",++label_skip_count);
+  if (!jit_cond(test, frame, label_else, 0)) return 0;
+  if (!jit_cond(then_c, frame, label, jump_if)) return 0;
+  jit_jmp(label_end);
+  jit_label(label_else);
+  if (!jit_cond(else_c, frame, label, jump_if)) return 0;
+  jit_label(label_end);
+  return 1;
+}
+
+// compiles condition c and a jump to label that is taken when c is
+// true (jump_if 1) or false (jump_if 0). returns 0 on failure.
+static int jit_cond(Cell* c, Frame* frame, char* label, int jump_if) {
+  jit_word_t value;
+  env_entry* e;
+  Cell* type = NULL;
+  int res = -1, idx;
+
+  if (!c) return 0;
+  if (fold_expr(c, frame, &value)) {
+    if (!!value == jump_if) jit_jmp(label);
+    return 1;
+  }
+
+  if (c->tag == TAG_SYM) {
+    idx = get_sym_frame_idx(c->ar.addr, frame->f, 0);
+    if (idx>=0) {
+      load_int(R0, frame->f[idx], frame);
+    } else if ((e = lookup_global_symbol(c->ar.addr))) {
+      Arg arg;
+      arg.env = e;
+      arg.type = ARGT_ENV;
+      load_int(R0, arg, frame);
+    } else {
+      printf("<undefined symbol %s>\r\n",(char*)c->ar.addr);
+      return 0;
+    }
+    type = prototype_int;
+  }
+  else if (!debug_mode && c->tag == TAG_CONS && car(c) && car(c)->tag == TAG_SYM
+           && (e = lookup_global_symbol(car(c)->ar.addr)) && e->cell) {
+    if (e->cell->tag == TAG_BUILTIN) {
+      switch (e->cell->ar.value) {
+      case BUILTIN_LT: case BUILTIN_GT: case BUILTIN_EQ:
+        res = cond_compare(c, e->cell->ar.value, frame, label, jump_if);
+        break;
+      case BUILTIN_IF:
+        res = cond_if(c, frame, label, jump_if);
+        break;
+      }
+      if (res>=0) return res;
+    }
+#ifdef JIT_INLINE
+    else if (e->cell->tag == TAG_LAMBDA) {
+      Inline inl;
+      if (inline_expand(c, e->cell, frame, &inl)) {
+        const_global_use(e, frame);
+        // a wide int result has to be cut, see inline_wide_form
+        if (!inl.num_temps && !inline_wide_form(inl.body, frame)) {
+          inline_depth++;
+          res = jit_cond(inl.body, frame, label, jump_if);
+          inline_depth--;
+          return res;
+        }
+        // the temps have to be dropped before the jump
+        type = inline_compile(&inl, c, frame, prototype_int);
+        if (!type) return 0;
+      }
+    }
+#endif
+  }
+
+  if (!type) {
+    type = compile_expr(c, frame, prototype_int);
+    if (!type) return 0;
+  }
+  if (type->tag != TAG_INT) jit_ldr(R0);
+  jit_cmpi(R0,0);
+  if (jump_if) jit_jne(label);
+  else jit_je(label);
+  return 1;
+}
+
+// does body let a name that has no frame entry yet? a condition
+// compiled after it would see that local.
+static int cond_new_lets(Cell* body, Frame* frame) {
+  Cell* op;
+  if (!body || body->tag != TAG_CONS) return 0;
+  op = car(body);
+  if (op && op->tag == TAG_SYM && !strcmp(op->ar.addr, "let")) {
+    Cell* sym = car(cdr(body));
+    if (sym && sym->tag == TAG_SYM && get_sym_frame_idx(sym->ar.addr, frame->f, 0)<0) return 1;
+  }
+  for (; body && body->tag == TAG_CONS; body = cdr(body)) {
+    if (cond_new_lets(car(body), frame)) return 1;
+  }
+  return 0;
+}
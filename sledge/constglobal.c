@@ -0,0 +1,108 @@
+// defconst globals (x64 hosted)
+//
+// (defconst name value) binds name like def and marks it as constant.
+// where an int constant is passed as an int argument, like screen-width
+// in (- screen-width 1), its value is compiled into the code instead of
+// being loaded through the env entry on every use, and folded together
+// with other constants (see fold_int).
+//
+// every fn compiled that way is added to the uses of the env entry.
+// rebinding the name, with def or defconst, compiles those fns again
+// from their source (tier0_recompile), so they see the new value from
+// their next call on. a call that is running finishes with the old
+// code. a fn that doesn't compile with the new value anymore is not
+// run at all until the next rebinding (see tier0_make_stale).
+// top-level code outside of fns is not recompiled, it has run already.
+//
+// code with constants folded in is not stored in the compiled-code
+// cache. heap images keep the uses. inline.c records fns that have
+// another fn expanded in them the same way.
+
+static int const_uses_count = 0;
+
+static void const_global_sweep_iter(const char *key, void *value, const void *obj) {
+  env_entry* e = (env_entry*)value;
+  ConstUse** u = &e->uses;
+  while (*u) {
+    ConstUse* use = *u;
+    if (!(use->lambda->tag & TAG_MARK)) {
+      *u = use->next;
+      free(use);
+      const_uses_count--;
+    } else {
+      u = &use->next;
+    }
+  }
+}
+
+// fns nobody can call anymore are dropped before their source is freed
+static void const_global_sweep() {
+  if (const_uses_count) sm_enum(global_env, const_global_sweep_iter, NULL);
+}
+
+void const_global_add(env_entry* e, Cell* lambda) {
+  static int hooked = 0;
+  ConstUse* u;
+
+  for (u = e->uses; u; u = u->next) {
+    if (u->lambda == lambda) return;
+  }
+  if (!hooked) {
+    gc_set_weak_hook(const_global_sweep);
+    hooked = 1;
+  }
+  u = malloc(sizeof(ConstUse));
+  u->lambda = lambda;
+  u->next = e->uses;
+  e->uses = u;
+  const_uses_count++;
+}
+
+// the value of e is folded into the code being compiled for frame
+void const_global_use(env_entry* e, Frame* frame) {
+  Cell* lambda = frame->lambda;
+  const_globals_folded = 1;
+  if (!lambda) return;
+  // a fn being recompiled replaces the code of an existing lambda
+  if (const_fn_target) lambda = const_fn_target;
+  const_global_add(e, lambda);
+}
+
+// e was rebound. this is called from jitted code, which doesn't keep
+// the stack aligned for the compiler.
+__attribute__((force_align_arg_pointer))
+void const_global_rebound(env_entry* e) {
+  ConstUse* u = e->uses;
+  e->uses = NULL;
+  while (u) {
+    ConstUse* next = u->next;
+    const_uses_count--;
+    // lambdas without code are unreachable
+    if (u->lambda->dr.next && !tier0_recompile(u->lambda)) {
+      printf("<%s was redefined, cannot recompile %p>\r\n",e->name,u->lambda);
+      // the old code has the old value built in
+      tier0_make_stale(u->lambda);
+      // try again on the next rebinding
+      const_global_add(e, u->lambda);
+    }
+    free(u);
+    u = next;
+  }
+}
+
+static void const_global_dependent_iter(const char *key, void *value, const void *obj) {
+  env_entry* e = (env_entry*)value;
+  Cell** lambda = (Cell**)obj;
+  ConstUse* u;
+  for (u = e->uses; u; u = u->next) {
+    if (u->lambda == lambda[0]) lambda[1] = lambda[0];
+  }
+}
+
+// does the code of lambda depend on a defconst value?
+int const_global_dependent(Cell* lambda) {
+  Cell* found[2] = {lambda, NULL};
+  if (!const_uses_count) return 0;
+  sm_enum(global_env, const_global_dependent_iter, found);
+  return !!found[1];
+}
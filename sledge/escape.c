@@ -0,0 +1,334 @@
+// cells on the stack (x64 hosted)
+//
+// conses and boxed ints that don't outlive the fn that makes them are
+// kept in its stack frame instead of the cell heap:
+//
+// - a list or cons passed to an arg that the fn called keeps no
+//   reference to, like the points of (line fb (pt x1 y1) (pt x2 y2) c),
+//   is built on the stack right before the call and dropped with the
+//   other args after it. only the spine is on the stack, the elements
+//   are cells as before.
+// - a local that is let to ints and to other cells, and never leaves
+//   the fn, like a position let from an arg and counted up in a loop,
+//   gets a box in the frame. a let of an int fills the box instead of
+//   calling alloc_int.
+//
+// a value leaves a fn when it is returned, let to a local, put into a
+// cons, list, struct or global, or passed to an arg that the fn called
+// keeps. math, compares, car, get8/16/32, put8/16/32, sget, size,
+// concat, substr, print and the conditions of if and while only look
+// at it. cdr gives the rest of the list it gets, so (car (cdr a)) only
+// looks at a, but (let b (cdr a)) lets it go. a call in tail position
+// drops the frame before the callee runs: a box passed to it leaves
+// the fn, and no stack cells are made for it.
+//
+// the args that a fn keeps no reference to are ESC_ARG flags in its
+// signature, next to the RAW_* flags of rettype.c. like an inlined fn,
+// the callee is recorded with const_global_use, so rebinding it
+// compiles the caller again. so is a callee whose flags gave the fn
+// its own flags or boxes. when a recompile changes the flags of a fn,
+// its recorded callers are compiled again too, and theirs in turn if
+// their flags change (see tier0_recompile).
+//
+// the collector doesn't sweep stack cells: it marks only the words of
+// the stack that point into the cell heap, and the cells that a stack
+// cell points to are words of the frame themselves.
+
+#define ESC_ARG(j) (0x100<<(j)) // the fn keeps no reference to arg j
+#define ESC_ARGS_ALL (ESC_ARG(MAXARGS)-ESC_ARG(0))
+#define ESC_BOXES 4             // boxed locals per fn at most
+#define ESC_CELL_WORDS (sizeof(Cell)/PTRSZ)
+#define ESC_LIST_MAX 8          // elements of a list on the stack at most
+
+// how a form uses a value, from harmless to worst
+#define ESC_READ 0 // looks at it
+#define ESC_TAIL 1 // passes it to a call in tail position that keeps no reference
+#define ESC_OUT 2  // lets it leave the fn
+
+typedef struct EscapeUses {
+  Cell* body;
+  Arg* fn_frame;
+  char* self;          // the name of the fn, for calls to itself
+  int mask;            // the ESC_ARG flags taken so far
+  char* names[MAXFRAME];
+  int uses[MAXFRAME];  // the worst use of each
+  int int_lets[MAXFRAME];
+  int other_lets[MAXFRAME];
+  int num;
+  env_entry* callees[MAXFRAME]; // whose ESC_ARG flags were relied on
+  int num_callees;
+} EscapeUses;
+
+static int escape_name(EscapeUses* u, char* name) {
+  int i;
+  for (i=0; i<u->num; i++) {
+    if (!strcmp(u->names[i], name)) return i;
+  }
+  if (u->num >= MAXFRAME) return -1;
+  u->names[i] = name;
+  u->uses[i] = ESC_READ;
+  u->int_lets[i] = 0;
+  u->other_lets[i] = 0;
+  u->num++;
+  return i;
+}
+
+static void escape_use(EscapeUses* u, char* name, int use) {
+  int i = escape_name(u, name);
+  if (i>=0 && use > u->uses[i]) u->uses[i] = use;
+}
+
+// the flags of the callee of e are taken for an arg, 0 if that can't
+// be recorded
+static int escape_callee(EscapeUses* u, env_entry* e) {
+  int i;
+  for (i=0; i<u->num_callees; i++) {
+    if (u->callees[i] == e) return 1;
+  }
+  if (u->num_callees >= MAXFRAME) return 0;
+  u->callees[u->num_callees++] = e;
+  return 1;
+}
+
+// builtins that only look at their args
+static int escape_reader(int b) {
+  if (b>=BUILTIN_ADD && b<=BUILTIN_EQ) return 1;
+  switch (b) {
+  case BUILTIN_CAR: case BUILTIN_SGET: case BUILTIN_SIZE: case BUILTIN_TYPE:
+  case BUILTIN_GET8: case BUILTIN_GET16: case BUILTIN_GET32:
+  case BUILTIN_PUT8: case BUILTIN_PUT16: case BUILTIN_PUT32:
+  case BUILTIN_CONCAT: case BUILTIN_SUBSTR: case BUILTIN_PRINT:
+  case BUILTIN_SIN: case BUILTIN_COS: case BUILTIN_SQRT:
+    return 1;
+  }
+  return 0;
+}
+
+static void escape_walk(Cell* c, int use, int tail, EscapeUses* u);
+
+static void escape_list(Cell* list, int use, EscapeUses* u) {
+  for (; list && list->tag == TAG_CONS; list = cdr(list)) {
+    escape_walk(car(list), use, 0, u);
+  }
+}
+
+// c gives its value to a use, and is in tail position if tail is set
+static void escape_walk(Cell* c, int use, int tail, EscapeUses* u) {
+  env_entry* e;
+  Cell* args;
+  int flags, i, j;
+
+  if (!c) return;
+  if (c->tag == TAG_SYM) {
+    escape_use(u, c->ar.addr, use);
+    return;
+  }
+  if (c->tag != TAG_CONS) return;
+
+  args = cdr(c);
+  if (!car(c) || car(c)->tag != TAG_SYM) {
+    escape_list(c, ESC_OUT, u);
+    return;
+  }
+  e = lookup_global_symbol(car(c)->ar.addr);
+
+  if (u->self && !strcmp(car(c)->ar.addr, u->self)) {
+    flags = u->mask;
+  } else if (e && e->cell && e->cell->tag == TAG_BUILTIN) {
+    switch (e->cell->ar.value) {
+    case BUILTIN_FN:
+    case BUILTIN_QUOTE:
+      return;
+    case BUILTIN_LET:
+      // the let gives the local
+      if (car(args) && car(args)->tag == TAG_SYM && (i = escape_name(u, car(args)->ar.addr))>=0) {
+        if (use > u->uses[i]) u->uses[i] = use;
+        if (ret_int_form(car(cdr(args)), u->body, u->fn_frame, 0)) u->int_lets[i] = 1;
+        else u->other_lets[i] = 1;
+      }
+      escape_walk(car(cdr(args)), ESC_OUT, 0, u);
+      return;
+    case BUILTIN_IF:
+      escape_walk(car(args), ESC_READ, 0, u);
+      escape_walk(car(cdr(args)), use, tail, u);
+      escape_walk(car(cdr(cdr(args))), use, tail, u);
+      return;
+    case BUILTIN_WHILE:
+      escape_list(args, ESC_READ, u);
+      return;
+    case BUILTIN_DO:
+      for (; args && args->tag == TAG_CONS; args = cdr(args)) {
+        if (car(cdr(args))) escape_walk(car(args), ESC_READ, 0, u);
+        else escape_walk(car(args), use, tail, u);
+      }
+      return;
+    case BUILTIN_CDR:
+      // the rest of a list goes where the cdr goes
+      escape_walk(car(args), use, 0, u);
+      return;
+    }
+    escape_list(args, escape_reader(e->cell->ar.value) ? ESC_READ : ESC_OUT, u);
+    return;
+  } else if (e && e->cell && e->cell->tag == TAG_LAMBDA && e->cell->dr.next) {
+    flags = lambda_flags(e->cell);
+    if ((flags & ESC_ARGS_ALL) && !escape_callee(u, e)) flags = 0;
+  } else {
+    flags = 0;
+  }
+
+  for (j=0; args && args->tag == TAG_CONS; args = cdr(args), j++) {
+    if (j<MAXARGS && (flags & ESC_ARG(j))) use = tail ? ESC_TAIL : ESC_READ;
+    else use = ESC_OUT;
+    escape_walk(car(args), use, 0, u);
+  }
+}
+
+// the ESC_ARG flags of the fn with body and args in fn_frame, self is
+// the name of the fn. the locals that get a box are put into boxes.
+// the fns whose flags they rely on are recorded for frame, so that a
+// change of those recompiles it, see tier0_recompile.
+static int escape_scan(Cell* body, Arg* fn_frame, int num_args, char* self, char** boxes, int* num_boxes, Frame* frame) {
+  EscapeUses u;
+  int i, j, prev;
+
+  u.body = body;
+  u.fn_frame = fn_frame;
+  u.self = self;
+  u.mask = ESC_ARG(num_args)-ESC_ARG(0);
+  u.num_callees = 0;
+
+  // args passed on to the fn itself are kept if they are kept there
+  do {
+    prev = u.mask;
+    u.num = 0;
+    escape_walk(body, ESC_OUT, 1, &u);
+    for (j=0; j<num_args; j++) {
+      i = escape_name(&u, fn_frame[j].name);
+      if (i<0 || u.uses[i] == ESC_OUT) u.mask &= ~ESC_ARG(j);
+    }
+  } while (u.mask != prev);
+
+  *num_boxes = 0;
+  for (i=0; i<u.num && *num_boxes<ESC_BOXES; i++) {
+    if (u.uses[i] != ESC_READ || !u.int_lets[i]) continue;
+    j = get_sym_frame_idx(u.names[i], fn_frame, 0);
+    if (j>=0) {
+      // an arg comes as a cell, unless it comes as an int
+      if (fn_frame[j].type != ARGT_REG && fn_frame[j].type != ARGT_STACK) continue;
+    } else if (!u.other_lets[i]) {
+      // a local that only takes ints is an int
+      continue;
+    }
+    boxes[(*num_boxes)++] = u.names[i];
+  }
+  if (u.mask || *num_boxes) {
+    for (i=0; i<u.num_callees; i++) {
+      const_global_use(u.callees[i], frame);
+    }
+  }
+  return u.mask;
+}
+
+// the box of local name, -1 if it has none
+static int escape_box(Frame* frame, char* name) {
+  int i;
+  for (i=0; i<frame->num_boxes; i++) {
+    if (!strcmp(frame->boxes[i], name)) return i;
+  }
+  return -1;
+}
+
+// does a let of value to local name go to its box as an int?
+static int escape_box_int(Cell* value, char* name, Frame* frame) {
+  return value->tag == TAG_CONS && escape_box(frame, name)>=0 && ret_int_form(value, NULL, frame->f, 0);
+}
+
+static int escape_box_offset(Frame* frame, int i) {
+  return PTRSZ*(frame->sp + frame->box_slot + ESC_CELL_WORDS*i);
+}
+
+// tags the boxes as ints, once after the prologue
+static void escape_boxes_init(Frame* frame) {
+  int i;
+  if (!frame->num_boxes) return;
+  jit_movi(R2,TAG_INT);
+  for (i=0; i<frame->num_boxes; i++) {
+    jit_str_stack(R2, escape_box_offset(frame, i) + 2*PTRSZ);
+  }
+}
+
+// puts the int in R0 into box i, which is left in R0. the box keeps
+// the 32 bits that alloc_int would.
+static void escape_box_let(Frame* frame, int i) {
+  int offset = escape_box_offset(frame, i);
+  jit_movsx32(R0,R0);
+  jit_str_stack(R0, offset);
+  jit_movr(R0, RSP);
+  jit_addi(R0, offset);
+}
+
+// the ESC_ARG flags of the args of a call to op that can be stack cells
+static int escape_call(Cell* expr, Cell* op, char* op_name, Frame* frame) {
+  if (debug_mode || !frame->f || expr == frame->tail || !op->dr.next) return 0;
+  // the fn being compiled is not bound to its name yet
+  if (frame->name && !strcmp(op_name, frame->name)) return 0;
+  return lambda_flags(op) & ESC_ARGS_ALL;
+}
+
+// BUILTIN_LIST or BUILTIN_CONS if c is a list or cons form that
+// escape_cells can build, else 0
+static int escape_cells_form(Cell* c) {
+  env_entry* e;
+  int n = 0;
+  if (!c || c->tag != TAG_CONS || !car(c) || car(c)->tag != TAG_SYM) return 0;
+  e = lookup_global_symbol(car(c)->ar.addr);
+  if (!e || !e->cell || e->cell->tag != TAG_BUILTIN) return 0;
+  for (c = cdr(c); c && car(c); c = cdr(c)) n++;
+  if (e->cell->ar.value == BUILTIN_LIST && n <= ESC_LIST_MAX) return BUILTIN_LIST;
+  if (e->cell->ar.value == BUILTIN_CONS && n == 2) return BUILTIN_CONS;
+  return 0;
+}
+
+// pushes the elements of c, a form of builtin op, then the cells that
+// hold them, and leaves the first cell in R0. returns the number of
+// words pushed, -1 if an element fails to compile.
+static int escape_cells(Cell* c, int op, Frame* frame) {
+  int slots[ESC_LIST_MAX];
+  int is_cons = (op == BUILTIN_CONS);
+  int n = 0, i;
+  Cell* args;
+
+  for (args = cdr(c); args && car(args); args = cdr(args)) {
+    if (!compile_expr(car(args), frame, prototype_any)) return -1;
+    jit_push(R0,R0);
+    slots[n++] = ++frame->sp;
+  }
+
+  if (is_cons) {
+    jit_ldr_stack(R2, PTRSZ*(frame->sp - slots[1]));
+    jit_ldr_stack(R0, PTRSZ*(frame->sp - slots[0]));
+    jit_movi(R1,TAG_CONS);
+    jit_push(R1,R1);
+    jit_push(R2,R2);
+    jit_push(R0,R0);
+    frame->sp += ESC_CELL_WORDS;
+  } else {
+    // the empty list at the end
+    jit_movi(R1,TAG_CONS);
+    jit_push(R1,R1);
+    jit_movi(R0,0);
+    jit_push(R0,R0);
+    jit_push(R0,R0);
+    frame->sp += ESC_CELL_WORDS;
+    for (i=n-1; i>=0; i--) {
+      jit_movr(R2,RSP);
+      jit_ldr_stack(R0, PTRSZ*(frame->sp - slots[i]));
+      jit_push(R1,R1);
+      jit_push(R2,R2);
+      jit_push(R0,R0);
+      frame->sp += ESC_CELL_WORDS;
+    }
+  }
+  jit_movr(R0,RSP);
+  return n + (is_cons ? 1 : n+1)*ESC_CELL_WORDS;
+}
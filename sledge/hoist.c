@@ -0,0 +1,287 @@
+// loop-invariant loads (x64 hosted)
+//
+// (sget font rune-h) and (size buf) in a while give the same value on
+// every round when the loop never lets font or buf, sputs no field of
+// that name and calls nothing that could: only builtins that don't
+// touch structs or sizes, and fns that inline.c finds pure. redefining
+// such a fn, or one it calls, recompiles the fn of the loop, like for a
+// defconst (see constglobal.c). the loads are done once before the
+// loop, into stack temps that the loop reads like locals. the loop may
+// run zero times, so the struct is checked to be one of the type of the
+// local first, like the tags of typeprop.c, and the loop is compiled a
+// second time for when it is not:
+//
+//       <guard: font is a font struct, else jmp Lslow>
+//       push (sget font rune-h)
+//       <while, reading the temp>
+//       pop
+//       jmp Lend
+//   Lslow:
+//       <while as before>
+//   Lend:
+//
+// this way loops written straight away get what the hand-made lets at
+// the top of blit-char16 do.
+
+#define HOIST_MAX 8 // loads taken out of a loop at most
+
+typedef struct Hoist {
+  char* name;   // the local
+  char* field;  // the field of sget, NULL for size
+  Cell* form;
+  Cell* type;   // what compile_expr gave for it
+  Arg temp;     // where the loop finds it
+} Hoist;
+
+static Hoist hoists[HOIST_MAX];
+static int num_hoists = 0;
+static Frame* hoist_frame = NULL; // the frame of the loop
+
+typedef struct HoistLoop {
+  Cell* loads[MAXFRAME];  // sget and size forms
+  int num_loads;
+  char* lets[MAXFRAME];
+  int num_lets;
+  char* sputs[MAXFRAME];
+  int num_sputs;
+  env_entry* fns[MAXFRAME]; // the fns found pure, and those they call
+  int num_fns;
+  int impure;
+} HoistLoop;
+
+static int hoist_in(char** names, int num, char* name) {
+  int i;
+  for (i=0; i<num; i++) {
+    if (!strcmp(names[i], name)) return 1;
+  }
+  return 0;
+}
+
+// builtins that change no struct field and no size
+static int hoist_pure_builtin(int b) {
+  if (b>=BUILTIN_ADD && b<=BUILTIN_EQ) return 1;
+  switch (b) {
+  case BUILTIN_WHILE: case BUILTIN_IF: case BUILTIN_DO: case BUILTIN_LET:
+  case BUILTIN_CAR: case BUILTIN_CDR: case BUILTIN_CONS: case BUILTIN_LIST:
+  case BUILTIN_ALLOC: case BUILTIN_ALLOC_STR: case BUILTIN_NEW: case BUILTIN_BYTES_TO_STR:
+  case BUILTIN_CONCAT: case BUILTIN_SUBSTR:
+  case BUILTIN_GET8: case BUILTIN_GET16: case BUILTIN_GET32:
+  case BUILTIN_PUT8: case BUILTIN_PUT16: case BUILTIN_PUT32:
+  case BUILTIN_SGET: case BUILTIN_SPUT: case BUILTIN_SIZE: case BUILTIN_TYPE:
+  case BUILTIN_SIN: case BUILTIN_COS: case BUILTIN_SQRT:
+    return 1;
+  }
+  return 0;
+}
+
+static void hoist_fn_calls(Cell* c, HoistLoop* l);
+
+// the loads stay valid as long as e and the fns it calls stay what
+// they are, see hoist_guard
+static void hoist_add_fn(env_entry* e, HoistLoop* l) {
+  int i;
+  for (i=0; i<l->num_fns; i++) {
+    if (l->fns[i] == e) return;
+  }
+  if (l->num_fns>=MAXFRAME) {
+    l->impure = 1;
+    return;
+  }
+  l->fns[l->num_fns++] = e;
+  hoist_fn_calls(cdr((Cell*)e->cell->ar.addr), l);
+}
+
+static void hoist_fn_calls(Cell* c, HoistLoop* l) {
+  env_entry* e;
+  if (!c || c->tag != TAG_CONS) return;
+  if (car(c) && car(c)->tag == TAG_SYM && (e = lookup_global_symbol(car(c)->ar.addr)) && e->cell && e->cell->tag == TAG_LAMBDA) {
+    hoist_add_fn(e, l);
+  }
+  for (; c && c->tag == TAG_CONS; c = cdr(c)) {
+    hoist_fn_calls(car(c), l);
+  }
+}
+
+static void hoist_walk(Cell* c, HoistLoop* l) {
+  env_entry* e;
+  Cell* a;
+  Cell* f;
+  if (!c || c->tag != TAG_CONS) return;
+  if (!car(c) || car(c)->tag != TAG_SYM || !(e = lookup_global_symbol(car(c)->ar.addr)) || !e->cell) {
+    l->impure = 1;
+    return;
+  }
+  if (e->cell->tag == TAG_LAMBDA) {
+    if (!inline_pure_fn(e->cell)) l->impure = 1;
+    else hoist_add_fn(e, l);
+  } else if (e->cell->tag != TAG_BUILTIN) {
+    l->impure = 1;
+  } else {
+    a = car(cdr(c));
+    f = car(cdr(cdr(c)));
+    switch (e->cell->ar.value) {
+    case BUILTIN_FN:
+    case BUILTIN_QUOTE:
+      return;
+    case BUILTIN_LET:
+      if (a && a->tag == TAG_SYM && l->num_lets<MAXFRAME) l->lets[l->num_lets++] = a->ar.addr;
+      break;
+    case BUILTIN_SPUT:
+      if (!f || f->tag != TAG_SYM) l->impure = 1;
+      else if (l->num_sputs<MAXFRAME) l->sputs[l->num_sputs++] = f->ar.addr;
+      break;
+    case BUILTIN_SGET:
+      if (!f || f->tag != TAG_SYM) break;
+    case BUILTIN_SIZE:
+      if (a && a->tag == TAG_SYM && l->num_loads<MAXFRAME) l->loads[l->num_loads++] = c;
+      break;
+    default:
+      if (!hoist_pure_builtin(e->cell->ar.value)) l->impure = 1;
+    }
+  }
+  for (c = cdr(c); c && c->tag == TAG_CONS; c = cdr(c)) {
+    hoist_walk(car(c), l);
+  }
+}
+
+// the hoisted load of field of local name, field NULL for its size
+static Hoist* hoist_find(Frame* frame, char* name, char* field) {
+  int i;
+  if (frame != hoist_frame) return NULL;
+  for (i=0; i<num_hoists; i++) {
+    if (strcmp(hoists[i].name, name)) continue;
+    if (field ? (hoists[i].field && !strcmp(hoists[i].field, field)) : !hoists[i].field) return &hoists[i];
+  }
+  return NULL;
+}
+
+// the temp that expr reads, if it is an sget or size loaded before the
+// loop
+static Hoist* hoist_lookup(Cell* expr, Frame* frame) {
+  env_entry* e;
+  Cell* a;
+  Cell* f;
+  if (!num_hoists || !expr || expr->tag != TAG_CONS || !car(expr) || car(expr)->tag != TAG_SYM) return NULL;
+  e = lookup_global_symbol(car(expr)->ar.addr);
+  if (!e || !e->cell || e->cell->tag != TAG_BUILTIN) return NULL;
+  a = car(cdr(expr));
+  f = car(cdr(cdr(expr)));
+  if (!a || a->tag != TAG_SYM || get_sym_frame_idx(a->ar.addr, frame->f, 0)<0) return NULL;
+  if (e->cell->ar.value == BUILTIN_SIZE) return hoist_find(frame, a->ar.addr, NULL);
+  if (e->cell->ar.value == BUILTIN_SGET && f && f->tag == TAG_SYM) return hoist_find(frame, a->ar.addr, f->ar.addr);
+  return NULL;
+}
+
+// the struct definition of a local with a struct type
+static Cell* hoist_struct_def(Arg* arg) {
+  env_entry* type_env;
+  if (!arg->type_name) return NULL;
+  type_env = lookup_global_symbol(arg->type_name);
+  if (!type_env || !type_env->cell || type_env->cell->tag != TAG_STRUCT_DEF) return NULL;
+  return type_env->cell;
+}
+
+// checks the locals that the loads out of the while expr read, jumping
+// to label_slow unless they are non-null, and structs of their type for
+// sget. then pushes the loads, which the loop reads until
+// hoist_unguard. returns their number, -1 if one fails to compile.
+static int hoist_guard(Cell* expr, Frame* frame, char* label_slow) {
+  HoistLoop l;
+  Cell* c;
+  Cell* f;
+  Cell* def;
+  char* name;
+  Arg* local;
+  char* checked[HOIST_MAX];
+  char* structs[HOIST_MAX];
+  int i, j, n = 0, num_checked = 0, num_structs = 0;
+
+  if (num_hoists) return 0;
+  l.num_loads = 0;
+  l.num_lets = 0;
+  l.num_sputs = 0;
+  l.num_fns = 0;
+  l.impure = 0;
+  for (c = cdr(expr); c && c->tag == TAG_CONS; c = cdr(c)) {
+    hoist_walk(car(c), &l);
+  }
+  if (l.impure) return 0;
+
+  for (i=0; i<l.num_loads && n<HOIST_MAX; i++) {
+    name = car(cdr(l.loads[i]))->ar.addr;
+    f = car(cdr(cdr(l.loads[i])));
+    if (hoist_in(l.lets, l.num_lets, name)) continue;
+    if (f && hoist_in(l.sputs, l.num_sputs, f->ar.addr)) continue;
+    j = get_sym_frame_idx(name, frame->f, 0);
+    if (j<0 || (frame->f[j].type != ARGT_REG && frame->f[j].type != ARGT_STACK)) continue;
+    local = &frame->f[j];
+    def = hoist_struct_def(local);
+    if (f && !def) continue;
+    for (j=0; j<n; j++) {
+      if (!strcmp(hoists[j].name, name) && (f ? hoists[j].field && !strcmp(hoists[j].field, f->ar.addr) : !hoists[j].field)) break;
+    }
+    if (j<n) continue;
+
+    // each local is checked once
+    if (!hoist_in(checked, num_checked, name)) {
+      load_cell(R0, *local, frame);
+      jit_cmpi(R0,0);
+      jit_je(label_slow);
+      checked[num_checked++] = name;
+    }
+    if (f && !hoist_in(structs, num_structs, name)) {
+      load_cell(R0, *local, frame);
+      jit_movr(R1,R0);
+      jit_addi(R1,2*PTRSZ);
+      jit_ldr(R1);
+      jit_cmpi(R1,TAG_STRUCT);
+      jit_jne(label_slow);
+      jit_ldr(R0); // element zero is the struct definition
+      jit_ldr(R0);
+      jit_lea(R1,def);
+      jit_cmpr(R0,R1);
+      jit_jne(label_slow);
+      structs[num_structs++] = name;
+    }
+
+    hoists[n].name = name;
+    hoists[n].field = f ? f->ar.addr : NULL;
+    hoists[n].form = l.loads[i];
+    n++;
+  }
+  if (!n) return 0;
+  // redefining one of them recompiles the fn of the loop
+  for (i=0; i<l.num_fns; i++) {
+    const_global_use(l.fns[i], frame);
+  }
+
+  for (i=0; i<n; i++) {
+    hoists[i].type = compile_expr(hoists[i].form, frame, hoists[i].field ? prototype_any : prototype_int);
+    if (!hoists[i].type) return -1;
+    jit_push(R0,R0);
+    frame->sp++;
+    hoists[i].temp.type = (hoists[i].type->tag == TAG_INT) ? ARGT_STACK_INT : ARGT_STACK;
+    hoists[i].temp.slot = frame->sp;
+    hoists[i].temp.cell = NULL;
+    hoists[i].temp.env = NULL;
+    hoists[i].temp.name = NULL;
+    hoists[i].temp.type_name = NULL;
+    if (hoists[i].type->tag == TAG_STRUCT) {
+      // a struct in a field keeps its type, like in a let
+      Cell** fields = hoists[i].type->ar.addr;
+      Cell** def_fields = fields[0]->ar.addr;
+      hoists[i].temp.type_name = def_fields[0]->ar.addr;
+    }
+  }
+  num_hoists = n;
+  hoist_frame = frame;
+  return n;
+}
+
+static void hoist_unguard(Frame* frame, int n) {
+  if (n<=0) return;
+  jit_inc_stack(n*PTRSZ);
+  frame->sp -= n;
+  num_hoists = 0;
+  hoist_frame = NULL;
+}
@@ -0,0 +1,671 @@
+// heap images (x64 hosted)
+//
+// (save path) writes the whole lisp world to a file: the cell heap and
+// its free list, byte payloads, the global env, mounted filesystems,
+// open streams and the compiled code of all lambdas. pointers are
+// stored as cell indices, env names and offsets into code blobs or the
+// host binary, so a later process of the same binary can map the image
+// back in (sledge --image path) instead of evaluating every def again.
+//
+// devices are not part of the image: streams are reopened and mmapped
+// buffers are mapped again from their paths when it is restored.
+
+#define IMAGE_MAGIC 0x31474d49 // "IMG1"
+#define IMAGE_VERSION 2
+
+// heap internals, see alloc.c
+extern size_t cells_used;
+extern Cell** free_list;
+extern size_t free_list_avail;
+extern size_t free_list_consumed;
+void* bytes_alloc(int num_bytes);
+
+enum image_code_ref {
+  IMAGE_CODE_NULL = 0,
+  IMAGE_CODE_BLOB,
+  IMAGE_CODE_HOST
+};
+
+enum image_payload {
+  IMAGE_PAYLOAD_NULL = 0,
+  IMAGE_PAYLOAD_BYTES,
+  IMAGE_PAYLOAD_MMAP
+};
+
+enum image_reloc {
+  IMAGE_RELOC_CELL = 0,
+  IMAGE_RELOC_ENV,
+  IMAGE_RELOC_HOST,
+  IMAGE_RELOC_GLOBAL_ENV,
+  IMAGE_RELOC_STACK_END
+};
+
+static int image_err;
+
+// cell pointer -> index+1, 0 is NULL
+static uint64_t image_ref(Cell* c) {
+  Cell* heap = get_cell_heap();
+  if (!c) return 0;
+  if (c<heap || c>=heap+cells_used || ((uint8_t*)c-(uint8_t*)heap)%sizeof(Cell)) {
+    printf("<save: pointer outside of the cell heap: %p>\r\n",c);
+    image_err = 1;
+    return 0;
+  }
+  return (c-heap)+1;
+}
+
+static int image_is_host(jit_word_t v) {
+  return v>=(jit_word_t)&__executable_start && v<(jit_word_t)&_end;
+}
+
+static int image_find_blob(uint8_t** blobs, int num_blobs, uint8_t* start) {
+  int i;
+  for (i=0; i<num_blobs; i++) {
+    if (blobs[i] == start) return i;
+  }
+  return -1;
+}
+
+static void image_put_env(const char *key, void *value, const void *obj) {
+  env_entry* e = (env_entry*)value;
+  JitBuf* b = (JitBuf*)obj;
+  ConstUse* u;
+  uint32_t n = 0;
+  jb_str(b, e->name);
+  jb_u64(b, image_ref(e->cell));
+
+  // defconst globals and the fns to recompile when they change
+  jb_u8(b, e->constant);
+  for (u = e->uses; u; u = u->next) n++;
+  jb_u32(b, n);
+  for (u = e->uses; u; u = u->next) {
+    jb_u64(b, image_ref(u->lambda));
+  }
+}
+
+static void image_put_blob(JitBuf* b, uint8_t* start, size_t size, uint32_t* relocs, int num_relocs) {
+  Cell* heap = get_cell_heap();
+  int i;
+  int here;
+#ifdef JIT_DIRECT_CALLS
+  uint8_t* site_blob;
+  size_t site_size;
+  uint32_t* site_relocs;
+  int site_num_relocs;
+#endif
+
+  jb_u32(b, size);
+  jb_put(b, start, size);
+  jb_u32(b, num_relocs);
+
+  for (i=0; i<num_relocs; i++) {
+    jit_word_t v, base;
+    env_entry* e;
+    memcpy(&v, start+relocs[i], sizeof(jit_word_t));
+    base = v & ~STACK_FRAME_MARKER;
+    jb_u32(b, relocs[i]);
+
+    if (v == (jit_word_t)global_env) {
+      jb_u8(b, IMAGE_RELOC_GLOBAL_ENV);
+    }
+    else if (base>=(jit_word_t)heap && base<(jit_word_t)(heap+cells_used)
+             && !((base-(jit_word_t)heap)%sizeof(Cell))) {
+      jb_u8(b, IMAGE_RELOC_CELL);
+      jb_u64(b, image_ref((Cell*)base));
+      jb_u64(b, v-base);
+    }
+    else if ((e = jit_cache_find_env(v))) {
+      jb_u8(b, IMAGE_RELOC_ENV);
+      jb_str(b, e->name);
+    }
+#ifdef JIT_DIRECT_CALLS
+    else if (code_blob_info((void*)v, &site_blob, &site_size, &site_relocs, &site_num_relocs)) {
+      // a linked call site, restored unlinked (see callsite.c)
+      jb_u8(b, IMAGE_RELOC_HOST);
+      jb_u64(b, callsite_unlinked(start+relocs[i])-(jit_word_t)compile_expr);
+    }
+#endif
+    else if (image_is_host(v)) {
+      jb_u8(b, IMAGE_RELOC_HOST);
+      jb_u64(b, v-(jit_word_t)compile_expr);
+    }
+    else if (v>(jit_word_t)&here && v-(jit_word_t)&here < 64*1024*1024) {
+      // the stack end of a top-level frame (see BUILTIN_GC)
+      jb_u8(b, IMAGE_RELOC_STACK_END);
+    }
+    else {
+      printf("<save: cannot relocate %p in code at %p>\r\n",(void*)v,start);
+      image_err = 1;
+      return;
+    }
+  }
+}
+
+Cell* image_save(Cell* path_cell) {
+  JitBuf out = {NULL, 0, 0};
+  Cell* heap = get_cell_heap();
+  uint8_t** blobs = NULL;
+  int num_blobs = 0;
+  char path[256];
+  char tmp_path[300];
+  size_t i;
+  int j;
+  FILE* f;
+
+  if (!path_cell || (path_cell->tag!=TAG_STR && path_cell->tag!=TAG_BYTES) || !path_cell->ar.addr) {
+    printf("<save: path required>\r\n");
+    return alloc_int(0);
+  }
+  snprintf(path, sizeof(path), "%s", (char*)path_cell->ar.addr);
+  if (!strncmp(path,"/sd/",4)) memmove(path, path+4, strlen(path)-3);
+
+  image_err = 0;
+  jit_cache_snapshot_env();
+
+  // code blobs reachable from lambdas
+  blobs = malloc((cells_used+1)*sizeof(uint8_t*));
+  for (i=0; i<cells_used; i++) {
+    uint8_t* start;
+    size_t size;
+    uint32_t* relocs;
+    int num_relocs;
+    if (heap[i].tag != TAG_LAMBDA) continue;
+    if (!code_blob_info(heap[i].dr.next, &start, &size, &relocs, &num_relocs)) continue;
+    if (image_find_blob(blobs, num_blobs, start)<0) blobs[num_blobs++] = start;
+  }
+
+  jb_u32(&out, IMAGE_MAGIC);
+  jb_u32(&out, IMAGE_VERSION);
+  {
+    JitBuf stamp = {NULL, 0, 0};
+    jit_cache_host_stamp(&stamp);
+    jb_u32(&out, stamp.len);
+    jb_put(&out, stamp.data, stamp.len);
+    free(stamp.data);
+  }
+
+  // cells
+  jb_u32(&out, cells_used);
+  for (i=0; i<cells_used && !image_err; i++) {
+    Cell* c = &heap[i];
+    jb_u64(&out, c->tag);
+
+    switch (c->tag) {
+    case TAG_FREED:
+      break;
+    case TAG_CONS:
+      jb_u64(&out, image_ref(c->ar.addr));
+      jb_u64(&out, image_ref(c->dr.next));
+      break;
+    case TAG_LAMBDA: {
+      uint8_t* start;
+      size_t size;
+      uint32_t* relocs;
+      int num_relocs;
+      jb_u64(&out, image_ref(c->ar.addr));
+      if (c->dr.next && code_blob_info(c->dr.next, &start, &size, &relocs, &num_relocs)) {
+        jb_u8(&out, IMAGE_CODE_BLOB);
+        jb_u32(&out, image_find_blob(blobs, num_blobs, start));
+        jb_u64(&out, (uint8_t*)c->dr.next-start);
+      } else if (c->dr.next && image_is_host((jit_word_t)c->dr.next)) {
+        // wrapped host function, see wrap_in_lambda
+        jb_u8(&out, IMAGE_CODE_HOST);
+        jb_u64(&out, (jit_word_t)c->dr.next-(jit_word_t)compile_expr);
+      } else {
+        // no code or code that was already reclaimed
+        jb_u8(&out, IMAGE_CODE_NULL);
+      }
+      break;
+    }
+    case TAG_BUILTIN:
+      jb_u64(&out, c->ar.value);
+      jb_u64(&out, image_ref(c->dr.next));
+      break;
+    case TAG_SYM:
+    case TAG_STR:
+    case TAG_BYTES: {
+      char* mapped = (c->tag == TAG_BYTES) ? fs_mmap_path(c) : NULL;
+      jb_u64(&out, c->dr.size);
+      if (mapped) {
+        jb_u8(&out, IMAGE_PAYLOAD_MMAP);
+        jb_str(&out, mapped);
+      } else if (c->ar.addr) {
+        jb_u8(&out, IMAGE_PAYLOAD_BYTES);
+        jb_put(&out, c->ar.addr, c->dr.size);
+      } else {
+        jb_u8(&out, IMAGE_PAYLOAD_NULL);
+      }
+      break;
+    }
+    case TAG_VEC:
+    case TAG_STRUCT:
+    case TAG_STRUCT_DEF: {
+      Cell** elements = c->ar.addr;
+      jb_u64(&out, c->dr.size);
+      jb_u8(&out, elements ? IMAGE_PAYLOAD_BYTES : IMAGE_PAYLOAD_NULL);
+      for (j=0; elements && j<c->dr.size; j++) {
+        jb_u64(&out, image_ref(elements[j]));
+      }
+      break;
+    }
+    case TAG_STREAM: {
+      Stream* s = c->ar.addr;
+      jb_u8(&out, s ? IMAGE_PAYLOAD_BYTES : IMAGE_PAYLOAD_NULL);
+      if (s) {
+        Cell* fsl;
+        uint64_t fs_ref = 0;
+        for (fsl = get_fs_list(); car(fsl); fsl = cdr(fsl)) {
+          if (car(fsl)->dr.next == s->fs) fs_ref = image_ref(car(fsl));
+        }
+        jb_u64(&out, s->id);
+        jb_u64(&out, image_ref(s->path));
+        jb_u64(&out, s->pos);
+        jb_u64(&out, s->size);
+        jb_u64(&out, s->mode);
+        jb_u64(&out, fs_ref);
+      }
+      break;
+    }
+    case TAG_FS: {
+      Filesystem* fs = c->dr.next;
+      jb_u64(&out, c->ar.value);
+      jb_u8(&out, fs ? IMAGE_PAYLOAD_BYTES : IMAGE_PAYLOAD_NULL);
+      if (fs) {
+        jb_u64(&out, image_ref(fs->mount_point));
+        jb_u64(&out, image_ref(fs->open_fn));
+        jb_u64(&out, image_ref(fs->close_fn));
+        jb_u64(&out, image_ref(fs->read_fn));
+        jb_u64(&out, image_ref(fs->write_fn));
+        jb_u64(&out, image_ref(fs->delete_fn));
+        jb_u64(&out, image_ref(fs->mmap_fn));
+      }
+      break;
+    }
+    default:
+      // plain values (ints, errors, type prototypes)
+      jb_u64(&out, c->ar.value);
+      jb_u64(&out, c->dr.size);
+    }
+  }
+
+  jb_u32(&out, free_list_avail-free_list_consumed);
+  for (i=free_list_consumed; i<free_list_avail; i++) {
+    jb_u64(&out, image_ref(free_list[i]));
+  }
+
+  jb_u32(&out, sm_get_count(global_env));
+  sm_enum(global_env, image_put_env, &out);
+
+  jb_u32(&out, JIT_CACHE_NUM_STATICS);
+  for (i=0; i<JIT_CACHE_NUM_STATICS; i++) {
+    jb_u64(&out, image_ref(*jit_cache_statics[i]));
+  }
+  jb_u64(&out, image_ref(get_fs_list()));
+
+  jb_u32(&out, num_blobs);
+  for (j=0; j<num_blobs && !image_err; j++) {
+    uint8_t* start;
+    size_t size;
+    uint32_t* relocs;
+    int num_relocs;
+    code_blob_info(blobs[j], &start, &size, &relocs, &num_relocs);
+    image_put_blob(&out, start, size, relocs, num_relocs);
+  }
+  free(blobs);
+
+  if (image_err) {
+    printf("<save: image not written>\r\n");
+    free(out.data);
+    return alloc_int(0);
+  }
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+  f = fopen(tmp_path, "wb");
+  if (!f || fwrite(out.data, 1, out.len, f) != out.len) {
+    printf("<save: cannot write %s>\r\n",path);
+    if (f) fclose(f);
+    unlink(tmp_path);
+    free(out.data);
+    return alloc_int(0);
+  }
+  fclose(f);
+  rename(tmp_path, path);
+
+  printf("[image] saved %lu cells, %d code blobs, %lu bytes to %s\r\n",(unsigned long)cells_used,num_blobs,(unsigned long)out.len,path);
+  free(out.data);
+  return alloc_int(1);
+}
+
+static Cell* image_cell(JitReader* r) {
+  uint64_t ref = jr_u64(r);
+  if (!ref) return NULL;
+  if (ref>cells_used) {
+    r->err = 1;
+    return NULL;
+  }
+  return get_cell_heap()+ref-1;
+}
+
+static void image_read_str(JitReader* r, char* dest, int size) {
+  uint32_t len = jr_u32(r);
+  uint8_t* src = jr_bytes(r, len);
+  if (!src || len>=size) {
+    r->err = 1;
+    dest[0] = 0;
+    return;
+  }
+  memcpy(dest, src, len);
+  dest[len] = 0;
+}
+
+typedef struct ImageLambda {
+  Cell* lambda;
+  uint32_t blob;
+  uint64_t offset;
+} ImageLambda;
+
+typedef struct ImageDeferred {
+  Cell* cell;
+  uint64_t ref;
+  char path[256];
+} ImageDeferred;
+
+// map an image written by image_save back in, replacing the current
+// heap. stack_end is the top of the stack that code will run on.
+// a damaged image past the header checks is fatal.
+int image_restore(char* path, void* stack_end) {
+  JitReader r = {NULL, 0, 0, 0};
+  JitBuf stamp = {NULL, 0, 0};
+  Cell* heap = get_cell_heap();
+  ImageLambda* lambdas = NULL;
+  ImageDeferred* streams = NULL;
+  ImageDeferred* mmaps = NULL;
+  uint8_t** blobs = NULL;
+  int num_lambdas = 0, num_streams = 0, num_mmaps = 0;
+  uint32_t i, j, n, uses, num_blobs;
+  uint8_t* src;
+  FILE* f;
+  long sz;
+
+  f = fopen(path, "rb");
+  if (!f) {
+    printf("<image: cannot open %s>\r\n",path);
+    return 0;
+  }
+  fseek(f, 0, SEEK_END);
+  sz = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (sz>0) {
+    r.data = malloc(sz);
+    r.len = fread(r.data, 1, sz, f);
+  }
+  fclose(f);
+
+  jit_cache_host_stamp(&stamp);
+  if (jr_u32(&r) != IMAGE_MAGIC || jr_u32(&r) != IMAGE_VERSION) {
+    printf("<image: %s is not a heap image>\r\n",path);
+    goto fail;
+  }
+  n = jr_u32(&r);
+  src = jr_bytes(&r, n);
+  if (!src || n != stamp.len || memcmp(src, stamp.data, n)) {
+    printf("<image: %s was saved by a different build>\r\n",path);
+    goto fail;
+  }
+  n = jr_u32(&r);
+  if (r.err || n>alloc_stats()->cells_max) {
+    printf("<image: %s has too many cells>\r\n",path);
+    goto fail;
+  }
+
+  // from here on, the current heap is gone
+  memset(heap, 0, alloc_stats()->cells_max*sizeof(Cell));
+  cells_used = n;
+  lambdas = malloc((n+1)*sizeof(ImageLambda));
+  streams = malloc((n+1)*sizeof(ImageDeferred));
+  mmaps = malloc((n+1)*sizeof(ImageDeferred));
+
+  for (i=0; i<n && !r.err; i++) {
+    Cell* c = &heap[i];
+    c->tag = jr_u64(&r);
+
+    switch (c->tag) {
+    case TAG_FREED:
+      break;
+    case TAG_CONS:
+      c->ar.addr = image_cell(&r);
+      c->dr.next = image_cell(&r);
+      break;
+    case TAG_LAMBDA: {
+      uint8_t kind;
+      c->ar.addr = image_cell(&r);
+      kind = jr_u8(&r);
+      if (kind == IMAGE_CODE_BLOB) {
+        lambdas[num_lambdas].lambda = c;
+        lambdas[num_lambdas].blob = jr_u32(&r);
+        lambdas[num_lambdas].offset = jr_u64(&r);
+        num_lambdas++;
+      } else if (kind == IMAGE_CODE_HOST) {
+        c->dr.next = (void*)((jit_word_t)compile_expr + jr_u64(&r));
+      }
+      break;
+    }
+    case TAG_BUILTIN:
+      c->ar.value = jr_u64(&r);
+      c->dr.next = image_cell(&r);
+      break;
+    case TAG_SYM:
+    case TAG_STR:
+    case TAG_BYTES: {
+      uint8_t kind;
+      c->dr.size = jr_u64(&r);
+      kind = jr_u8(&r);
+      if (kind == IMAGE_PAYLOAD_BYTES) {
+        src = jr_bytes(&r, c->dr.size);
+        if (!src) break;
+        c->ar.addr = bytes_alloc(c->dr.size+1);
+        memcpy(c->ar.addr, src, c->dr.size);
+      } else if (kind == IMAGE_PAYLOAD_MMAP) {
+        mmaps[num_mmaps].cell = c;
+        image_read_str(&r, mmaps[num_mmaps].path, sizeof(mmaps[num_mmaps].path));
+        num_mmaps++;
+      }
+      break;
+    }
+    case TAG_VEC:
+    case TAG_STRUCT:
+    case TAG_STRUCT_DEF: {
+      Cell** elements;
+      uint64_t j;
+      c->dr.size = jr_u64(&r);
+      if (jr_u8(&r) != IMAGE_PAYLOAD_BYTES) break;
+      if (c->dr.size>n) {
+        r.err = 1;
+        break;
+      }
+      elements = malloc((c->dr.size+1)*sizeof(Cell*));
+      for (j=0; j<c->dr.size; j++) {
+        elements[j] = image_cell(&r);
+      }
+      c->ar.addr = elements;
+      break;
+    }
+    case TAG_STREAM: {
+      Stream* s;
+      if (jr_u8(&r) != IMAGE_PAYLOAD_BYTES) break;
+      s = malloc(sizeof(Stream));
+      s->id = jr_u64(&r);
+      s->path = image_cell(&r);
+      s->pos = jr_u64(&r);
+      s->size = jr_u64(&r);
+      s->mode = jr_u64(&r);
+      s->fs = NULL;
+      c->ar.addr = s;
+      streams[num_streams].cell = c;
+      streams[num_streams].ref = jr_u64(&r);
+      num_streams++;
+      break;
+    }
+    case TAG_FS: {
+      Filesystem* fs;
+      c->ar.value = jr_u64(&r);
+      if (jr_u8(&r) != IMAGE_PAYLOAD_BYTES) break;
+      fs = malloc(sizeof(Filesystem));
+      fs->mount_point = image_cell(&r);
+      fs->open_fn = image_cell(&r);
+      fs->close_fn = image_cell(&r);
+      fs->read_fn = image_cell(&r);
+      fs->write_fn = image_cell(&r);
+      fs->delete_fn = image_cell(&r);
+      fs->mmap_fn = image_cell(&r);
+      c->dr.next = fs;
+      break;
+    }
+    default:
+      c->ar.value = jr_u64(&r);
+      c->dr.size = jr_u64(&r);
+    }
+  }
+
+  free_list_consumed = 0;
+  free_list_avail = jr_u32(&r);
+  if (free_list_avail>cells_used) r.err = 1;
+  for (i=0; i<free_list_avail && !r.err; i++) {
+    free_list[i] = image_cell(&r);
+  }
+
+  n = jr_u32(&r);
+  for (i=0; i<n && !r.err; i++) {
+    char name[MAX_SYMBOL_SIZE];
+    Cell* c;
+    env_entry* e;
+    image_read_str(&r, name, sizeof(name));
+    c = image_cell(&r);
+    if (r.err) break;
+    e = lookup_global_symbol(name);
+    if (e) {
+      e->cell = c;
+    } else {
+      insert_global_symbol(alloc_sym(name), c);
+      e = lookup_global_symbol(name);
+    }
+
+    e->constant = jr_u8(&r);
+    uses = jr_u32(&r);
+    for (j=0; j<uses && !r.err; j++) {
+      Cell* lambda = image_cell(&r);
+#ifdef JIT_CONST_GLOBALS
+      if (lambda) const_global_add(e, lambda);
+#endif
+    }
+  }
+
+  n = jr_u32(&r);
+  if (n != JIT_CACHE_NUM_STATICS) r.err = 1;
+  for (i=0; i<n && !r.err; i++) {
+    *jit_cache_statics[i] = image_cell(&r);
+  }
+  fs_set_list(image_cell(&r));
+
+  // code, relocated against the restored heap and env
+  num_blobs = jr_u32(&r);
+  if (!r.err) blobs = malloc((num_blobs+1)*sizeof(uint8_t*));
+  for (i=0; i<num_blobs && !r.err; i++) {
+    uint32_t size = jr_u32(&r);
+    uint32_t num_relocs, k;
+    uint32_t* offsets;
+    uint8_t* blob;
+    src = jr_bytes(&r, size);
+    if (!src) break;
+    blob = code_alloc(size);
+    if (!blob) {
+      r.err = 1;
+      break;
+    }
+    memcpy(blob, src, size);
+    blobs[i] = blob;
+
+    num_relocs = jr_u32(&r);
+    offsets = malloc((num_relocs+1)*sizeof(uint32_t));
+    for (k=0; k<num_relocs && !r.err; k++) {
+      uint32_t idx = jr_u32(&r);
+      uint8_t kind = jr_u8(&r);
+      jit_word_t v = 0;
+      offsets[k] = idx;
+
+      if (kind == IMAGE_RELOC_CELL) {
+        v = (jit_word_t)image_cell(&r);
+        v += jr_u64(&r);
+      } else if (kind == IMAGE_RELOC_ENV) {
+        char name[MAX_SYMBOL_SIZE];
+        env_entry* e;
+        image_read_str(&r, name, sizeof(name));
+        e = lookup_global_symbol(name);
+        if (!e) r.err = 1;
+        v = (jit_word_t)e;
+      } else if (kind == IMAGE_RELOC_HOST) {
+        v = (jit_word_t)compile_expr + jr_u64(&r);
+      } else if (kind == IMAGE_RELOC_GLOBAL_ENV) {
+        v = (jit_word_t)global_env;
+      } else if (kind == IMAGE_RELOC_STACK_END) {
+        v = (jit_word_t)stack_end;
+      } else {
+        r.err = 1;
+      }
+      if (idx+sizeof(jit_word_t) > size) r.err = 1;
+      if (!r.err) memcpy(blob+idx, &v, sizeof(jit_word_t));
+    }
+    code_set_relocs(blob, offsets, num_relocs);
+    code_seal(blob);
+    free(offsets);
+  }
+
+  for (i=0; i<num_lambdas && !r.err; i++) {
+    if (lambdas[i].blob>=num_blobs) {
+      r.err = 1;
+      break;
+    }
+    lambdas[i].lambda->dr.next = blobs[lambdas[i].blob] + lambdas[i].offset;
+  }
+
+  if (r.err) {
+    printf("<image: %s is damaged>\r\n",path);
+    exit(1);
+  }
+
+#ifdef JIT_DIRECT_CALLS
+  for (i=0; i<num_blobs; i++) {
+    link_calls(blobs[i], 0);
+  }
+#endif
+
+  // devices
+  for (i=0; i<num_streams; i++) {
+    Stream* s = streams[i].cell->ar.addr;
+    Cell* fs_cell = streams[i].ref ? heap+streams[i].ref-1 : NULL;
+    if (fs_cell && fs_cell->tag == TAG_FS) s->fs = fs_cell->dr.next;
+    if (s->fs) stream_reopen(streams[i].cell);
+  }
+  for (i=0; i<num_mmaps; i++) {
+    Cell* mapped = fs_mmap(alloc_string_copy(mmaps[i].path));
+    if (mapped && mapped->tag == TAG_BYTES) {
+      mmaps[i].cell->ar.addr = mapped->ar.addr;
+      mmaps[i].cell->dr.size = mapped->dr.size;
+    }
+  }
+
+  printf("[image] restored %lu cells, %u code blobs from %s\r\n",(unsigned long)cells_used,num_blobs,path);
+
+  free(lambdas);
+  free(streams);
+  free(mmaps);
+  free(blobs);
+  free(stamp.data);
+  free(r.data);
+  return 1;
+
+fail:
+  free(stamp.data);
+  free(r.data);
+  return 0;
+}
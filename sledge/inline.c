@@ -0,0 +1,331 @@
+// inline expansion of small fns (x64 hosted)
+//
+// inside a fn, a call to a global fn whose body has no more than
+// INLINE_MAX_CELLS conses is compiled as a copy of that body, with its
+// params replaced by the argument forms. nothing is pushed or boxed for
+// the call, int args stay unboxed and constant args are folded.
+//
+// ints are substituted as they are. when all args are pure (int math,
+// if, do, car, cdr, get8/16/32, size and small fns made of those), so
+// that it doesn't matter when and how often they run, locals are too,
+// and so are other args if the body is pure as well. everything else
+// is evaluated in order before the body, like for a call, and kept in
+// stack slots. so are int args that may not fit in 32 bits, like (* a b)
+// or an int local: a call would box them with alloc_int, which keeps
+// the low 32 bits, so the temp gets them cut the same way. so does an
+// int result of the body. bodies with let, def, fn or field names are not
+// inlined, nor are bodies that use a global a local of the caller
+// would hide.
+//
+// the caller is added to the uses of the callee's env entry, like for
+// a defconst (see constglobal.c), so redefining the callee recompiles
+// it. code that the compiled-code cache stores is not expanded.
+
+#define INLINE_MAX_CELLS 24 // size of the callee's body
+#define INLINE_MAX_COPY  8  // size of a pure arg that is used more than once
+#define INLINE_MAX_DEPTH 4  // for fns expanded inside expanded fns
+
+Cell* compile_expr(Cell* expr, Frame* frame, Cell* return_type);
+
+static int inline_depth = 0;
+static int inline_temps_used = 0;
+
+static int inline_cells(Cell* c) {
+  int n = 0;
+  for (; c && c->tag == TAG_CONS; c = cdr(c)) {
+    n += 1 + inline_cells(car(c));
+  }
+  return n;
+}
+
+// size of an arg for copying it, fn calls are never copied
+static int inline_copy_cost(Cell* c) {
+  env_entry* e;
+  int n = 0;
+  if (!c || c->tag != TAG_CONS) return 0;
+  if (car(c) && car(c)->tag == TAG_SYM) {
+    e = lookup_global_symbol(car(c)->ar.addr);
+    if (e && e->cell && e->cell->tag == TAG_LAMBDA) return INLINE_MAX_COPY+1;
+  }
+  for (; c && c->tag == TAG_CONS; c = cdr(c)) {
+    n += 1 + inline_copy_cost(car(c));
+  }
+  return n;
+}
+
+static int inline_param_idx(Cell* sym, Cell** params, int num_params) {
+  int i;
+  for (i=0; i<num_params; i++) {
+    if (!strcmp(sym->ar.addr, params[i]->ar.addr)) return i;
+  }
+  return -1;
+}
+
+static int inline_check(Cell* c, Cell** params, int* uses, int num_params, Frame* caller);
+
+// does calling lambda have no effects?
+static int inline_pure_fn(Cell* lambda) {
+  static int depth = 0;
+  Cell* params[MAXARGS];
+  int uses[MAXARGS];
+  Cell* sig = car((Cell*)lambda->ar.addr);
+  Cell* body = cdr((Cell*)lambda->ar.addr);
+  int n = 0, pure;
+
+  if (inline_depth+depth>=INLINE_MAX_DEPTH) return 0;
+  if (!body || inline_cells(body)>INLINE_MAX_CELLS) return 0;
+  for (; car(sig); sig = cdr(sig)) {
+    if (n>=MAXARGS) return 0;
+    params[n] = car(car(sig));
+    uses[n++] = 0;
+  }
+  depth++;
+  pure = (inline_check(body, params, uses, n, NULL) == 2);
+  depth--;
+  return pure;
+}
+
+// 0: form can't be inlined, 1: it can, 2: it can and has no effects
+static int inline_check(Cell* c, Cell** params, int* uses, int num_params, Frame* caller) {
+  env_entry* e;
+  Cell* op;
+  Cell* sig;
+  int kind, k, i;
+
+  if (!c) return 2;
+  if (c->tag == TAG_SYM) {
+    i = inline_param_idx(c, params, num_params);
+    if (i>=0) {
+      uses[i]++;
+      return 2;
+    }
+    // a global of the callee, unless the caller has a local of that name
+    if (caller && get_sym_frame_idx(c->ar.addr, caller->f, 0)>=0) return 0;
+    return 2;
+  }
+  if (c->tag != TAG_CONS) return 2;
+
+  op = car(c);
+  if (!op || op->tag != TAG_SYM) return 0;
+  e = lookup_global_symbol(op->ar.addr);
+  if (!e || !e->cell) return 0;
+
+  if (e->cell->tag == TAG_LAMBDA) {
+    kind = inline_pure_fn(e->cell) ? 2 : 1;
+  } else if (e->cell->tag != TAG_BUILTIN) {
+    return 0;
+  } else {
+    switch (e->cell->ar.value) {
+    case BUILTIN_IF: case BUILTIN_DO: case BUILTIN_CAR: case BUILTIN_CDR:
+    case BUILTIN_GET8: case BUILTIN_GET16: case BUILTIN_GET32: case BUILTIN_SIZE:
+      kind = 2;
+      break;
+    case BUILTIN_WHILE: case BUILTIN_LIST:
+      kind = 1;
+      break;
+    default:
+      if (e->cell->ar.value>=BUILTIN_ADD && e->cell->ar.value<=BUILTIN_EQ) {
+        kind = 2;
+        break;
+      }
+      // special forms and builtins that take names
+      if (!e->cell->dr.next) return 0;
+      for (sig = e->cell->dr.next; car(sig); sig = cdr(sig)) {
+        if (car(sig) == prototype_symbol) return 0;
+      }
+      kind = 1;
+    }
+  }
+
+  for (c = cdr(c); c && car(c); c = cdr(c)) {
+    k = inline_check(car(c), params, uses, num_params, caller);
+    if (!k) return 0;
+    if (k<kind) kind = k;
+  }
+  return kind;
+}
+
+static Cell* inline_subst(Cell* c, Cell** params, Cell** args, int num_params);
+
+static Cell* inline_subst_list(Cell* c, Cell** params, Cell** args, int num_params) {
+  if (!c || c->tag != TAG_CONS || !car(c)) return c;
+  return alloc_cons(inline_subst(car(c), params, args, num_params),
+                    inline_subst_list(cdr(c), params, args, num_params));
+}
+
+// copy of form with the params replaced by args. operators stay.
+static Cell* inline_subst(Cell* c, Cell** params, Cell** args, int num_params) {
+  int i;
+  if (!c) return c;
+  if (c->tag == TAG_SYM) {
+    i = inline_param_idx(c, params, num_params);
+    return i>=0 ? args[i] : c;
+  }
+  if (c->tag != TAG_CONS || !car(c)) return c;
+  return alloc_cons(car(c), inline_subst_list(cdr(c), params, args, num_params));
+}
+
+// is the value of form an int? such temps are kept unboxed
+static int inline_int_form(Cell* c, int depth) {
+  env_entry* e;
+  Cell* op;
+  if (!c) return 0;
+  if (c->tag == TAG_INT) return 1;
+  if (c->tag != TAG_CONS || !car(c) || car(c)->tag != TAG_SYM) return 0;
+  e = lookup_global_symbol(car(c)->ar.addr);
+  if (!e || !(op = e->cell)) return 0;
+
+  if (op->tag == TAG_LAMBDA) {
+    return depth<INLINE_MAX_DEPTH && inline_int_form(cdr((Cell*)op->ar.addr), depth+1);
+  }
+  if (op->tag != TAG_BUILTIN) return 0;
+  if (op->ar.value>=BUILTIN_ADD && op->ar.value<=BUILTIN_EQ) return 1;
+  switch (op->ar.value) {
+  case BUILTIN_GET8: case BUILTIN_GET16: case BUILTIN_GET32: case BUILTIN_SIZE:
+    return 1;
+  case BUILTIN_IF:
+    return inline_int_form(car(cdr(cdr(c))), depth) && inline_int_form(car(cdr(cdr(cdr(c)))), depth);
+  }
+  return 0;
+}
+
+// can the int value of c have more than 32 bits? a call boxes such a
+// value with alloc_int, which keeps the low 32 bits, so an expansion
+// has to cut it the same way. compares count as narrow, a condition
+// only tests them. calls that are not expanded cut their result.
+static int inline_wide_form(Cell* c, Frame* frame) {
+  env_entry* e;
+  Cell* op;
+  int i;
+  if (!c) return 0;
+  if (c->tag == TAG_SYM) {
+    i = get_sym_frame_idx(c->ar.addr, frame->f, 0);
+    if (i<0 || i>=MAXFRAME-inline_temps_used) return 0; // cells, or temps cut already
+    return frame->f[i].type == ARGT_REG_INT || frame->f[i].type == ARGT_STACK_INT;
+  }
+  if (c->tag != TAG_CONS || !car(c) || car(c)->tag != TAG_SYM) return 0;
+  e = lookup_global_symbol(car(c)->ar.addr);
+  if (!e || !(op = e->cell) || op->tag != TAG_BUILTIN) return 0;
+  switch (op->ar.value) {
+  case BUILTIN_LT: case BUILTIN_GT: case BUILTIN_EQ:
+    return 0;
+  case BUILTIN_IF:
+    return inline_wide_form(car(cdr(cdr(c))), frame) || inline_wide_form(car(cdr(cdr(cdr(c)))), frame);
+  case BUILTIN_DO:
+    for (c = cdr(c); c && car(cdr(c)); c = cdr(c));
+    return c ? inline_wide_form(car(c), frame) : 0;
+  case BUILTIN_GET32:
+    return 1;
+  }
+  return op->ar.value>=BUILTIN_ADD && op->ar.value<=BUILTIN_EQ;
+}
+
+typedef struct Inline {
+  Cell* body;             // copy of the callee's body
+  Cell* temps[MAXARGS];   // args that are evaluated before it
+  Cell* temp_syms[MAXARGS];
+  int num_temps;
+} Inline;
+
+// fills in inl for expanding the call expr of lambda, returns 0 if
+// the call has to stay a call
+static int inline_expand(Cell* expr, Cell* lambda, Frame* frame, Inline* inl) {
+  Cell* params[MAXARGS];
+  Cell* args[MAXARGS];
+  int uses[MAXARGS];
+  Cell* sig = car((Cell*)lambda->ar.addr);
+  Cell* body = cdr((Cell*)lambda->ar.addr);
+  Cell* c;
+  char name[32];
+  int n = 0, i, kind, pure_args = 1;
+
+  if (debug_mode || !frame->lambda || !frame->f || inline_depth>=INLINE_MAX_DEPTH) return 0;
+  // the fn being def'd is about to replace the callee
+  if (frame->name && !strcmp(frame->name, car(expr)->ar.addr)) return 0;
+  if (lambda == frame->lambda || lambda == const_fn_target) return 0;
+#ifdef JIT_CACHE
+  if (jit_cache_storing()) return 0;
+#endif
+#ifdef JIT_PROFILE
+  // calls of counted fns stay calls
+  if (profile_mode()) return 0;
+#endif
+  if (!body || inline_cells(body)>INLINE_MAX_CELLS) return 0;
+
+  for (c = cdr(expr); c && car(c); c = cdr(c)) {
+    if (n>=MAXARGS) return 0;
+    args[n++] = car(c);
+  }
+  for (i=0; car(sig); sig = cdr(sig), i++) {
+    // typed params are left to the call
+    if (i>=n || cdr(car(sig))->tag != TAG_ANY) return 0;
+    params[i] = car(car(sig));
+    uses[i] = 0;
+  }
+  if (i != n) return 0;
+
+  kind = inline_check(body, params, uses, n, frame);
+  if (!kind) return 0;
+  for (i=0; i<n; i++) {
+    if (inline_check(args[i], NULL, NULL, 0, NULL)<2) pure_args = 0;
+  }
+
+  // the rest goes to temps, which the body reads like lets
+  inl->num_temps = 0;
+  for (i=0; i<n; i++) {
+    Cell* a = args[i];
+    if (a->tag == TAG_INT) continue;
+    // the call would cut it to 32 bits, see inline_compile
+    if (pure_args && !inline_wide_form(a, frame)) {
+      if (a->tag == TAG_SYM && get_sym_frame_idx(a->ar.addr, frame->f, 0)>=0) continue;
+      if (kind==2 && (uses[i]<2 || inline_copy_cost(a)<=INLINE_MAX_COPY)) continue;
+    }
+    snprintf(name, sizeof(name), "inline %d", inline_temps_used+inl->num_temps);
+    inl->temps[inl->num_temps] = a;
+    inl->temp_syms[inl->num_temps] = args[i] = alloc_sym(name);
+    inl->num_temps++;
+  }
+  // temps take frame entries from the top, lets from below
+  if (MAXARGS+frame->num_lets+inline_temps_used+inl->num_temps > MAXFRAME) return 0;
+
+  inl->body = inline_subst(body, params, args, n);
+  return 1;
+}
+
+// compiles the expansion in place of the call expr
+static Cell* inline_compile(Inline* inl, Cell* expr, Frame* frame, Cell* return_type) {
+  Arg* f = frame->f;
+  Cell* type;
+  int i, idx;
+
+  for (i=0; i<inl->num_temps; i++) {
+    type = compile_expr(inl->temps[i], frame, inline_int_form(inl->temps[i], 0) ? prototype_int : prototype_any);
+    if (!type) return NULL;
+    if (type->tag == TAG_INT) jit_movsx32(R0,R0);
+    jit_push(R0,R0);
+    frame->sp++;
+
+    idx = MAXFRAME-1-inline_temps_used++;
+    f[idx].name = inl->temp_syms[i]->ar.addr;
+    f[idx].type = (type->tag == TAG_INT) ? ARGT_STACK_INT : ARGT_STACK;
+    f[idx].slot = frame->sp;
+    f[idx].cell = NULL;
+    f[idx].type_name = NULL;
+  }
+
+  if (expr == frame->tail) frame->tail = inl->body;
+  inline_depth++;
+  type = compile_expr(inl->body, frame, return_type);
+  inline_depth--;
+  // the int the call would have boxed
+  if (type && type->tag == TAG_INT) jit_movsx32(R0,R0);
+
+  for (i=0; i<inl->num_temps; i++) {
+    f[MAXFRAME-inline_temps_used--].name = NULL;
+  }
+  if (inl->num_temps) {
+    jit_inc_stack(inl->num_temps*PTRSZ);
+    frame->sp -= inl->num_temps;
+  }
+  return type;
+}
@@ -0,0 +1,147 @@
+// unboxed int args (x64 hosted)
+//
+// an arg that a fn only ever uses as an int, like x and y of
+// set-pixel, arrives unboxed in its register at the raw entry of the
+// fn (see rettype.c). the boxed entry unboxes it and goes on to the
+// raw entry, so there is only one copy of the body:
+//
+//   L0: jmp L3          boxed entry, lambda->dr.next
+//       <prologue, body, epilogue>
+//                       raw entry at L0+RAW_ENTRY
+//   L3: mov (%r13),%r13 unbox the int args
+//       jmp L0+5        or call it and box the result, see rettype.c
+//
+// a call from compiled code passes such args the way it has them, an
+// int local or an int expression like (+ x 1) is passed without
+// allocating a cell, and enters at the raw entry. only args passed in
+// registers are unboxed. a call that wants a cell from a fn that also
+// returns an unboxed int takes the boxed entry, with boxed args.
+//
+// an int use is an operand of int math and compares, the condition of
+// if and while, the offset and value of get8/16/32 and put8/16/32, and
+// an int arg of a call. an arg with any other use, like being returned
+// to a caller that wants a cell or passed to car, stays boxed.
+
+#define INT_ARGS_NUM (ARG_SPILLOVER<FRAME_REGS ? ARG_SPILLOVER : FRAME_REGS)
+
+typedef struct IntArgUses {
+  Arg* fn_frame;
+  int num_args;
+  char* self;          // the name of the fn, for calls to itself
+  int mask;            // the args taken to be ints so far
+  int ints[INT_ARGS_NUM];
+  int others[INT_ARGS_NUM];
+} IntArgUses;
+
+static void int_args_walk(Cell* c, int int_use, int tail, IntArgUses* u);
+
+// forms of list, the n first of them int uses
+static void int_args_list(Cell* list, int n, IntArgUses* u) {
+  for (; list && list->tag == TAG_CONS; list = cdr(list), n--) {
+    int_args_walk(car(list), n>0, 0, u);
+  }
+}
+
+static void int_args_walk(Cell* c, int int_use, int tail, IntArgUses* u) {
+  env_entry* e;
+  Cell* args;
+  int raw, j;
+
+  if (!c) return;
+  if (c->tag == TAG_SYM) {
+    j = get_sym_frame_idx(c->ar.addr, u->fn_frame, 0);
+    if (j>=0 && j<INT_ARGS_NUM && j<u->num_args) {
+      if (int_use) u->ints[j]++;
+      else u->others[j]++;
+    }
+    return;
+  }
+  if (c->tag != TAG_CONS) return;
+
+  args = cdr(c);
+  if (!car(c) || car(c)->tag != TAG_SYM) {
+    int_args_list(c, 0, u);
+    return;
+  }
+  e = lookup_global_symbol(car(c)->ar.addr);
+
+  if (u->self && !strcmp(car(c)->ar.addr, u->self)) {
+    // a call to itself passes ints the way it takes them
+    raw = u->mask;
+  } else if (e && e->cell && e->cell->tag == TAG_BUILTIN) {
+    switch (e->cell->ar.value) {
+    case BUILTIN_FN:
+    case BUILTIN_QUOTE:
+      return;
+    case BUILTIN_LET:
+      int_args_walk(car(cdr(args)), 0, 0, u);
+      return;
+    case BUILTIN_IF:
+      int_args_walk(car(args), 1, 0, u);
+      int_args_walk(car(cdr(args)), int_use, tail, u);
+      int_args_walk(car(cdr(cdr(args))), int_use, tail, u);
+      return;
+    case BUILTIN_WHILE:
+      int_args_walk(car(args), 1, 0, u);
+      int_args_list(cdr(args), 0, u);
+      return;
+    case BUILTIN_DO:
+      for (; args && args->tag == TAG_CONS; args = cdr(args)) {
+        if (car(cdr(args))) int_args_walk(car(args), 0, 0, u);
+        else int_args_walk(car(args), int_use, tail, u);
+      }
+      return;
+    case BUILTIN_GET8: case BUILTIN_GET16: case BUILTIN_GET32:
+    case BUILTIN_PUT8: case BUILTIN_PUT16: case BUILTIN_PUT32:
+      int_args_walk(car(args), 0, 0, u);
+      int_args_list(cdr(args), 2, u);
+      return;
+    }
+    if (e->cell->ar.value>=BUILTIN_ADD && e->cell->ar.value<=BUILTIN_EQ) {
+      int_args_list(args, MAXARGS, u);
+    } else {
+      int_args_list(args, 0, u);
+    }
+    return;
+  } else if (e && e->cell && e->cell->tag == TAG_LAMBDA && !tail) {
+    raw = lambda_raw(e->cell)>>1;
+  } else {
+    // a tail call to another fn passes cells
+    raw = 0;
+  }
+
+  for (j=0; args && args->tag == TAG_CONS; args = cdr(args), j++) {
+    int_args_walk(car(args), (raw>>j)&1, 0, u);
+  }
+}
+
+// the RAW_ARG flags of the args of the fn with body and args in
+// fn_frame that are only used as ints. self is the name of the fn.
+static int fn_int_args(Cell* body, Arg* fn_frame, int num_args, char* self) {
+  IntArgUses u;
+  int j, prev;
+
+  u.fn_frame = fn_frame;
+  u.num_args = num_args;
+  u.self = self;
+  u.mask = 0;
+  for (j=0; j<INT_ARGS_NUM && j<num_args; j++) {
+    // args with a struct type keep it
+    if (fn_frame[j].type == ARGT_REG && !fn_frame[j].type_name) u.mask |= 1<<j;
+  }
+
+  // args passed on to the fn itself are ints if they end up ints
+  do {
+    prev = u.mask;
+    for (j=0; j<INT_ARGS_NUM; j++) {
+      u.ints[j] = 0;
+      u.others[j] = 0;
+    }
+    int_args_walk(body, 0, 1, &u);
+    for (j=0; j<INT_ARGS_NUM; j++) {
+      if (!u.ints[j] || u.others[j]) u.mask &= ~(1<<j);
+    }
+  } while (u.mask != prev);
+
+  return u.mask<<1;
+}
@@ -0,0 +1,587 @@
+// recorded jit_* calls, and a pass over them (all backends)
+//
+// compile_expr emits through the jit_* interface that every backend
+// implements. the jit_* functions below record each call as an
+// instruction instead: an op, the abstract registers R0.. that the
+// backend maps to hardware ones, an immediate, an
+// address or a label, and the type of the value written, a raw int,
+// a boxed cell or a plain word (an address, or not known):
+//
+//   B8 Lskip_67:
+//     movr             r1 <- r5                     int
+//     movi             r2 <- 1                      int
+//     addr             r1 <- r1, r2                 int
+//     movr             r0 <- r1                     int
+//
+// a label starts a basic block, a branch, jmp or ret ends it. once a
+// block is complete, the pass runs over it and it is replayed by
+// calling the jit_* functions of the backend for each instruction, in
+// order. so a pass is written once for x64, x86, arm and m68k, and
+// code that needs the real position of the code (like code_idx or
+// find_label) sees it after the block before it has ended.
+//
+// the only pass so far removes writes to a register that the block
+// overwrites before reading it. ops the pass doesn't know count as
+// reading every register.
+//
+// this only records what compile_expr emits, it is not an ir that
+// the compiler lowers to and the backends translate. there are no
+// virtual registers: the registers are the ones the compiler allocated, and a
+// pass can drop instructions of a block but not rename or move values
+// across blocks. no pass reads the types yet, only IR_DUMP.
+//
+// load_int and load_cell mark what they load, everything else gets
+// the type its op implies. with IR_DUMP defined, the recorded calls
+// of every compiled form are printed.
+
+enum ir_op_t {
+  IR_NOP,
+  IR_PUSH, IR_POP, IR_MOVR, IR_MOVSX32, IR_MOVI, IR_LEA, IR_LDR, IR_LDR_STACK, IR_STR_STACK,
+  IR_INC_STACK, IR_DEC_STACK,
+  IR_LDRB, IR_LDRS, IR_LDRW, IR_STRB, IR_STRS, IR_STRW, IR_STRA,
+  IR_ADDI, IR_ADDR, IR_SUBR, IR_MULR, IR_DIVR, IR_MODR,
+  IR_ANDR, IR_ORR, IR_XORR, IR_NOTR, IR_SHLR, IR_SHRR,
+  IR_MOVNE, IR_MOVEQ, IR_MOVNEG,
+  IR_CMPI, IR_CMPR,
+  IR_CALL, IR_CALL2, IR_CALL3, IR_CALLR, IR_CALL_REL, IR_CALL_ENV, IR_CALL_ENV_RAW,
+  IR_HOST_CALL_ENTER, IR_HOST_CALL_EXIT,
+  IR_LABEL, IR_JMP, IR_JE, IR_JNE, IR_JGE, IR_JNEG, IR_JLT, IR_JLE, IR_JGT,
+  IR_JMP_REL, IR_JMP_ENV, IR_RET,
+  IR_COMMENT
+};
+
+static char* ir_op_names[] = {
+  "nop",
+  "push", "pop", "movr", "movsx32", "movi", "lea", "ldr", "ldr_stack", "str_stack",
+  "inc_stack", "dec_stack",
+  "ldrb", "ldrs", "ldrw", "strb", "strs", "strw", "stra",
+  "addi", "addr", "subr", "mulr", "divr", "modr",
+  "andr", "orr", "xorr", "notr", "shlr", "shrr",
+  "movne", "moveq", "movneg",
+  "cmpi", "cmpr",
+  "call", "call2", "call3", "callr", "call_rel", "call_env", "call_env_raw",
+  "host_call_enter", "host_call_exit",
+  "label", "jmp", "je", "jne", "jge", "jneg", "jlt", "jle", "jgt",
+  "jmp_rel", "jmp_env", "ret",
+  ";"
+};
+
+enum ir_type_t {
+  IR_NONE,  // writes no register
+  IR_WORD,
+  IR_INT,
+  IR_CELL
+};
+
+typedef struct IrOp {
+  int op;
+  int a;          // destination or first register
+  int b;          // source register, last register or immediate
+  int type;       // of the value written to a
+  jit_word_t v;   // movi immediate
+  void* p;        // lea address, call target, env entry
+  char* s;        // label (owned), or call note
+} IrOp;
+
+static IrOp* ir_ops = NULL;
+static int ir_num = 0;
+static int ir_size = 0;
+static int ir_block = 0;    // the first op of the open block
+static int ir_removed = 0;
+
+static void ir_reset() {
+  int i;
+  for (i=0; i<ir_num; i++) {
+    if (ir_ops[i].op >= IR_LABEL && ir_ops[i].op <= IR_JGT) free(ir_ops[i].s);
+  }
+  ir_num = 0;
+  ir_block = 0;
+  ir_removed = 0;
+}
+
+// the lowering: one call into the backend per op
+static void ir_emit(IrOp* o) {
+  switch (o->op) {
+  case IR_NOP:          break;
+  case IR_PUSH:         jit_push(o->a, o->b); break;
+  case IR_POP:          jit_pop(o->a, o->b); break;
+  case IR_MOVR:         jit_movr(o->a, o->b); break;
+  case IR_MOVSX32:      jit_movsx32(o->a, o->b); break;
+  case IR_MOVI:         jit_movi(o->a, o->v); break;
+  case IR_LEA:          jit_lea(o->a, o->p); break;
+  case IR_LDR:          jit_ldr(o->a); break;
+  case IR_LDR_STACK:    jit_ldr_stack(o->a, o->b); break;
+  case IR_STR_STACK:    jit_str_stack(o->a, o->b); break;
+  case IR_INC_STACK:    jit_inc_stack(o->b); break;
+  case IR_DEC_STACK:    jit_dec_stack(o->b); break;
+  case IR_LDRB:         jit_ldrb(o->a); break;
+  case IR_LDRW:         jit_ldrw(o->a); break;
+  case IR_STRB:         jit_strb(o->a); break;
+  case IR_STRW:         jit_strw(o->a); break;
+#ifndef __AMIGA
+  case IR_LDRS:         jit_ldrs(o->a); break;
+  case IR_STRS:         jit_strs(o->a); break;
+  case IR_STRA:         jit_stra(o->a); break;
+  case IR_COMMENT:      jit_comment(o->s); break;
+#endif
+  case IR_ADDI:         jit_addi(o->a, o->b); break;
+  case IR_ADDR:         jit_addr(o->a, o->b); break;
+  case IR_SUBR:         jit_subr(o->a, o->b); break;
+  case IR_MULR:         jit_mulr(o->a, o->b); break;
+  case IR_DIVR:         jit_divr(o->a, o->b); break;
+  case IR_MODR:         jit_modr(o->a, o->b); break;
+  case IR_ANDR:         jit_andr(o->a, o->b); break;
+  case IR_ORR:          jit_orr(o->a, o->b); break;
+  case IR_XORR:         jit_xorr(o->a, o->b); break;
+  case IR_NOTR:         jit_notr(o->a); break;
+  case IR_SHLR:         jit_shlr(o->a, o->b); break;
+  case IR_SHRR:         jit_shrr(o->a, o->b); break;
+  case IR_MOVNE:        jit_movne(o->a, o->b); break;
+  case IR_MOVEQ:        jit_moveq(o->a, o->b); break;
+  case IR_MOVNEG:       jit_movneg(o->a, o->b); break;
+  case IR_CMPI:         jit_cmpi(o->a, o->b); break;
+  case IR_CMPR:         jit_cmpr(o->a, o->b); break;
+  case IR_CALL:         jit_call(o->p, o->s); break;
+  case IR_CALL2:        jit_call2(o->p, o->s); break;
+  case IR_CALL3:        jit_call3(o->p, o->s); break;
+  case IR_CALLR:        jit_callr(o->a); break;
+  case IR_HOST_CALL_ENTER: jit_host_call_enter(); break;
+  case IR_HOST_CALL_EXIT:  jit_host_call_exit(); break;
+  case IR_LABEL:        jit_label(o->s); break;
+  case IR_JMP:          jit_jmp(o->s); break;
+  case IR_JE:           jit_je(o->s); break;
+  case IR_JNE:          jit_jne(o->s); break;
+  case IR_JNEG:         jit_jneg(o->s); break;
+#if defined(CPU_X64) || defined(CPU_ARM) || defined(CPU_ARM64)
+  case IR_JGE:          jit_jge(o->s); break;
+#endif
+#if defined(CPU_X64) || defined(CPU_ARM64)
+  case IR_JLT:          jit_jlt(o->s); break;
+  case IR_JLE:          jit_jle(o->s); break;
+  case IR_JGT:          jit_jgt(o->s); break;
+#endif
+#ifdef CPU_X64
+  case IR_CALL_REL:     jit_call_rel(o->b); break;
+  case IR_JMP_REL:      jit_jmp_rel(o->b); break;
+#endif
+#ifdef JIT_DIRECT_CALLS
+  case IR_CALL_ENV:     jit_call_env(o->p); break;
+  case IR_CALL_ENV_RAW: jit_call_env_raw(o->p, o->b); break;
+  case IR_JMP_ENV:      jit_jmp_env(o->p); break;
+#endif
+  case IR_RET:          jit_ret(); break;
+  default:
+    printf("<ir error: no lowering of %s>\r\n",ir_op_names[o->op]);
+  }
+}
+
+#define IR_ALL_REGS 0xffffffffu
+#define IR_REG(r) (1u<<(r))
+
+// the registers op reads, and those it surely writes. unknown ops read
+// all of them, which keeps every write before them.
+static void ir_regs(IrOp* o, unsigned int* reads, unsigned int* writes) {
+  int i;
+  *reads = 0;
+  *writes = 0;
+  switch (o->op) {
+  case IR_NOP: case IR_COMMENT:
+    return;
+  case IR_MOVI: case IR_LEA:
+    *writes = IR_REG(o->a);
+    return;
+  case IR_MOVR: case IR_MOVSX32:
+    *reads = IR_REG(o->b);
+    *writes = IR_REG(o->a);
+    return;
+  case IR_LDR_STACK:
+    *reads = IR_REG(RSP);
+    *writes = IR_REG(o->a);
+    return;
+  case IR_LDR: case IR_ADDI: case IR_NOTR:
+    *reads = IR_REG(o->a);
+    *writes = IR_REG(o->a);
+    return;
+  case IR_STR_STACK:
+    *reads = IR_REG(o->a)|IR_REG(RSP);
+    return;
+  case IR_CMPI:
+    *reads = IR_REG(o->a);
+    return;
+  case IR_CMPR:
+    *reads = IR_REG(o->a)|IR_REG(o->b);
+    return;
+  case IR_ADDR: case IR_SUBR: case IR_ANDR: case IR_ORR: case IR_XORR:
+  case IR_MOVNE: case IR_MOVEQ: case IR_MOVNEG:
+    *reads = IR_REG(o->a)|IR_REG(o->b);
+    *writes = IR_REG(o->a);
+    return;
+  case IR_PUSH:
+    for (i=o->a; i<=o->b; i++) *reads |= IR_REG(i);
+    *reads |= IR_REG(RSP);
+    return;
+  case IR_POP:
+    for (i=o->a; i<=o->b; i++) *writes |= IR_REG(i);
+    *reads = IR_REG(RSP);
+    return;
+  case IR_INC_STACK: case IR_DEC_STACK:
+    *reads = IR_REG(RSP);
+    return;
+  case IR_CALL: case IR_CALL2: case IR_CALL3: case IR_CALLR: case IR_CALL_REL:
+  case IR_CALL_ENV: case IR_CALL_ENV_RAW:
+    // the result
+    *writes = IR_REG(R0);
+    break;
+  }
+  *reads = IR_ALL_REGS;
+}
+
+// a write to a register that is overwritten before it is read. the
+// stack pointer and everything at the end of the block are live.
+static void ir_dead_writes(int from, int to) {
+  unsigned int live = IR_ALL_REGS;
+  unsigned int reads, writes;
+  IrOp* o;
+  int i;
+
+  for (i=to-1; i>=from; i--) {
+    o = &ir_ops[i];
+    ir_regs(o, &reads, &writes);
+    if ((o->op == IR_MOVI || o->op == IR_LEA || o->op == IR_MOVR || o->op == IR_MOVSX32 || o->op == IR_LDR_STACK)
+        && o->a != RSP && !(live & IR_REG(o->a))) {
+      o->op = IR_NOP;
+      ir_removed++;
+      continue;
+    }
+    live = (live & ~writes) | reads;
+  }
+}
+
+// runs the passes over the open block and lowers it
+static void ir_flush() {
+  int i;
+  ir_dead_writes(ir_block, ir_num);
+  for (i=ir_block; i<ir_num; i++) {
+    ir_emit(&ir_ops[i]);
+  }
+  ir_block = ir_num;
+}
+
+// the type of the last value written to reg in the open block
+static int ir_reg_type(int reg) {
+  unsigned int reads, writes;
+  int i;
+  for (i=ir_num-1; i>=ir_block; i--) {
+    ir_regs(&ir_ops[i], &reads, &writes);
+    if (writes & IR_REG(reg)) return ir_ops[i].type;
+    if (ir_ops[i].op >= IR_CALL && ir_ops[i].op <= IR_HOST_CALL_EXIT) break;
+  }
+  return IR_WORD;
+}
+
+static IrOp* ir_add(int op, int a, int b) {
+  IrOp* o;
+  if (ir_num >= ir_size) {
+    ir_size = ir_size ? ir_size*2 : 1024;
+    ir_ops = realloc(ir_ops, ir_size*sizeof(IrOp));
+  }
+  o = &ir_ops[ir_num++];
+  o->op = op;
+  o->a = a;
+  o->b = b;
+  o->type = IR_NONE;
+  o->v = 0;
+  o->p = NULL;
+  o->s = NULL;
+  return o;
+}
+
+// a label or branch to label
+static void ir_add_label(int op, char* label) {
+  if (op == IR_LABEL) ir_flush();
+  ir_add(op, 0, 0)->s = strdup(label);
+  if (op != IR_LABEL) ir_flush();
+}
+
+// marks the value the open block last wrote to reg as a raw int or a
+// boxed cell
+static void ir_type(int reg, int type) {
+  unsigned int reads, writes;
+  int i;
+  for (i=ir_num-1; i>=ir_block; i--) {
+    ir_regs(&ir_ops[i], &reads, &writes);
+    if (writes & IR_REG(reg)) {
+      ir_ops[i].type = type;
+      return;
+    }
+  }
+}
+
+void ir_push(int r1, int r2) { ir_add(IR_PUSH, r1, r2); }
+void ir_pop(int r1, int r2) { ir_add(IR_POP, r1, r2)->type = IR_WORD; }
+void ir_movr(int dreg, int sreg) {
+  int type = ir_reg_type(sreg);
+  ir_add(IR_MOVR, dreg, sreg)->type = type;
+}
+void ir_movsx32(int dreg, int sreg) { ir_add(IR_MOVSX32, dreg, sreg)->type = IR_INT; }
+void ir_movi(int reg, jit_word_t imm) {
+  IrOp* o = ir_add(IR_MOVI, reg, 0);
+  o->v = imm;
+  o->type = IR_INT;
+}
+void ir_lea(int reg, void* addr) {
+  IrOp* o = ir_add(IR_LEA, reg, 0);
+  o->p = addr;
+  o->type = is_heap_cell((Cell*)addr) ? IR_CELL : IR_WORD;
+}
+void ir_ldr(int reg) { ir_add(IR_LDR, reg, 0)->type = IR_WORD; }
+void ir_ldr_stack(int dreg, int offset) { ir_add(IR_LDR_STACK, dreg, offset)->type = IR_WORD; }
+void ir_str_stack(int sreg, int offset) { ir_add(IR_STR_STACK, sreg, offset); }
+void ir_inc_stack(int offset) { ir_add(IR_INC_STACK, RSP, offset); }
+void ir_dec_stack(int offset) { ir_add(IR_DEC_STACK, RSP, offset); }
+void ir_ldrb(int reg) { ir_add(IR_LDRB, reg, 0)->type = IR_INT; }
+void ir_ldrs(int reg) { ir_add(IR_LDRS, reg, 0)->type = IR_INT; }
+void ir_ldrw(int reg) { ir_add(IR_LDRW, reg, 0)->type = IR_INT; }
+void ir_strb(int reg) { ir_add(IR_STRB, reg, 0); }
+void ir_strs(int reg) { ir_add(IR_STRS, reg, 0); }
+void ir_strw(int reg) { ir_add(IR_STRW, reg, 0); }
+void ir_stra(int reg) { ir_add(IR_STRA, reg, 0); }
+void ir_addi(int dreg, int imm) {
+  int type = ir_reg_type(dreg);
+  ir_add(IR_ADDI, dreg, imm)->type = type;
+}
+void ir_addr(int dreg, int sreg) { ir_add(IR_ADDR, dreg, sreg)->type = IR_INT; }
+void ir_subr(int dreg, int sreg) { ir_add(IR_SUBR, dreg, sreg)->type = IR_INT; }
+void ir_mulr(int dreg, int sreg) { ir_add(IR_MULR, dreg, sreg)->type = IR_INT; }
+void ir_divr(int dreg, int sreg) { ir_add(IR_DIVR, dreg, sreg)->type = IR_INT; }
+void ir_modr(int dreg, int sreg) { ir_add(IR_MODR, dreg, sreg)->type = IR_INT; }
+void ir_andr(int dreg, int sreg) { ir_add(IR_ANDR, dreg, sreg)->type = IR_INT; }
+void ir_orr(int dreg, int sreg) { ir_add(IR_ORR, dreg, sreg)->type = IR_INT; }
+void ir_xorr(int dreg, int sreg) { ir_add(IR_XORR, dreg, sreg)->type = IR_INT; }
+void ir_notr(int dreg) { ir_add(IR_NOTR, dreg, 0)->type = IR_INT; }
+void ir_shlr(int dreg, int sreg) { ir_add(IR_SHLR, dreg, sreg)->type = IR_INT; }
+void ir_shrr(int dreg, int sreg) { ir_add(IR_SHRR, dreg, sreg)->type = IR_INT; }
+void ir_movne(int dreg, int sreg) { ir_add(IR_MOVNE, dreg, sreg)->type = IR_INT; }
+void ir_moveq(int dreg, int sreg) { ir_add(IR_MOVEQ, dreg, sreg)->type = IR_INT; }
+void ir_movneg(int dreg, int sreg) { ir_add(IR_MOVNEG, dreg, sreg)->type = IR_INT; }
+void ir_cmpi(int sreg, int imm) { ir_add(IR_CMPI, sreg, imm); }
+void ir_cmpr(int sreg, int dreg) { ir_add(IR_CMPR, sreg, dreg); }
+
+static void ir_add_call(int op, void* func, char* note) {
+  IrOp* o = ir_add(op, R0, 0);
+  o->p = func;
+  o->s = note;
+  o->type = IR_CELL;
+}
+void ir_call(void* func, char* note) { ir_add_call(IR_CALL, func, note); }
+void ir_call2(void* func, char* note) { ir_add_call(IR_CALL2, func, note); }
+void ir_call3(void* func, char* note) { ir_add_call(IR_CALL3, func, note); }
+void ir_callr(int reg) { ir_add(IR_CALLR, reg, 0)->type = IR_CELL; }
+void ir_call_rel(int32_t target) { ir_add(IR_CALL_REL, R0, target)->type = IR_WORD; }
+void ir_call_env(void* env) { ir_add_call(IR_CALL_ENV, env, NULL); }
+void ir_call_env_raw(void* env, int raw) {
+  IrOp* o = ir_add(IR_CALL_ENV_RAW, R0, raw);
+  o->p = env;
+  o->type = (raw & 1) ? IR_INT : IR_CELL; // RAW_RET, see rettype.c
+}
+void ir_host_call_enter() { ir_add(IR_HOST_CALL_ENTER, 0, 0); }
+void ir_host_call_exit() { ir_add(IR_HOST_CALL_EXIT, 0, 0); }
+
+void ir_label(char* label) { ir_add_label(IR_LABEL, label); }
+void ir_jmp(char* label) { ir_add_label(IR_JMP, label); }
+void ir_je(char* label) { ir_add_label(IR_JE, label); }
+void ir_jne(char* label) { ir_add_label(IR_JNE, label); }
+void ir_jge(char* label) { ir_add_label(IR_JGE, label); }
+void ir_jneg(char* label) { ir_add_label(IR_JNEG, label); }
+void ir_jlt(char* label) { ir_add_label(IR_JLT, label); }
+void ir_jle(char* label) { ir_add_label(IR_JLE, label); }
+void ir_jgt(char* label) { ir_add_label(IR_JGT, label); }
+void ir_jmp_rel(int32_t target) {
+  ir_add(IR_JMP_REL, 0, target);
+  ir_flush();
+}
+void ir_jmp_env(void* env) {
+  ir_add(IR_JMP_ENV, 0, 0)->p = env;
+  ir_flush();
+}
+void ir_ret() {
+  ir_add(IR_RET, 0, 0);
+  ir_flush();
+}
+void ir_comment(char* comment) { ir_add(IR_COMMENT, 0, 0)->s = comment; }
+
+void ir_dump(char* name) {
+  static char* types[] = {"", "", "int", "cell"};
+  IrOp* o;
+  int i, block = 0, open = 0;
+  char args[96];
+
+  printf("<ir %s: %d ops, %d removed>\r\n",name,ir_num,ir_removed);
+  for (i=0; i<ir_num; i++) {
+    o = &ir_ops[i];
+    if (o->op == IR_LABEL || !open) {
+      printf("B%d%s%s:\r\n",block++,o->op == IR_LABEL ? " " : "",o->op == IR_LABEL ? o->s : "");
+      open = 1;
+      if (o->op == IR_LABEL) continue;
+    }
+    args[0] = 0;
+    switch (o->op) {
+    case IR_NOP: continue;
+    case IR_PUSH: case IR_POP:
+      if (o->a == o->b) sprintf(args,"r%d",o->a);
+      else sprintf(args,"r%d..r%d",o->a,o->b);
+      break;
+    case IR_MOVR: case IR_MOVSX32: sprintf(args,"r%d <- r%d",o->a,o->b); break;
+    case IR_MOVI: sprintf(args,"r%d <- %ld",o->a,(long)o->v); break;
+    case IR_LEA: sprintf(args,"r%d <- %p",o->a,o->p); break;
+    case IR_LDR: case IR_LDRB: case IR_LDRS: case IR_LDRW:
+      sprintf(args,"r%d <- [r%d]",o->a,o->a);
+      break;
+    case IR_STRB: case IR_STRS: case IR_STRW: case IR_STRA:
+      sprintf(args,"[r%d]",o->a);
+      break;
+    case IR_LDR_STACK: sprintf(args,"r%d <- [sp+%d]",o->a,o->b); break;
+    case IR_STR_STACK: sprintf(args,"[sp+%d] <- r%d",o->b,o->a); break;
+    case IR_INC_STACK: case IR_DEC_STACK: case IR_CALL_REL: case IR_JMP_REL:
+      sprintf(args,"%d",o->b);
+      break;
+    case IR_ADDI: sprintf(args,"r%d <- r%d, %d",o->a,o->a,o->b); break;
+    case IR_CMPI: sprintf(args,"r%d, %d",o->a,o->b); break;
+    case IR_CALL: case IR_CALL2: case IR_CALL3:
+      sprintf(args,"%s",o->s ? o->s : "");
+      break;
+    case IR_CALL_ENV: case IR_JMP_ENV: case IR_CALL_ENV_RAW:
+      sprintf(args,"%s",((env_entry*)o->p)->name);
+      break;
+    case IR_COMMENT: sprintf(args,"%s",o->s); break;
+    default:
+      if (o->op >= IR_LABEL && o->op <= IR_JGT) sprintf(args,"%s",o->s);
+      else if (o->op == IR_CMPR) sprintf(args,"r%d, r%d",o->a,o->b);
+      else if (o->op >= IR_ADDR && o->op <= IR_MOVNEG && o->op != IR_NOTR) sprintf(args,"r%d <- r%d, r%d",o->a,o->a,o->b);
+      else if (o->op != IR_RET && o->op != IR_HOST_CALL_ENTER && o->op != IR_HOST_CALL_EXIT) sprintf(args,"r%d",o->a);
+    }
+    printf("  %-16s %-28s %s\r\n",ir_op_names[o->op],args,types[o->type]);
+    if ((o->op >= IR_JMP && o->op <= IR_RET)) open = 0;
+  }
+}
+
+#undef jit_push
+#define jit_push ir_push
+#undef jit_pop
+#define jit_pop ir_pop
+#undef jit_movr
+#define jit_movr ir_movr
+#undef jit_movsx32
+#define jit_movsx32 ir_movsx32
+#undef jit_movi
+#define jit_movi ir_movi
+#undef jit_lea
+#define jit_lea ir_lea
+#undef jit_ldr
+#define jit_ldr ir_ldr
+#undef jit_ldr_stack
+#define jit_ldr_stack ir_ldr_stack
+#undef jit_str_stack
+#define jit_str_stack ir_str_stack
+#undef jit_inc_stack
+#define jit_inc_stack ir_inc_stack
+#undef jit_dec_stack
+#define jit_dec_stack ir_dec_stack
+#undef jit_ldrb
+#define jit_ldrb ir_ldrb
+#undef jit_ldrs
+#define jit_ldrs ir_ldrs
+#undef jit_ldrw
+#define jit_ldrw ir_ldrw
+#undef jit_strb
+#define jit_strb ir_strb
+#undef jit_strs
+#define jit_strs ir_strs
+#undef jit_strw
+#define jit_strw ir_strw
+#undef jit_stra
+#define jit_stra ir_stra
+#undef jit_addi
+#define jit_addi ir_addi
+#undef jit_addr
+#define jit_addr ir_addr
+#undef jit_subr
+#define jit_subr ir_subr
+#undef jit_mulr
+#define jit_mulr ir_mulr
+#undef jit_divr
+#define jit_divr ir_divr
+#undef jit_modr
+#define jit_modr ir_modr
+#undef jit_andr
+#define jit_andr ir_andr
+#undef jit_orr
+#define jit_orr ir_orr
+#undef jit_xorr
+#define jit_xorr ir_xorr
+#undef jit_notr
+#define jit_notr ir_notr
+#undef jit_shlr
+#define jit_shlr ir_shlr
+#undef jit_shrr
+#define jit_shrr ir_shrr
+#undef jit_movne
+#define jit_movne ir_movne
+#undef jit_moveq
+#define jit_moveq ir_moveq
+#undef jit_movneg
+#define jit_movneg ir_movneg
+#undef jit_cmpi
+#define jit_cmpi ir_cmpi
+#undef jit_cmpr
+#define jit_cmpr ir_cmpr
+#undef jit_call
+#define jit_call ir_call
+#undef jit_call2
+#define jit_call2 ir_call2
+#undef jit_call3
+#define jit_call3 ir_call3
+#undef jit_callr
+#define jit_callr ir_callr
+#undef jit_call_rel
+#define jit_call_rel ir_call_rel
+#undef jit_call_env
+#define jit_call_env ir_call_env
+#undef jit_call_env_raw
+#define jit_call_env_raw ir_call_env_raw
+#undef jit_host_call_enter
+#define jit_host_call_enter ir_host_call_enter
+#undef jit_host_call_exit
+#define jit_host_call_exit ir_host_call_exit
+#undef jit_label
+#define jit_label ir_label
+#undef jit_jmp
+#define jit_jmp ir_jmp
+#undef jit_je
+#define jit_je ir_je
+#undef jit_jne
+#define jit_jne ir_jne
+#undef jit_jge
+#define jit_jge ir_jge
+#undef jit_jneg
+#define jit_jneg ir_jneg
+#undef jit_jlt
+#define jit_jlt ir_jlt
+#undef jit_jle
+#define jit_jle ir_jle
+#undef jit_jgt
+#define jit_jgt ir_jgt
+#undef jit_jmp_rel
+#define jit_jmp_rel ir_jmp_rel
+#undef jit_jmp_env
+#define jit_jmp_env ir_jmp_env
+#undef jit_ret
+#define jit_ret ir_ret
+#undef jit_comment
+#define jit_comment ir_comment
+#ifdef JIT_PEEPHOLE
+#undef jit_init
+#define jit_init(...) (ir_reset(), pp_reset(), jit_init(__VA_ARGS__))
+#else
+#define jit_init(...) (ir_reset(), jit_init(__VA_ARGS__))
+#endif
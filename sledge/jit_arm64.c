@@ -0,0 +1,660 @@
+#include <inttypes.h>
+
+char* regnames[] = {
+  "x0",
+  "x1",
+  "x2",
+  "x3",
+  "x19",
+  "x20",
+  "x21",
+  "x22",
+  "x23",
+  "x24",
+  "x25",
+  "x26",
+  "x28"
+};
+
+enum jit_reg {
+  R0 = 0,
+  R1,
+  R2,
+  R3,
+  R4,
+  R5,
+  R6,
+  R7,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+  R14,
+  R15
+};
+enum arg_reg {
+  ARGR0 = 0,
+  ARGR1 = 1,
+  ARGR2 = 2
+};
+
+// hardware register numbers for the names above
+uint8_t regi[] = {
+  0,  // x0
+  1,  // x1
+  2,  // x2
+  3,  // x3
+  19, // x19
+  20, // x20
+  21, // x21
+  22, // x22
+  23, // x23
+  24, // x24
+  25, // x25
+  26, // x26
+  28  // x28
+};
+
+#define RSP R12
+#define FRAME_REGS 8 // R4-R11 (x19-x26) hold the args and locals of a fn
+
+#define A64_IP0 16 // call target of a veneer
+#define A64_IP1 17 // immediates that don't fit an instruction
+#define A64_JSP 28 // the jit stack pointer
+#define A64_LR 30
+#define A64_SP 31  // as the base of a load or store, or add/and
+#define A64_ZR 31  // anywhere else
+
+#define A64_EQ 0x0
+#define A64_NE 0x1
+#define A64_MI 0x4
+#define A64_GE 0xa
+#define A64_LT 0xb
+#define A64_GT 0xc
+#define A64_LE 0xd
+
+// the jitted code works on a stack of its own in x28, that grows down
+// in 8 byte steps like the x64 one. sp has to stay 16 byte aligned, so
+// it is set to x28 rounded down whenever x28 goes down: c code called
+// from here, and signal handlers, only ever use memory below the jit
+// stack.
+//
+// calls to jitted code push their return address like x64 call does,
+// which keeps the frames the same for (gc). the callee returns to that
+// address and the caller pops it, so c functions wrapped in a lambda
+// can be called the same way. calls to the runtime are direct bl,
+// patched by jit_finish once the code has its place, or through a
+// veneer at the end of the code for runtime functions out of the reach
+// of bl (128MB). code is emitted into a growable scratch buffer and
+// copied into executable memory by jit_finish.
+static uint32_t* code = NULL;
+static uint32_t code_idx;
+static uint32_t code_size = 0;
+
+// labels by name, in a hash table with open addressing. branches to a
+// label that isn't placed yet wait in its list of fixups.
+typedef struct Arm64Label {
+  Label l;     // idx is -1 until the label is placed
+  int fixups;  // the first branch waiting for it, -1 if none
+} Arm64Label;
+
+typedef struct Fixup {
+  uint32_t idx;
+  int next;
+} Fixup;
+
+static Arm64Label* jit_labels = NULL;
+static int labels_size = 0; // a power of two
+static int label_idx = 0;   // names in the table
+static Fixup* fixups = NULL;
+static int fixups_num = 0;
+static int fixups_size = 0;
+
+// every bl to the runtime, linked by jit_finish
+typedef struct RuntimeCall {
+  uint32_t idx;
+  void* func;
+} RuntimeCall;
+
+static RuntimeCall* calls = NULL;
+static int calls_num = 0;
+static int calls_size = 0;
+
+static void jit_emit(uint32_t op) {
+  if (code_idx >= code_size) {
+    code_size = code_size ? code_size*2 : 1024;
+    code = realloc(code, code_size*4);
+  }
+  code[code_idx++] = op;
+}
+
+static void jit_labels_clear() {
+  int i;
+  for (i=0; i<labels_size; i++) {
+    if (jit_labels[i].l.name) free(jit_labels[i].l.name);
+    jit_labels[i].l.name = NULL;
+  }
+  label_idx = 0;
+}
+
+void jit_init() {
+  // cleans up jit state
+  jit_labels_clear();
+  fixups_num = 0;
+  calls_num = 0;
+  code_idx = 0;
+}
+
+// mov xd,#imm in as few movz/movn and movk as it takes
+static void jit_movi_hw(int hd, uint64_t imm) {
+  int i, ones = 0, zeros = 0, first = 1;
+  uint32_t fill, h;
+
+  for (i=0; i<4; i++) {
+    h = (imm>>(16*i))&0xffff;
+    if (h == 0xffff) ones++;
+    if (h == 0) zeros++;
+  }
+  fill = (ones>zeros) ? 0xffff : 0;
+  for (i=0; i<4; i++) {
+    h = (imm>>(16*i))&0xffff;
+    // 0 and -1 are a single movz or movn of halfword 0
+    if (h == fill && !(i == 0 && (ones == 4 || zeros == 4))) continue;
+    if (!first) {
+      jit_emit(0xf2800000 | (i<<21) | (h<<5) | hd); // movk
+    } else if (fill) {
+      jit_emit(0x92800000 | (i<<21) | ((~h&0xffff)<<5) | hd); // movn
+    } else {
+      jit_emit(0xd2800000 | (i<<21) | (h<<5) | hd); // movz
+    }
+    first = 0;
+  }
+}
+
+static void jit_movr_hw(int hd, int hs) {
+  if (hd == hs) return;
+  jit_emit(0xaa0003e0 | (hs<<16) | hd); // orr xd,xzr,xs
+}
+
+// add, adds, sub or subs (op is the one with an immediate) of a 64 bit
+// immediate
+static void jit_addsub_imm(uint32_t op, int hd, int hn, int64_t imm) {
+  if (imm<0) {
+    imm = -imm;
+    op ^= 0x40000000; // add <-> sub
+  }
+  if (imm < 0x1000) {
+    jit_emit(op | ((uint32_t)imm<<10) | (hn<<5) | hd);
+  } else if (!(imm&0xfff) && imm < 0x1000000) {
+    jit_emit(op | (1<<22) | ((uint32_t)(imm>>12)<<10) | (hn<<5) | hd); // lsl #12
+  } else {
+    jit_movi_hw(A64_IP1, imm);
+    op = (op & 0x60000000) | 0x8b000000; // the same with a register
+    jit_emit(op | (A64_IP1<<16) | (hn<<5) | hd);
+  }
+}
+
+// keeps sp below x28, see above
+static void jit_sp_sync() {
+  jit_emit(0x927cef9f); // and sp,x28,#~15
+}
+
+// 64 bit load or store of rt at x28+offset. uop is the one with an
+// unsigned scaled offset.
+static void jit_stack_mem(uint32_t uop, int rt, int offset) {
+  if (offset>=0 && offset < 0x8000 && !(offset&7)) {
+    jit_emit(uop | ((offset/8)<<10) | (A64_JSP<<5) | rt);
+  } else if (offset>=-256 && offset<256) {
+    jit_emit(((uop & 0xffc00000) ^ 0x01000000) | ((offset&0x1ff)<<12) | (A64_JSP<<5) | rt); // ldur/stur
+  } else {
+    jit_movi_hw(A64_IP1, offset);
+    jit_emit(((uop & 0xffc00000) ^ 0x01200000) | (A64_IP1<<16) | 0x6800 | (A64_JSP<<5) | rt); // [x28,x17]
+  }
+}
+
+void jit_movi(int reg, uint64_t imm) {
+  jit_movi_hw(regi[reg], imm);
+}
+
+void jit_movr(int dreg, int sreg) {
+  jit_movr_hw(regi[dreg], regi[sreg]);
+}
+
+// csel xd,xs,xd,cc
+static void jit_csel(int cc, int dreg, int sreg) {
+  if (dreg == sreg) return;
+  jit_emit(0x9a800000 | (regi[dreg]<<16) | (cc<<12) | (regi[sreg]<<5) | regi[dreg]);
+}
+
+void jit_movneg(int dreg, int sreg) {
+  jit_csel(A64_MI, dreg, sreg);
+}
+
+void jit_movne(int dreg, int sreg) {
+  jit_csel(A64_NE, dreg, sreg);
+}
+
+void jit_moveq(int dreg, int sreg) {
+  jit_csel(A64_EQ, dreg, sreg);
+}
+
+void jit_lea(int reg, void* addr) {
+  jit_movi_hw(regi[reg], (uint64_t)addr);
+}
+
+void jit_ldr(int reg) {
+  int hreg = regi[reg];
+  jit_emit(0xf9400000 | (hreg<<5) | hreg);
+}
+
+void jit_ldr_stack(int dreg, int offset) {
+  jit_stack_mem(0xf9400000, regi[dreg], offset);
+}
+
+void jit_str_stack(int sreg, int offset) {
+  jit_stack_mem(0xf9000000, regi[sreg], offset);
+}
+
+void jit_inc_stack(int offset) {
+  if (offset == 0) return;
+  jit_addsub_imm(0x91000000, A64_JSP, A64_JSP, offset);
+}
+
+void jit_dec_stack(int offset) {
+  if (offset == 0) return;
+  jit_addsub_imm(0x91000000, A64_JSP, A64_JSP, -offset);
+  jit_sp_sync();
+}
+
+// zero-extending load of (reg) into x3, copied to reg
+static void jit_ldr_zx(uint32_t op, int reg) {
+  jit_emit(op | (regi[reg]<<5) | 3);
+  if (reg!=3) {
+    jit_movr_hw(regi[reg], 3);
+  }
+}
+
+// clobbers x3!
+void jit_ldrb(int reg) {
+  jit_ldr_zx(0x39400000, reg); // ldrb w3,[reg]
+}
+
+// clobbers x3!
+void jit_ldrs(int reg) {
+  jit_ldr_zx(0x79400000, reg); // ldrh w3,[reg]
+}
+
+// clobbers x3!
+void jit_ldrw(int reg) {
+  jit_ldr_zx(0xb9400000, reg); // ldr w3,[reg]
+}
+
+// 8 bit only from x3!
+void jit_strb(int reg) {
+  jit_emit(0x39000000 | (regi[reg]<<5) | 3); // strb w3,[reg]
+}
+
+// 16 bit only from x3!
+void jit_strs(int reg) {
+  jit_emit(0x79000000 | (regi[reg]<<5) | 3); // strh w3,[reg]
+}
+
+// 32 bit only from x3!
+void jit_strw(int reg) {
+  jit_emit(0xb9000000 | (regi[reg]<<5) | 3); // str w3,[reg]
+}
+
+void jit_stra(int reg) {
+  jit_emit(0xf9000000 | (regi[reg]<<5) | 3); // str x3,[reg]
+}
+
+// op xd,xd,xs
+static void jit_op_rr(uint32_t op, int dreg, int sreg) {
+  jit_emit(op | (regi[sreg]<<16) | (regi[dreg]<<5) | regi[dreg]);
+}
+
+// like on x64, arithmetic sets the flags
+void jit_addr(int dreg, int sreg) {
+  jit_op_rr(0xab000000, dreg, sreg); // adds
+}
+
+void jit_addi(int dreg, int imm) {
+  jit_addsub_imm(0xb1000000, regi[dreg], regi[dreg], imm); // adds
+}
+
+void jit_andr(int dreg, int sreg) {
+  jit_op_rr(0xea000000, dreg, sreg); // ands
+}
+
+// dreg = the low 32 bits of sreg, sign extended, like an int that went
+// through alloc_int
+void jit_movsx32(int dreg, int sreg) {
+  jit_emit(0x93407c00 | (regi[sreg]<<5) | regi[dreg]); // sxtw xd,ws
+}
+
+void jit_notr(int dreg) {
+  jit_emit(0xaa2003e0 | (regi[dreg]<<16) | regi[dreg]); // orn xd,xzr,xd
+}
+
+void jit_orr(int dreg, int sreg) {
+  jit_op_rr(0xaa000000, dreg, sreg);
+}
+
+void jit_xorr(int dreg, int sreg) {
+  jit_op_rr(0xca000000, dreg, sreg); // eor
+}
+
+void jit_shrr(int dreg, int sreg) {
+  jit_op_rr(0x9ac02400, dreg, sreg); // lsrv
+}
+
+void jit_shlr(int dreg, int sreg) {
+  jit_op_rr(0x9ac02000, dreg, sreg); // lslv
+}
+
+void jit_subr(int dreg, int sreg) {
+  jit_op_rr(0xeb000000, dreg, sreg); // subs
+}
+
+void jit_mulr(int dreg, int sreg) {
+  jit_op_rr(0x9b007c00, dreg, sreg); // madd xd,xd,xs,xzr
+}
+
+void jit_divr(int dreg, int sreg) {
+  jit_op_rr(0x9ac00c00, dreg, sreg); // sdiv
+}
+
+void jit_modr(int dreg, int sreg) {
+  int hd = regi[dreg], hs = regi[sreg];
+  jit_emit(0x9ac00c00 | (hs<<16) | (hd<<5) | A64_IP1); // sdiv x17,xd,xs
+  jit_emit(0x9b008000 | (hs<<16) | (hd<<10) | (A64_IP1<<5) | hd); // msub xd,x17,xs,xd
+}
+
+// sp is aligned all the time, see jit_sp_sync
+void jit_host_call_enter() {
+}
+
+void jit_host_call_exit() {
+}
+
+// bl to a runtime function, linked by jit_finish
+void jit_call(void* func, char* note) {
+  if (calls_num >= calls_size) {
+    calls_size = calls_size ? calls_size*2 : 256;
+    calls = realloc(calls, calls_size*sizeof(RuntimeCall));
+  }
+  calls[calls_num].idx = code_idx;
+  calls[calls_num].func = func;
+  calls_num++;
+  jit_emit(0x94000000); // bl
+}
+
+#define jit_call2 jit_call
+#define jit_call3 jit_call
+
+// call of jitted code, or of a c function wrapped in a lambda
+void jit_callr(int reg) {
+  jit_emit(0x10000000 | (4<<5) | A64_LR); // adr x30, the add below
+  jit_emit(0xf81f8c00 | (A64_JSP<<5) | A64_LR); // str x30,[x28,#-8]!
+  jit_sp_sync();
+  jit_emit(0xd63f0000 | (regi[reg]<<5)); // blr
+  jit_emit(0x91002000 | (A64_JSP<<5) | A64_JSP); // add x28,x28,#8
+}
+
+void jit_cmpi(int sreg, int imm) {
+  jit_addsub_imm(0xf1000000, A64_ZR, regi[sreg], imm); // subs xzr
+}
+
+void jit_cmpr(int sreg, int dreg) {
+  jit_emit(0xeb000000 | (regi[dreg]<<16) | (regi[sreg]<<5) | A64_ZR); // subs xzr,xs,xd
+}
+
+static uint32_t label_hash(char* name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++) h = (h ^ (uint8_t)*name) * 16777619u;
+  return h;
+}
+
+// the entry of name, a free one for it if there is none
+static Arm64Label* label_slot(char* name) {
+  uint32_t i = label_hash(name) & (labels_size-1);
+  while (jit_labels[i].l.name && strcmp(jit_labels[i].l.name, name)) {
+    i = (i+1) & (labels_size-1);
+  }
+  return &jit_labels[i];
+}
+
+// the entry of name, added if there is none
+static Arm64Label* label_entry(char* name) {
+  Arm64Label* e;
+  int i;
+  if (2*(label_idx+1) > labels_size) {
+    // rehash into a table twice the size
+    Arm64Label* old = jit_labels;
+    int old_size = labels_size;
+    labels_size = labels_size ? labels_size*2 : 256;
+    jit_labels = calloc(labels_size, sizeof(Arm64Label));
+    for (i=0; i<old_size; i++) {
+      if (old[i].l.name) *label_slot(old[i].l.name) = old[i];
+    }
+    free(old);
+  }
+  e = label_slot(name);
+  if (!e->l.name) {
+    e->l.name = strdup(name);
+    e->l.idx = -1;
+    e->fixups = -1;
+    label_idx++;
+  }
+  return e;
+}
+
+Label* find_label(char* label) {
+  Arm64Label* e;
+  if (!labels_size) return NULL;
+  e = label_slot(label);
+  if (!e->l.name || e->l.idx<0) return NULL;
+  return &e->l;
+}
+
+// the word offset of the branch at idx to target, in the 26 bits of b
+// or the 19 bits of b.cond
+static uint32_t branch_offset(uint32_t idx, uint32_t target, char* label) {
+  int32_t offset = (int32_t)(target - idx);
+  if ((code[idx] & 0xfc000000) == 0x14000000) return offset&0x3ffffff;
+  if (offset < -0x40000 || offset > 0x3ffff) {
+    printf("<jit error: branch to %s out of range>\r\n",label);
+  }
+  return (offset&0x7ffff)<<5;
+}
+
+static void jit_emit_branch(uint32_t op, char* label) {
+  Arm64Label* e = label_entry(label);
+  jit_emit(op);
+  if (e->l.idx >= 0) {
+    code[code_idx-1] |= branch_offset(code_idx-1, e->l.idx, label);
+  } else {
+    // resolved by jit_label
+    if (fixups_num >= fixups_size) {
+      fixups_size = fixups_size ? fixups_size*2 : 256;
+      fixups = realloc(fixups, fixups_size*sizeof(Fixup));
+    }
+    fixups[fixups_num].idx = code_idx-1;
+    fixups[fixups_num].next = e->fixups;
+    e->fixups = fixups_num++;
+  }
+}
+
+void jit_je(char* label) {
+  jit_emit_branch(0x54000000 | A64_EQ, label);
+}
+
+void jit_jne(char* label) {
+  jit_emit_branch(0x54000000 | A64_NE, label);
+}
+
+void jit_jge(char* label) {
+  jit_emit_branch(0x54000000 | A64_GE, label);
+}
+
+void jit_jneg(char* label) {
+  jit_emit_branch(0x54000000 | A64_MI, label);
+}
+
+// signed compares, see cond.c
+void jit_jlt(char* label) {
+  jit_emit_branch(0x54000000 | A64_LT, label);
+}
+
+void jit_jle(char* label) {
+  jit_emit_branch(0x54000000 | A64_LE, label);
+}
+
+void jit_jgt(char* label) {
+  jit_emit_branch(0x54000000 | A64_GT, label);
+}
+
+void jit_jmp(char* label) {
+  jit_emit_branch(0x14000000, label); // b
+}
+
+void jit_label(char* label) {
+  Arm64Label* e = label_entry(label);
+  int f;
+
+  // like on x64, branches go to the first of labels with the same name
+  if (e->l.idx >= 0) return;
+  e->l.idx = code_idx;
+  for (f = e->fixups; f >= 0; f = fixups[f].next) {
+    code[fixups[f].idx] |= branch_offset(fixups[f].idx, code_idx, label);
+  }
+  e->fixups = -1;
+}
+
+// to the return address pushed by the caller, who pops it
+void jit_ret() {
+  jit_emit(0xf9400000 | (A64_JSP<<5) | A64_LR); // ldr x30,[x28]
+  jit_emit(0xd65f03c0); // ret
+}
+
+// the first register at the highest address, like x64 pushes
+void jit_push(int r1, int r2) {
+  int n = r2-r1+1, i;
+  if (n == 1) {
+    jit_emit(0xf81f8c00 | (A64_JSP<<5) | regi[r1]); // str xr,[x28,#-8]!
+  } else {
+    // stp r2,r2-1,[x28,#-8n]!
+    jit_emit(0xa9800000 | (((-n)&0x7f)<<15) | (regi[r2-1]<<10) | (A64_JSP<<5) | regi[r2]);
+    for (i=r2-2; i>=r1; i-=2) {
+      int offset = r2-i; // in words
+      if (i>r1) {
+        jit_emit(0xa9000000 | (offset<<15) | (regi[i-1]<<10) | (A64_JSP<<5) | regi[i]); // stp
+      } else {
+        jit_emit(0xf9000000 | (offset<<10) | (A64_JSP<<5) | regi[i]); // str
+      }
+    }
+  }
+  jit_sp_sync();
+}
+
+void jit_pop(int r1, int r2) {
+  int n = r2-r1+1, i;
+  if (n == 1) {
+    jit_emit(0xf8408400 | (A64_JSP<<5) | regi[r1]); // ldr xr,[x28],#8
+  } else {
+    for (i=r2-2; i>=r1; i-=2) {
+      int offset = r2-i;
+      if (i>r1) {
+        jit_emit(0xa9400000 | (offset<<15) | (regi[i-1]<<10) | (A64_JSP<<5) | regi[i]); // ldp
+      } else {
+        jit_emit(0xf9400000 | (offset<<10) | (A64_JSP<<5) | regi[i]); // ldr
+      }
+    }
+    // ldp r2,r2-1,[x28],#8n
+    jit_emit(0xa8c00000 | ((n&0x7f)<<15) | (regi[r2-1]<<10) | (A64_JSP<<5) | regi[r2]);
+  }
+}
+
+void jit_comment(char* comment) {
+}
+
+// copies the code into an executable blob, links the calls to the
+// runtime and points the lambdas compiled into it at their code
+void* jit_finish() {
+  uint32_t* binary;
+  uint32_t veneers, end;
+  int i;
+
+  // room for a veneer per call, the unused part is given back
+  veneers = (code_idx+1)&~1;
+  binary = code_alloc((veneers + 4*calls_num)*4);
+  if (!binary) return NULL;
+  memcpy(binary, code, code_idx*4);
+  if (veneers>code_idx) binary[code_idx] = 0xd503201f; // nop
+  end = veneers;
+
+  for (i=0; i<calls_num; i++) {
+    uint32_t idx = calls[i].idx;
+    int64_t offset = ((int64_t)calls[i].func - (int64_t)&binary[idx])/4;
+    if (offset < -0x2000000 || offset > 0x1ffffff) {
+      // ldr x16,#8; br x16; .quad func
+      uint32_t v;
+      for (v=veneers; v<end && memcmp(&binary[v+2], &calls[i].func, 8); v+=4);
+      if (v == end) {
+        binary[v] = 0x58000040 | A64_IP0;
+        binary[v+1] = 0xd61f0000 | (A64_IP0<<5);
+        memcpy(&binary[v+2], &calls[i].func, 8);
+        end += 4;
+      }
+      offset = (int64_t)v - idx;
+    }
+    binary[idx] |= offset&0x3ffffff;
+  }
+  code_shrink(binary, end*4);
+
+  for (i=0; i<labels_size; i++) {
+    char* name = jit_labels[i].l.name;
+    if (name && jit_labels[i].l.idx >= 0 && !strncmp(name,"L0_",3)) {
+      Cell* lambda = (Cell*)strtoul(&name[3], NULL, 16);
+      lambda->dr.next = binary + jit_labels[i].l.idx;
+    }
+  }
+  return binary;
+}
+
+void debug_handler(char* line, Frame* frame) {
+  printf("@ %s\r\n",line);
+
+  if (debug_mode==2 && frame) {
+    if (frame->f) {
+      for (int i=0; i<MAXFRAME; i++) {
+        char* typestr = "UNKNOWN";
+        Arg a = frame->f[i];
+
+        if (a.type) {
+          switch (a.type) {
+          case ARGT_CONST: typestr = "CONST"; break;
+          case ARGT_ENV: typestr = "ENV"; break;
+          case ARGT_LAMBDA: typestr = "LAMBDA"; break;
+          case ARGT_REG: {
+            char buf[10];
+            sprintf(buf,"R%d(%s)",a.slot,regnames[a.slot]);
+            typestr = buf;
+            break;
+          }
+          case ARGT_REG_INT: typestr = "INT"; break;
+          case ARGT_STACK: typestr = "STACK"; break;
+          case ARGT_STACK_INT: typestr = "STACK_INT"; break;
+          case ARGT_IMM: typestr = "IMM"; break;
+          }
+
+          printf("  %2d\t%s\t%s\t%d\r\n",i,a.name,typestr,a.slot);
+        }
+      }
+    } else {
+      //printf("  empty frame\r\n");
+    }
+  }
+}
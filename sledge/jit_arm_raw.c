@@ -25,16 +25,48 @@ enum arg_reg {
 };
 
 #define RSP R13
-
-static uint32_t* code;
+#define FRAME_REGS 7 // R4-R10 hold the args and locals of a fn
+
+// code is emitted into a growable scratch buffer and copied into
+// executable memory by jit_finish. constants are loaded pc-relative
+// from literal pools placed in the code itself: after an unconditional
+// jmp or ret, or behind a branch when the oldest pending load would be
+// out of the reach of ldr (4095 bytes).
+static uint32_t* code = NULL;
 static uint32_t code_idx;
-static uint32_t cpool_idx; // constant pool
-
-#define JIT_MAX_LABELS 32
-static int label_idx = 0;
-static Label jit_labels[JIT_MAX_LABELS];
-static Label jit_labels_unres[JIT_MAX_LABELS]; // unresolved (forward) labels
-static int unres_labels = 0;
+static uint32_t code_size = 0;
+
+#define POOL_REACH 1023 // words that ldr rd,[pc,#imm12] reaches past pc
+#define POOL_MARGIN 16  // for sequences emitted with the pool held
+
+typedef struct Literal {
+  uint32_t idx;   // the ldr that loads it
+  uint32_t value;
+} Literal;
+
+static Literal* pool = NULL;
+static int pool_num = 0;
+static int pool_size = 0;
+static int pool_hold = 0; // > 0 while a pool would break a sequence
+
+// labels by name, in a hash table with open addressing. branches to a
+// label that isn't placed yet wait in its list of fixups.
+typedef struct ArmLabel {
+  Label l;     // idx is -1 until the label is placed
+  int fixups;  // the first branch waiting for it, -1 if none
+} ArmLabel;
+
+typedef struct Fixup {
+  uint32_t idx;
+  int next;
+} Fixup;
+
+static ArmLabel* jit_labels = NULL;
+static int labels_size = 0; // a power of two
+static int label_idx = 0;   // names in the table
+static Fixup* fixups = NULL;
+static int fixups_num = 0;
+static int fixups_size = 0;
 
 /*
 
@@ -50,36 +82,78 @@ static int unres_labels = 0;
 
  */
 
-void jit_init(int gap) {
-  // cleans up jit state
+static void jit_word(uint32_t w) {
+  if (code_idx >= code_size) {
+    code_size = code_size ? code_size*2 : 1024;
+    code = realloc(code, code_size*4);
+  }
+  code[code_idx++] = w;
+}
+
+// places the pending constants here, with a branch around them if
+// execution can get here
+static void jit_pool_flush(int branch) {
+  uint32_t start, over = code_idx;
+  int i, j;
+
+  if (!pool_num) return;
+  if (branch) jit_word(0xea000000); // b, patched below
+  start = code_idx;
+  for (i=0; i<pool_num; i++) {
+    // equal constants share a word
+    for (j=start; j<code_idx && code[j] != pool[i].value; j++);
+    if (j == code_idx) jit_word(pool[i].value);
+    code[pool[i].idx] |= (j - pool[i].idx - 2)*4;
+  }
+  if (branch) code[over] |= (code_idx - over - 2)&0xffffff;
+  pool_num = 0;
+}
+
+// flushes the pool before the oldest pending load loses it
+static void jit_pool_check() {
+  if (pool_num && !pool_hold
+      && code_idx + pool_num + POOL_MARGIN - pool[0].idx >= POOL_REACH) {
+    jit_pool_flush(1);
+  }
+}
+
+static void jit_emit(uint32_t op) {
+  jit_pool_check();
+  jit_word(op);
+}
+
+static void jit_labels_clear() {
+  int i;
+  for (i=0; i<labels_size; i++) {
+    if (jit_labels[i].l.name) free(jit_labels[i].l.name);
+    jit_labels[i].l.name = NULL;
+  }
   label_idx = 0;
-  unres_labels = 0;
+}
+
+void jit_init() {
+  // cleans up jit state
+  jit_labels_clear();
+  fixups_num = 0;
   code_idx = 0;
-  cpool_idx = gap;
-  for (int i=0; i<JIT_MAX_LABELS; i++) {
-    if (jit_labels[i].name) free(jit_labels[i].name);
-    jit_labels[i].name = NULL;
-    jit_labels[i].idx = 0;
-    if (jit_labels_unres[i].name) free(jit_labels_unres[i].name);
-    jit_labels_unres[i].name = NULL;
-    jit_labels_unres[i].idx = 0;
-  }
+  pool_num = 0;
+  pool_hold = 0;
 }
 
 void jit_movi(int reg, uint32_t imm) {
-  // load from constant pool
-  // template: 0b11000101100100000000000000000000
-  // 0x5900000
+  // ldr rd,[pc,#offset], the offset is filled in with the pool
   uint32_t op = 0xe5900000;
   op |= (15<<16); // base reg = pc
   op |= (reg<<12); // dreg
-  op |= ((cpool_idx-code_idx-2)*4);
-  *(code+cpool_idx) = imm; // store in constant pool
-
-  cpool_idx++;
+  jit_emit(op);
 
-  code[code_idx] = op;
-  code_idx++;
+  if (pool_num >= pool_size) {
+    pool_size = pool_size ? pool_size*2 : 64;
+    pool = realloc(pool, pool_size*sizeof(Literal));
+  }
+  pool[pool_num].idx = code_idx-1;
+  pool[pool_num].value = imm;
+  pool_num++;
 }
 
 void jit_movr(int dreg, int sreg) {
@@ -87,7 +161,7 @@ void jit_movr(int dreg, int sreg) {
   op |= (sreg<<0);
   op |= (dreg<<12);
   
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_movneg(int dreg, int sreg) {  
@@ -95,7 +169,7 @@ void jit_movneg(int dreg, int sreg) {
   op |= (sreg<<0); // base reg = pc
   op |= (dreg<<12); // dreg
   
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_movne(int dreg, int sreg) {
@@ -103,7 +177,7 @@ void jit_movne(int dreg, int sreg) {
   op |= (sreg<<0); // base reg = pc
   op |= (dreg<<12); // dreg
   
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_moveq(int dreg, int sreg) {
@@ -111,7 +185,7 @@ void jit_moveq(int dreg, int sreg) {
   op |= (sreg<<0); // base reg = pc
   op |= (dreg<<12); // dreg
   
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_lea(int reg, void* addr) {
@@ -122,7 +196,7 @@ void jit_ldr(int reg) {
   uint32_t op = 0xe5900000;
   op |= (reg<<16); // base reg = pc
   op |= (reg<<12); // dreg
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_ldr_stack(int dreg, int offset) {
@@ -133,7 +207,7 @@ void jit_ldr_stack(int dreg, int offset) {
   }
   op |= (offset)&0xfff;
   op |= (dreg<<12); // dreg
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_str_stack(int sreg, int offset) {
@@ -144,19 +218,19 @@ void jit_str_stack(int sreg, int offset) {
   }
   op |= (offset)&0xfff;
   op |= (sreg<<12); // dreg
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_inc_stack(int offset) {
   uint32_t op = 0xe28dd000;
   op |= (offset)&0xfff;
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_dec_stack(int offset) {
   uint32_t op = 0xe24dd000;
   op |= (offset)&0xfff;
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_ldrw(int reg) {
@@ -169,7 +243,7 @@ void jit_ldrb(int reg) {
   op |= 1<<22; // byte access
   op |= (reg<<16); // r3
   op |= (3<<12); // dreg
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 // 8 bit only from rdx! (R3)
@@ -178,7 +252,7 @@ void jit_ldrs(int reg) {
   op |= 1<<22; // byte access
   op |= (reg<<16); // r3
   op |= (3<<12); // dreg
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 // 8 bit only from rdx! (R3)
@@ -187,7 +261,7 @@ void jit_strb(int reg) {
   op |= 1<<22; // byte access
   op |= (reg<<16); // r3
   op |= (3<<12); // dreg
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 // 16 bit only from rdx! (R3)
@@ -196,7 +270,7 @@ void jit_strs(int reg) {
   op |= 1<<22; // byte access
   op |= (reg<<16); // r3
   op |= (3<<12); // dreg
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 // 32 bit only from rdx!
@@ -204,7 +278,7 @@ void jit_strw(int reg) {
   uint32_t op = 0xe5800000;
   op |= (reg<<16); // r3
   op |= (3<<12); // dreg
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 #define jit_stra jit_strw
@@ -214,7 +288,7 @@ void jit_addr(int dreg, int sreg) {
   op |= (sreg<<0);
   op |= (dreg<<12);
   op |= (dreg<<16);
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_addi(int dreg, int imm) {
@@ -227,7 +301,7 @@ void jit_subr(int dreg, int sreg) {
   op |= (sreg<<0);
   op |= (dreg<<12);
   op |= (dreg<<16);
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_mulr(int dreg, int sreg) {
@@ -235,7 +309,7 @@ void jit_mulr(int dreg, int sreg) {
   op |= (sreg<<8);
   op |= (dreg<<0);
   op |= (dreg<<16);
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_andr(int dreg, int sreg) {
@@ -243,14 +317,19 @@ void jit_andr(int dreg, int sreg) {
   op |= (sreg<<0);
   op |= (dreg<<12);
   op |= (dreg<<16);
-  code[code_idx++] = op;
+  jit_emit(op);
+}
+
+// words are 32 bits already
+void jit_movsx32(int dreg, int sreg) {
+  jit_movr(dreg, sreg);
 }
 
 void jit_notr(int dreg) {
   uint32_t op = 0xe1e00000;
   op |= (dreg<<0);
   op |= (dreg<<12);
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_orr(int dreg, int sreg) {
@@ -258,7 +337,7 @@ void jit_orr(int dreg, int sreg) {
   op |= (sreg<<0);
   op |= (dreg<<12);
   op |= (dreg<<16);
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_xorr(int dreg, int sreg) {
@@ -266,7 +345,7 @@ void jit_xorr(int dreg, int sreg) {
   op |= (sreg<<0);
   op |= (dreg<<12);
   op |= (dreg<<16);
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_shlr(int dreg, int sreg) {
@@ -274,7 +353,7 @@ void jit_shlr(int dreg, int sreg) {
   op |= (sreg<<8);
   op |= (dreg<<12);
   op |= (dreg<<0);
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_shrr(int dreg, int sreg) {
@@ -282,24 +361,29 @@ void jit_shrr(int dreg, int sreg) {
   op |= (sreg<<8);
   op |= (dreg<<12);
   op |= (dreg<<0);
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_call(void* func, char* note) {
-  code[code_idx++] = 0xe92d4000; // stmfd	sp!, {lr}
+  jit_emit(0xe92d4000); // stmfd	sp!, {lr}
+  // lr is pc+8, the instruction after the next one
+  pool_hold++;
   jit_movr(14,15);
   jit_lea(15,func);
-  code[code_idx++] = 0xe8bd4000; // ldmfd	sp!, {lr}
+  pool_hold--;
+  jit_emit(0xe8bd4000); // ldmfd	sp!, {lr}
 }
 
 #define jit_call2 jit_call
 #define jit_call3 jit_call
 
 void jit_callr(int reg) {
-  code[code_idx++] = 0xe92d4000; // stmfd	sp!, {lr}
+  jit_emit(0xe92d4000); // stmfd	sp!, {lr}
+  pool_hold++;
   jit_movr(14,15);
   jit_movr(15,reg);
-  code[code_idx++] = 0xe8bd4000; // ldmfd	sp!, {lr}
+  pool_hold--;
+  jit_emit(0xe8bd4000); // ldmfd	sp!, {lr}
 }
 
 int32_t inline_div(int32_t a, int32_t b) {
@@ -328,57 +412,88 @@ void jit_cmpr(int sreg, int dreg) {
   uint32_t op = 0xe1500000;
   op|=(sreg<<0);
   op|=(dreg<<16);
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_cmpi(int sreg, int imm) {
   uint32_t op = 0xe3500000;
   op|=imm&0xffff; // TODO double check
   op|=(sreg<<16);
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
-Label* find_label(char* label) {
-  for (int i=0; i<label_idx; i++) {
-    if (jit_labels[i].name) {
-      //printf("find_label %s label vs %s\r\n",label,jit_labels[i].name);
-    }
-    if (jit_labels[i].name && (strcmp(jit_labels[i].name,label)==0)) {
-      return &jit_labels[i];
+static uint32_t label_hash(char* name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++) h = (h ^ (uint8_t)*name) * 16777619u;
+  return h;
+}
+
+// the entry of name, a free one for it if there is none
+static ArmLabel* label_slot(char* name) {
+  uint32_t i = label_hash(name) & (labels_size-1);
+  while (jit_labels[i].l.name && strcmp(jit_labels[i].l.name, name)) {
+    i = (i+1) & (labels_size-1);
+  }
+  return &jit_labels[i];
+}
+
+// the entry of name, added if there is none
+static ArmLabel* label_entry(char* name) {
+  ArmLabel* e;
+  int i;
+  if (2*(label_idx+1) > labels_size) {
+    // rehash into a table twice the size
+    ArmLabel* old = jit_labels;
+    int old_size = labels_size;
+    labels_size = labels_size ? labels_size*2 : 256;
+    jit_labels = calloc(labels_size, sizeof(ArmLabel));
+    for (i=0; i<old_size; i++) {
+      if (old[i].l.name) *label_slot(old[i].l.name) = old[i];
     }
+    free(old);
   }
-  return NULL;
+  e = label_slot(name);
+  if (!e->l.name) {
+    e->l.name = strdup(name);
+    e->l.idx = -1;
+    e->fixups = -1;
+    label_idx++;
+  }
+  return e;
 }
 
-Label* find_unresolved_label(char* label) {
-  for (int i=0; i<unres_labels; i++) {
-    if (jit_labels_unres[i].name) {
-      //printf("find_unres_label %s label vs %s\r\n",label,jit_labels_unres[i].name);
-    }
-    if (jit_labels_unres[i].name && (strcmp(jit_labels_unres[i].name,label)==0)) {
-      return &jit_labels_unres[i];
-    }
+Label* find_label(char* label) {
+  ArmLabel* e;
+  if (!labels_size) return NULL;
+  e = label_slot(label);
+  if (!e->l.name || e->l.idx<0) return NULL;
+  return &e->l;
+}
+
+// the word offset of a branch at idx to target, in the 24 bits of b
+static uint32_t branch_offset(uint32_t idx, uint32_t target, char* label) {
+  int32_t offset = (int32_t)(target - idx) - 2;
+  if (offset < -0x800000 || offset > 0x7fffff) {
+    printf("<jit error: branch to %s out of range>\r\n",label);
   }
-  return NULL;
+  return offset&0xffffff;
 }
 
 void jit_emit_branch(uint32_t op, char* label) {
-  Label* lbl = find_label(label);
-  if (lbl) {
-    int offset = (lbl->idx - code_idx) - 2;
-    //printf("offset to %s: %d (*4)\r\n",label,offset);
-    if (offset<0) {
-      offset = 0x1000000-(-offset);
-      op|=offset;
-      code[code_idx++] = op;
-    }
+  ArmLabel* e = label_entry(label);
+  jit_pool_check();
+  if (e->l.idx >= 0) {
+    jit_word(op | branch_offset(code_idx, e->l.idx, label));
   } else {
-    //printf("! label not found %s, adding unresolved.\r\n",label);
-    jit_labels_unres[unres_labels].name = strdup(label);
-    jit_labels_unres[unres_labels].idx  = code_idx;
-    code[code_idx++] = op;
-    
-    unres_labels++;
+    // resolved by jit_label
+    jit_word(op);
+    if (fixups_num >= fixups_size) {
+      fixups_size = fixups_size ? fixups_size*2 : 256;
+      fixups = realloc(fixups, fixups_size*sizeof(Fixup));
+    }
+    fixups[fixups_num].idx = code_idx-1;
+    fixups[fixups_num].next = e->fixups;
+    e->fixups = fixups_num++;
   }
 }
 
@@ -403,30 +518,27 @@ void jit_jneg(char* label) {
 }
 
 void jit_jmp(char* label) {
-  //printf("jmp to label: %s\r\n",label);
   uint32_t op = 0xea000000; // b
   jit_emit_branch(op, label);
+  jit_pool_flush(0);
 }
 
 void jit_label(char* label) {
-  jit_labels[label_idx].name = strdup(label);
-  jit_labels[label_idx].idx = code_idx;
-
-  Label* unres_lbl = NULL;
-  while ((unres_lbl = find_unresolved_label(label))) {
-    //printf("! forward label to %s at idx %d resolved.\r\n",label,unres_lbl->idx);
-    code[unres_lbl->idx] |= (code_idx - unres_lbl->idx) - 2;
-
-    free(unres_lbl->name);
-    unres_lbl->name = NULL;
-    unres_lbl->idx  = 0;
+  ArmLabel* e = label_entry(label);
+  int f;
+
+  // like on x64, branches go to the first of labels with the same name
+  if (e->l.idx >= 0) return;
+  e->l.idx = code_idx;
+  for (f = e->fixups; f >= 0; f = fixups[f].next) {
+    code[fixups[f].idx] |= branch_offset(fixups[f].idx, code_idx, label);
   }
-  
-  label_idx++;
+  e->fixups = -1;
 }
 
 void jit_ret() {
   jit_movr(15,14); // lr -> pc
+  jit_pool_flush(0);
 }
 
 void jit_push(int r1, int r2) {
@@ -435,7 +547,7 @@ void jit_push(int r1, int r2) {
   for (int i=r1; i<=r2; i++) {
     op |= (1<<i); // build bit pattern of registers to push
   }
-  code[code_idx++] = op;
+  jit_emit(op);
 }
 
 void jit_pop(int r1, int r2) {
@@ -444,7 +556,7 @@ void jit_pop(int r1, int r2) {
   for (int i=r1; i<=r2; i++) {
     op |= (1<<i); // build bit pattern of registers to pop
   }
-  code[code_idx++] = op; 
+  jit_emit(op); 
 }
 
 // do any needed stack alignment etc. here for host ABI
@@ -456,6 +568,27 @@ void jit_host_call_exit() {
 void jit_comment(char* comment) {
 }
 
+// copies the code into an executable blob and points the lambdas
+// compiled into it at their code
+void* jit_finish() {
+  uint32_t* binary;
+  int i;
+
+  jit_pool_flush(0);
+  binary = code_alloc(code_idx*4);
+  if (!binary) return NULL;
+  memcpy(binary, code, code_idx*4);
+
+  for (i=0; i<labels_size; i++) {
+    char* name = jit_labels[i].l.name;
+    if (name && jit_labels[i].l.idx >= 0 && !strncmp(name,"L0_",3)) {
+      Cell* lambda = (Cell*)strtoul(&name[3], NULL, 16);
+      lambda->dr.next = binary + jit_labels[i].l.idx;
+    }
+  }
+  return binary;
+}
+
 void debug_handler() {
   // NYI
 }
@@ -226,6 +226,11 @@ void jit_andr(int dreg, int sreg) {
   code[code_idx++] = 0x80|regi[sreg];
 }
 
+// words are 32 bits already
+void jit_movsx32(int dreg, int sreg) {
+  jit_movr(dreg, sreg);
+}
+
 void jit_notr(int dreg) {
   code[code_idx++] = 0x46;
   code[code_idx++] = 0x80|regi[dreg];
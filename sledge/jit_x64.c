@@ -32,7 +32,7 @@ enum jit_reg {
   R12,
   R13,
   R14,
-  R15 
+  R15
 };
 enum arg_reg {
   ARGR0 = 1,
@@ -40,181 +40,534 @@ enum arg_reg {
   ARGR2 = 3
 };
 
+// hardware register numbers for the names above
+uint8_t regi[] = {
+  0,  // rax
+  7,  // rdi
+  6,  // rsi
+  2,  // rdx
+  12, // r12
+  13, // r13
+  14, // r14
+  15, // r15
+  8,  // r8
+  9,  // r9
+  10, // r10
+  11, // r11
+  4   // rsp
+};
+
 #define RSP R12
+#define FRAME_REGS 4 // R4-R7 (r12-r15) hold the args and locals of a fn
+
+#define X64_RAX 0
+#define X64_RCX 1
+#define X64_RDX 2
+#define X64_RSP 4
+
+// code is emitted into a growable scratch buffer and copied
+// into executable memory by compile_for_platform.
+static uint8_t* code = NULL;
+static uint32_t code_idx;
+static uint32_t code_size = 0;
+
+// labels by name, in a hash table with open addressing. branches to a
+// label that isn't placed yet wait in its list of fixups.
+typedef struct X64Label {
+  Label l;     // idx is -1 until the label is placed
+  int fixups;  // the first branch waiting for it, -1 if none
+} X64Label;
+
+typedef struct Fixup {
+  uint32_t idx;
+  int next;
+} Fixup;
+
+static X64Label* jit_labels = NULL;
+static int labels_size = 0; // a power of two
+static int label_idx = 0;   // names in the table
+static Fixup* fixups = NULL;
+static int fixups_num = 0;
+static int fixups_size = 0;
+
+// every absolute address embedded in the code (see jit_lea),
+// so that a blob can be relocated by the compiled-code cache
+typedef struct Reloc {
+  uint32_t idx;
+  jit_word_t value;
+} Reloc;
+
+static Reloc* jit_relocs = NULL;
+static int reloc_idx = 0;
+static int reloc_size = 0;
+
+static void jit_labels_clear() {
+  int i;
+  for (i=0; i<labels_size; i++) {
+    if (jit_labels[i].l.name) free(jit_labels[i].l.name);
+    jit_labels[i].l.name = NULL;
+  }
+  label_idx = 0;
+}
 
 void jit_init() {
+  // cleans up jit state
+  jit_labels_clear();
+  fixups_num = 0;
+  code_idx = 0;
+  reloc_idx = 0;
+
+  if (!code) {
+    code_size = 4096;
+    code = malloc(code_size);
+  }
+}
+
+static void jit_emit(uint8_t b) {
+  if (code_idx >= code_size) {
+    code_size *= 2;
+    code = realloc(code, code_size);
+  }
+  code[code_idx++] = b;
+}
+
+static void jit_imm(uint32_t imm) {
+  jit_emit(imm&0xff); imm>>=8;
+  jit_emit(imm&0xff); imm>>=8;
+  jit_emit(imm&0xff); imm>>=8;
+  jit_emit(imm&0xff);
+}
+
+static void jit_imm64(uint64_t imm) {
+  jit_imm(imm&0xffffffff);
+  jit_imm(imm>>32);
+}
+
+static int fits_int8(int64_t v) {
+  return v >= -128 && v <= 127;
+}
+
+static int fits_int32(int64_t v) {
+  return v == (int64_t)(int32_t)v;
+}
+
+// REX prefix for a 64 bit operation with hardware regs r (ModRM.reg) and b (ModRM.rm)
+static void jit_rex(int w, int r, int b) {
+  uint8_t rex = 0x40 | (w<<3) | ((r>>3)<<2) | (b>>3);
+  if (rex != 0x40) jit_emit(rex);
+}
+
+// ModRM register-direct
+static void jit_modrm_rr(int r, int b) {
+  jit_emit(0xc0 | ((r&7)<<3) | (b&7));
+}
+
+// ModRM memory operand [base+disp]
+static void jit_modrm_mem(int r, int base, int32_t disp) {
+  int mod = 0;
+  if (disp != 0 || (base&7) == 5) { // rbp/r13 base needs a displacement
+    mod = fits_int8(disp) ? 1 : 2;
+  }
+  jit_emit((mod<<6) | ((r&7)<<3) | (base&7));
+  if ((base&7) == X64_RSP) jit_emit(0x24); // SIB for rsp/r12 base
+  if (mod == 1) jit_emit((uint8_t)disp);
+  else if (mod == 2) jit_imm(disp);
+}
+
+// op r/m64, r64 (reg-direct)
+static void jit_op_rr(uint8_t op, int rm, int r) {
+  jit_rex(1, r, rm);
+  jit_emit(op);
+  jit_modrm_rr(r, rm);
+}
+
+// group-1 arithmetic with immediate: /ext selects add(0), or(1), and(4), sub(5), xor(6), cmp(7)
+static void jit_op_ri(int ext, int hreg, int64_t imm) {
+  jit_rex(1, 0, hreg);
+  if (fits_int8(imm)) {
+    jit_emit(0x83);
+    jit_modrm_rr(ext, hreg);
+    jit_emit((uint8_t)imm);
+  } else {
+    jit_emit(0x81);
+    jit_modrm_rr(ext, hreg);
+    jit_imm((uint32_t)imm);
+  }
+}
+
+static void jit_movr_hw(int dhreg, int shreg) {
+  if (dhreg == shreg) return;
+  jit_op_rr(0x89, dhreg, shreg);
+}
+
+static uint32_t label_hash(char* name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++) h = (h ^ (uint8_t)*name) * 16777619u;
+  return h;
+}
+
+// the entry of name, a free one for it if there is none
+static X64Label* label_slot(char* name) {
+  uint32_t i = label_hash(name) & (labels_size-1);
+  while (jit_labels[i].l.name && strcmp(jit_labels[i].l.name, name)) {
+    i = (i+1) & (labels_size-1);
+  }
+  return &jit_labels[i];
+}
+
+// the entry of name, added if there is none
+static X64Label* label_entry(char* name) {
+  X64Label* e;
+  int i;
+  if (2*(label_idx+1) > labels_size) {
+    // rehash into a table twice the size
+    X64Label* old = jit_labels;
+    int old_size = labels_size;
+    labels_size = labels_size ? labels_size*2 : 256;
+    jit_labels = calloc(labels_size, sizeof(X64Label));
+    for (i=0; i<old_size; i++) {
+      if (old[i].l.name) *label_slot(old[i].l.name) = old[i];
+    }
+    free(old);
+  }
+  e = label_slot(name);
+  if (!e->l.name) {
+    e->l.name = strdup(name);
+    e->l.idx = -1;
+    e->fixups = -1;
+    label_idx++;
+  }
+  return e;
+}
+
+Label* find_label(char* label) {
+  X64Label* e;
+  if (!labels_size) return NULL;
+  e = label_slot(label);
+  if (!e->l.name || e->l.idx<0) return NULL;
+  return &e->l;
+}
+
+// emits a rel32 branch displacement to label
+void jit_emit_branch(char* label) {
+  X64Label* e = label_entry(label);
+  if (e->l.idx >= 0) {
+    int32_t offset = e->l.idx - (code_idx + 4);
+    jit_imm(offset);
+  } else {
+    // resolved by jit_label
+    if (fixups_num >= fixups_size) {
+      fixups_size = fixups_size ? fixups_size*2 : 256;
+      fixups = realloc(fixups, fixups_size*sizeof(Fixup));
+    }
+    fixups[fixups_num].idx = code_idx;
+    fixups[fixups_num].next = e->fixups;
+    e->fixups = fixups_num++;
+    jit_imm(0);
+  }
 }
 
 void jit_movi(int reg, uint64_t imm) {
-  fprintf(jit_out, "movq $%" PRIu64 ", %s\n", imm, regnames[reg]);
+  int hreg = regi[reg];
+  if (imm <= 0xffffffff) {
+    // movl zero-extends to 64 bit
+    jit_rex(0, 0, hreg);
+    jit_emit(0xb8 | (hreg&7));
+    jit_imm(imm);
+  } else if (fits_int32(imm)) {
+    // sign-extended imm32
+    jit_rex(1, 0, hreg);
+    jit_emit(0xc7);
+    jit_modrm_rr(0, hreg);
+    jit_imm(imm);
+  } else {
+    jit_rex(1, 0, hreg);
+    jit_emit(0xb8 | (hreg&7));
+    jit_imm64(imm);
+  }
 }
 
 void jit_movr(int dreg, int sreg) {
+  jit_movr_hw(regi[dreg], regi[sreg]);
+}
+
+static void jit_cmov(uint8_t cc, int dreg, int sreg) {
   if (dreg == sreg) return;
-  fprintf(jit_out, "movq %s, %s\n", regnames[sreg], regnames[dreg]);
+  jit_rex(1, regi[dreg], regi[sreg]);
+  jit_emit(0x0f);
+  jit_emit(cc);
+  jit_modrm_rr(regi[dreg], regi[sreg]);
 }
 
 void jit_movneg(int dreg, int sreg) {
-  if (dreg == sreg) return;
-  fprintf(jit_out, "cmovs %s, %s\n", regnames[sreg], regnames[dreg]);
+  jit_cmov(0x48, dreg, sreg); // cmovs
 }
 
 void jit_movne(int dreg, int sreg) {
-  if (dreg == sreg) return;
-  fprintf(jit_out, "cmovne %s, %s\n", regnames[sreg], regnames[dreg]);
+  jit_cmov(0x45, dreg, sreg); // cmovne
 }
 
 void jit_moveq(int dreg, int sreg) {
-  if (dreg == sreg) return;
-  fprintf(jit_out, "cmoveq %s, %s\n", regnames[sreg], regnames[dreg]);
+  jit_cmov(0x44, dreg, sreg); // cmove
 }
 
+// always a full 64 bit immediate (movabs)
 void jit_lea(int reg, void* addr) {
-  fprintf(jit_out, "movq $%p, %s\n", addr, regnames[reg]);
+  int hreg = regi[reg];
+  jit_rex(1, 0, hreg);
+  jit_emit(0xb8 | (hreg&7));
+
+  if (reloc_idx>=reloc_size) {
+    reloc_size = reloc_size ? reloc_size*2 : 256;
+    jit_relocs = realloc(jit_relocs, reloc_size*sizeof(Reloc));
+  }
+  jit_relocs[reloc_idx].idx = code_idx;
+  jit_relocs[reloc_idx].value = (jit_word_t)addr;
+  reloc_idx++;
+
+  jit_imm64((uint64_t)addr);
 }
 
 void jit_ldr(int reg) {
-  fprintf(jit_out, "movq (%s), %s\n", regnames[reg], regnames[reg]);
+  int hreg = regi[reg];
+  jit_rex(1, hreg, hreg);
+  jit_emit(0x8b);
+  jit_modrm_mem(hreg, hreg, 0);
 }
 
 void jit_ldr_stack(int dreg, int offset) {
-  fprintf(jit_out, "movq %d(%%rsp), %s\n", offset, regnames[dreg]);
+  int hreg = regi[dreg];
+  jit_rex(1, hreg, X64_RSP);
+  jit_emit(0x8b);
+  jit_modrm_mem(hreg, X64_RSP, offset);
 }
 
 void jit_str_stack(int sreg, int offset) {
-  fprintf(jit_out, "movq %s, %d(%%rsp)\n", regnames[sreg], offset);
+  int hreg = regi[sreg];
+  jit_rex(1, hreg, X64_RSP);
+  jit_emit(0x89);
+  jit_modrm_mem(hreg, X64_RSP, offset);
 }
 
 void jit_inc_stack(int offset) {
   if (offset == 0) return;
-  fprintf(jit_out, "addq $%d, %%rsp\n", offset);
+  jit_op_ri(0, X64_RSP, offset); // addq
 }
 
 void jit_dec_stack(int offset) {
   if (offset == 0) return;
-  fprintf(jit_out, "subq $%d, %%rsp\n", offset);
+  jit_op_ri(5, X64_RSP, offset); // subq
 }
 
-// clobbers rdx!
-void jit_ldrb(int reg) {
-  fprintf(jit_out, "movb (%s), %%dl\n", regnames[reg]);
-  fprintf(jit_out, "andq $0xff, %%rdx\n");
+// zero-extending load of (reg) into rdx, copied to reg
+static void jit_ldr_zx(uint8_t op, int reg) {
+  int hreg = regi[reg];
+  jit_rex(0, X64_RDX, hreg);
+  jit_emit(0x0f);
+  jit_emit(op);
+  jit_modrm_mem(X64_RDX, hreg, 0);
   if (reg!=3) {
-    fprintf(jit_out, "movq %%rdx, %s\n", regnames[reg]);
+    jit_movr_hw(hreg, X64_RDX);
   }
 }
 
+// clobbers rdx!
+void jit_ldrb(int reg) {
+  jit_ldr_zx(0xb6, reg); // movzbl
+}
+
 // clobbers rdx!
 void jit_ldrs(int reg) {
-  fprintf(jit_out, "movw (%s), %%dx\n", regnames[reg]);
-  fprintf(jit_out, "andq $0xffff, %%rdx\n");
-  if (reg!=3) {
-    fprintf(jit_out, "movq %%rdx, %s\n", regnames[reg]);
-  }
+  jit_ldr_zx(0xb7, reg); // movzwl
 }
 
 // clobbers rdx!
 void jit_ldrw(int reg) {
-  fprintf(jit_out, "movl (%s), %%edx\n", regnames[reg]);
-  //fprintf(jit_out, "andq $0xffffffff, %rdx\n", regnames[reg]);
+  int hreg = regi[reg];
+  jit_rex(0, X64_RDX, hreg);
+  jit_emit(0x8b); // movl (reg), %edx
+  jit_modrm_mem(X64_RDX, hreg, 0);
   if (reg!=3) {
-    fprintf(jit_out, "movq %%rdx, %s\n", regnames[reg]);
+    jit_movr_hw(hreg, X64_RDX);
   }
 }
 
 // 8 bit only from rdx!
 void jit_strb(int reg) {
-  fprintf(jit_out, "movb %%dl, (%s)\n", regnames[reg]);
+  int hreg = regi[reg];
+  jit_rex(0, X64_RDX, hreg);
+  jit_emit(0x88); // movb %dl, (reg)
+  jit_modrm_mem(X64_RDX, hreg, 0);
 }
 
 // 16 bit only from rdx!
 void jit_strs(int reg) {
-  fprintf(jit_out, "movw %%dx, (%s)\n", regnames[reg]);
+  int hreg = regi[reg];
+  jit_emit(0x66);
+  jit_rex(0, X64_RDX, hreg);
+  jit_emit(0x89); // movw %dx, (reg)
+  jit_modrm_mem(X64_RDX, hreg, 0);
 }
 
 // 32 bit only from rdx!
 void jit_strw(int reg) {
-  fprintf(jit_out, "movl %%edx, (%s)\n", regnames[reg]);
+  int hreg = regi[reg];
+  jit_rex(0, X64_RDX, hreg);
+  jit_emit(0x89); // movl %edx, (reg)
+  jit_modrm_mem(X64_RDX, hreg, 0);
 }
 
 void jit_stra(int reg) {
-  fprintf(jit_out, "movq %%rdx, (%s)\n", regnames[reg]);
+  int hreg = regi[reg];
+  jit_rex(1, X64_RDX, hreg);
+  jit_emit(0x89); // movq %rdx, (reg)
+  jit_modrm_mem(X64_RDX, hreg, 0);
 }
 
 void jit_addr(int dreg, int sreg) {
-  fprintf(jit_out, "addq %s, %s\n", regnames[sreg], regnames[dreg]);
+  jit_op_rr(0x01, regi[dreg], regi[sreg]);
 }
 
 void jit_addi(int dreg, int imm) {
-  fprintf(jit_out, "addq $%d, %s\n", imm, regnames[dreg]);
+  jit_op_ri(0, regi[dreg], imm);
 }
 
 void jit_andr(int dreg, int sreg) {
-  fprintf(jit_out, "andq %s, %s\n", regnames[sreg], regnames[dreg]);
+  jit_op_rr(0x21, regi[dreg], regi[sreg]);
+}
+
+// dreg = the low 32 bits of sreg, sign extended (movsxd), like an int
+// that went through alloc_int
+void jit_movsx32(int dreg, int sreg) {
+  jit_rex(1, regi[dreg], regi[sreg]);
+  jit_emit(0x63);
+  jit_modrm_rr(regi[dreg], regi[sreg]);
 }
 
 void jit_notr(int dreg) {
-  fprintf(jit_out, "notq %s\n", regnames[dreg]);
+  int hreg = regi[dreg];
+  jit_rex(1, 0, hreg);
+  jit_emit(0xf7);
+  jit_modrm_rr(2, hreg);
 }
 
 void jit_orr(int dreg, int sreg) {
-  fprintf(jit_out, "orq %s, %s\n", regnames[sreg], regnames[dreg]);
+  jit_op_rr(0x09, regi[dreg], regi[sreg]);
 }
 
 void jit_xorr(int dreg, int sreg) {
-  fprintf(jit_out, "xorq %s, %s\n", regnames[sreg], regnames[dreg]);
+  jit_op_rr(0x31, regi[dreg], regi[sreg]);
+}
+
+// shift count goes through %cl
+static void jit_shift(int ext, int dreg, int sreg) {
+  int hreg = regi[dreg];
+  jit_movr_hw(X64_RCX, regi[sreg]);
+  jit_rex(1, 0, hreg);
+  jit_emit(0xd3);
+  jit_modrm_rr(ext, hreg);
 }
 
 void jit_shrr(int dreg, int sreg) {
-  fprintf(jit_out, "movq %s, %%rcx\n", regnames[sreg]);
-  fprintf(jit_out, "shr %%cl, %s\n", regnames[dreg]);
+  jit_shift(5, dreg, sreg);
 }
 
 void jit_shlr(int dreg, int sreg) {
-  fprintf(jit_out, "movq %s, %%rcx\n", regnames[sreg]);
-  fprintf(jit_out, "shl %%cl, %s\n", regnames[dreg]);
+  jit_shift(4, dreg, sreg);
 }
 
 void jit_subr(int dreg, int sreg) {
-  fprintf(jit_out, "subq %s, %s\n", regnames[sreg], regnames[dreg]);
+  jit_op_rr(0x29, regi[dreg], regi[sreg]);
 }
 
 void jit_mulr(int dreg, int sreg) {
-  fprintf(jit_out, "imulq %s, %s\n", regnames[sreg], regnames[dreg]);
+  jit_rex(1, regi[dreg], regi[sreg]);
+  jit_emit(0x0f);
+  jit_emit(0xaf); // imulq
+  jit_modrm_rr(regi[dreg], regi[sreg]);
 }
 
 void jit_divr(int dreg, int sreg) {
-  fprintf(jit_out, "movq %s, %%rax\n", regnames[dreg]);
-  fprintf(jit_out, "cqto\n");
-  fprintf(jit_out, "idivq %s\n", regnames[sreg]);
-  fprintf(jit_out, "movq %%rax, %s\n", regnames[dreg]);
+  int hreg = regi[sreg];
+  jit_movr_hw(X64_RAX, regi[dreg]);
+  jit_emit(0x48);
+  jit_emit(0x99); // cqto
+  jit_rex(1, 0, hreg);
+  jit_emit(0xf7);
+  jit_modrm_rr(7, hreg); // idivq
+  jit_movr_hw(regi[dreg], X64_RAX);
 }
 
 void jit_host_call_enter() {
-  fprintf(jit_out, "movq %%rsp, %%rax\n");
-  fprintf(jit_out, "push %%rax\n");
-  fprintf(jit_out, "andq $0xfffffffffffffff0, %%rsp\n");
-  fprintf(jit_out, "mov %%rax,(%%rsp)\n");
+  jit_movr_hw(X64_RAX, X64_RSP); // movq %rsp, %rax
+  jit_emit(0x50); // push %rax
+  jit_op_ri(4, X64_RSP, -16); // andq $0xfffffffffffffff0, %rsp
+  jit_rex(1, X64_RAX, X64_RSP);
+  jit_emit(0x89); // mov %rax,(%rsp)
+  jit_modrm_mem(X64_RAX, X64_RSP, 0);
 }
 
 void jit_host_call_exit() {
-  fprintf(jit_out, "pop %%rsp\n");
+  jit_emit(0x5c); // pop %rsp
 }
 
 void jit_call(void* func, char* note) {
-  fprintf(jit_out, "mov $%p, %%rax\n", func);
-  fprintf(jit_out, "callq *%%rax # %s\n", note);
+  jit_lea(R0, func);
+  jit_emit(0xff);
+  jit_modrm_rr(2, X64_RAX); // callq *%rax
+}
+
+// pc-relative call to code+target, for callees placed next to this code
+void jit_call_rel(int32_t target) {
+  jit_emit(0xe8);
+  jit_imm(target - (int32_t)(code_idx + 4));
+}
+
+void jit_jmp_rel(int32_t target) {
+  jit_emit(0xe9);
+  jit_imm(target - (int32_t)(code_idx + 4));
 }
 
 #define jit_call2 jit_call
 #define jit_call3 jit_call
 
 void jit_callr(int reg) {
-  fprintf(jit_out, "callq *%s\n", regnames[reg]);
+  int hreg = regi[reg];
+  jit_rex(0, 0, hreg);
+  jit_emit(0xff);
+  jit_modrm_rr(2, hreg);
+}
+
+#ifdef JIT_DIRECT_CALLS
+// call the lambda bound to a global. the entrypoint is filled in by
+// link_calls after the code is placed, see callsite.c
+void jit_call_env(void* env) {
+  jit_lea(R11, env);
+  jit_lea(R0, jit_call_global);
+  jit_callr(R0);
+}
+
+// the same for a call to the raw entry of a fn, see rettype.c. the
+// RAW_* flags of the call are passed in r10.
+void jit_call_env_raw(void* env, int raw) {
+  jit_movi(R10, raw);
+  jit_lea(R11, env);
+  jit_lea(R0, jit_call_global_raw);
+  jit_callr(R0);
 }
 
-int32_t inline_mod(int64_t a, int64_t b) {
-  return a%b;
+// the same as a tail call
+void jit_jmp_env(void* env) {
+  jit_lea(R11, env);
+  jit_lea(R0, jit_call_global);
+  jit_emit(0xff);
+  jit_modrm_rr(4, X64_RAX); // jmp *%rax
+}
+#endif
+
+// 32 bits like on the other cpus, sign extended for raw int users
+int64_t inline_mod(int64_t a, int64_t b) {
+  return (int32_t)(a%b);
 }
 void jit_modr(int dreg, int sreg) {
   jit_movr(ARGR0,dreg);
@@ -224,66 +577,99 @@ void jit_modr(int dreg, int sreg) {
 }
 
 void jit_cmpi(int sreg, int imm) {
-  fprintf(jit_out, "cmp $%d, %s\n", imm, regnames[sreg]);
+  jit_op_ri(7, regi[sreg], imm);
 }
 
 void jit_cmpr(int sreg, int dreg) {
-  fprintf(jit_out, "cmp %s, %s\n", regnames[dreg], regnames[sreg]);
+  jit_op_rr(0x39, regi[sreg], regi[dreg]);
+}
+
+static void jit_jcc(uint8_t cc, char* label) {
+  jit_emit(0x0f);
+  jit_emit(cc);
+  jit_emit_branch(label);
 }
 
 void jit_je(char* label) {
-  fprintf(jit_out, "je %s\n", label);
+  jit_jcc(0x84, label);
 }
 
 void jit_jne(char* label) {
-  fprintf(jit_out, "jne %s\n", label);
+  jit_jcc(0x85, label);
 }
 
 void jit_jge(char* label) {
-  fprintf(jit_out, "jge %s\n", label);
+  jit_jcc(0x8d, label);
 }
 
 void jit_jneg(char* label) {
-  fprintf(jit_out, "js %s\n", label);
+  jit_jcc(0x88, label); // js
+}
+
+// signed compares, see cond.c
+void jit_jlt(char* label) {
+  jit_jcc(0x8c, label);
+}
+
+void jit_jle(char* label) {
+  jit_jcc(0x8e, label);
+}
+
+void jit_jgt(char* label) {
+  jit_jcc(0x8f, label);
 }
 
 void jit_jmp(char* label) {
-  fprintf(jit_out, "jmp %s\n", label);
+  jit_emit(0xe9);
+  jit_emit_branch(label);
 }
 
 void jit_label(char* label) {
-  fprintf(jit_out, "%s:\n", label);
+  X64Label* e = label_entry(label);
+  int f;
+
+  // branches go to the first of labels with the same name
+  if (e->l.idx >= 0) return;
+  e->l.idx = code_idx;
+  for (f = e->fixups; f >= 0; f = fixups[f].next) {
+    int32_t imm = code_idx - (fixups[f].idx + 4);
+    memcpy(&code[fixups[f].idx], &imm, 4);
+  }
+  e->fixups = -1;
 }
 
 void jit_ret() {
-  fprintf(jit_out, "ret\n");
+  jit_emit(0xc3);
 }
 
 void jit_push(int r1, int r2) {
   for (int i=r1; i<=r2; i++) {
-    fprintf(jit_out, "push %s\n",regnames[i]);
+    int hreg = regi[i];
+    jit_rex(0, 0, hreg);
+    jit_emit(0x50 | (hreg&7));
   }
 }
 
 void jit_pop(int r1, int r2) {
   for (int i=r2; i>=r1; i--) {
-    fprintf(jit_out, "pop %s\n",regnames[i]);
+    int hreg = regi[i];
+    jit_rex(0, 0, hreg);
+    jit_emit(0x58 | (hreg&7));
   }
 }
 
 void jit_comment(char* comment) {
-  fprintf(jit_out, "# %s\n",comment);
 }
 
 void debug_handler(char* line, Frame* frame) {
   printf("@ %s\r\n",line);
-  
+
   if (debug_mode==2 && frame) {
     if (frame->f) {
       for (int i=0; i<MAXFRAME; i++) {
         char* typestr = "UNKNOWN";
         Arg a = frame->f[i];
-          
+
         if (a.type) {
           switch (a.type) {
           case ARGT_CONST: typestr = "CONST"; break;
@@ -298,8 +684,9 @@ void debug_handler(char* line, Frame* frame) {
           case ARGT_REG_INT: typestr = "INT"; break;
           case ARGT_STACK: typestr = "STACK"; break;
           case ARGT_STACK_INT: typestr = "STACK_INT"; break;
+          case ARGT_IMM: typestr = "IMM"; break;
           }
-      
+
           printf("  %2d\t%s\t%s\t%d\r\n",i,a.name,typestr,a.slot);
         }
       }
@@ -188,6 +188,11 @@ void jit_andi(int dreg, int imm) {
   jit_imm(imm);
 }
 
+// words are 32 bits already
+void jit_movsx32(int dreg, int sreg) {
+  jit_movr(dreg, sreg);
+}
+
 void jit_notr(int dreg) {
   code[code_idx++] = 0xf7;
   code[code_idx++] = 0xd0 | regi[dreg];
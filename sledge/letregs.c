@@ -0,0 +1,109 @@
+// registers for let-bound locals (x64, arm)
+//
+// the first ARG_SPILLOVER args of a fn arrive in the registers from
+// LBDREG on. the rest of the FRAME_REGS registers of the backend are
+// given to locals: before the body of a fn is compiled, let_regs_scan
+// adds up the reads and lets of each of its locals, and the calls to
+// other fns, every while around them multiplying their weight by
+// LETREG_LOOP. the locals with the most uses get a register, as long
+// as they have more uses than there are calls, which have to save and
+// restore it. all other locals keep their stack slot.
+//
+// a let of such a local moves its value, boxed or a raw int like on
+// the stack, into the register. calls save it while it is read after
+// them, see liveregs.c.
+
+#define LETREG_LOOP 8 // weight of a use per while around it
+
+typedef struct LetRegUse {
+  char* name;
+  int uses;
+} LetRegUse;
+
+static void let_regs_walk(Cell* c, int weight, Arg* fn_frame, LetRegUse* lets, int* num_lets, int* calls) {
+  env_entry* e;
+  Cell* op;
+  Cell* sym;
+  int i;
+
+  if (!c) return;
+  if (c->tag == TAG_SYM) {
+    for (i=0; i<*num_lets; i++) {
+      if (!strcmp(lets[i].name, c->ar.addr)) {
+        lets[i].uses += weight;
+        break;
+      }
+    }
+    return;
+  }
+  if (c->tag != TAG_CONS) return;
+
+  op = car(c);
+  if (op && op->tag == TAG_SYM) {
+    e = lookup_global_symbol(op->ar.addr);
+    if (e && e->cell && e->cell->tag == TAG_BUILTIN) {
+      switch (e->cell->ar.value) {
+      case BUILTIN_FN:
+      case BUILTIN_QUOTE:
+        // a fn has a frame of its own
+        return;
+      case BUILTIN_WHILE:
+        if (weight < (1<<20)) weight *= LETREG_LOOP;
+        break;
+      case BUILTIN_LET:
+        sym = car(cdr(c));
+        if (!sym || sym->tag != TAG_SYM || *num_lets >= MAXFRAME-MAXARGS) break;
+        // lets of args stay where the arg is
+        if (get_sym_frame_idx(sym->ar.addr, fn_frame, 0)>=0) break;
+        for (i=0; i<*num_lets; i++) {
+          if (!strcmp(lets[i].name, sym->ar.addr)) break;
+        }
+        if (i == *num_lets) {
+          lets[i].name = sym->ar.addr;
+          lets[i].uses = 0;
+          (*num_lets)++;
+        }
+        break;
+      }
+    } else {
+      *calls += weight;
+    }
+    c = cdr(c);
+  }
+
+  for (; c && c->tag == TAG_CONS; c = cdr(c)) {
+    let_regs_walk(car(c), weight, fn_frame, lets, num_lets, calls);
+  }
+}
+
+// picks up to max locals of body for registers, the hottest first.
+// names gets them, NULL-terminated. returns their number.
+static int let_regs_scan(Cell* body, Arg* fn_frame, int max, char** names) {
+  LetRegUse lets[MAXFRAME-MAXARGS];
+  int num_lets = 0, calls = 0, n = 0, i, best;
+
+  let_regs_walk(body, 1, fn_frame, lets, &num_lets, &calls);
+
+  while (n < max) {
+    best = -1;
+    for (i=0; i<num_lets; i++) {
+      if (lets[i].uses > calls && (best<0 || lets[i].uses > lets[best].uses)) best = i;
+    }
+    if (best<0) break;
+    names[n++] = lets[best].name;
+    lets[best].uses = 0;
+  }
+  names[n] = NULL;
+  return n;
+}
+
+// the register of local name, or -1 if it lives on the stack
+static int let_reg(Frame* frame, char* name) {
+  int i, n = 0;
+  if (!frame->let_regs) return -1;
+  while (frame->let_regs[n]) n++;
+  for (i=0; i<n; i++) {
+    if (!strcmp(frame->let_regs[i], name)) return LBDREG + frame->num_regs - n + i;
+  }
+  return -1;
+}
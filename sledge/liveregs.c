@@ -0,0 +1,164 @@
+// saving registers around calls (x64, arm)
+//
+// jitted fns clobber the registers that hold args and locals (see
+// letregs.c), so a call into lisp code has to save those of its caller.
+// before the body of a fn is compiled, live_regs_scan goes over it
+// backwards and records for every call which of them are read again
+// after it returns. only those are pushed and popped around it. a while
+// is gone over until its registers stop changing. the args of a fn that
+// may be inlined can end up evaluated in any order, so each of them
+// sees the registers read by all of them.
+//
+// calls the scan didn't see, like those in inlined copies of a body,
+// save all registers. builtins that only call C functions save none,
+// C keeps r12-r15 and r4-r10.
+
+static unsigned int live_regs_walk(Cell* c, unsigned int out, Frame* frame);
+
+static int live_regs_count(Cell* c) {
+  int n = 0;
+  for (; c && c->tag == TAG_CONS; c = cdr(c)) {
+    n += 1 + live_regs_count(car(c));
+  }
+  return n;
+}
+
+// the bit of the register that holds local name
+static unsigned int live_reg_bit(char* name, Frame* frame) {
+  int idx = get_sym_frame_idx(name, frame->f, 0);
+  int reg = -1;
+  if (idx>=0) {
+    if (frame->f[idx].type == ARGT_REG || frame->f[idx].type == ARGT_REG_INT) reg = frame->f[idx].slot;
+  } else {
+#ifdef LET_REGS
+    reg = let_reg(frame, name);
+#endif
+  }
+  return reg<0 ? 0 : 1<<(reg-LBDREG);
+}
+
+static void live_regs_record(Cell* expr, unsigned int regs, Frame* frame) {
+  int i;
+  for (i=0; i<frame->num_live_sites; i++) {
+    if (frame->live_sites[i].expr == expr) {
+      frame->live_sites[i].regs |= regs;
+      return;
+    }
+  }
+  frame->live_sites[i].expr = expr;
+  frame->live_sites[i].regs = regs;
+  frame->num_live_sites++;
+}
+
+// forms of list evaluated in order
+static unsigned int live_regs_seq(Cell* list, unsigned int out, Frame* frame) {
+  if (!list || list->tag != TAG_CONS) return out;
+  return live_regs_walk(car(list), live_regs_seq(cdr(list), out, frame), frame);
+}
+
+// args of a call: symbols are loaded after all forms are evaluated
+static unsigned int live_regs_args(Cell* list, unsigned int out, Frame* frame) {
+  if (!list || list->tag != TAG_CONS) return out;
+  out = live_regs_args(cdr(list), out, frame);
+  if (car(list) && car(list)->tag == TAG_CONS) out = live_regs_walk(car(list), out, frame);
+  return out;
+}
+
+// registers read from c on, when those in out are read after it
+static unsigned int live_regs_walk(Cell* c, unsigned int out, Frame* frame) {
+  env_entry* e = NULL;
+  Cell* args;
+  Cell* a;
+  unsigned int live, prev;
+
+  if (!c) return out;
+  if (c->tag == TAG_SYM) return out | live_reg_bit(c->ar.addr, frame);
+  if (c->tag != TAG_CONS) return out;
+
+  args = cdr(c);
+  if (!car(c) || car(c)->tag != TAG_SYM) return live_regs_seq(c, out, frame);
+  e = lookup_global_symbol(car(c)->ar.addr);
+
+  if (e && e->cell && e->cell->tag == TAG_BUILTIN) {
+    switch (e->cell->ar.value) {
+    case BUILTIN_FN:
+    case BUILTIN_QUOTE:
+      return out;
+    case BUILTIN_LET:
+      a = car(args);
+      if (a && a->tag == TAG_SYM) out &= ~live_reg_bit(a->ar.addr, frame);
+      return live_regs_walk(car(cdr(args)), out, frame);
+    case BUILTIN_IF:
+      live = live_regs_walk(car(cdr(args)), out, frame) | live_regs_walk(car(cdr(cdr(args))), out, frame);
+      return live_regs_walk(car(args), live, frame);
+    case BUILTIN_WHILE:
+      live = out;
+      do {
+        prev = live;
+        live = live_regs_walk(car(args), out | live_regs_seq(cdr(args), prev, frame), frame);
+      } while (live != prev);
+      return live;
+    case BUILTIN_DO:
+      return live_regs_seq(args, out, frame);
+    }
+  }
+
+  live_regs_record(c, out, frame);
+  for (a = args; a && a->tag == TAG_CONS; a = cdr(a)) {
+    if (car(a) && car(a)->tag == TAG_SYM) out |= live_reg_bit(car(a)->ar.addr, frame);
+  }
+#ifdef JIT_INLINE
+  if (e && e->cell && e->cell->tag == TAG_LAMBDA) {
+    for (a = args; a && a->tag == TAG_CONS; a = cdr(a)) {
+      out |= live_regs_walk(car(a), 0, frame);
+    }
+    for (a = args; a && a->tag == TAG_CONS; a = cdr(a)) {
+      live_regs_walk(car(a), out, frame);
+    }
+    return out;
+  }
+#endif
+  return live_regs_args(args, out, frame);
+}
+
+// records the live registers of the calls in body, a fn of frame
+static void live_regs_scan(Cell* body, Frame* frame) {
+  unsigned int lets = 0, entry = 0, prev;
+  int i;
+
+  frame->live_sites = malloc(sizeof(LiveSite)*(live_regs_count(body)+1));
+  frame->num_live_sites = 0;
+#ifdef LET_REGS
+  for (i=0; frame->let_regs && frame->let_regs[i]; i++) {
+    lets |= live_reg_bit(frame->let_regs[i], frame);
+  }
+#endif
+  // a self call in tail position runs the body again, with the
+  // locals of the round before
+  do {
+    prev = entry;
+    entry = live_regs_walk(body, prev, frame) & lets;
+  } while (entry != prev);
+}
+
+// the registers that have to be saved around expr, a bit per register
+static unsigned int live_regs(Frame* frame, Cell* expr) {
+  unsigned int all = (1<<frame->num_regs)-1;
+  env_entry* e;
+  int i;
+
+  if (expr && expr->tag == TAG_CONS && car(expr) && car(expr)->tag == TAG_SYM) {
+    e = lookup_global_symbol(car(expr)->ar.addr);
+    if (e && e->cell && e->cell->tag == TAG_BUILTIN) {
+      switch (e->cell->ar.value) {
+      case BUILTIN_DEF: case BUILTIN_DEFCONST: case BUILTIN_STRUCT: case BUILTIN_PRINT:
+        return 0;
+      }
+    }
+  }
+  if (!expr || !frame->live_sites) return all;
+  for (i=0; i<frame->num_live_sites; i++) {
+    if (frame->live_sites[i].expr == expr) return frame->live_sites[i].regs & all;
+  }
+  return all;
+}
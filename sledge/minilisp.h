@@ -10,7 +10,7 @@
 #include <stdint.h>
 #endif
 
-#if CPU_X64
+#if CPU_X64 || CPU_ARM64
 #define jit_word_t uint64_t
 #else
 #define jit_word_t uint32_t
@@ -96,6 +96,9 @@ int is_nil(Cell* c);
 typedef struct env_entry {
   Cell* cell;
   char name[MAX_SYMBOL_SIZE];
+  struct CallSite* sites; // compiled calls bound to cell
+  int constant;           // defined with defconst
+  struct ConstUse* uses;  // compiled fns that have cell's value folded in (defconst, inlined)
 } env_entry;
 
 #define car(x) (x?(Cell*)((Cell*)x)->ar.addr:NULL)
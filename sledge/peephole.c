@@ -0,0 +1,324 @@
+// peephole pass over the jit_* instruction stream (all backends)
+//
+// compile_expr emits code by calling the jit_* functions of the
+// backend one after the other, which leaves some obvious waste behind:
+// a value pushed for a nested argument and popped right away, movr of a
+// register to itself, a constant cell loaded with lea+ldr instead of its
+// value, an int boxed by alloc_int only to be unboxed by the next op.
+//
+// the jit_* functions that move values around (push, pop, movr, movi,
+// lea, ldr, call, addi, inc/dec_stack) are redirected to the pp_*
+// functions below, which keep the last few ops in a small window.
+// every new op is matched against the end of the window and may cancel
+// or replace it. all other jit_* functions flush the window and are
+// emitted as before, so nothing is reordered across labels, branches
+// or stack accesses.
+//
+// with PEEPHOLE_STATS defined, the number of removed ops is printed for
+// every compiled form.
+
+#define PP_WINDOW 4
+
+enum pp_op_t {
+  PP_PUSH,
+  PP_POP,
+  PP_MOVR,
+  PP_MOVSX32,
+  PP_MOVI,
+  PP_LEA,
+  PP_LDR,
+  PP_CALL,
+  PP_ADDI,
+  PP_INC_STACK,
+  PP_DEC_STACK
+};
+
+typedef struct PeepOp {
+  int op;
+  int a;        // destination or first register
+  int b;        // source register, last register or immediate
+  jit_word_t v; // movi immediate
+  void* p;      // lea address, call target
+  char* note;
+} PeepOp;
+
+static PeepOp pp_ops[PP_WINDOW];
+static int pp_num = 0;
+static int pp_seen = 0;
+static int pp_removed = 0;
+
+static void pp_emit(PeepOp* o) {
+  switch (o->op) {
+  case PP_PUSH:      jit_push(o->a, o->b); break;
+  case PP_POP:       jit_pop(o->a, o->b); break;
+  case PP_MOVR:      jit_movr(o->a, o->b); break;
+  case PP_MOVSX32:   jit_movsx32(o->a, o->b); break;
+  case PP_MOVI:      jit_movi(o->a, o->v); break;
+  case PP_LEA:       jit_lea(o->a, o->p); break;
+  case PP_LDR:       jit_ldr(o->a); break;
+  case PP_CALL:      jit_call(o->p, o->note); break;
+  case PP_ADDI:      jit_addi(o->a, o->b); break;
+  case PP_INC_STACK: jit_inc_stack(o->b); break;
+  case PP_DEC_STACK: jit_dec_stack(o->b); break;
+  }
+}
+
+static void pp_flush() {
+  int i;
+  for (i=0; i<pp_num; i++) {
+    pp_emit(&pp_ops[i]);
+  }
+  pp_num = 0;
+}
+
+static void pp_reset() {
+  pp_num = 0;
+  pp_seen = 0;
+  pp_removed = 0;
+}
+
+// a constant like 123 in the source, compiled to lea of its cell
+static int pp_int_literal(void* p) {
+  Cell* c = (Cell*)p;
+  return is_heap_cell(c) && c->tag == TAG_INT;
+}
+
+// try to merge n into the last op of the window. returns 1 if n was
+// absorbed, possibly after replacing the last op by m (set in *n).
+static int pp_match(PeepOp* l, PeepOp* n) {
+  // push x; pop y -> movr y,x
+  if (l->op == PP_PUSH && n->op == PP_POP && l->a == l->b && n->a == n->b) {
+    int src = l->a;
+    pp_num--;
+    pp_removed++;
+    if (n->a == src) {
+      pp_removed++;
+      return 1;
+    }
+    n->op = PP_MOVR;
+    n->b = src;
+    return 0;
+  }
+  // push x..y; pop x..y
+  if (l->op == PP_PUSH && n->op == PP_POP && l->a == n->a && l->b == n->b) {
+    pp_num--;
+    pp_removed += 2*(l->b-l->a+1);
+    return 1;
+  }
+  // movr x,y; movr y,x
+  if (l->op == PP_MOVR && n->op == PP_MOVR && l->a == n->b && l->b == n->a) {
+    pp_removed++;
+    return 1;
+  }
+  // lea r,<int cell>; ldr r -> movi r,value
+  if (l->op == PP_LEA && n->op == PP_LDR && l->a == n->a && pp_int_literal(l->p)) {
+    l->op = PP_MOVI;
+    l->v = ((Cell*)l->p)->ar.value;
+    pp_removed++;
+    return 1;
+  }
+  // boxing right before unboxing: the value is still in ARGR0, cut to
+  // the int that alloc_int takes
+  if (l->op == PP_CALL && l->p == (void*)alloc_int && n->op == PP_LDR && n->a == R0) {
+    l->op = PP_MOVSX32;
+    l->a = R0;
+    l->b = ARGR0;
+    pp_removed++;
+    return 1;
+  }
+  // addi r,a; addi r,b -> addi r,a+b
+  if (l->op == PP_ADDI && n->op == PP_ADDI && l->a == n->a) {
+    l->b += n->b;
+    pp_removed++;
+    if (!l->b) {
+      pp_num--;
+      pp_removed++;
+    }
+    return 1;
+  }
+  // stack adjustments add up
+  if ((l->op == PP_INC_STACK || l->op == PP_DEC_STACK)
+      && (n->op == PP_INC_STACK || n->op == PP_DEC_STACK)) {
+    int d = (l->op == PP_INC_STACK ? l->b : -l->b) + (n->op == PP_INC_STACK ? n->b : -n->b);
+    l->op = d<0 ? PP_DEC_STACK : PP_INC_STACK;
+    l->b = d<0 ? -d : d;
+    pp_removed++;
+    if (!d) {
+      pp_num--;
+      pp_removed++;
+    }
+    return 1;
+  }
+  // an overwritten constant or copy
+  if ((l->op == PP_MOVI || l->op == PP_LEA || l->op == PP_MOVR) && l->a == n->a
+      && (n->op == PP_MOVI || n->op == PP_LEA || (n->op == PP_MOVR && n->b != n->a))) {
+    *l = *n;
+    pp_removed++;
+    return 1;
+  }
+  return 0;
+}
+
+static void pp_add(PeepOp n) {
+  pp_seen++;
+
+  // ops that do nothing
+  if ((n.op == PP_MOVR && n.a == n.b)
+      || ((n.op == PP_ADDI || n.op == PP_INC_STACK || n.op == PP_DEC_STACK) && !n.b)) {
+    pp_removed++;
+    return;
+  }
+
+  // a replaced op is matched again against the new end of the window
+  while (pp_num) {
+    int before = pp_num;
+    if (pp_match(&pp_ops[pp_num-1], &n)) return;
+    if (pp_num == before) break;
+    if (n.op == PP_MOVR && n.a == n.b) return;
+  }
+
+  if (pp_num == PP_WINDOW) {
+    pp_emit(&pp_ops[0]);
+    memmove(&pp_ops[0], &pp_ops[1], (PP_WINDOW-1)*sizeof(PeepOp));
+    pp_num--;
+  }
+  pp_ops[pp_num++] = n;
+}
+
+static void pp_push(int r1, int r2) {
+  PeepOp o = {PP_PUSH, r1, r2, 0, NULL, NULL};
+  pp_add(o);
+}
+
+static void pp_pop(int r1, int r2) {
+  PeepOp o = {PP_POP, r1, r2, 0, NULL, NULL};
+  pp_add(o);
+}
+
+static void pp_movr(int dreg, int sreg) {
+  PeepOp o = {PP_MOVR, dreg, sreg, 0, NULL, NULL};
+  pp_add(o);
+}
+
+static void pp_movi(int reg, jit_word_t imm) {
+  PeepOp o = {PP_MOVI, reg, 0, imm, NULL, NULL};
+  pp_add(o);
+}
+
+static void pp_lea(int reg, void* addr) {
+  PeepOp o = {PP_LEA, reg, 0, 0, addr, NULL};
+  pp_add(o);
+}
+
+static void pp_ldr(int reg) {
+  PeepOp o = {PP_LDR, reg, 0, 0, NULL, NULL};
+  pp_add(o);
+}
+
+static void pp_call(void* func, char* note) {
+  PeepOp o = {PP_CALL, 0, 0, 0, func, note};
+  pp_add(o);
+}
+
+static void pp_addi(int dreg, int imm) {
+  PeepOp o = {PP_ADDI, dreg, imm, 0, NULL, NULL};
+  pp_add(o);
+}
+
+static void pp_inc_stack(int offset) {
+  PeepOp o = {PP_INC_STACK, 0, offset, 0, NULL, NULL};
+  pp_add(o);
+}
+
+static void pp_dec_stack(int offset) {
+  PeepOp o = {PP_DEC_STACK, 0, offset, 0, NULL, NULL};
+  pp_add(o);
+}
+
+// backend aliases like #define jit_call2 jit_call
+static void pp_call2(void* func, char* note) {
+  pp_flush();
+  pp_seen++;
+  jit_call2(func, note);
+}
+
+static void pp_call3(void* func, char* note) {
+  pp_flush();
+  pp_seen++;
+  jit_call3(func, note);
+}
+
+static void pp_stra(int reg) {
+  pp_flush();
+  pp_seen++;
+  jit_stra(reg);
+}
+
+void peephole_report(char* name) {
+  printf("<peephole: %d of %d ops removed (%s)>\r\n",pp_removed,pp_seen,name);
+}
+
+#define jit_push pp_push
+#define jit_pop pp_pop
+#define jit_movr pp_movr
+#define jit_movi pp_movi
+#define jit_lea pp_lea
+#define jit_ldr pp_ldr
+#define jit_call pp_call
+#define jit_addi pp_addi
+#define jit_inc_stack pp_inc_stack
+#define jit_dec_stack pp_dec_stack
+#undef jit_call2
+#define jit_call2 pp_call2
+#undef jit_call3
+#define jit_call3 pp_call3
+#undef jit_stra
+#define jit_stra pp_stra
+
+// everything else is emitted in order
+#define PP_FLUSHED(...) (pp_flush(), pp_seen++, __VA_ARGS__)
+#define jit_init(...) (pp_reset(), jit_init(__VA_ARGS__))
+#define jit_ret(...) PP_FLUSHED(jit_ret(__VA_ARGS__))
+#define jit_label(...) PP_FLUSHED(jit_label(__VA_ARGS__))
+#define jit_comment(...) (pp_flush(), jit_comment(__VA_ARGS__))
+#define jit_jmp(...) PP_FLUSHED(jit_jmp(__VA_ARGS__))
+#define jit_je(...) PP_FLUSHED(jit_je(__VA_ARGS__))
+#define jit_jne(...) PP_FLUSHED(jit_jne(__VA_ARGS__))
+#define jit_jge(...) PP_FLUSHED(jit_jge(__VA_ARGS__))
+#define jit_jneg(...) PP_FLUSHED(jit_jneg(__VA_ARGS__))
+#define jit_jlt(...) PP_FLUSHED(jit_jlt(__VA_ARGS__))
+#define jit_jle(...) PP_FLUSHED(jit_jle(__VA_ARGS__))
+#define jit_jgt(...) PP_FLUSHED(jit_jgt(__VA_ARGS__))
+#define jit_cmpi(...) PP_FLUSHED(jit_cmpi(__VA_ARGS__))
+#define jit_cmpr(...) PP_FLUSHED(jit_cmpr(__VA_ARGS__))
+#define jit_movne(...) PP_FLUSHED(jit_movne(__VA_ARGS__))
+#define jit_moveq(...) PP_FLUSHED(jit_moveq(__VA_ARGS__))
+#define jit_movneg(...) PP_FLUSHED(jit_movneg(__VA_ARGS__))
+#define jit_addr(...) PP_FLUSHED(jit_addr(__VA_ARGS__))
+#define jit_subr(...) PP_FLUSHED(jit_subr(__VA_ARGS__))
+#define jit_mulr(...) PP_FLUSHED(jit_mulr(__VA_ARGS__))
+#define jit_divr(...) PP_FLUSHED(jit_divr(__VA_ARGS__))
+#define jit_modr(...) PP_FLUSHED(jit_modr(__VA_ARGS__))
+#define jit_andr(...) PP_FLUSHED(jit_andr(__VA_ARGS__))
+#define jit_orr(...) PP_FLUSHED(jit_orr(__VA_ARGS__))
+#define jit_xorr(...) PP_FLUSHED(jit_xorr(__VA_ARGS__))
+#define jit_notr(...) PP_FLUSHED(jit_notr(__VA_ARGS__))
+#define jit_movsx32(...) PP_FLUSHED(jit_movsx32(__VA_ARGS__))
+#define jit_shlr(...) PP_FLUSHED(jit_shlr(__VA_ARGS__))
+#define jit_shrr(...) PP_FLUSHED(jit_shrr(__VA_ARGS__))
+#define jit_ldrb(...) PP_FLUSHED(jit_ldrb(__VA_ARGS__))
+#define jit_ldrs(...) PP_FLUSHED(jit_ldrs(__VA_ARGS__))
+#define jit_ldrw(...) PP_FLUSHED(jit_ldrw(__VA_ARGS__))
+#define jit_strb(...) PP_FLUSHED(jit_strb(__VA_ARGS__))
+#define jit_strs(...) PP_FLUSHED(jit_strs(__VA_ARGS__))
+#define jit_strw(...) PP_FLUSHED(jit_strw(__VA_ARGS__))
+#define jit_ldr_stack(...) PP_FLUSHED(jit_ldr_stack(__VA_ARGS__))
+#define jit_str_stack(...) PP_FLUSHED(jit_str_stack(__VA_ARGS__))
+#define jit_callr(...) PP_FLUSHED(jit_callr(__VA_ARGS__))
+#define jit_call_rel(...) PP_FLUSHED(jit_call_rel(__VA_ARGS__))
+#define jit_jmp_rel(...) PP_FLUSHED(jit_jmp_rel(__VA_ARGS__))
+#define jit_call_env(...) PP_FLUSHED(jit_call_env(__VA_ARGS__))
+#define jit_call_env_raw(...) PP_FLUSHED(jit_call_env_raw(__VA_ARGS__))
+#define jit_jmp_env(...) PP_FLUSHED(jit_jmp_env(__VA_ARGS__))
+#define jit_host_call_enter(...) PP_FLUSHED(jit_host_call_enter(__VA_ARGS__))
+#define jit_host_call_exit(...) PP_FLUSHED(jit_host_call_exit(__VA_ARGS__))
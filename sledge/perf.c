@@ -0,0 +1,225 @@
+// linux perf symbols for compiled code (x64 linux)
+//
+// to perf, compiled code is anonymous memory without symbols. with
+// INTERIM_PERF=map, every compiled form appends lines to
+// /tmp/perf-<pid>.map, which perf report and perf top read by
+// themselves: a line per fn, named after its def, and a line per part of
+// the form's code around its fns. INTERIM_PERF=jitdump writes the same
+// ranges together with their code bytes to /tmp/jit-<pid>.dump (see
+// jitdump-specification.txt in the linux tree), so perf annotate can
+// show the instructions:
+//
+//   INTERIM_PERF=jitdump perf record -k mono ./sledge ...
+//   perf inject --jit -i perf.data -o perf.jit.data
+//   perf report -i perf.jit.data
+//
+// code loaded from the compiled-code cache is named after its form as a
+// whole. code reclaimed by (gc) keeps its entries, perf takes the latest
+// code loaded at an address.
+
+#include <sys/mman.h>
+#include <time.h>
+#include <elf.h>
+
+#define PERF_MAX_RANGES 64
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+
+typedef struct JitdumpHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+} JitdumpHeader;
+
+typedef struct JitdumpCodeLoad {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+  // followed by the name and the code
+} JitdumpCodeLoad;
+
+// a fn compiled into the current form, named by its def
+typedef struct PerfFn {
+  Cell* lambda;
+  char* name;
+} PerfFn;
+
+// a part of the form's code, offsets from its start
+typedef struct PerfRange {
+  uint32_t start;
+  uint32_t end;
+  char* name;
+} PerfRange;
+
+static int perf_state = 0; // 1 map, 2 jitdump, -1 off
+static FILE* perf_file = NULL;
+static uint64_t perf_code_index = 0;
+static PerfFn* perf_fns = NULL;
+static int perf_fns_count = 0;
+static int perf_fns_size = 0;
+
+static uint64_t perf_timestamp() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static int perf_wanted() {
+  char* env;
+  char path[64];
+  if (perf_state) return perf_state>0;
+  perf_state = -1;
+
+  env = getenv("INTERIM_PERF");
+  if (!env || !env[0]) return 0;
+  if (!strcmp(env,"map")) {
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+    perf_file = fopen(path, "a");
+    if (!perf_file) {
+      printf("<perf: cannot write %s>\r\n",path);
+      return 0;
+    }
+    perf_state = 1;
+  } else if (!strcmp(env,"jitdump")) {
+    JitdumpHeader h;
+    snprintf(path, sizeof(path), "/tmp/jit-%d.dump", getpid());
+    perf_file = fopen(path, "w+");
+    if (!perf_file) {
+      printf("<perf: cannot write %s>\r\n",path);
+      return 0;
+    }
+    h.magic = JITDUMP_MAGIC;
+    h.version = JITDUMP_VERSION;
+    h.total_size = sizeof(h);
+    h.elf_mach = EM_X86_64;
+    h.pad1 = 0;
+    h.pid = getpid();
+    h.timestamp = perf_timestamp();
+    h.flags = 0;
+    fwrite(&h, sizeof(h), 1, perf_file);
+    fflush(perf_file);
+    // perf record finds the dump through this mapping
+    if (mmap(NULL, getpagesize(), PROT_READ|PROT_EXEC, MAP_PRIVATE, fileno(perf_file), 0) == MAP_FAILED) {
+      printf("<perf: cannot map %s>\r\n",path);
+      fclose(perf_file);
+      return 0;
+    }
+    perf_state = 2;
+  } else {
+    printf("<perf: INTERIM_PERF is map or jitdump>\r\n");
+    return 0;
+  }
+  return 1;
+}
+
+// called by BUILTIN_FN for every fn of the form being compiled
+void perf_fn(Cell* lambda, char* name) {
+  if (!perf_wanted()) return;
+  if (perf_fns_count >= perf_fns_size) {
+    perf_fns_size = perf_fns_size ? perf_fns_size*2 : 64;
+    perf_fns = realloc(perf_fns, perf_fns_size*sizeof(PerfFn));
+  }
+  perf_fns[perf_fns_count].lambda = lambda;
+  perf_fns[perf_fns_count].name = name;
+  perf_fns_count++;
+}
+
+static void perf_write(uint8_t* start, uint32_t size, char* name) {
+  if (perf_state == 1) {
+    fprintf(perf_file, "%" PRIx64 " %x %s\n", (uint64_t)(jit_word_t)start, size, name);
+  } else {
+    JitdumpCodeLoad r;
+    uint32_t len = strlen(name)+1;
+    r.id = JIT_CODE_LOAD;
+    r.total_size = sizeof(r) + len + size;
+    r.timestamp = perf_timestamp();
+    r.pid = getpid();
+    r.tid = r.pid;
+    r.vma = (uint64_t)(jit_word_t)start;
+    r.code_addr = r.vma;
+    r.code_size = size;
+    r.code_index = perf_code_index++;
+    fwrite(&r, sizeof(r), 1, perf_file);
+    fwrite(name, 1, len, perf_file);
+    fwrite(start, 1, size, perf_file);
+  }
+}
+
+// name the size bytes of code at start, compiled from the form defsym.
+// the labels of the form's fns are still there. every byte goes to the
+// innermost fn around it, parts outside of any fn to the form.
+void perf_code(uint8_t* start, uint32_t size, char* defsym) {
+  PerfRange ranges[PERF_MAX_RANGES];
+  char fn_name[MAX_SYMBOL_SIZE+16];
+  char label[64];
+  int num_ranges = 1, i, fns;
+  uint32_t pos, next, piece = 0;
+  PerfRange* owner = NULL;
+  PerfRange* piece_owner = NULL;
+
+  fns = perf_fns_count;
+  perf_fns_count = 0;
+  if (!perf_wanted() || !size) return;
+
+  ranges[0].start = 0;
+  ranges[0].end = size;
+  ranges[0].name = strcmp(defsym,"anon") ? defsym : "toplevel";
+  snprintf(fn_name, sizeof(fn_name), "fn in %s", ranges[0].name);
+
+  for (i=0; i<fns && num_ranges<PERF_MAX_RANGES; i++) {
+    Label* l0;
+    Label* l1;
+    sprintf(label,"L0_%p",perf_fns[i].lambda);
+    l0 = find_label(label);
+    sprintf(label,"L1_%p",perf_fns[i].lambda);
+    l1 = find_label(label);
+    // a fn of a form that failed to compile
+    if (!l0 || !l1 || l0->idx<0 || l1->idx<=l0->idx || l1->idx>size) continue;
+    ranges[num_ranges].start = l0->idx;
+    ranges[num_ranges].end = l1->idx;
+    ranges[num_ranges].name = perf_fns[i].name ? perf_fns[i].name : fn_name;
+    num_ranges++;
+  }
+
+  for (pos=0; pos<size; pos=next) {
+    owner = &ranges[0];
+    next = size;
+    for (i=0; i<num_ranges; i++) {
+      PerfRange* r = &ranges[i];
+      if (r->start<=pos && pos<r->end && r->end-r->start < owner->end-owner->start) owner = r;
+      if (r->start>pos && r->start<next) next = r->start;
+      if (r->end>pos && r->end<next) next = r->end;
+    }
+    if (piece_owner && strcmp(owner->name, piece_owner->name)) {
+      perf_write(start+piece, pos-piece, piece_owner->name);
+      piece = pos;
+    }
+    piece_owner = owner;
+  }
+  perf_write(start+piece, size-piece, piece_owner->name);
+  fflush(perf_file);
+}
+
+// a whole blob, i.e. one loaded from the compiled-code cache
+void perf_blob(uint8_t* blob, char* defsym) {
+  uint8_t* start;
+  size_t size;
+  uint32_t* relocs;
+  int num_relocs;
+  if (code_blob_info(blob, &start, &size, &relocs, &num_relocs)) {
+    perf_code(start, size, defsym);
+  }
+}
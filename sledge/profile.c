@@ -0,0 +1,224 @@
+// call counts and cycles per fn, read from /sys/profile (x64, arm64 linux)
+//
+// with INTERIM_PROFILE=calls, every fn compiled from then on increments
+// the call counter of its record when it is entered. INTERIM_PROFILE=cycles
+// calls profile_enter and profile_leave around its body instead, which
+// also add up the cycles spent in it (rdtsc on x64, cntvct_el0 on arm64):
+// inclusive, from entry to return of its outermost active call, and
+// exclusive, without the calls it makes to other counted fns. with either
+// mode, the compiled-code cache, tier 0 and inlining are off and calls in
+// tail position are plain calls (with cycles), so that every call is a
+// call of a counted fn. self calls in tail position are loops and count
+// once. without INTERIM_PROFILE, the code is the same as before.
+//
+// fns of the same name share a record, so a redefined fn goes on
+// counting. (recv (open "/sys/profile")) gives a line per fn that was
+// called, most cycles or calls first, and (send (open "/sys/profile") 0)
+// sets all counters to zero.
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#define PROFILE_CALLS 1
+#define PROFILE_CYCLES 2
+#define PROFILE_MAX_DEPTH 4096
+
+typedef struct ProfileFn {
+  uint64_t calls;
+  uint64_t incl;
+  uint64_t excl;
+  int active; // calls on the profile stack, incl counts the outermost
+  char name[MAX_SYMBOL_SIZE+8];
+  struct ProfileFn* next;
+} ProfileFn;
+
+// a call of a counted fn that has not returned yet
+typedef struct ProfileCall {
+  ProfileFn* fn;
+  uint64_t start;
+  uint64_t callees;
+} ProfileCall;
+
+static int profile_state = 0; // PROFILE_CALLS, PROFILE_CYCLES, -1 off
+static ProfileFn* profile_fns = NULL;
+static ProfileCall profile_stack[PROFILE_MAX_DEPTH];
+static int profile_depth = 0;
+
+static inline uint64_t profile_ticks() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  uint64_t t;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+  return t;
+#endif
+}
+
+// PROFILE_CALLS or PROFILE_CYCLES if fns are counted, 0 if not
+int profile_mode() {
+  char* env;
+  if (profile_state) return profile_state>0 ? profile_state : 0;
+  profile_state = -1;
+
+  env = getenv("INTERIM_PROFILE");
+  if (!env || !env[0]) return 0;
+  if (!strcmp(env,"calls")) {
+    profile_state = PROFILE_CALLS;
+  } else if (!strcmp(env,"cycles")) {
+    profile_state = PROFILE_CYCLES;
+  } else {
+    printf("<profile: INTERIM_PROFILE is calls or cycles>\r\n");
+    return 0;
+  }
+  return profile_state;
+}
+
+void profile_enter(ProfileFn* p) {
+  p->calls++;
+  if (profile_depth<PROFILE_MAX_DEPTH) {
+    ProfileCall* c = &profile_stack[profile_depth];
+    c->fn = p;
+    c->callees = 0;
+    p->active++;
+    c->start = profile_ticks();
+  }
+  profile_depth++;
+}
+
+void profile_leave() {
+  uint64_t now = profile_ticks();
+  ProfileCall* c;
+  uint64_t t;
+
+  if (profile_depth<=0) return;
+  profile_depth--;
+  // deeper calls count for the deepest one on the stack
+  if (profile_depth>=PROFILE_MAX_DEPTH) return;
+
+  c = &profile_stack[profile_depth];
+  t = now - c->start;
+  c->fn->excl += t - c->callees;
+  if (!--c->fn->active) c->fn->incl += t;
+  if (profile_depth>0) profile_stack[profile_depth-1].callees += t;
+}
+
+// the record of a fn about to be compiled, NULL if fns are not counted.
+// name is its def, or outer the def of the fn it is in.
+ProfileFn* profile_fn(char* name, char* outer) {
+  char buf[MAX_SYMBOL_SIZE+8];
+  ProfileFn* p;
+
+  if (!profile_mode()) return NULL;
+  if (name) snprintf(buf, sizeof(buf), "%s", name);
+  else if (outer) snprintf(buf, sizeof(buf), "fn in %s", outer);
+  else snprintf(buf, sizeof(buf), "fn");
+
+  for (p = profile_fns; p; p = p->next) {
+    if (!strcmp(p->name, buf)) return p;
+  }
+  p = calloc(1, sizeof(ProfileFn));
+  strcpy(p->name, buf);
+  p->next = profile_fns;
+  profile_fns = p;
+  return p;
+}
+
+// at the entry of p's fn, after its frame is set up. only args are in
+// registers, and those are kept by c calls.
+void profile_emit_entry(ProfileFn* p) {
+  if (profile_state == PROFILE_CALLS) {
+    jit_lea(R3, &p->calls);
+    jit_ldr(R3);
+    jit_addi(R3, 1);
+    jit_lea(R1, &p->calls);
+    jit_stra(R1);
+  } else {
+    jit_lea(ARGR0, p);
+    jit_host_call_enter();
+    jit_call(profile_enter, "profile_enter");
+    jit_host_call_exit();
+  }
+}
+
+// after the body of p's fn, its result is in R0
+void profile_emit_exit(ProfileFn* p) {
+  if (profile_state != PROFILE_CYCLES) return;
+  jit_push(R0,R0);
+  jit_host_call_enter();
+  jit_call(profile_leave, "profile_leave");
+  jit_host_call_exit();
+  jit_pop(R0,R0);
+}
+
+// /sys/profile
+
+static int profile_cmp(const void* a, const void* b) {
+  ProfileFn* pa = *(ProfileFn**)a;
+  ProfileFn* pb = *(ProfileFn**)b;
+  uint64_t ka = profile_state == PROFILE_CYCLES ? pa->excl : pa->calls;
+  uint64_t kb = profile_state == PROFILE_CYCLES ? pb->excl : pb->calls;
+  if (ka != kb) return ka < kb ? 1 : -1;
+  return strcmp(pa->name, pb->name);
+}
+
+Cell* profilefs_open(Cell* path) {
+  return alloc_nil();
+}
+
+Cell* profilefs_read(Cell* stream) {
+  ProfileFn** fns;
+  ProfileFn* p;
+  Cell* res;
+  char* buf;
+  int count = 0, i, len = 0;
+
+  for (p = profile_fns; p; p = p->next) {
+    if (p->calls) count++;
+  }
+  fns = malloc((count+1)*sizeof(ProfileFn*));
+  count = 0;
+  for (p = profile_fns; p; p = p->next) {
+    if (p->calls) fns[count++] = p;
+  }
+  qsort(fns, count, sizeof(ProfileFn*), profile_cmp);
+
+  buf = malloc((count+1)*(3*21+MAX_SYMBOL_SIZE+16));
+  if (profile_state == PROFILE_CYCLES) {
+    len += sprintf(buf+len, "%12s %16s %16s  %s\n", "calls", "incl cycles", "excl cycles", "fn");
+    for (i=0; i<count; i++) {
+      len += sprintf(buf+len, "%12" PRIu64 " %16" PRIu64 " %16" PRIu64 "  %s\n", fns[i]->calls, fns[i]->incl, fns[i]->excl, fns[i]->name);
+    }
+  } else {
+    len += sprintf(buf+len, "%12s  %s\n", "calls", "fn");
+    for (i=0; i<count; i++) {
+      len += sprintf(buf+len, "%12" PRIu64 "  %s\n", fns[i]->calls, fns[i]->name);
+    }
+  }
+  res = alloc_string_copy(buf);
+  free(buf);
+  free(fns);
+  return res;
+}
+
+// any write resets the counters. calls that are running go on from now.
+Cell* profilefs_write(Cell* stream, Cell* arg) {
+  ProfileFn* p;
+  uint64_t now = profile_ticks();
+  int i;
+
+  for (p = profile_fns; p; p = p->next) {
+    p->calls = 0;
+    p->incl = 0;
+    p->excl = 0;
+  }
+  for (i=0; i<profile_depth && i<PROFILE_MAX_DEPTH; i++) {
+    profile_stack[i].start = now;
+    profile_stack[i].callees = 0;
+  }
+  return alloc_int(1);
+}
+
+void mount_profilefs() {
+  fs_mount_builtin("/sys/profile", profilefs_open, profilefs_read, profilefs_write, 0, 0);
+}
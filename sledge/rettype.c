@@ -0,0 +1,128 @@
+// unboxed int returns (x64 hosted)
+//
+// a fn whose body always gives an int, like strlen or sin, is compiled
+// with two entrypoints:
+//
+//   L0: jmp L3          boxed entry, lambda->dr.next
+//       <prologue, body, epilogue>
+//                       raw entry at L0+RAW_ENTRY, result in R0
+//   L3: call L0+5       boxing wrapper for everyone else
+//       alloc_int
+//       ret
+//
+// a call that wants an int, like (+ (strlen s) 1), enters at the raw
+// entry and gets no cell to unbox. the raw entry cuts the result to 32
+// bits, sign extended, like the alloc_int of the boxed one. everyone else, C code and the
+// interpreter included, sees an ordinary lambda. args that arrive
+// unboxed at the raw entry use the same layout, see intargs.c.
+//
+// an int body is found from its source alone: int literals, int math
+// and compares, get8/16/32 and size, if and do of those, and locals
+// that every let gives such a value. args and calls are never ints,
+// so recompiling a fn always gives the same return type.
+//
+// the signature of a lambda with a raw entry ends in a cons with an
+// int of RAW_* flags as its cdr, and of the ESC_ARG flags of escape.c.
+// call sites compiled for its raw entry still work when the global is
+// rebound to another fn, see callsite.c.
+
+#define RAW_ENTRY 5         // size of the jmp at the boxed entry
+#define RAW_RET 1           // the raw entry returns an unboxed int
+#define RAW_ARG(j) (2<<(j)) // arg j arrives unboxed at the raw entry
+#define RAW_MASK 0xff       // the RAW_* flags among the others
+#define RET_INT_MAX_DEPTH 8 // for locals let from other locals
+
+static int ret_int_form(Cell* c, Cell* body, Arg* fn_frame, int depth);
+
+// do all lets of local name in c give ints? found counts them.
+static int ret_int_lets(Cell* c, char* name, Cell* body, Arg* fn_frame, int depth, int* found) {
+  env_entry* e;
+  Cell* sym;
+  if (!c || c->tag != TAG_CONS) return 1;
+  if (car(c) && car(c)->tag == TAG_SYM && (e = lookup_global_symbol(car(c)->ar.addr))
+      && e->cell && e->cell->tag == TAG_BUILTIN) {
+    switch (e->cell->ar.value) {
+    case BUILTIN_FN:
+    case BUILTIN_QUOTE:
+      return 1;
+    case BUILTIN_LET:
+      sym = car(cdr(c));
+      if (sym && sym->tag == TAG_SYM && !strcmp(sym->ar.addr, name)) {
+        if (!ret_int_form(car(cdr(cdr(c))), body, fn_frame, depth+1)) return 0;
+        (*found)++;
+      }
+      break;
+    }
+  }
+  for (; c && c->tag == TAG_CONS; c = cdr(c)) {
+    if (!ret_int_lets(car(c), name, body, fn_frame, depth, found)) return 0;
+  }
+  return 1;
+}
+
+static int ret_int_form(Cell* c, Cell* body, Arg* fn_frame, int depth) {
+  env_entry* e;
+  Cell* op;
+  Cell* last;
+
+  if (!c || depth>RET_INT_MAX_DEPTH) return 0;
+  if (c->tag == TAG_INT) return 1;
+  if (c->tag == TAG_SYM) {
+    int found = 0;
+    // args arrive boxed, and can be anything
+    if (get_sym_frame_idx(c->ar.addr, fn_frame, 0)>=0) return 0;
+    return ret_int_lets(body, c->ar.addr, body, fn_frame, depth, &found) && found;
+  }
+  if (c->tag != TAG_CONS || !car(c) || car(c)->tag != TAG_SYM) return 0;
+  e = lookup_global_symbol(car(c)->ar.addr);
+  if (!e || !(op = e->cell) || op->tag != TAG_BUILTIN) return 0;
+
+  if (op->ar.value>=BUILTIN_ADD && op->ar.value<=BUILTIN_EQ) return 1;
+  switch (op->ar.value) {
+  case BUILTIN_GET8: case BUILTIN_GET16: case BUILTIN_GET32: case BUILTIN_SIZE:
+    return 1;
+  case BUILTIN_IF:
+    return ret_int_form(car(cdr(cdr(c))), body, fn_frame, depth)
+      && ret_int_form(car(cdr(cdr(cdr(c)))), body, fn_frame, depth);
+  case BUILTIN_DO:
+    for (last = NULL, c = cdr(c); c && car(c); c = cdr(c)) last = car(c);
+    return ret_int_form(last, body, fn_frame, depth);
+  }
+  return 0;
+}
+
+// does the fn with body and args in fn_frame always give an int?
+static int fn_returns_int(Cell* body, Arg* fn_frame) {
+  return ret_int_form(body, body, fn_frame, 0);
+}
+
+// the cons that ends the signature of lambda
+static Cell* ret_int_sig_end(Cell* lambda) {
+  Cell* sig = car((Cell*)lambda->ar.addr);
+  while (sig && car(sig)) sig = cdr(sig);
+  return sig;
+}
+
+// the flags at the end of the signature of lambda
+int lambda_flags(Cell* lambda) {
+  Cell* end;
+  if (!lambda || lambda->tag != TAG_LAMBDA) return 0;
+  end = ret_int_sig_end(lambda);
+  if (!end || !cdr(end) || cdr(end)->tag != TAG_INT) return 0;
+  return cdr(end)->ar.value;
+}
+
+void lambda_set_flags(Cell* lambda, int flags) {
+  Cell* end = ret_int_sig_end(lambda);
+  if (end) end->dr.next = flags ? alloc_int(flags) : NULL;
+}
+
+// the RAW_* flags of lambda, 0 if it has no raw entry
+int lambda_raw(Cell* lambda) {
+  if (!lambda || !lambda->dr.next) return 0;
+  return lambda_flags(lambda) & RAW_MASK;
+}
+
+void lambda_set_raw(Cell* lambda, int raw) {
+  lambda_set_flags(lambda, (lambda_flags(lambda) & ~RAW_MASK) | raw);
+}
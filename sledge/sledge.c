@@ -2,6 +2,7 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include "minilisp.h"
 #include <stdlib.h>
 #include "alloc.h"
@@ -18,6 +19,10 @@
 #include "compiler_arm_hosted.c"
 #endif
 
+#ifdef CPU_ARM64
+#include "compiler_arm64_hosted.c"
+#endif
+
 #ifdef CPU_X86
 #include "compiler_x86.c"
 #endif
@@ -82,7 +87,25 @@ int main(int argc, char *argv[])
 #ifdef __AMIGA
   mount_amiga();
 #endif
+
+#ifdef JIT_PROFILE
+  if (profile_mode()) mount_profilefs();
+#endif
   
+#ifdef HEAP_IMAGE
+  if (argc>2 && !strcmp(argv[1],"--image")) {
+    if (!image_restore(argv[2], __builtin_frame_address(0))) exit(1);
+    argc-=2;
+    argv+=2;
+  }
+#endif
+
+#ifdef JIT_CACHE
+  if (argc>2 && !strcmp(argv[1],"--aot")) {
+    return jit_aot_main(argv[2], argc-3, &argv[3]);
+  }
+#endif
+
   if (argc==2) {
     in_fd = open(argv[1],O_RDONLY);
     in_f = fdopen(in_fd,"r");
@@ -176,7 +199,14 @@ Cell* platform_eval(Cell* expr) {
     return NULL;
   }
 
+#ifdef JIT_UNITS
+  Unit* unit = unit_begin(expr); // NULL unless INTERIM_UNITS is set
+#endif
+
   while (expr && (c = car(expr))) {
+#ifdef JIT_UNITS
+    if (unit) tag = unit_eval(unit, c, &res); else
+#endif
     tag = compile_for_platform(c, &res); 
   
     if (tag) {
@@ -188,11 +218,12 @@ Cell* platform_eval(Cell* expr) {
       printf("[platform_eval] stopped at expression %d: %s\r\n",i,buf);
       break;
     }
-    // TOOD: when to free the code blocks? -> when no bound lambdas involved
-    
     i++;
     expr = cdr(expr);
   }
+#ifdef JIT_UNITS
+  unit_end(unit);
+#endif
   free(buf);
   
   return res;
@@ -9,6 +9,16 @@ static int stream_id;
 
 typedef Cell* (*funcptr2)(Cell* a1, Cell* a2);
 
+// buffers handed out by fs_mmap, so they can be mapped again
+// when a heap image is restored
+typedef struct FsMapping {
+  void* addr;
+  char* path;
+} FsMapping;
+
+static FsMapping* fs_mappings;
+static int num_fs_mappings;
+
 // TODO: include fs_list in gc mark
 
 Cell* get_fs_list() {
@@ -72,7 +82,14 @@ Cell* fs_mmap(Cell* path) {
 
       if (fs->mmap_fn && fs->mmap_fn->dr.next) {
         Cell* mmap_fn = fs->mmap_fn;
-        return (Cell*)((funcptr2)mmap_fn->dr.next)(path, NULL);
+        Cell* res = (Cell*)((funcptr2)mmap_fn->dr.next)(path, NULL);
+        if (res && res->tag == TAG_BYTES && !fs_mmap_path(res)) {
+          fs_mappings = realloc(fs_mappings, (num_fs_mappings+1)*sizeof(FsMapping));
+          fs_mappings[num_fs_mappings].addr = res->ar.addr;
+          fs_mappings[num_fs_mappings].path = strdup(path->ar.addr);
+          num_fs_mappings++;
+        }
+        return res;
       } else {
         printf("[mmap] error: fs has no mmap implementation.");
         return alloc_nil();
@@ -83,6 +100,17 @@ Cell* fs_mmap(Cell* path) {
   return alloc_nil();
 }
 
+// the path the buffer of a byte cell was mmapped from, or NULL
+char* fs_mmap_path(Cell* bytes) {
+  int i;
+  for (i=num_fs_mappings-1; i>=0; i--) {
+    if (bytes->ar.addr && fs_mappings[i].addr == bytes->ar.addr) {
+      return fs_mappings[i].path;
+    }
+  }
+  return NULL;
+}
+
 Cell* fs_mount(Cell* path, Cell* handlers) {
   Filesystem* fs;
   Cell* fs_cell;
@@ -169,6 +197,23 @@ void fs_mount_builtin(char* path, void* open_handler, void* read_handler, void*
   fs_mount(alloc_string_copy(path), handlers);
 }
 
+// replace the mounted filesystems, i.e. with those of a heap image
+void fs_set_list(Cell* list) {
+  Cell* fsl;
+  fs_list = list;
+  num_fs = 0;
+  for (fsl = list; car(fsl); fsl = cdr(fsl)) num_fs++;
+}
+
+// run the open handler of a restored stream again
+void stream_reopen(Cell* stream) {
+  Stream* s = (Stream*)stream->ar.addr;
+  if (s && s->fs && s->fs->open_fn && s->fs->open_fn->dr.next) {
+    ((funcptr2)s->fs->open_fn->dr.next)(s->path, NULL);
+  }
+  if (s && s->id>=stream_id) stream_id = s->id+1;
+}
+
 Cell* filesystems_init() {
   fs_list = alloc_nil();
   return fs_list;
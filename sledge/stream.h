@@ -31,5 +31,8 @@ Cell* stream_read(Cell* stream);
 Cell* stream_write(Cell* stream, Cell* arg);
 void fs_mount_builtin(char* path, void* open_handler, void* read_handler, void* write_handler, void* delete_handler, void* mmap_handler);
 Cell* get_fs_list();
+void fs_set_list(Cell* list);
+char* fs_mmap_path(Cell* bytes);
+void stream_reopen(Cell* stream);
 
 #endif
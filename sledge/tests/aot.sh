@@ -0,0 +1,54 @@
+#!/bin/sh
+# compiles tests/aot.l ahead of time, links it into a second binary
+# like build_x64.sh does for the os layer, and checks that the forms
+# are taken from there and print the same. run from the sledge dir,
+# the test binary is built without sdl.
+# usage: tests/aot.sh [sledge]
+
+SLEDGE=${1:-./sledge}
+DIR=/tmp/aot_test.$$
+SRCS="sledge.c reader.c writer.c alloc.c strmap.c stream.c ../devices/posixfs.c"
+DEFS="-DCPU_X64 -DDEV_POSIXFS"
+
+run() {
+    INTERIM_TIER0=0 INTERIM_JIT_CACHE= $1 $DIR/run.l < /dev/null 2>&1 | tr -d "\r" | grep -v -e "^\\["
+}
+
+rm -rf $DIR
+mkdir -p $DIR
+STATUS=0
+echo '(eval (read (recv (open "/sd/tests/aot.l"))))' > $DIR/run.l
+
+INTERIM_JIT_CACHE= $SLEDGE --aot $DIR/aot.c tests/aot.l > /dev/null 2>&1 &&
+cc -g -o $DIR/sledge --std=gnu99 -O1 -I. ${SRCS} $DIR/aot.c -lm ${DEFS} -DJIT_AOT
+if [ ! -x $DIR/sledge ] ; then
+    echo "aot build: FAILED"
+    rm -rf $DIR
+    exit 1
+fi
+
+run $SLEDGE > $DIR/plain.out
+run $DIR/sledge > $DIR/aot.out
+# use-twice takes the escape flags of twice, code like that is not
+# stored (see constglobal.c) and is compiled at boot
+for NAME in test first-char apt-sum count-up twice ; do
+    if ! grep -q "^native def $NAME\$" $DIR/aot.out ; then
+        echo "aot binary: $NAME NOT NATIVE"
+        STATUS=1
+    fi
+done
+if [ $STATUS = 0 ] ; then
+    echo "aot binary: native"
+fi
+grep -v " def " $DIR/plain.out > $DIR/plain.cmp
+grep -v " def " $DIR/aot.out > $DIR/aot.cmp
+if diff $DIR/plain.cmp $DIR/aot.cmp > /dev/null && ! grep -q FAIL $DIR/aot.cmp ; then
+    echo "output: same"
+else
+    echo "output: DIFF"
+    diff $DIR/plain.cmp $DIR/aot.cmp | head -20
+    STATUS=1
+fi
+
+rm -rf $DIR
+exit $STATUS
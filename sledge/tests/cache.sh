@@ -0,0 +1,60 @@
+#!/bin/sh
+# runs a program twice with an empty compiled-code cache. the second
+# run has to take every def from the cache and print the same. then
+# a def whose struct changed has to be compiled again.
+# usage: tests/cache.sh [sledge] [file.l]
+
+SLEDGE=${1:-./sledge}
+SRC=${2:-tests/cache.l}
+DIR=/tmp/cache_test.$$
+
+run() {
+    INTERIM_TIER0=0 INTERIM_JIT_CACHE=$DIR $SLEDGE $1 < /dev/null 2>&1 | grep -v -e "^\\["
+}
+
+rm -rf $DIR
+mkdir -p $DIR
+STATUS=0
+
+run $SRC > /tmp/cache_first.out
+run $SRC > /tmp/cache_second.out
+if grep -q "^compiled def" /tmp/cache_second.out ; then
+    echo "second run: COMPILED AGAIN"
+    grep "^compiled def" /tmp/cache_second.out | head -5
+    STATUS=1
+elif ! grep -q "^cached def" /tmp/cache_second.out ; then
+    echo "second run: NOT CACHED"
+    STATUS=1
+else
+    echo "second run: cached"
+fi
+grep -v -e "^compiled def" -e "^cached def" /tmp/cache_first.out > /tmp/cache_first.cmp
+grep -v -e "^compiled def" -e "^cached def" /tmp/cache_second.out > /tmp/cache_second.cmp
+if diff /tmp/cache_first.cmp /tmp/cache_second.cmp > /dev/null ; then
+    echo "output: same"
+else
+    echo "output: DIFF"
+    diff /tmp/cache_first.cmp /tmp/cache_second.cmp | head -20
+    STATUS=1
+fi
+
+# the same def over a struct with its fields swapped
+for ORDER in "x 1 y 2" "y 2 x 1" ; do
+    cat > $DIR/struct.l <<LISP
+(struct cpt $ORDER)
+(def cpt-x (fn (p cpt) (sget p x)))
+(def p1 (new cpt))
+(sput p1 x 5)
+(print (cpt-x p1))
+LISP
+    run $DIR/struct.l > /tmp/cache_struct.out
+done
+if grep -q "^5" /tmp/cache_struct.out && grep -q "^compiled def cpt-x" /tmp/cache_struct.out ; then
+    echo "changed struct: compiled again"
+else
+    echo "changed struct: STALE"
+    STATUS=1
+fi
+
+rm -rf $DIR
+exit $STATUS
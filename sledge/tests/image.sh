@@ -0,0 +1,48 @@
+#!/bin/sh
+# runs tests/image.l and saves the heap, then restores it with
+# sledge --image in a new process, which has to see the same globals
+# and run the saved code without compiling it again.
+# usage: tests/image.sh [sledge]
+
+SLEDGE=${1:-./sledge}
+DIR=/tmp/image_test.$$
+
+rm -rf $DIR
+mkdir -p $DIR
+STATUS=0
+
+cat tests/image.l > $DIR/save.l
+echo "(save \"$DIR/sledge.img\")" >> $DIR/save.l
+
+# the saved fns called, then rebinding a callee and a defconst
+cat > $DIR/restored.l <<LISP
+(test 4 (eq (+ im-n (car (cdr im-l))) 1236))
+(test 5 (eq (im-call) 145))
+(sput im-p x 2)
+(test 6 (eq (im-sum im-p) 42))
+(def im-first (fn s 0))
+(test 7 (eq (im-call) 42))
+(defconst im-w 640)
+(test 8 (eq (im-half) 320))
+(def im-new (fn (im-half)))
+(test 9 (eq (im-new) 320))
+LISP
+
+for TIER0 in 0 1 ; do
+    rm -f $DIR/sledge.img
+    INTERIM_TIER0=$TIER0 INTERIM_JIT_CACHE= $SLEDGE $DIR/save.l < /dev/null > $DIR/save.out 2>&1
+    INTERIM_TIER0=$TIER0 INTERIM_JIT_CACHE= $SLEDGE --image $DIR/sledge.img $DIR/restored.l < /dev/null > $DIR/restored.out 2>&1
+    if [ `grep -c "OK\")" $DIR/save.out` != 3 ] || [ `grep -c "OK\")" $DIR/restored.out` != 6 ] ; then
+        echo "INTERIM_TIER0=$TIER0: FAILED"
+        grep -v -e "def " $DIR/save.out $DIR/restored.out | head -20
+        STATUS=1
+    elif grep -q -e "def im-call" -e "def im-sum" $DIR/restored.out ; then
+        echo "INTERIM_TIER0=$TIER0: COMPILED AGAIN"
+        STATUS=1
+    else
+        echo "INTERIM_TIER0=$TIER0: restored"
+    fi
+done
+
+rm -rf $DIR
+exit $STATUS
@@ -0,0 +1,57 @@
+#!/bin/sh
+# runs a program with INTERIM_PERF=map and checks the names in
+# /tmp/perf-<pid>.map, then with INTERIM_PERF=jitdump and checks the
+# header of /tmp/jit-<pid>.dump. neither may change what it prints.
+# usage: tests/perf.sh [sledge]
+
+SLEDGE=${1:-./sledge}
+SRC=/tmp/perf_test.l
+
+cat > $SRC <<EOF2
+(def pf-add (fn a b (+ a b)))
+(def pf-outer (fn x (do (let f (fn y (* y 2))) (pf-add x 1))))
+(print (pf-outer 3))
+(def pf-loop (fn n (do (while (gt n 0) (let n (- n 1))) n)))
+(print (pf-loop 5))
+EOF2
+
+run() {
+    INTERIM_TIER0=0 INTERIM_JIT_CACHE= INTERIM_PERF=$1 $SLEDGE $SRC < /dev/null > /tmp/perf_$2.raw 2>&1 &
+    PID=$!
+    wait $PID
+    grep -v -e "^\\[" /tmp/perf_$2.raw > /tmp/perf_$2.out
+}
+
+STATUS=0
+run "" off
+run map map
+MAP=/tmp/perf-$PID.map
+for NAME in "pf-add" "pf-outer" "fn in pf-outer" "pf-loop" "toplevel" ; do
+    if ! grep -q -e "^[0-9a-f]* [0-9a-f]* $NAME\$" $MAP 2>/dev/null ; then
+        echo "INTERIM_PERF=map: $NAME MISSING"
+        STATUS=1
+    fi
+done
+if [ $STATUS = 0 ] ; then
+    echo "INTERIM_PERF=map: named"
+fi
+rm -f $MAP
+
+run jitdump jitdump
+DUMP=/tmp/jit-$PID.dump
+if [ "`od -A n -t x4 -N 8 $DUMP 2>/dev/null | tr -s ' '`" = " 4a695444 00000001" ] ; then
+    echo "INTERIM_PERF=jitdump: written"
+else
+    echo "INTERIM_PERF=jitdump: BAD HEADER"
+    STATUS=1
+fi
+rm -f $DUMP
+
+for MODE in map jitdump ; do
+    if ! diff /tmp/perf_off.out /tmp/perf_$MODE.out > /dev/null ; then
+        echo "INTERIM_PERF=$MODE: DIFF"
+        diff /tmp/perf_off.out /tmp/perf_$MODE.out | head -20
+        STATUS=1
+    fi
+done
+exit $STATUS
@@ -0,0 +1,43 @@
+#!/bin/sh
+# runs a program with and without INTERIM_PROFILE, profiling must not
+# change what it prints. then checks the call counts at /sys/profile.
+# usage: tests/profile.sh [sledge] [file.l]
+
+SLEDGE=${1:-./sledge}
+SRC=${2:-tests/profile.l}
+
+run() {
+    INTERIM_JIT_CACHE= INTERIM_PROFILE=$1 $SLEDGE $SRC < /dev/null 2>&1 | grep -v -e "^compiled def" -e "^interpreted def" -e "^\\["
+}
+
+run "" > /tmp/profile_off.out
+STATUS=0
+for MODE in calls cycles ; do
+    run $MODE > /tmp/profile_$MODE.out
+    if diff /tmp/profile_off.out /tmp/profile_$MODE.out > /dev/null ; then
+        echo "INTERIM_PROFILE=$MODE: same"
+    else
+        echo "INTERIM_PROFILE=$MODE: DIFF"
+        diff /tmp/profile_off.out /tmp/profile_$MODE.out | head -20
+        STATUS=1
+    fi
+done
+
+# three calls of a fn, in both modes
+SRC=/tmp/profile_count.l
+cat > $SRC <<EOF
+(def prof-count (fn n n))
+(prof-count 1)
+(prof-count 2)
+(prof-count 3)
+(print (recv (open "/sys/profile")))
+EOF
+for MODE in calls cycles ; do
+    if run $MODE | grep -q -e "^ *3 .*prof-count\$" ; then
+        echo "INTERIM_PROFILE=$MODE: counted"
+    else
+        echo "INTERIM_PROFILE=$MODE: NOT COUNTED"
+        STATUS=1
+    fi
+done
+exit $STATUS
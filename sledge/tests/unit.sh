@@ -0,0 +1,47 @@
+#!/bin/sh
+# evaluates tests/unit.l with and without INTERIM_UNITS, both have to
+# print the same. then rebinds a unit fn from outside of its unit,
+# which its callers inside the unit don't see.
+# usage: tests/unit.sh [sledge]
+
+SLEDGE=${1:-./sledge}
+DIR=/tmp/unit_test.$$
+
+run() {
+    INTERIM_UNITS=$1 INTERIM_JIT_CACHE= $SLEDGE $2 < /dev/null 2>&1 | grep -v -e " def " -e "^\\["
+}
+
+rm -rf $DIR
+mkdir -p $DIR
+STATUS=0
+
+echo '(eval (read (recv (open "/sd/tests/unit.l"))))' > $DIR/run.l
+run "" $DIR/run.l > $DIR/plain.out
+run 1 $DIR/run.l > $DIR/unit.out
+if [ `grep -c "OK\")" $DIR/unit.out` != 6 ] ; then
+    echo "INTERIM_UNITS=1: FAILED"
+    grep -v "OK\")" $DIR/unit.out | head -20
+    STATUS=1
+elif diff $DIR/plain.out $DIR/unit.out > /dev/null ; then
+    echo "INTERIM_UNITS=1: same"
+else
+    echo "INTERIM_UNITS=1: DIFF"
+    diff $DIR/plain.out $DIR/unit.out | head -20
+    STATUS=1
+fi
+
+# un-pair rebound from the repl
+cat $DIR/run.l > $DIR/rebind.l
+cat >> $DIR/rebind.l <<LISP
+(def un-pair (fn a (cons 7 a)))
+(print (un-first 9))
+LISP
+if run 1 $DIR/rebind.l | grep -q "^9" && run "" $DIR/rebind.l | grep -q "^7" ; then
+    echo "rebound outside: bound at compile time"
+else
+    echo "rebound outside: WRONG"
+    STATUS=1
+fi
+
+rm -rf $DIR
+exit $STATUS
@@ -0,0 +1,1179 @@
+// tier-0 interpreter (x64 hosted)
+//
+// most top-level forms are evaluated exactly once: REPL lines, setup
+// code of the os files, forms sent to eval by the repl task or
+// remote-cmd. compiling them costs more than running them, so forms
+// without loops are walked directly over their cells instead. builtins
+// behave like their compiled versions in compile_expr, including raw
+// integer arithmetic between int lets.
+//
+// a (fn ...) evaluated here becomes an interpreted lambda. its code is
+// a small stub that enters the interpreter, so compiled callers don't
+// need to know. calls are counted, and after TIER0_HOT_CALLS calls the
+// lambda is promoted: its fn form is compiled and the lambda points to
+// the native code from then on. forms containing a while loop are hot
+// by construction and always compiled right away, as are forms that
+// have a record in the compiled-code cache.
+//
+// set INTERIM_TIER0 to 0 to compile everything, or to the number of
+// calls after which a lambda is promoted.
+
+#define TIER0_HOT_CALLS 32
+#define TIER0_MAX_SLOTS 4096
+#define TIER0_MAX_TEMPS 4096
+#define TIER0_STUB_SIZE 23
+
+int jit_cache_has(Cell* expr);
+
+typedef struct Tier0Fn {
+  Cell* lambda;
+  Cell* form;     // the (fn ...) it was made from, NULL after image restore
+  uint8_t* stub;
+  int calls;
+  int no_promote; // compiling failed, stay interpreted
+  int stale;      // its compiled code is outdated, see tier0_make_stale
+} Tier0Fn;
+
+// a local of an interpreted call: an argument or a let
+typedef struct Tier0Slot {
+  char* name;
+  Cell* cell;
+  jit_word_t value;
+  int is_int;
+} Tier0Slot;
+
+// locals known while checking a form, like the Frame of compile_expr.
+// types holds the struct definition of typed locals.
+typedef struct Tier0Scope {
+  char* names[MAXFRAME];
+  Cell* types[MAXFRAME];
+  int count;
+  int in_fn;
+} Tier0Scope;
+
+static int tier0_state = 0; // 0 = uninitialized, -1 = off, else promotion threshold
+
+static Tier0Fn* tier0_fns = NULL;
+static int tier0_fns_count = 0;
+static int tier0_fns_size = 0;
+static int* tier0_by_lambda = NULL; // index+1, open addressing
+static int* tier0_by_form = NULL;
+static int tier0_hash_size = 0;
+
+static Tier0Slot tier0_slots[TIER0_MAX_SLOTS];
+static int tier0_slots_used = 0;
+static int tier0_frame = 0; // first slot of the current call
+
+// values that nothing else points to while their siblings are evaluated
+static Cell* tier0_temps[TIER0_MAX_TEMPS];
+static int tier0_temps_used = 0;
+
+static void* tier0_stack_end = NULL;
+
+Cell* tier0_call_native(void* entry, Cell** args, jit_word_t argc);
+void tier0_enter();
+
+static int tier0_eval_any(Cell* expr, Cell** res, jit_word_t* value);
+
+static int tier0_init() {
+  char* env;
+  if (tier0_state) return tier0_state>0;
+
+  tier0_state = TIER0_HOT_CALLS;
+  env = getenv("INTERIM_TIER0");
+  if (env && env[0]) {
+    tier0_state = atoi(env);
+    if (tier0_state<=0) tier0_state = -1;
+  }
+  return tier0_state>0;
+}
+
+static void tier0_mark_roots() {
+  int i;
+  for (i=0; i<tier0_slots_used; i++) {
+    if (!tier0_slots[i].is_int) mark_tree(tier0_slots[i].cell);
+  }
+  for (i=0; i<tier0_temps_used; i++) {
+    mark_tree(tier0_temps[i]);
+  }
+  for (i=0; i<tier0_fns_count; i++) {
+    mark_tree(tier0_fns[i].lambda);
+    mark_tree(tier0_fns[i].form);
+  }
+}
+
+static void tier0_push_temp(Cell* c) {
+  if (tier0_temps_used>=TIER0_MAX_TEMPS) {
+    printf("<tier0: too many temporaries>\r\n");
+    exit(1);
+  }
+  tier0_temps[tier0_temps_used++] = c;
+}
+
+static Cell* tier0_eval(Cell* expr) {
+  Cell* res;
+  jit_word_t value;
+  if (tier0_eval_any(expr, &res, &value)) {
+    return alloc_int(value);
+  }
+  return res;
+}
+
+static jit_word_t tier0_eval_int(Cell* expr) {
+  Cell* res;
+  jit_word_t value;
+  if (tier0_eval_any(expr, &res, &value)) {
+    return value;
+  }
+  return res ? res->ar.value : 0;
+}
+
+// ---------------------------------------------------------------------
+// interpreted lambdas
+
+static uint32_t tier0_ptr_hash(void* p) {
+  uint64_t v = (uint64_t)(jit_word_t)p;
+  v ^= v>>17;
+  v *= 0xed5ad4bbULL;
+  v ^= v>>11;
+  return (uint32_t)v;
+}
+
+static void tier0_hash_put(int* table, void* key, int idx) {
+  uint32_t h = tier0_ptr_hash(key) & (tier0_hash_size-1);
+  while (table[h]) h = (h+1) & (tier0_hash_size-1);
+  table[h] = idx+1;
+}
+
+static Tier0Fn* tier0_find(int* table, void* key, int by_form) {
+  uint32_t h;
+  if (!key || !tier0_hash_size) return NULL;
+  h = tier0_ptr_hash(key) & (tier0_hash_size-1);
+  while (table[h]) {
+    Tier0Fn* f = &tier0_fns[table[h]-1];
+    if ((by_form ? f->form : f->lambda) == key) return f;
+    h = (h+1) & (tier0_hash_size-1);
+  }
+  return NULL;
+}
+
+static Tier0Fn* tier0_add_fn(Cell* lambda, Cell* form, uint8_t* stub) {
+  Tier0Fn* f;
+  int i;
+  if (tier0_fns_count>=tier0_fns_size) {
+    tier0_fns_size = tier0_fns_size ? tier0_fns_size*2 : 64;
+    tier0_fns = realloc(tier0_fns, tier0_fns_size*sizeof(Tier0Fn));
+  }
+  f = &tier0_fns[tier0_fns_count++];
+  f->lambda = lambda;
+  f->form = form;
+  f->stub = stub;
+  f->calls = 0;
+  f->no_promote = 0;
+  f->stale = 0;
+
+  if (tier0_fns_count*2 > tier0_hash_size) {
+    free(tier0_by_lambda);
+    free(tier0_by_form);
+    tier0_hash_size = 4*tier0_fns_size;
+    tier0_by_lambda = calloc(tier0_hash_size, sizeof(int));
+    tier0_by_form = calloc(tier0_hash_size, sizeof(int));
+    for (i=0; i<tier0_fns_count-1; i++) {
+      tier0_hash_put(tier0_by_lambda, tier0_fns[i].lambda, i);
+      if (tier0_fns[i].form) tier0_hash_put(tier0_by_form, tier0_fns[i].form, i);
+    }
+  }
+  tier0_hash_put(tier0_by_lambda, lambda, tier0_fns_count-1);
+  if (form) tier0_hash_put(tier0_by_form, form, tier0_fns_count-1);
+  return f;
+}
+
+// movabs $lambda, %rax; movabs $tier0_enter, %r11; jmp *%r11
+static uint8_t* tier0_make_stub(Cell* lambda) {
+  uint8_t* stub = code_alloc(TIER0_STUB_SIZE);
+  uint32_t relocs[2] = {2, 12};
+  jit_word_t v;
+  if (!stub) return NULL;
+
+  stub[0] = 0x48; stub[1] = 0xb8;
+  v = (jit_word_t)lambda;
+  memcpy(stub+2, &v, 8);
+  stub[10] = 0x49; stub[11] = 0xbb;
+  v = (jit_word_t)tier0_enter;
+  memcpy(stub+12, &v, 8);
+  stub[20] = 0x41; stub[21] = 0xff; stub[22] = 0xe3;
+
+  code_set_relocs(stub, relocs, 2);
+  code_seal(stub);
+  return stub;
+}
+
+// is this lambda (still) running in the interpreter?
+static Tier0Fn* tier0_interpreted(Cell* lambda) {
+  Tier0Fn* f = tier0_find(tier0_by_lambda, lambda, 0);
+  uint8_t* start;
+  size_t size;
+  uint32_t* relocs;
+  int num_relocs;
+  jit_word_t target;
+
+  if (f) return (lambda->dr.next == f->stub) ? f : NULL;
+
+  // a lambda restored from a heap image keeps its stub, but has no record
+  if (!code_blob_info(lambda->dr.next, &start, &size, &relocs, &num_relocs)) return NULL;
+  if (start != lambda->dr.next || size < TIER0_STUB_SIZE) return NULL;
+  memcpy(&target, start+12, sizeof(target));
+  if (start[0] != 0x48 || start[1] != 0xb8 || target != (jit_word_t)tier0_enter) return NULL;
+  return tier0_add_fn(lambda, NULL, start);
+}
+
+static int tier0_has_while(Cell* expr) {
+  for (; expr && expr->tag == TAG_CONS; expr = cdr(expr)) {
+    Cell* c = car(expr);
+    if (c && c->tag == TAG_SYM && !strcmp(c->ar.addr, "while")) return 1;
+    if (c && c->tag == TAG_CONS && tier0_has_while(c)) return 1;
+  }
+  return 0;
+}
+
+// compile a (fn ...) form, returns its lambda. like all compiled
+// lambdas, it scans the stack up to where the interpreter started.
+static Cell* tier0_compile_fn(Cell* form) {
+  Cell* res = NULL;
+  void* saved = toplevel_stack_end;
+  int ok;
+  toplevel_stack_end = tier0_stack_end;
+  ok = compile_toplevel(form, &res, 1);
+  toplevel_stack_end = saved;
+  if (!ok || !res || res->tag != TAG_LAMBDA) return NULL;
+  return res;
+}
+
+// builds the lambda like BUILTIN_FN does, minus the code
+static Cell* tier0_make_lambda(Cell* form) {
+  Cell* args = cdr(form);
+  Cell* params[MAXARGS];
+  Cell* sig;
+  Cell* body = NULL;
+  Cell* lambda;
+  int n = 0, i;
+
+  for (; car(args); args = cdr(args)) {
+    if (!car(cdr(args))) {
+      body = car(args);
+      break;
+    }
+    params[n++] = car(args);
+  }
+
+  sig = alloc_nil();
+  tier0_push_temp(sig);
+  for (i=n-1; i>=0; i--) {
+    Cell* p = params[i];
+    Cell* proto = prototype_any;
+    if (p->tag == TAG_CONS) {
+      proto = lookup_global_symbol(car(cdr(p))->ar.addr)->cell;
+      p = car(p);
+    }
+    sig = alloc_cons(alloc_cons(alloc_sym(p->ar.addr), proto), sig);
+    tier0_temps[tier0_temps_used-1] = sig;
+  }
+  lambda = alloc_lambda(alloc_cons(sig, body));
+  lambda->dr.next = 0;
+  tier0_temps_used--;
+  return lambda;
+}
+
+static Cell* tier0_fn(Cell* form) {
+  Cell* lambda;
+  Tier0Fn* f;
+
+  // like compiled code, evaluating the same fn form again
+  // yields the same lambda
+  f = tier0_find(tier0_by_form, form, 1);
+  if (f) return f->lambda;
+
+  if (tier0_has_while(form)) {
+    lambda = tier0_compile_fn(form);
+    return lambda ? lambda : alloc_nil();
+  }
+
+  lambda = tier0_make_lambda(form);
+  lambda->dr.next = tier0_make_stub(lambda);
+  if (!lambda->dr.next) return alloc_nil();
+  tier0_add_fn(lambda, form, lambda->dr.next);
+  return lambda;
+}
+
+static void tier0_name_iter(const char *key, void *value, const void *obj) {
+  env_entry* e = (env_entry*)value;
+  char** name = (char**)obj;
+  if (e->cell == (Cell*)name[1]) name[0] = e->name;
+}
+
+// a global name lambda is bound to, or NULL
+static char* tier0_lambda_name(Cell* lambda) {
+  char* name[2] = {NULL, (char*)lambda};
+  sm_enum(global_env, tier0_name_iter, name);
+  return name[0];
+}
+
+// rebuild the (fn ...) form of an interpreted lambda from its signature
+static Cell* tier0_fn_form(Cell* lambda) {
+  Cell* sig = car((Cell*)lambda->ar.addr);
+  Cell* form = alloc_cons(cdr((Cell*)lambda->ar.addr), alloc_nil());
+  Cell* params[MAXARGS];
+  int n = 0, i;
+
+  tier0_push_temp(form);
+  for (; car(sig); sig = cdr(sig)) {
+    Cell* proto = cdr(car(sig));
+    params[n] = car(car(sig));
+    if (proto && proto->tag == TAG_STRUCT_DEF) {
+      Cell* struct_name = ((Cell**)proto->ar.addr)[0];
+      params[n] = alloc_cons(params[n], alloc_cons(struct_name, alloc_nil()));
+      tier0_push_temp(params[n]);
+    }
+    n++;
+  }
+  for (i=n-1; i>=0; i--) {
+    form = alloc_cons(params[i], form);
+  }
+  return alloc_cons(alloc_sym("fn"), form);
+}
+
+// compile lambda again from its source. the lambda itself stays, so
+// its callers and the env run the new code from now on.
+#if defined(JIT_STACK_CELLS) && defined(JIT_CONST_GLOBALS)
+#define TIER0_MAX_ALIASES 16
+
+typedef struct Tier0Users {
+  Cell* lambda;
+  env_entry* envs[TIER0_MAX_ALIASES];
+  int num;
+} Tier0Users;
+
+static void tier0_users_iter(const char *key, void *value, const void *obj) {
+  env_entry* e = (env_entry*)value;
+  Tier0Users* u = (Tier0Users*)obj;
+  if (e->cell == u->lambda && e->uses && u->num<TIER0_MAX_ALIASES) u->envs[u->num++] = e;
+}
+
+// the callers that build stack cells for lambda, or took their own
+// ESC_ARG flags from it, were compiled for its old flags (see escape.c).
+// they are compiled again like after a rebinding of lambda, which does
+// the same for their callers if their flags change.
+static void tier0_flags_changed(Cell* lambda) {
+  Tier0Users u;
+  int i;
+  u.lambda = lambda;
+  u.num = 0;
+  sm_enum(global_env, tier0_users_iter, &u);
+  for (i=0; i<u.num; i++) {
+    const_global_rebound(u.envs[i]);
+  }
+}
+#endif
+
+static int tier0_recompile(Cell* lambda) {
+  int saved_temps = tier0_temps_used;
+  Cell* form = tier0_fn_form(lambda);
+  Cell* compiled;
+#ifdef JIT_RET_INT
+  int old_flags = lambda_flags(lambda);
+#endif
+#ifdef JIT_CONST_GLOBALS
+  Cell* saved_target = const_fn_target;
+#endif
+
+  tier0_temps_used = saved_temps;
+  tier0_push_temp(form);
+  // lets self-recursive tail calls become loops
+  def_fn_form = form;
+  def_fn_name = tier0_lambda_name(lambda);
+#ifdef JIT_CONST_GLOBALS
+  const_fn_target = lambda;
+#endif
+  compiled = tier0_compile_fn(form);
+#ifdef JIT_CONST_GLOBALS
+  const_fn_target = saved_target;
+#endif
+  tier0_temps_used = saved_temps;
+
+  if (!compiled || !compiled->dr.next) return 0;
+  lambda->dr.next = compiled->dr.next;
+#ifdef JIT_RET_INT
+  lambda_set_flags(lambda, lambda_flags(compiled));
+#endif
+#ifdef JIT_DIRECT_CALLS
+  callsite_relink_lambda(lambda);
+#endif
+#if defined(JIT_STACK_CELLS) && defined(JIT_CONST_GLOBALS)
+  if ((lambda_flags(lambda) ^ old_flags) & ESC_ARGS_ALL) tier0_flags_changed(lambda);
+#endif
+  return 1;
+}
+
+static void tier0_promote(Tier0Fn* f) {
+  if (!tier0_recompile(f->lambda)) f->no_promote = 1;
+}
+
+#ifdef JIT_CONST_GLOBALS
+// a rebinding needs lambda recompiled, but it doesn't compile anymore,
+// e.g. a fn inlined in it is now bound to an int. its old code must not
+// run, so lambda gets a stub like an interpreted one. calls report the
+// error until another rebinding lets tier0_recompile succeed.
+static void tier0_make_stale(Cell* lambda) {
+  Tier0Fn* f = tier0_find(tier0_by_lambda, lambda, 0);
+  uint8_t* stub = tier0_make_stub(lambda);
+#ifdef JIT_RET_INT
+  int old_flags = lambda_flags(lambda);
+#endif
+  if (!stub) return;
+
+  if (!f) f = tier0_add_fn(lambda, NULL, stub);
+  f->stub = stub;
+  f->no_promote = 1;
+  f->stale = 1;
+  lambda->dr.next = stub;
+#ifdef JIT_RET_INT
+  lambda_set_flags(lambda, 0);
+#endif
+#ifdef JIT_DIRECT_CALLS
+  callsite_relink_lambda(lambda);
+#endif
+#if defined(JIT_STACK_CELLS) && defined(JIT_CONST_GLOBALS)
+  if (old_flags & ESC_ARGS_ALL) tier0_flags_changed(lambda);
+#endif
+}
+#endif
+
+// ---------------------------------------------------------------------
+// evaluation
+
+static Tier0Slot* tier0_find_slot(char* name) {
+  int i;
+  for (i=tier0_slots_used-1; i>=tier0_frame; i--) {
+    if (!strcmp(tier0_slots[i].name, name)) return &tier0_slots[i];
+  }
+  return NULL;
+}
+
+static Tier0Slot* tier0_new_slot(char* name) {
+  Tier0Slot* s;
+  if (tier0_slots_used>=TIER0_MAX_SLOTS) {
+    printf("<tier0: too many locals>\r\n");
+    exit(1);
+  }
+  s = &tier0_slots[tier0_slots_used++];
+  s->name = name;
+  s->cell = NULL;
+  s->value = 0;
+  s->is_int = 0;
+  return s;
+}
+
+static Cell* tier0_interpret(Cell* lambda, Cell** args, int argc) {
+  Cell* sig = car((Cell*)lambda->ar.addr);
+  Cell* res;
+  int saved_frame = tier0_frame;
+  int saved_used = tier0_slots_used;
+  int i;
+
+  tier0_frame = tier0_slots_used;
+  for (i=0; i<argc && car(sig); i++, sig = cdr(sig)) {
+    tier0_new_slot(car(car(sig))->ar.addr)->cell = args[i];
+  }
+
+  res = tier0_eval(cdr((Cell*)lambda->ar.addr));
+
+  tier0_slots_used = saved_used;
+  tier0_frame = saved_frame;
+  return res;
+}
+
+// args has room for ARG_SPILLOVER entries past argc
+static Cell* tier0_apply(Cell* lambda, Cell** args, int argc) {
+  Tier0Fn* f = tier0_interpreted(lambda);
+
+  if (f && f->stale) {
+    printf("<tier0: lambda %p could not be recompiled after a redefinition>\r\n",lambda);
+    return alloc_nil();
+  }
+  if (f && !f->no_promote && tier0_state>0 && ++f->calls >= tier0_state) {
+    tier0_promote(f);
+    f = tier0_interpreted(lambda);
+  }
+  if (f) return tier0_interpret(lambda, args, argc);
+
+  if (!lambda->dr.next) {
+    printf("<tier0: lambda %p has no code>\r\n",lambda);
+    return alloc_nil();
+  }
+  return tier0_call_native(lambda->dr.next, args, argc);
+}
+
+// called by tier0_enter for compiled callers of an interpreted lambda.
+// spill points to the arguments passed on the stack.
+__attribute__((used))
+Cell* tier0_apply_native(Cell* lambda, Cell* a0, Cell* a1, Cell* a2, Cell** spill) {
+  Cell* args[MAXARGS+ARG_SPILLOVER];
+  Cell* sig = car((Cell*)lambda->ar.addr);
+  int saved_temps = tier0_temps_used;
+  int argc = 0;
+  Cell* res;
+
+  tier0_init();
+  for (; car(sig) && argc<MAXARGS; sig = cdr(sig), argc++) {
+    if (argc==0) args[argc] = a0;
+    else if (argc==1) args[argc] = a1;
+    else if (argc==2) args[argc] = a2;
+    else args[argc] = spill[argc-ARG_SPILLOVER];
+    tier0_push_temp(args[argc]);
+  }
+  args[argc] = args[argc+1] = args[argc+2] = NULL;
+
+  res = tier0_apply(lambda, args, argc);
+  tier0_temps_used = saved_temps;
+  return res;
+}
+
+static Cell* tier0_call(Cell* op, Cell* args_expr) {
+  Cell* args[MAXARGS+ARG_SPILLOVER];
+  int saved_temps = tier0_temps_used;
+  int argc = 0;
+  Cell* res;
+
+  for (; car(args_expr) && argc<MAXARGS; args_expr = cdr(args_expr), argc++) {
+    args[argc] = tier0_eval(car(args_expr));
+    tier0_push_temp(args[argc]);
+  }
+  args[argc] = args[argc+1] = args[argc+2] = NULL;
+
+  res = tier0_apply(op, args, argc);
+  tier0_temps_used = saved_temps;
+  return res;
+}
+
+static int tier0_field_idx(Cell* def, char* name) {
+  Cell** fields = def->ar.addr;
+  int i;
+  for (i=0; i<def->dr.size/2; i++) {
+    if (!strcmp(name, fields[1+i*2]->ar.addr)) return i+1;
+  }
+  return 0;
+}
+
+// the field of a struct instance, looked up in its definition
+static Cell** tier0_field(Cell* s, Cell* name) {
+  Cell** elements;
+  int idx;
+  if (!s || s->tag != TAG_STRUCT) return NULL;
+  elements = s->ar.addr;
+  idx = tier0_field_idx(elements[0], name->ar.addr);
+  return idx ? &elements[idx] : NULL;
+}
+
+static Cell* tier0_struct(Cell* args) {
+  Cell* name_sym = car(args);
+  Cell* def;
+  Cell** fields;
+  Cell* a;
+  int saved_temps = tier0_temps_used;
+  int n = 1, i;
+
+  for (a = cdr(args); car(a); a = cdr(cdr(a))) n+=2;
+  def = alloc_struct_def(n);
+  fields = def->ar.addr;
+  for (i=0; i<n; i++) fields[i] = NULL;
+  tier0_push_temp(def);
+
+  fields[0] = name_sym;
+  for (a = cdr(args), i = 1; car(a); a = cdr(cdr(a)), i+=2) {
+    fields[i] = car(a);
+    fields[i+1] = tier0_eval(car(cdr(a)));
+  }
+  insert_global_symbol(name_sym, def);
+  tier0_temps_used = saved_temps;
+  return def;
+}
+
+static Cell* tier0_list(Cell* args) {
+  int saved_temps = tier0_temps_used;
+  int n = 0;
+  Cell* res;
+
+  for (; car(args); args = cdr(args), n++) {
+    tier0_push_temp(tier0_eval(car(args)));
+  }
+  res = alloc_nil();
+  while (n--) {
+    res = alloc_cons(tier0_temps[saved_temps+n], res);
+  }
+  tier0_temps_used = saved_temps;
+  return res;
+}
+
+// a new let slot holds a raw integer if its value is an int constant
+// or an int local, an existing one keeps its kind
+static int tier0_let(Cell* args, Cell** res, jit_word_t* value) {
+  char* name = car(args)->ar.addr;
+  Cell* val = car(cdr(args));
+  Tier0Slot* s = tier0_find_slot(name);
+
+  if (!s) {
+    Tier0Slot* src = (val->tag == TAG_SYM) ? tier0_find_slot(val->ar.addr) : NULL;
+    int is_int = (val->tag == TAG_INT) || (src && src->is_int);
+    s = tier0_new_slot(name);
+    s->is_int = is_int;
+  }
+
+  if (s->is_int) {
+    s->value = tier0_eval_int(val);
+    *value = s->value;
+    return 1;
+  }
+  s->cell = tier0_eval(val);
+  *res = s->cell;
+  return 0;
+}
+
+// evaluates expr. builtins that compile to raw integers set *value
+// and return 1, everything else stores a cell in *res and returns 0.
+static int tier0_eval_any(Cell* expr, Cell** res, jit_word_t* value) {
+  Cell* op;
+  Cell* args;
+  env_entry* e;
+  jit_word_t a, b;
+  Cell* x, *y;
+
+  *res = NULL;
+  if (!expr) return 0;
+
+  if (expr->tag == TAG_SYM) {
+    Tier0Slot* s = tier0_find_slot(expr->ar.addr);
+    if (s && s->is_int) {
+      *value = s->value;
+      return 1;
+    }
+    if (s) {
+      *res = s->cell;
+    } else {
+      e = lookup_global_symbol(expr->ar.addr);
+      *res = e ? e->cell : NULL;
+    }
+    return 0;
+  }
+  if (expr->tag != TAG_CONS) {
+    *res = expr;
+    return 0;
+  }
+
+  e = lookup_global_symbol(car(expr)->ar.addr);
+  op = e->cell;
+  args = cdr(expr);
+
+  if (op->tag == TAG_LAMBDA) {
+    *res = tier0_call(op, args);
+    return 0;
+  }
+  if (op->tag == TAG_STRUCT_DEF) {
+    *res = alloc_struct(op);
+    return 0;
+  }
+  if (op->tag != TAG_BUILTIN) {
+    printf("<tier0: %s is not a function>\r\n",(char*)car(expr)->ar.addr);
+    return 0;
+  }
+
+#define ARG(n) car((n==0 ? args : n==1 ? cdr(args) : cdr(cdr(args))))
+#define INT2 a = tier0_eval_int(ARG(0)); b = tier0_eval_int(ARG(1))
+// first argument as a cell, kept alive while the others are evaluated
+#define CELL1 x = tier0_eval(ARG(0)); tier0_push_temp(x)
+#define DONE1 tier0_temps_used--
+
+  switch (op->ar.value) {
+  case BUILTIN_ADD: INT2; *value = a+b; return 1;
+  case BUILTIN_SUB: INT2; *value = a-b; return 1;
+  case BUILTIN_MUL: INT2; *value = (int64_t)a*(int64_t)b; return 1;
+  case BUILTIN_DIV: INT2; *value = (int64_t)a/(int64_t)b; return 1;
+  case BUILTIN_MOD: INT2; *value = (int64_t)inline_mod(a,b); return 1;
+  case BUILTIN_BITAND: INT2; *value = a&b; return 1;
+  case BUILTIN_BITOR: INT2; *value = a|b; return 1;
+  case BUILTIN_BITXOR: INT2; *value = a^b; return 1;
+  case BUILTIN_BITNOT: *value = ~tier0_eval_int(ARG(0)); return 1;
+  case BUILTIN_SHL: INT2; *value = (uint64_t)a<<(b&63); return 1;
+  case BUILTIN_SHR: INT2; *value = (uint64_t)a>>(b&63); return 1;
+  // the difference if positive, else 0
+  case BUILTIN_GT: INT2; *value = ((int64_t)(a-b)<0) ? 0 : a-b; return 1;
+  case BUILTIN_LT: INT2; *value = ((int64_t)(b-a)<0) ? 0 : b-a; return 1;
+  case BUILTIN_EQ: INT2; *value = (a==b); return 1;
+
+  case BUILTIN_IF:
+    if (tier0_eval_int(ARG(0))) {
+      return tier0_eval_any(ARG(1), res, value);
+    }
+    return tier0_eval_any(ARG(2), res, value);
+  case BUILTIN_DO: {
+    int is_int = 0;
+    for (; car(args); args = cdr(args)) {
+      is_int = tier0_eval_any(car(args), res, value);
+    }
+    return is_int;
+  }
+
+  case BUILTIN_DEF:
+    // the name of a fn that gets compiled right away, see BUILTIN_FN
+    def_fn_form = ARG(1);
+    def_fn_name = ARG(0)->ar.addr;
+    *res = insert_global_symbol(ARG(0), tier0_eval(ARG(1)));
+    return 0;
+  case BUILTIN_DEFCONST:
+    def_fn_form = ARG(1);
+    def_fn_name = ARG(0)->ar.addr;
+    *res = insert_global_const(ARG(0), tier0_eval(ARG(1)));
+    return 0;
+  case BUILTIN_LET:
+    return tier0_let(args, res, value);
+  case BUILTIN_FN:
+    *res = tier0_fn(expr);
+    return 0;
+  case BUILTIN_QUOTE:
+    *res = ARG(0);
+    return 0;
+  case BUILTIN_LIST:
+    *res = tier0_list(args);
+    return 0;
+  case BUILTIN_STRUCT:
+    *res = tier0_struct(args);
+    return 0;
+  case BUILTIN_NEW:
+    *res = alloc_struct(lookup_global_symbol(ARG(0)->ar.addr)->cell);
+    return 0;
+  case BUILTIN_SGET: {
+    Cell** field = tier0_field(tier0_eval(ARG(0)), ARG(1));
+    if (!field) {
+      printf("<sget field %s not found!>\r\n",(char*)ARG(1)->ar.addr);
+      return 0;
+    }
+    *res = *field;
+    return 0;
+  }
+  case BUILTIN_SPUT: {
+    Cell** field;
+    CELL1; y = tier0_eval(ARG(2)); DONE1;
+    field = tier0_field(x, ARG(1));
+    if (!field) {
+      printf("<sput field %s not found!>\r\n",(char*)ARG(1)->ar.addr);
+      return 0;
+    }
+    *field = y;
+    *res = x;
+    return 0;
+  }
+
+  case BUILTIN_CAR:
+  case BUILTIN_CDR:
+    x = tier0_eval(ARG(0));
+    if (!x || x->tag != TAG_CONS) {
+      *res = prototype_type_error;
+      return 0;
+    }
+    *res = (op->ar.value == BUILTIN_CAR) ? car(x) : cdr(x);
+    if (!*res) *res = prototype_nil;
+    return 0;
+  case BUILTIN_CONS:
+    CELL1; y = tier0_eval(ARG(1)); DONE1;
+    *res = alloc_cons(x, y);
+    return 0;
+  case BUILTIN_CONCAT:
+    CELL1; y = tier0_eval(ARG(1)); DONE1;
+    *res = alloc_concat(x, y);
+    return 0;
+  case BUILTIN_SUBSTR:
+    CELL1; a = tier0_eval_int(ARG(1)); b = tier0_eval_int(ARG(2)); DONE1;
+    *res = alloc_substr(x, a, b);
+    return 0;
+
+  case BUILTIN_GET8:
+  case BUILTIN_GET16:
+    CELL1; b = tier0_eval_int(ARG(1)); DONE1;
+    *value = 0;
+    if (x && (x->tag == TAG_BYTES || x->tag == TAG_STR)) {
+      uint8_t* p = (uint8_t*)x->ar.addr + b;
+      *value = (op->ar.value == BUILTIN_GET8) ? *p : *(uint16_t*)p;
+    }
+    return 1;
+  case BUILTIN_GET32:
+    CELL1; b = tier0_eval_int(ARG(1)); DONE1;
+    *res = alloc_int(*(uint32_t*)((uint8_t*)x->ar.addr + b*4));
+    return 0;
+  case BUILTIN_PUT8:
+  case BUILTIN_PUT16: {
+    uint8_t* p;
+    CELL1; a = tier0_eval_int(ARG(1)); b = tier0_eval_int(ARG(2)); DONE1;
+    p = (uint8_t*)x->ar.addr + a;
+    if (op->ar.value == BUILTIN_PUT8) *p = b;
+    else *(uint16_t*)p = b;
+    *res = x;
+    return 0;
+  }
+  case BUILTIN_SIZE:
+    x = tier0_eval(ARG(0));
+    *value = x->dr.size;
+    return 1;
+
+  case BUILTIN_ALLOC:
+    *res = alloc_num_bytes(tier0_eval_int(ARG(0)));
+    return 0;
+  case BUILTIN_ALLOC_STR:
+    *res = alloc_num_string(tier0_eval_int(ARG(0)));
+    return 0;
+  case BUILTIN_BYTES_TO_STR:
+    *res = alloc_string_from_bytes(tier0_eval(ARG(0)));
+    return 0;
+  case BUILTIN_WRITE:
+    CELL1; y = tier0_eval(ARG(1)); DONE1;
+    *res = lisp_write_to_cell(x, y);
+    return 0;
+  case BUILTIN_READ:
+    *res = read_string_cell(tier0_eval(ARG(0)));
+    return 0;
+  case BUILTIN_EVAL:
+    *res = platform_eval(tier0_eval(ARG(0)));
+    return 0;
+  case BUILTIN_PRINT:
+    *res = lisp_print(tier0_eval(ARG(0)));
+    return 0;
+  case BUILTIN_MOUNT:
+    CELL1; y = tier0_eval(ARG(1)); DONE1;
+    *res = fs_mount(x, y);
+    return 0;
+  case BUILTIN_MMAP:
+    *res = fs_mmap(tier0_eval(ARG(0)));
+    return 0;
+  case BUILTIN_OPEN:
+    *res = fs_open(tier0_eval(ARG(0)));
+    return 0;
+  case BUILTIN_RECV:
+    *res = stream_read(tier0_eval(ARG(0)));
+    return 0;
+  case BUILTIN_SEND:
+    CELL1; y = tier0_eval(ARG(1)); DONE1;
+    *res = stream_write(x, y);
+    return 0;
+#ifdef HEAP_IMAGE
+  case BUILTIN_SAVE:
+    *res = image_save(tier0_eval(ARG(0)));
+    return 0;
+#endif
+  case BUILTIN_GC: {
+    int here;
+    *res = collect_garbage(global_env, tier0_stack_end, &here);
+    return 0;
+  }
+  case BUILTIN_SYMBOLS:
+    *res = list_symbols(global_env);
+    return 0;
+  case BUILTIN_DEBUG:
+    return 0;
+  }
+
+#undef DONE1
+#undef CELL1
+#undef INT2
+#undef ARG
+
+  printf("<tier0: unhandled builtin %d>\r\n",(int)op->ar.value);
+  return 0;
+}
+
+// ---------------------------------------------------------------------
+// which forms to interpret
+//
+// the checks mirror the errors compile_expr reports, so a form that
+// would not compile goes to the compiler and fails there as usual.
+
+static int tier0_check(Cell* expr, Tier0Scope* scope);
+
+static int tier0_scope_find(Tier0Scope* scope, char* name) {
+  int i;
+  for (i=0; i<scope->count; i++) {
+    if (!strcmp(scope->names[i], name)) return i;
+  }
+  return -1;
+}
+
+// the struct definition expr is known to evaluate to at compile time,
+// like the type_name of an Arg
+static Cell* tier0_struct_type(Cell* expr, Tier0Scope* scope) {
+  env_entry* e;
+  Cell* op;
+  int i;
+  if (!expr) return NULL;
+
+  if (expr->tag == TAG_SYM) {
+    i = tier0_scope_find(scope, expr->ar.addr);
+    if (i>=0) return scope->types[i];
+    e = lookup_global_symbol(expr->ar.addr);
+    if (e && e->cell && e->cell->tag == TAG_STRUCT) return ((Cell**)e->cell->ar.addr)[0];
+    return NULL;
+  }
+  if (expr->tag != TAG_CONS || !car(expr) || car(expr)->tag != TAG_SYM) return NULL;
+
+  e = lookup_global_symbol(car(expr)->ar.addr);
+  if (!e || !e->cell) return NULL;
+  op = e->cell;
+  if (op->tag == TAG_STRUCT_DEF) return op;
+  if (op->tag != TAG_BUILTIN) return NULL;
+
+  if (op->ar.value == BUILTIN_NEW && car(cdr(expr)) && car(cdr(expr))->tag == TAG_SYM) {
+    e = lookup_global_symbol(car(cdr(expr))->ar.addr);
+    if (e && e->cell && e->cell->tag == TAG_STRUCT_DEF) return e->cell;
+  }
+  if (op->ar.value == BUILTIN_SGET) {
+    Cell* def = tier0_struct_type(car(cdr(expr)), scope);
+    Cell* field = car(cdr(cdr(expr)));
+    if (def && field && field->tag == TAG_SYM && (i = tier0_field_idx(def, field->ar.addr))) {
+      Cell* v = ((Cell**)def->ar.addr)[2*i];
+      if (v && v->tag == TAG_STRUCT) return ((Cell**)v->ar.addr)[0];
+    }
+  }
+  return NULL;
+}
+
+static int tier0_check_fn(Cell* args) {
+  Tier0Scope scope;
+  int n = 0;
+  scope.count = 0;
+  scope.in_fn = 1;
+
+  for (; car(args); args = cdr(args)) {
+    Cell* p = car(args);
+    Cell* type = NULL;
+    if (!car(cdr(args))) return tier0_check(p, &scope);
+    if (++n>MAXARGS-2) return 0;
+    if (p->tag == TAG_CONS) {
+      env_entry* te;
+      Cell* type_sym = car(cdr(p));
+      if (!type_sym || type_sym->tag != TAG_SYM) return 0;
+      te = lookup_global_symbol(type_sym->ar.addr);
+      if (!te || !te->cell || te->cell->tag != TAG_STRUCT_DEF) return 0;
+      type = te->cell;
+      p = car(p);
+    }
+    if (!p || p->tag != TAG_SYM) return 0;
+    scope.names[scope.count] = p->ar.addr;
+    scope.types[scope.count++] = type;
+  }
+  return 0; // fn without body
+}
+
+static int tier0_check_let(Cell* args, Tier0Scope* scope) {
+  Cell* sym = car(args);
+  Cell* val = car(cdr(args));
+  if (!scope->in_fn || !sym || sym->tag != TAG_SYM || !val) return 0;
+  if (car(cdr(cdr(args)))) return 0;
+  if (!tier0_check(val, scope)) return 0;
+  if (tier0_scope_find(scope, sym->ar.addr)>=0) return 1;
+  if (scope->count>=MAXFRAME-MAXARGS) return 0;
+  scope->names[scope->count] = sym->ar.addr;
+  scope->types[scope->count++] = tier0_struct_type(val, scope);
+  return 1;
+}
+
+static int tier0_check(Cell* expr, Tier0Scope* scope) {
+  Cell* op;
+  Cell* args;
+  Cell* sig;
+  env_entry* e;
+  int argi;
+
+  if (!expr) return 0;
+  if (expr->tag == TAG_SYM) {
+    return tier0_scope_find(scope, expr->ar.addr)>=0 || lookup_global_symbol(expr->ar.addr);
+  }
+  if (expr->tag != TAG_CONS) return 1;
+
+  if (!car(expr) || car(expr)->tag != TAG_SYM) return 0;
+  e = lookup_global_symbol(car(expr)->ar.addr);
+  if (!e || !e->cell) return 0;
+  op = e->cell;
+  args = cdr(expr);
+
+  if (op->tag == TAG_STRUCT_DEF) return 1;
+  if (op->tag == TAG_LAMBDA) {
+    sig = car((Cell*)op->ar.addr);
+  } else if (op->tag == TAG_BUILTIN) {
+    sig = op->dr.next;
+  } else {
+    return 0;
+  }
+
+  if (op->tag == TAG_BUILTIN) {
+    switch (op->ar.value) {
+    case BUILTIN_WHILE:
+    case BUILTIN_MAP:
+    case BUILTIN_PUT32:
+      return 0;
+    case BUILTIN_FN:
+      return tier0_check_fn(args);
+    case BUILTIN_QUOTE:
+      return !!car(args);
+    case BUILTIN_DO:
+      if (!car(args)) return 0;
+      // fall through
+    case BUILTIN_LIST:
+      for (; car(args); args = cdr(args)) {
+        if (!tier0_check(car(args), scope)) return 0;
+      }
+      return 1;
+    case BUILTIN_STRUCT:
+      if (!car(args) || car(args)->tag != TAG_SYM) return 0;
+      for (args = cdr(args); car(args); args = cdr(cdr(args))) {
+        if (car(args)->tag != TAG_SYM) return 0;
+        if (!tier0_check(car(cdr(args)), scope)) return 0;
+      }
+      return 1;
+    case BUILTIN_LET:
+      return tier0_check_let(args, scope);
+    case BUILTIN_NEW:
+      if (!tier0_struct_type(expr, scope)) return 0;
+      break;
+    case BUILTIN_SGET:
+    case BUILTIN_SPUT: {
+      Cell* def = tier0_struct_type(car(args), scope);
+      Cell* field = car(cdr(args));
+      if (!def || !field || field->tag != TAG_SYM) return 0;
+      if (!tier0_field_idx(def, field->ar.addr)) return 0;
+      break;
+    }
+    case BUILTIN_GC:
+    case BUILTIN_SYMBOLS:
+    case BUILTIN_DEBUG:
+      return 1;
+    }
+    if (!sig) return 0;
+  }
+
+  // arity and argument types as in compile_expr
+  for (argi=0; car(args) || car(sig); argi++, args = cdr(args), sig = cdr(sig)) {
+    Cell* arg = car(args);
+    Cell* proto = car(sig);
+    if (!arg || !proto || argi>=MAXARGS-1) return 0;
+    if (op->tag == TAG_LAMBDA) proto = cdr(proto); // (name . prototype)
+
+    if (proto->tag == TAG_SYM) {
+      if (arg->tag != TAG_SYM) return 0;
+    } else if (proto->tag == TAG_LAMBDA || arg->tag == TAG_CONS || arg->tag == TAG_SYM) {
+      if (!tier0_check(arg, scope)) return 0;
+    } else if (!compatible_type(arg->tag, proto->tag) && proto->tag != TAG_ANY) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// should this top-level form be interpreted?
+int tier0_wanted(Cell* expr) {
+  Tier0Scope scope;
+  if (debug_mode || !tier0_init()) return 0;
+#ifdef JIT_PROFILE
+  // interpreted fns are not counted
+  if (profile_mode()) return 0;
+#endif
+  if (!expr || expr->tag != TAG_CONS) return 0;
+  if (tier0_has_while(expr)) return 0;
+#ifdef JIT_CACHE
+  // native code is already there
+  if (jit_cache_wanted(expr) && jit_cache_has(expr)) return 0;
+#endif
+  scope.count = 0;
+  scope.in_fn = 0;
+  return tier0_check(expr, &scope);
+}
+
+int tier0_eval_toplevel(Cell* expr, Cell** res) {
+  static int roots_registered = 0;
+  void* saved_stack_end = tier0_stack_end;
+  int saved_frame = tier0_frame;
+  int saved_temps = tier0_temps_used;
+  Cell* op = car(expr);
+
+  if (!roots_registered) {
+    gc_set_root_marker(tier0_mark_roots);
+    roots_registered = 1;
+  }
+  // like the stack_end of a compiled top-level form
+  if (!tier0_stack_end) tier0_stack_end = __builtin_frame_address(0);
+  // a form sent to eval doesn't see the locals of its caller
+  tier0_frame = tier0_slots_used;
+
+  tier0_push_temp(expr);
+  *res = tier0_eval(expr);
+
+  if (op->tag == TAG_SYM && !strcmp(op->ar.addr, "def")) {
+    printf("interpreted def %s\r\n",(char*)car(cdr(expr))->ar.addr);
+  }
+
+  tier0_temps_used = saved_temps;
+  tier0_frame = saved_frame;
+  tier0_stack_end = saved_stack_end;
+  return 1;
+}
+
+// compiled lambdas take their first ARG_SPILLOVER arguments in r12-r14
+// and the rest on the stack, the last one pushed first. they don't
+// preserve any registers.
+__asm__(
+  ".text\n"
+  ".globl tier0_call_native\n"
+  "tier0_call_native:\n"
+  "  push %rbp\n"
+  "  mov %rsp, %rbp\n"
+  "  push %rbx\n"
+  "  push %r12\n"
+  "  push %r13\n"
+  "  push %r14\n"
+  "  push %r15\n"
+  "  mov %rdi, %r11\n"
+  "  mov %rdx, %rcx\n"
+  "1:\n"
+  "  cmp $3, %rcx\n"
+  "  jle 2f\n"
+  "  dec %rcx\n"
+  "  push (%rsi,%rcx,8)\n"
+  "  jmp 1b\n"
+  "2:\n"
+  "  mov (%rsi), %r12\n"
+  "  mov 8(%rsi), %r13\n"
+  "  mov 16(%rsi), %r14\n"
+  "  call *%r11\n"
+  "  lea -40(%rbp), %rsp\n"
+  "  pop %r15\n"
+  "  pop %r14\n"
+  "  pop %r13\n"
+  "  pop %r12\n"
+  "  pop %rbx\n"
+  "  pop %rbp\n"
+  "  ret\n"
+);
+
+// entered from the stub of an interpreted lambda, with the lambda in rax
+__asm__(
+  ".text\n"
+  ".globl tier0_enter\n"
+  "tier0_enter:\n"
+  "  push %rbp\n"
+  "  mov %rsp, %rbp\n"
+  "  mov %rax, %rdi\n"
+  "  mov %r12, %rsi\n"
+  "  mov %r13, %rdx\n"
+  "  mov %r14, %rcx\n"
+  "  lea 16(%rbp), %r8\n"
+  "  and $-16, %rsp\n"
+  "  call tier0_apply_native\n"
+  "  mov %rbp, %rsp\n"
+  "  pop %rbp\n"
+  "  ret\n"
+);
@@ -0,0 +1,294 @@
+// known tags of locals (x64 hosted)
+//
+// car and cdr check that they get a cons, get8 and get16 that they get
+// a string or bytes. these checks are left out when the tag of the
+// cell is known at compile time:
+//
+// - a local that every let in its fn gives a string or bytes literal,
+//   a cons, or the result of cons, concat, substr, alloc, alloc-str or
+//   bytes->str, or an if or do of those. type_prop_scan finds them
+//   before the body of a fn is compiled.
+// - an arg or local that a while uses with car, cdr, get8 or get16 and
+//   never lets. its tag can't change while the loop runs, so it is
+//   checked once before the loop, which is compiled twice:
+//
+//       <guard: tag of buf is string or bytes, else jmp Lslow>
+//       <while, get8 buf without checks>
+//       jmp Lend
+//   Lslow:
+//       <while as before>
+//   Lend:
+//
+//   the loads that hoist.c takes out of the loop share the guard. the
+//   whiles inside either copy are compiled once, so a loop nest grows
+//   to twice its size at most.
+//
+// this is how the get8 of text-scanning loops like find-next and
+// strlen becomes a bare byte load. a known tag is TAG_CONS, or
+// TAG_BYTES for both strings and bytes.
+
+#define TYPE_PROP_GUARDS 4 // locals checked before a loop at most
+
+static int type_prop_copies = 0; // inside a while that is compiled twice
+
+static int type_prop_name(char* name, Frame* frame) {
+  int i;
+  for (i=0; i<frame->num_tag_facts; i++) {
+    if (!strcmp(frame->tag_facts[i].name, name)) return frame->tag_facts[i].tag;
+  }
+  return 0;
+}
+
+// the known tag of the value of c, 0 if there is none. without a frame,
+// locals are not looked at.
+static int type_prop_tag(Cell* c, Frame* frame) {
+  env_entry* e;
+  Cell* last;
+  int tag;
+
+  if (!c) return 0;
+  if (c->tag == TAG_STR || c->tag == TAG_BYTES) return TAG_BYTES;
+  if (c->tag == TAG_SYM) {
+    if (!frame || !frame->f || !frame->tag_facts) return 0;
+    // not a global of the same name
+    if (get_sym_frame_idx(c->ar.addr, frame->f, 0)<0) return 0;
+    return type_prop_name(c->ar.addr, frame);
+  }
+  if (c->tag != TAG_CONS || !car(c) || car(c)->tag != TAG_SYM) return 0;
+  e = lookup_global_symbol(car(c)->ar.addr);
+  if (!e || !e->cell || e->cell->tag != TAG_BUILTIN) return 0;
+
+  switch (e->cell->ar.value) {
+  case BUILTIN_CONS:
+    return TAG_CONS;
+  case BUILTIN_QUOTE:
+    return (car(cdr(c)) && car(cdr(c))->tag == TAG_CONS) ? TAG_CONS : 0;
+  case BUILTIN_CONCAT: case BUILTIN_SUBSTR: case BUILTIN_ALLOC: case BUILTIN_ALLOC_STR:
+  case BUILTIN_BYTES_TO_STR:
+    return TAG_BYTES;
+  case BUILTIN_IF:
+    tag = type_prop_tag(car(cdr(cdr(c))), frame);
+    return (tag == type_prop_tag(car(cdr(cdr(cdr(c)))), frame)) ? tag : 0;
+  case BUILTIN_DO:
+    for (last = NULL, c = cdr(c); c && car(c); c = cdr(c)) last = car(c);
+    return type_prop_tag(last, frame);
+  }
+  return 0;
+}
+
+// does form give a cell with tag, as far as is known at compile time?
+static int type_prop_proven(Cell* form, Frame* frame, int tag) {
+  return !debug_mode && type_prop_tag(form, frame) == tag;
+}
+
+static void type_prop_add(Frame* frame, char* name, int tag) {
+  frame->tag_facts[frame->num_tag_facts].name = name;
+  frame->tag_facts[frame->num_tag_facts].tag = tag;
+  frame->num_tag_facts++;
+}
+
+// the tags of the lets of c to name: -1 while none are found
+static int type_prop_lets(Cell* c, char* name, int tag) {
+  env_entry* e;
+  Cell* sym;
+  if (!c || c->tag != TAG_CONS || !tag) return tag;
+  if (car(c) && car(c)->tag == TAG_SYM && (e = lookup_global_symbol(car(c)->ar.addr))
+      && e->cell && e->cell->tag == TAG_BUILTIN) {
+    switch (e->cell->ar.value) {
+    case BUILTIN_FN:
+    case BUILTIN_QUOTE:
+      return tag;
+    case BUILTIN_LET:
+      sym = car(cdr(c));
+      if (sym && sym->tag == TAG_SYM && !strcmp(sym->ar.addr, name)) {
+        int t = type_prop_tag(car(cdr(cdr(c))), NULL);
+        if (tag>0 && t != tag) return 0;
+        tag = t;
+      }
+      break;
+    }
+  }
+  for (; c && c->tag == TAG_CONS; c = cdr(c)) {
+    tag = type_prop_lets(car(c), name, tag);
+  }
+  return tag;
+}
+
+static void type_prop_scan_walk(Cell* c, Cell* body, Arg* fn_frame, Frame* frame) {
+  env_entry* e;
+  Cell* sym;
+  int tag;
+  if (!c || c->tag != TAG_CONS) return;
+  if (car(c) && car(c)->tag == TAG_SYM && (e = lookup_global_symbol(car(c)->ar.addr))
+      && e->cell && e->cell->tag == TAG_BUILTIN) {
+    switch (e->cell->ar.value) {
+    case BUILTIN_FN:
+    case BUILTIN_QUOTE:
+      return;
+    case BUILTIN_LET:
+      sym = car(cdr(c));
+      // lets of args stay where the arg is, and can be anything
+      if (!sym || sym->tag != TAG_SYM || get_sym_frame_idx(sym->ar.addr, fn_frame, 0)>=0) break;
+      if (type_prop_name(sym->ar.addr, frame) || frame->num_tag_facts >= MAXFRAME-MAXARGS) break;
+      tag = type_prop_lets(body, sym->ar.addr, -1);
+      if (tag>0) type_prop_add(frame, sym->ar.addr, tag);
+      break;
+    }
+  }
+  for (; c && c->tag == TAG_CONS; c = cdr(c)) {
+    type_prop_scan_walk(car(c), body, fn_frame, frame);
+  }
+}
+
+// finds the locals of body, a fn of frame with args in fn_frame, that
+// have a known tag
+static void type_prop_scan(Cell* body, Arg* fn_frame, Frame* frame) {
+  frame->tag_facts = malloc(sizeof(TagFact)*(MAXFRAME-MAXARGS+TYPE_PROP_GUARDS));
+  frame->num_tag_facts = 0;
+  type_prop_scan_walk(body, body, fn_frame, frame);
+}
+
+typedef struct TypePropLoop {
+  char* names[MAXFRAME];
+  int tags[MAXFRAME];  // the tag its uses want, -1 for none or for a let
+  int num;
+} TypePropLoop;
+
+static void type_prop_loop_use(TypePropLoop* l, char* name, int tag) {
+  int i;
+  for (i=0; i<l->num; i++) {
+    if (!strcmp(l->names[i], name)) break;
+  }
+  if (i == l->num) {
+    if (l->num >= MAXFRAME) return;
+    l->names[l->num] = name;
+    l->tags[l->num++] = tag;
+  } else if (l->tags[i] != tag) {
+    l->tags[i] = -1;
+  }
+}
+
+static void type_prop_loop_walk(Cell* c, Frame* frame, TypePropLoop* l) {
+  env_entry* e;
+  Cell* a;
+  if (!c || c->tag != TAG_CONS) return;
+  if (car(c) && car(c)->tag == TAG_SYM && (e = lookup_global_symbol(car(c)->ar.addr))
+      && e->cell && e->cell->tag == TAG_BUILTIN) {
+    a = car(cdr(c));
+    switch (e->cell->ar.value) {
+    case BUILTIN_FN:
+    case BUILTIN_QUOTE:
+      return;
+    case BUILTIN_LET:
+      if (a && a->tag == TAG_SYM) type_prop_loop_use(l, a->ar.addr, -1);
+      break;
+    case BUILTIN_CAR: case BUILTIN_CDR:
+      if (a && a->tag == TAG_SYM) type_prop_loop_use(l, a->ar.addr, TAG_CONS);
+      break;
+    case BUILTIN_GET8: case BUILTIN_GET16:
+      if (a && a->tag == TAG_SYM) type_prop_loop_use(l, a->ar.addr, TAG_BYTES);
+      break;
+    }
+  }
+  for (; c && c->tag == TAG_CONS; c = cdr(c)) {
+    type_prop_loop_walk(car(c), frame, l);
+  }
+}
+
+// checks the tags of the locals that the while expr uses with car, cdr,
+// get8 or get16, jumping to label_slow if one is not the wanted one.
+// they are known until type_prop_unguard. returns their number.
+static int type_prop_guard(Cell* expr, Frame* frame, char* label_slow) {
+  TypePropLoop l;
+  char label_ok[64];
+  int i, idx, n = 0;
+
+  l.num = 0;
+  type_prop_loop_walk(cdr(expr), frame, &l);
+
+  for (i=0; i<l.num && n<TYPE_PROP_GUARDS; i++) {
+    if (l.tags[i]<0 || type_prop_name(l.names[i], frame)) continue;
+    idx = get_sym_frame_idx(l.names[i], frame->f, 0);
+    if (idx<0 || (frame->f[idx].type != ARGT_REG && frame->f[idx].type != ARGT_STACK)) continue;
+
+    sprintf(label_ok,"Lok_%d",++label_skip_count);
+    load_cell(R0, frame->f[idx], frame);
+    jit_cmpi(R0,0);
+    jit_je(label_slow);
+    jit_addi(R0,2*PTRSZ);
+    jit_ldr(R0);
+    if (l.tags[i] == TAG_BYTES) {
+      jit_cmpi(R0,TAG_STR);
+      jit_je(label_ok);
+    }
+    jit_cmpi(R0,l.tags[i]);
+    jit_jne(label_slow);
+    jit_label(label_ok);
+
+    type_prop_add(frame, l.names[i], l.tags[i]);
+    n++;
+  }
+  return n;
+}
+
+static void type_prop_unguard(Frame* frame, int n) {
+  frame->num_tag_facts -= n;
+}
+
+// does a let in c make a new local that hides a global? the second
+// copy of a loop would read the local where the first read the global.
+static int type_prop_hides(Cell* c, Frame* frame) {
+  Cell* sym;
+  if (!c || c->tag != TAG_CONS) return 0;
+  if (car(c) && car(c)->tag == TAG_SYM && !strcmp(car(c)->ar.addr, "let")) {
+    sym = car(cdr(c));
+    if (sym && sym->tag == TAG_SYM && get_sym_frame_idx(sym->ar.addr, frame->f, 0)<0
+        && lookup_global_symbol(sym->ar.addr)) return 1;
+  }
+  for (; c && c->tag == TAG_CONS; c = cdr(c)) {
+    if (type_prop_hides(car(c), frame)) return 1;
+  }
+  return 0;
+}
+
+// compiles the while expr twice if type_prop_guard or hoist_guard find
+// something to check before it, and sets *done. whiles inside it are
+// compiled once.
+static Cell* type_prop_while(Cell* expr, Frame* frame, Cell* return_type, int* done) {
+  char label_slow[64];
+  char label_end[64];
+  int guards, hoists = 0;
+  Cell* type;
+
+  *done = 0;
+  if (debug_mode || !frame->f || !frame->tag_facts || type_prop_copies) return NULL;
+  if (type_prop_hides(cdr(expr), frame)) return NULL;
+  sprintf(label_slow,"Lslow_%d",++label_skip_count);
+  sprintf(label_end,"Lendwhile_%d",label_skip_count);
+
+  guards = type_prop_guard(expr, frame, label_slow);
+#ifdef JIT_HOIST
+  hoists = hoist_guard(expr, frame, label_slow);
+#endif
+  if (!guards && !hoists) return NULL;
+  *done = 1;
+  if (hoists<0) return NULL;
+
+  // the loop with the tags of its guarded locals known
+  type_prop_copies++;
+  type = compile_expr(expr, frame, return_type);
+  type_prop_unguard(frame, guards);
+#ifdef JIT_HOIST
+  hoist_unguard(frame, hoists);
+#endif
+  if (type) {
+    jit_jmp(label_end);
+
+    // and as it is
+    jit_label(label_slow);
+    type = compile_expr(expr, frame, return_type);
+    jit_label(label_end);
+  }
+  type_prop_copies--;
+  return type;
+}
@@ -0,0 +1,223 @@
+// whole-file compilation units (x64 hosted)
+//
+// platform_eval, which runs the forms of an (import ...) or (eval ...),
+// normally compiles every form into a blob of its own, and every call
+// is linked through the env entry of its callee (see callsite.c). with
+// INTERIM_UNITS=1, all forms of one platform_eval are compiled into a
+// shared code segment instead. forms are still compiled and run one
+// after the other, so each form sees the globals of the ones before it.
+//
+// a call to a lambda whose code already lives in the current segment
+// is bound once, when the calling form is compiled, and becomes a
+// pc-relative call. this only happens for names that are def'd exactly
+// once in the unit: a forward def like (def f (fn 0)) followed by the
+// real definition keeps f going through the env. rebinding a unit
+// function from outside the unit (i.e. from the repl) does not affect
+// its callers inside the unit, except for those recorded in its uses
+// (it was inlined into them or gave them escape flags), which are
+// compiled again like for a defconst.
+//
+// unit forms bypass the tier-0 interpreter and the compiled-code cache.
+
+#define UNIT_SEGMENT_SIZE (128*1024)
+
+typedef struct Unit {
+  StrMap* defs;       // name -> number of defs of name in the unit
+  uint8_t* seg;       // current code segment
+  uint32_t seg_size;
+  uint32_t seg_used;
+  uint32_t* relocs;   // absolute addresses in the segment
+  int num_relocs;
+  int max_relocs;
+  int compiling;      // set while a form of this unit is being compiled
+  struct Unit* parent;
+} Unit;
+
+static Unit* unit_current = NULL;
+static int unit_state = 0;
+
+static int unit_wanted() {
+  char* env;
+  if (!unit_state) {
+    env = getenv("INTERIM_UNITS");
+    unit_state = (env && atoi(env)>0) ? 1 : -1;
+  }
+  return unit_state>0;
+}
+
+// count the defs of every name, including the ones nested in fns
+static void unit_count_defs(Cell* c, StrMap* defs) {
+  Cell* op;
+  Cell* name;
+  void* n;
+  if (!c || c->tag != TAG_CONS) return;
+
+  op = car(c);
+  name = car(cdr(c));
+  if (op && op->tag == TAG_SYM && !strcmp(op->ar.addr,"def") && name && name->tag == TAG_SYM) {
+    n = NULL;
+    sm_get(defs, name->ar.addr, &n);
+    sm_put(defs, name->ar.addr, (void*)((intptr_t)n+1));
+  }
+
+  for (; c && c->tag == TAG_CONS; c = cdr(c)) {
+    unit_count_defs(car(c), defs);
+  }
+}
+
+// called by compile_expr for every lambda call. emits a direct call (a
+// jump for tail calls) and returns 1 if the callee is linked into the
+// segment being compiled. raw calls its raw entry, see rettype.c.
+int unit_direct_call(char* name, Cell* lambda, int tail, int raw) {
+  Unit* u = unit_current;
+  uint8_t* entry = (uint8_t*)lambda->dr.next;
+  void* n = NULL;
+
+  if (!u || !u->compiling || !u->seg) return 0;
+  if (entry < u->seg || entry >= u->seg + u->seg_used) return 0;
+  if (!sm_get(u->defs, name, &n) || (intptr_t)n != 1) return 0;
+#ifdef JIT_CONST_GLOBALS
+  // its code may be replaced when a defconst changes
+  if (const_global_dependent(lambda)) return 0;
+#endif
+
+#ifdef JIT_RET_INT
+  if (raw) {
+    if (lambda_raw(lambda) != raw) return 0;
+    entry += RAW_ENTRY;
+  }
+#endif
+  // code[0] ends up at seg+seg_used
+  if (tail) jit_jmp_rel(entry - (u->seg + u->seg_used));
+  else jit_call_rel(entry - (u->seg + u->seg_used));
+  return 1;
+}
+
+static void unit_close_segment(Unit* u) {
+  if (!u->seg) return;
+  if (u->seg_used) {
+    code_shrink(u->seg, u->seg_used);
+  } else {
+    code_free(u->seg);
+  }
+  u->seg = NULL;
+  u->seg_size = 0;
+  u->seg_used = 0;
+  u->num_relocs = 0;
+}
+
+static int unit_open_segment(Unit* u, uint32_t min_size) {
+  uint32_t size = UNIT_SEGMENT_SIZE;
+  if (min_size>size) size = min_size;
+
+  u->seg = code_alloc(size);
+  if (!u->seg) return 0;
+  u->seg_size = size;
+  u->seg_used = 0;
+  u->num_relocs = 0;
+  code_seal(u->seg);
+  return 1;
+}
+
+Unit* unit_begin(Cell* forms) {
+  Unit* u;
+  if (!unit_wanted()) return NULL;
+
+  u = calloc(1, sizeof(Unit));
+  u->defs = sm_new(256);
+  unit_count_defs(forms, u->defs);
+  u->parent = unit_current;
+  unit_current = u;
+  return u;
+}
+
+void unit_end(Unit* u) {
+  if (!u) return;
+  unit_close_segment(u);
+  unit_current = u->parent;
+  sm_delete(u->defs);
+  free(u->relocs);
+  free(u);
+}
+
+// append one form to the unit's segment and run it
+int unit_eval(Unit* u, Cell* expr, Cell** res) {
+  char* defsym = "anon";
+  Cell* success = NULL;
+  uint8_t* dest;
+  uint32_t need = 0;
+  int i;
+
+  register void* sp asm ("sp");
+  Frame* empty_frame = malloc(sizeof(Frame)); // FIXME leak, see compile_toplevel
+  frame_init_toplevel(empty_frame, toplevel_stack_end ? toplevel_stack_end : sp);
+
+  if (expr && expr->tag == TAG_CONS && car(expr)->tag == TAG_SYM) {
+    if (!strcmp(car(expr)->ar.addr,"def")) {
+      defsym = car(cdr(expr))->ar.addr;
+    }
+  }
+
+  // direct calls depend on where the form is placed, so a form that
+  // doesn't fit is compiled again for a fresh segment
+  while (1) {
+    if (!u->seg && !unit_open_segment(u, need)) return 0;
+
+    jit_init();
+    u->compiling = 1;
+    success = compile_expr(expr, empty_frame, prototype_any);
+    u->compiling = 0;
+    jit_ret();
+
+    if (!success) {
+      printf("<compile_expr failed: %p>\r\n",success);
+      return 0;
+    }
+    if (u->seg_used + code_idx <= u->seg_size) break;
+    if (need) {
+      printf("<unit: form does not fit its segment>\r\n");
+      return 0;
+    }
+    unit_close_segment(u);
+    need = code_idx;
+  }
+
+  if (strcmp(defsym,"anon")) {
+    printf("compiled def %s\r\n",defsym);
+  }
+#ifdef PEEPHOLE_STATS
+  peephole_report(defsym);
+#endif
+#ifdef IR_DUMP
+  ir_dump(defsym);
+#endif
+
+  dest = u->seg + u->seg_used;
+  code_unseal(u->seg);
+  memcpy(dest, code, code_idx);
+  link_lambdas(dest);
+#ifdef JIT_PERF
+  perf_code(dest, code_idx, defsym);
+#endif
+
+  if (u->num_relocs + reloc_idx > u->max_relocs) {
+    u->max_relocs = (u->num_relocs + reloc_idx)*2;
+    u->relocs = realloc(u->relocs, u->max_relocs*sizeof(uint32_t));
+  }
+  for (i=0; i<reloc_idx; i++) {
+    u->relocs[u->num_relocs++] = u->seg_used + jit_relocs[i].idx;
+  }
+  code_set_relocs(u->seg, u->relocs, u->num_relocs);
+  code_seal(u->seg);
+#ifdef JIT_DIRECT_CALLS
+  link_calls(u->seg, u->num_relocs - reloc_idx);
+#endif
+
+  u->seg_used = (u->seg_used + code_idx + 15) & ~15;
+
+  code_enter(u->seg, empty_frame->stack_end);
+  *res = execute_jitted(dest);
+  code_leave(u->seg);
+
+  return 1;
+}